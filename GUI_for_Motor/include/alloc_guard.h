@@ -0,0 +1,41 @@
+/*!
+ * \file alloc_guard.h
+ * \brief Marks the steady state control path, so a build with COUNT_ALLOCATIONS can prove it never allocates.
+ * \details The receive, decode, control, encode, send and publish steps of a control thread run
+ * between HotPathEnter() and HotPathLeave(). In an ordinary build both do nothing. When CMake is
+ * run with -DCOUNT_ALLOCATIONS=ON, operator new and malloc are replaced by versions that count
+ * every call, and a call made by a thread inside a marked section prints the section and aborts,
+ * so running the loop once is enough to catch a regression.
+ */
+#ifndef _MY__ALLOC_GUARD__H
+#define _MY__ALLOC_GUARD__H	//!< Used to ensure the header is only included once during compilation
+
+#include <stdint.h>
+
+#ifdef COUNT_ALLOCATIONS
+
+void HotPathEnter(const char *section);
+void HotPathLeave();
+uint64_t AllocationCount();
+
+#else
+
+/*!
+ * \brief Starts a section of the control path that must not allocate
+ * \param section names the section in the report
+ */
+inline void HotPathEnter(const char * /*section*/) {}
+
+/*!
+ * \brief Ends the section started by HotPathEnter()
+ */
+inline void HotPathLeave() {}
+
+/*!
+ * \brief Allocations made by the whole program so far, always 0 without COUNT_ALLOCATIONS
+ */
+inline uint64_t AllocationCount() { return 0; }
+
+#endif
+
+#endif
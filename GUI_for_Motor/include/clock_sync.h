@@ -0,0 +1,80 @@
+/*!
+ * \file clock_sync.h
+ * \brief Maps the Teensy's micros() clock onto the host monotonic clock.
+ * \details The host sends SYNC_COMMAND requests and notes when each one left and when its reply
+ * arrived; the Teensy adds when the request arrived and when the reply left, NTP style. Only the
+ * exchanges with a round trip close to the shortest one recently seen are trusted, since a slow
+ * exchange was held up on one leg or the other and its offset is off by up to half the extra time.
+ * Once the trusted exchanges span long enough, a straight line fit through them also follows the
+ * drift of the Teensy's crystal, so device times can be mapped between exchanges.
+ */
+#ifndef _MY__CLOCK_SYNC__H
+#define _MY__CLOCK_SYNC__H	//!< Used to ensure the header is only included once during compilation
+
+#include <stdint.h>
+#include <mutex>
+
+#define CLOCK_SYNC_SAMPLES 64			//!< Exchanges kept for the fit
+#define CLOCK_SYNC_PENDING 16			//!< Requests that can be waiting for a reply
+#define CLOCK_SYNC_BURST 8			//!< Requests sent back to back when syncing starts
+#define CLOCK_SYNC_BURST_GAP_US 20000		//!< Time between the requests of the first burst
+#define CLOCK_SYNC_MIN_EXCHANGES 3		//!< Exchanges needed before device times are mapped
+#define CLOCK_SYNC_PERIOD_US 1000000		//!< Time between requests once synced
+#define CLOCK_SYNC_MAX_RTT_NS 50000000LL	//!< Exchanges slower than this are thrown away
+#define CLOCK_SYNC_RTT_FACTOR 1.5		//!< Exchanges up to this many times the shortest round trip are trusted...
+#define CLOCK_SYNC_RTT_SLACK_NS 200000LL	//!< ...plus this much, so a very fast link still has a few samples
+#define CLOCK_SYNC_MIN_SPAN_S 10.0		//!< Trusted exchanges must span this long before the drift is fitted
+#define CLOCK_SYNC_MAX_DRIFT_PPM 500.0		//!< A fitted drift beyond this is taken as a bad fit and ignored
+
+/*!
+ *  One request and reply
+ */
+typedef struct
+{
+  int64_t sendNs;		//!< Host time the request was written
+  int64_t receiveUs;		//!< Device time the request was read, unwrapped
+  int64_t transmitUs;		//!< Device time the reply was written, unwrapped
+  int64_t replyNs;		//!< Host time the reply was read
+} ClockExchange;
+
+/*!
+ * \brief Estimate of the Teensy clock in host time.
+ * \details Safe to use from the read thread, the sync thread and the control threads at once.
+ */
+class DeviceClock
+{
+public:
+  DeviceClock();
+  void Reset();
+  uint32_t NextRequest(int64_t sendNs);
+  bool AddReply(uint32_t sequence, uint32_t receiveUs, uint32_t transmitUs, int64_t replyNs);
+  bool AddExchange(int64_t sendNs, uint32_t receiveUs, uint32_t transmitUs, int64_t replyNs);
+  int64_t ToHostNs(uint32_t deviceUs) const;
+  bool IsSynced() const;
+  double DriftPpm() const;
+  int64_t BestRttNs() const;
+  int64_t ErrorBoundNs() const;
+  unsigned int Exchanges() const;
+
+private:
+  int64_t Unwrap(uint32_t deviceUs) const;
+  void Fit();
+
+  mutable std::mutex lock;		//!< Guards everything below
+  ClockExchange samples[CLOCK_SYNC_SAMPLES];	//!< Ring of the latest exchanges
+  unsigned int numSamples;		//!< Valid entries in samples
+  unsigned int nextSample;		//!< Slot the next exchange goes into
+  unsigned int exchanges;		//!< Exchanges accepted since the last Reset
+  uint32_t pendingSequence[CLOCK_SYNC_PENDING];	//!< Sequence numbers of requests waiting for a reply
+  int64_t pendingSendNs[CLOCK_SYNC_PENDING];	//!< Host times those requests were written, 0 once answered
+  uint32_t nextSequence;		//!< Sequence number of the next request
+  bool haveReference;			//!< True once a device time has been seen
+  uint32_t referenceUs;			//!< Last device time seen, as sent
+  int64_t referenceUnwrapped;		//!< The same time counted past the 32 bit wraps
+  double fitDeviceUs;			//!< Device time the fitted line passes through
+  double fitHostNs;			//!< Host time the fitted line passes through
+  double fitSlope;			//!< Host nanoseconds per device microsecond
+  int64_t bestRttNs;			//!< Shortest round trip among the kept exchanges
+};
+
+#endif
@@ -0,0 +1,163 @@
+/*!
+ * \file device_manager.h
+ * \brief Runs the flow loops of many Teensy boards on a small fixed pool of threads.
+ * \details Every board is a TeensyDevice holding its own protocol state, valve position and PID
+ * controller. The boards are spread over a few I/O threads. Each I/O thread waits on one epoll set
+ * for serial data from its boards and for a timerfd armed at their next control deadline, so
+ * adding a board never adds a thread. When a deadline passes the I/O thread asks the board for
+ * its flow. The reading goes onto a queue served by a pool of control threads, which run the PID
+ * and send the new valve target back to the board.
+ */
+#ifndef _MY__DEVICE_MANAGER__H
+#define _MY__DEVICE_MANAGER__H	//!< Used to ensure the header is only included once during compilation
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include "protocol.h"
+#include "frame_parser.h"
+#include "flow_sensor.h"
+#include "pid.h"
+
+#define JITTER_BUCKET_US 50		//!< Width of one bucket of the lateness histogram
+#define JITTER_BUCKETS 400		//!< Buckets of the lateness histogram; later samples land in the last one
+#define DEVICE_HELLO_TIMEOUT_MS 500	//!< How long to wait for the hello reply before asking again
+#define DEVICE_HELLO_RETRIES 4		//!< Hello attempts before a board is given up on
+
+/*!
+ *  How late the control steps of one board ran, measured from the deadline to the valve target being sent
+ */
+struct LoopJitterStats
+{
+  uint64_t count = 0;			//!< Number of control steps
+  double sumUs = 0.0;			//!< Sum of the lateness
+  double sumSqUs = 0.0;			//!< Sum of the squared lateness
+  double minUs = 0.0;			//!< Smallest lateness
+  double maxUs = 0.0;			//!< Largest lateness
+  uint32_t buckets[JITTER_BUCKETS] = {0};	//!< Histogram of the lateness
+
+  void Add(double latenessUs);
+  double MeanUs() const;
+  double StdDevUs() const;
+  double PercentileUs(double fraction) const;
+};
+
+/*!
+ *  Where a board is in its life cycle
+ */
+enum DeviceState
+{
+  DEVICE_CONNECTING,	//!< Waiting for the hello reply
+  DEVICE_RUNNING,	//!< The flow loop is running
+  DEVICE_FAILED		//!< The board did not answer or cannot run the loop
+};
+
+/*!
+ *  One Teensy board and the flow loop that drives its valve
+ */
+struct TeensyDevice
+{
+  char path[64] = "";			//!< Serial port of the board
+  int fd = -1;				//!< Open serial port
+  std::atomic<DeviceState> state{DEVICE_CONNECTING};	//!< Written by the I/O thread, read by the control threads and the caller
+
+  // protocol state, only touched by the I/O thread that owns the board
+  FrameParser parser;			//!< Reassembles the packets the board sends
+  int helloAttempts = 0;
+  int64_t helloSentNs = 0;
+  bool requestPending = false;		//!< A flow request has not been answered yet
+  int64_t requestDeadlineNs = 0;	//!< Deadline the pending flow request belongs to
+  int64_t nextDeadlineNs = 0;		//!< When the next flow request is due
+
+  // identity from the hello reply
+  uint32_t serialNumber = 0;
+  uint32_t features = 0;
+  FlowSensorProfile sensor = FLOW_SENSOR_PROFILES[FLOW_SENSOR_LEGACY];
+  int maxStepRate = 0;
+
+  // flow loop, guarded by lock
+  std::mutex lock;			//!< Guards the loop state
+  std::mutex writeLock;			//!< Keeps packets from the I/O and control threads from interleaving
+  double targetFlow = 0.0;		//!< mL/s
+  int64_t periodNs = 0;			//!< Control period
+  PidGains gains;
+  PidState pid;
+  bool pidTuned = false;		//!< gains were loaded from the device profile
+  double flow = 0.0;			//!< Last measured flow in mL/s
+  int position = 0;			//!< Last position the board reported
+  int command = 0;			//!< Last valve target sent
+  int64_t lastDeadlineNs = 0;		//!< Deadline of the previous control step
+
+  // statistics
+  LoopJitterStats jitter;		//!< Lateness of the control steps
+  uint64_t missed = 0;			//!< Flow requests not answered before the next deadline
+  uint64_t overruns = 0;		//!< Deadlines skipped because the I/O thread fell behind
+  uint64_t writeErrors = 0;		//!< Packets that could not be written in full
+};
+
+/*!
+ * \brief Owns the boards and the threads that drive them.
+ * \details Add every board, then Start. The boards and threads are released by Stop or the destructor.
+ */
+class DeviceManager
+{
+public:
+  DeviceManager(int ioThreads, int controlThreads);
+  ~DeviceManager();
+  TeensyDevice *Add(const char *path, double targetFlow, const PidGains &defaultGains, double periodS);
+  bool Start();
+  void Stop();
+  void UseDeviceProfiles(bool use) { loadProfiles = use; }
+  int NumDevices() const { return (int)devices.size(); }
+  TeensyDevice *Device(int i) { return devices[i]; }
+
+private:
+  /*!
+   *  One I/O thread and the boards it owns
+   */
+  struct IoWorker
+  {
+    int epollFd = -1;			//!< Serial ports, the timer and the wake up event
+    int timerFd = -1;			//!< Armed at the earliest deadline of the boards
+    int wakeFd = -1;			//!< Signalled by Stop
+    std::vector<TeensyDevice *> devices;
+    std::thread thread;
+  };
+  /*!
+   *  A flow reading waiting for a control thread
+   */
+  struct ControlJob
+  {
+    TeensyDevice *device;
+    double flow;			//!< mL/s
+    int64_t deadlineNs;			//!< Deadline the reading was requested for
+  };
+
+  void IoLoop(IoWorker *worker);
+  void ControlLoop();
+  void ReadDevice(TeensyDevice *device, int64_t nowNs);
+  void HandleFrame(TeensyDevice *device, const uint8_t *packet, unsigned int size, int64_t nowNs);
+  void ServiceDeadlines(IoWorker *worker, int64_t nowNs);
+  void RunControlStep(const ControlJob &job);
+  bool SendFrame(TeensyDevice *device, unsigned int payloadSize, const uint8_t *payload);
+
+  std::vector<TeensyDevice *> devices;
+  std::vector<IoWorker *> workers;
+  std::vector<std::thread> controllers;
+  int numIoThreads;
+  int numControlThreads;
+  std::deque<ControlJob> jobs;		//!< Readings waiting for a control thread
+  std::mutex jobsLock;
+  std::condition_variable jobsReady;
+  std::atomic<bool> stopping;
+  bool started;
+  bool loadProfiles;			//!< Use the gains stored in the profile of each board
+};
+
+int64_t MonotonicNs();
+
+#endif
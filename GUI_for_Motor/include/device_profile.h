@@ -0,0 +1,20 @@
+#include <stddef.h>
+
+#ifndef _MY__DEVICE_PROFILE__H
+#define _MY__DEVICE_PROFILE__H	//!< Used to ensure the header is only included once during compilation
+
+#define DEVICE_PROFILE_DIR_ENV "PIFLOW_DIR"	//!< Environment variable that overrides where device profiles are kept
+#define DEVICE_PROFILE_DEFAULT_DIR ".piflow"	//!< Directory under $HOME used when the variable is not set
+
+/*!
+ * \brief Builds the path of a file that belongs to one Teensy
+ * \param serialNumber is the serial number the Teensy reported during the handshake
+ * \param channel is the valve channel on the Teensy the file belongs to
+ * \param fileName is the name of the file inside the device directory
+ * \param path receives the full path
+ * \param size is the size of path
+ * \details Files are kept in <profile dir>/<serial number>/<file name> for channel 0 and in <profile dir>/<serial number>/channel<n>/<file name> for the other channels. The directories are created if needed.
+ */
+bool DeviceProfilePath(unsigned long serialNumber, int channel, const char *fileName, char *path, size_t size);
+
+#endif
@@ -0,0 +1,89 @@
+/*!
+ * \file device_sim.h
+ * \brief Simulated Teensy and valve used to exercise the host without hardware.
+ * \details SimulatedTeensy answers the hello, rate, timed flow, move and abort commands the way the
+ * firmware does and drives a simple plant: the motor slews toward its target at the maximum step
+ * rate, the valve passes flow along an equal-percentage-like curve and the flow sensor lags the
+ * valve by a first order time constant. Time is supplied by the caller, so the same model can run
+ * in real time behind a pty or as fast as possible inside a tool. Offline tools can also drive
+ * the valve directly with MoveTo and sample the sensor without going through packets.
+ * SetSupply scales the flow at every position, like a change of the supply pressure.
+ * SetClock gives the board's micros() an offset and a drift from the host clock, for exercising the clock sync.
+ */
+#ifndef _MY__DEVICE_SIM__H
+#define _MY__DEVICE_SIM__H	//!< Used to ensure the header is only included once during compilation
+
+#include <stdint.h>
+#include <stddef.h>
+#include "protocol.h"
+#include "frame_parser.h"
+#include "valve_table.h"
+
+#define SIM_MAX_FLOW 100.0		//!< Flow through the fully open valve in mL/s
+#define SIM_FLOW_TIME_CONSTANT 0.5	//!< Lag between the valve and the measured flow in seconds
+#define SIM_ML_PER_PULSE 6.5		//!< Flow sensor calibration reported by the simulated board
+#define SIM_STEP_RATE 500		//!< Fastest step rate of the simulated motor in steps per second
+
+/*!
+ *  Shape of the simulated plant
+ */
+typedef struct
+{
+  double maxFlow;		//!< Flow through the fully open valve in mL/s (built-in curve only)
+  double timeConstant;		//!< First order lag of the measured flow in seconds
+  double deadTime;		//!< Transport delay between the valve and the sensor in seconds
+  double noise;			//!< Standard deviation of the measurement noise in mL/s
+  const ValveTable *curve;	//!< Measured position to flow curve, or NULL for the built-in one
+} SimPlant;
+
+/*!
+ * \brief One simulated Teensy with one valve and flow sensor.
+ */
+class SimulatedTeensy
+{
+public:
+  SimulatedTeensy(uint32_t serialNumber, const SimPlant &plant);
+  size_t Receive(const uint8_t *data, size_t size, int64_t nowNs, uint8_t *reply, size_t replySize);
+  size_t Advance(int64_t nowNs, uint8_t *reply, size_t replySize);
+  void MoveTo(int position);
+  double MeasuredFlow();
+  double Flow() const { return flow; }
+  int Position() const { return (int)position; }
+  double Pulses() const { return pulses; }
+  double Travel() const { return travel; }
+  double SteadyFlow(double steps) const { return ValveFlow(steps); }
+  void SetSupply(double scale) { supply = scale; }
+  void SetClock(int64_t offsetUs, double driftPpm) { clockOffsetUs = offsetUs; clockDriftPpm = driftPpm; }
+  uint32_t DeviceMicros(int64_t nowNs) const;
+  void Characterize(int spacing, ValveTable *table) const;
+
+private:
+  size_t HandlePacket(const uint8_t *packet, unsigned int size, int64_t nowNs, uint8_t *reply, size_t replySize);
+  size_t Frame(unsigned int payloadSize, const uint8_t *payload, uint8_t *reply, size_t replySize);
+  double ValveFlow(double steps) const;
+  double Noise();
+
+  uint32_t serialNumber;		//!< Reported in the hello reply
+  SimPlant plant;			//!< Shape of the plant
+  double supply;			//!< Scale of the flow relative to the nominal supply pressure
+  int64_t clockOffsetUs;		//!< micros() of the board when the host clock reads 0
+  double clockDriftPpm;			//!< How much faster micros() runs than the host clock
+  FrameParser parser;			//!< Reassembles the packets the host sends
+  double position;			//!< Motor position in steps from fully closed
+  int target;				//!< Position the motor is moving to
+  bool reportMove;			//!< Send a MOVE_DONE_FRAME when the motor stops
+  bool aborted;				//!< The move in flight was aborted
+  double flow;				//!< Flow seen by the sensor in mL/s
+  double delayed[256];			//!< Valve flow history used for the dead time
+  unsigned int delayedIndex;		//!< Next slot of the history
+  double delayedStep;			//!< Seconds between history slots
+  double delayedElapsed;		//!< Seconds since the last history slot was filled
+  double pulses;			//!< Pulses counted since power up
+  double travel;			//!< Steps the motor has moved since power up
+  double windowPulses;			//!< Pulses counted since the last timed flow read
+  int64_t windowStartNs;		//!< Start of the timed flow window
+  int64_t lastNs;			//!< Time of the last Advance
+  uint64_t random;			//!< State of the noise generator
+};
+
+#endif
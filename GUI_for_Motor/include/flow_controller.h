@@ -0,0 +1,118 @@
+/*!
+ * \file flow_controller.h
+ * \brief Decisions of the host flow loop, separated from the serial port and the clock.
+ * \details MasterLogic measures the flow, calls FlowControllerStep and carries out the move it
+ * returns. The step only reads its arguments and updates the state it is given, so the same
+ * inputs always give the same move. Offline tools can run thousands of controllers side by
+ * side against a model of the valve and get exactly the decisions the rig would make.
+ */
+#ifndef _MY__FLOW_CONTROLLER__H
+#define _MY__FLOW_CONTROLLER__H	//!< Used to ensure the header is only included once during compilation
+
+#include "pid.h"
+#include "valve_table.h"
+#include "loop_rate.h"
+#include "plant_model.h"
+#include "mpc.h"
+
+#define FLOW_ERROR_BAND 0.25		//!< Deadband as a fraction of the target when the flow is counted over whole seconds
+#define FLOW_FILTERED_ERROR_BAND 0.10	//!< Deadband as a fraction of the target when the Teensy filters the rate
+#define FLOW_STEP_SIZE 200		//!< Steps moved by each correction of the deadband controller
+#define FLOW_MAX_STEP_SIZE 255		//!< Largest deadband correction the legacy move command can carry
+#define FLOW_FEEDBACK_MAX_STEPS 400	//!< Largest single correction made from the valve table
+#define FLOW_REPLY_TIMEOUT_US 500000	//!< Ask for the flow again if the reply has not arrived by then
+#define FLOW_SMITH_CLOSED_LOOP 0.75	//!< Closed loop time constant of the Smith mode as a fraction of the model time constant
+#define FLOW_TABLE_MIN_PERIOD 1.0	//!< Shortest control period of the table and deadband modes in seconds, long enough for a move to show at the sensor
+#define FLOW_TABLE_SETTLE_S 2.0		//!< Time the table mode lets the flow settle after a move when there is no plant model, as the characterization sweep does
+#define FLOW_TABLE_SETTLE_TIME_CONSTANTS 3.0	//!< Time constants past the dead time the table mode lets the flow settle after a move when there is a plant model
+#define FLOW_TABLE_HYSTERESIS 0.5	//!< Fraction of the band the table mode brings the error within once it has left the band
+#define FLOW_SMITH_MIN_PERIOD 0.1	//!< Shortest control period of the Smith mode in seconds
+#define FLOW_SMITH_MAX_PERIOD 2.0	//!< Longest control period of the Smith mode in seconds
+#define FLOW_SMITH_HISTORY 256		//!< Model flows kept to look up the one a dead time ago
+#define FLOW_SMITH_SUBSTEP 0.01		//!< Longest step of the model while it moves the valve, in seconds
+
+/*!
+ *  How the controller corrects the flow
+ */
+enum FlowControlMode
+{
+  FLOW_CONTROL_DEADBAND,	//!< Move a fixed number of steps while the flow is outside the deadband
+  FLOW_CONTROL_TABLE,		//!< Move by the error over the slope of the valve table while outside the deadband
+  FLOW_CONTROL_PID,		//!< Position form PID on every sample
+  FLOW_CONTROL_SMITH,		//!< Correction on every sample from a Smith predictor built on the plant model
+  FLOW_CONTROL_MPC		//!< Moves planned on every sample over the Smith predictor, within the travel of the motor
+};
+
+/*!
+ *  Tuning of the flow controller
+ */
+typedef struct
+{
+  FlowControlMode mode;		//!< How the flow is corrected
+  double errorBand;		//!< Deadband as a fraction of the target (deadband and table modes)
+  int stepSize;			//!< Steps per correction (deadband mode)
+  int feedbackMaxSteps;		//!< Largest single correction (table mode)
+  bool feedforward;		//!< Start at the position the valve table predicts for the target
+  PidGains gains;		//!< Gains of the PID mode
+  PlantModel model;		//!< Valve to sensor model of the Smith mode
+  double closedLoop;		//!< Closed loop time constant of the Smith mode as a fraction of the model time constant
+  double stepRate;		//!< Fastest the motor moves in steps per second, 0 if a move is taken to be instant
+  MpcWeights mpcWeights;	//!< Costs of the plans of the MPC mode
+  LoopRateConfig rate;		//!< Bounds of the adaptive control period
+} FlowControllerConfig;
+
+/*!
+ *  Running state of the Smith predictor
+ *  \details The model runs alongside the valve, moving its motor at the step rate and leaving out
+ *  the dead time. The measured flow minus what the model predicted a dead time ago is what the
+ *  model does not know about, such as a change of the supply. The controller moves the valve so
+ *  the model plus that difference reaches the target, so it never waits for the sensor to see a
+ *  move and there is no integral to wind up while the motor travels.
+ */
+typedef struct
+{
+  double gain;				//!< Gain of the model in mL/s per step, used when there is no valve table
+  bool useTable;			//!< The model follows the valve table instead of the gain
+  double valve;				//!< Position the model has the motor at, in steps
+  double flow;				//!< Flow the model predicts without the dead time in mL/s
+  double clock;				//!< Seconds since the start, summed from the steps
+  double mismatch;			//!< Measured flow minus the delayed model flow, filtered, in mL/s
+  bool started;				//!< False until the first sample has set mismatch
+  double time[FLOW_SMITH_HISTORY];	//!< Clock of the recorded model flows
+  double past[FLOW_SMITH_HISTORY];	//!< Recorded model flows, oldest at head
+  int head;				//!< Oldest record
+  int count;				//!< Records kept
+} SmithPredictor;
+
+/*!
+ *  Running state of the flow controller
+ */
+typedef struct
+{
+  PidState pid;			//!< State of the PID mode
+  SmithPredictor smith;		//!< State of the Smith mode, and the predictor the MPC mode plans from
+  MpcSolver mpc;		//!< Solver of the MPC mode, holding the last plan
+  int lastDirection;		//!< Direction of the last move of the MPC mode: 1 opening, -1 closing, 0 none yet
+  double settleLeft;		//!< Seconds until the last move of the table mode has reached the sensor and settled
+  double lastFlow;		//!< Flow of the previous sample in mL/s, which the table mode checks has stopped changing
+  bool tableCorrecting;		//!< The table mode left the band and corrects until the error is inside FLOW_TABLE_HYSTERESIS of it
+  LoopRateState schedule;	//!< State of the adaptive control period
+} FlowControllerState;
+
+/*!
+ *  What the controller wants done after a sample
+ */
+typedef struct
+{
+  int position;			//!< Position the valve should be at, in steps from fully closed
+  bool move;			//!< True when position differs from the current one
+  double period;		//!< Seconds to wait before the next sample
+} FlowControlAction;
+
+void FlowControllerDefaults(FlowControllerConfig *config, FlowControlMode mode, bool filtered);
+int FlowControllerStart(FlowControllerState *state, const FlowControllerConfig *config, const ValveTable *table, double target, int position);
+void FlowControllerShift(FlowControllerState *state, const FlowControllerConfig *config, int steps);
+FlowControlAction FlowControllerStep(FlowControllerState *state, const FlowControllerConfig *config, const ValveTable *table,
+                                     double target, double flow, int position, double dt);
+
+#endif
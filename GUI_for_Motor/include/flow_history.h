@@ -0,0 +1,89 @@
+/*!
+ * \file flow_history.h
+ * \brief Bounded history of the flow of one valve over runs of any length.
+ * \details The latest raw samples are kept for a short window. Every sample also updates the
+ * min, max, sum and count of its 1 second, 1 minute and 1 hour buckets, each level held in a
+ * fixed ring, so the memory used does not grow with the length of the run. A query over any span
+ * picks the finest level that still covers it in at most the number of points asked for, so
+ * charting a day touches no more points than charting a minute. The rollups are saved to the
+ * device profile directory and carried over to the next run; the raw window is not.
+ * Sample times are CLOCK_REALTIME nanoseconds so saved buckets still line up after a reboot.
+ */
+#ifndef _MY__FLOW_HISTORY__H
+#define _MY__FLOW_HISTORY__H	//!< Used to ensure the header is only included once during compilation
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+
+#define FLOW_HISTORY_RAW_SAMPLES 4096		//!< Raw samples kept (about 17 minutes at the fastest loop rate)
+#define FLOW_HISTORY_LEVELS 3			//!< Rollup levels: seconds, minutes and hours
+#define FLOW_HISTORY_SECOND_BUCKETS 3600	//!< 1 second buckets kept (1 hour)
+#define FLOW_HISTORY_MINUTE_BUCKETS 2880	//!< 1 minute buckets kept (2 days)
+#define FLOW_HISTORY_HOUR_BUCKETS 2160		//!< 1 hour buckets kept (90 days)
+#define FLOW_HISTORY_FILE "flow_history.bin"	//!< Name of the saved rollups in the device profile directory
+#define FLOW_HISTORY_MAGIC 0x53484650u		//!< "PFHS" little endian, marks a saved history
+#define FLOW_HISTORY_VERSION 1			//!< Layout version of the saved history
+
+/*!
+ *  Flow over one bucket of time, or one raw sample when count is 1
+ */
+typedef struct
+{
+  int64_t startNs;	//!< Start of the bucket in CLOCK_REALTIME nanoseconds
+  int64_t widthNs;	//!< Length of the bucket, 0 for a raw sample
+  double min;		//!< Lowest flow in mL/s
+  double max;		//!< Highest flow in mL/s
+  double sum;		//!< Sum of the flows, so the mean is sum / count
+  uint32_t count;	//!< Number of samples, 0 for an empty slot
+  uint32_t reserved;	//!< Keeps the saved layout free of padding
+} FlowRollup;
+
+/*!
+ * \brief Raw samples and rollups of the flow of one valve.
+ * \details Safe to add from the control thread while another thread queries or saves. Saving only holds the lock
+ * while it copies the rollups, so an Add never waits for the disk.
+ */
+class FlowHistory
+{
+public:
+  FlowHistory();
+  void Clear();
+  bool Add(int64_t timeNs, double flow);
+  int Query(int64_t fromNs, int64_t toNs, int maxPoints, FlowRollup *points) const;
+  bool Summary(int64_t fromNs, int64_t toNs, FlowRollup *summary) const;
+  int64_t NewestNs() const;
+  bool Save(const char *fileName) const;
+  bool Load(const char *fileName);
+
+private:
+  int QueryRaw(int64_t fromNs, int64_t toNs, int maxPoints, FlowRollup *points) const;
+  int QueryLevel(int level, int64_t fromNs, int64_t toNs, int maxPoints, FlowRollup *points) const;
+
+  mutable std::mutex lock;			//!< Guards everything below up to newestNs
+  int64_t rawTimeNs[FLOW_HISTORY_RAW_SAMPLES];	//!< Ring of raw sample times
+  double rawFlow[FLOW_HISTORY_RAW_SAMPLES];	//!< Ring of raw flows in mL/s
+  unsigned int rawCount;			//!< Valid raw samples
+  unsigned int rawNext;				//!< Slot of the next raw sample
+  FlowRollup seconds[FLOW_HISTORY_SECOND_BUCKETS];	//!< 1 second buckets, indexed by bucket number modulo the size
+  FlowRollup minutes[FLOW_HISTORY_MINUTE_BUCKETS];	//!< 1 minute buckets
+  FlowRollup hours[FLOW_HISTORY_HOUR_BUCKETS];		//!< 1 hour buckets
+  FlowRollup *levels[FLOW_HISTORY_LEVELS];		//!< The rings from finest to coarsest
+  int64_t newestNs;				//!< Time of the newest sample, 0 if there is none
+
+  mutable std::mutex saveLock;			//!< Lets one Save at a time use the snapshot
+  mutable FlowRollup snapshot[FLOW_HISTORY_SECOND_BUCKETS + FLOW_HISTORY_MINUTE_BUCKETS + FLOW_HISTORY_HOUR_BUCKETS];	//!< Copy of the rollups Save writes once lock is released
+};
+
+/*!
+ * \brief Mean flow of a bucket in mL/s
+ */
+inline double FlowRollupMean(const FlowRollup *rollup)
+{
+  return rollup->count > 0 ? rollup->sum / rollup->count : 0.0;
+}
+
+bool LoadFlowHistory(unsigned long serialNumber, int channel, FlowHistory *history);
+bool SaveFlowHistory(unsigned long serialNumber, int channel, const FlowHistory *history);
+
+#endif
@@ -0,0 +1,105 @@
+/*!
+ * \file flow_profile.h
+ * \brief Flow that follows a recipe over time: ramps, holds, tapers and a stop at a volume.
+ * \details A profile file lists segments, one per line, after the line "# piflow flow profile v1":
+ * - ramp <mL/s> <s> changes the flow linearly from where the segment before left it
+ * - hold <mL/s> <s> goes to the flow at once and holds it
+ * - taper <mL/s> <s> eases the flow to a new value, quickly at first and gently at the end
+ * - stop <mL> keeps the flow until the volume delivered since the start of the profile reaches the given volume, then ends the profile
+ *
+ * A profile without a stop ends after its last segment. Either way the valve closes at the end.
+ * Blank lines and lines starting with # are skipped.
+ *
+ * BuildFlowProfile samples the setpoint and the position the valve table predicts for it every
+ * sampleS before the run, so the control loop only interpolates. FlowProfileStart puts the start
+ * of every segment on a timer wheel in CLOCK_MONOTONIC time, and FlowProfileNextDeadline tells
+ * the loop when to wake for the next one, so a change of the setpoint is acted on when it is due
+ * rather than at the end of a long control period.
+ */
+#ifndef _MY__FLOW_PROFILE__H
+#define _MY__FLOW_PROFILE__H	//!< Used to ensure the header is only included once during compilation
+
+#include "valve_table.h"
+#include "timer_wheel.h"
+
+#define FLOW_PROFILE_MAX_SEGMENTS 32	//!< Segments a profile may have
+#define FLOW_PROFILE_MAX_SAMPLES 8192	//!< Points of the precomputed trajectory
+#define FLOW_PROFILE_SAMPLE_S 0.1	//!< Spacing of the trajectory for profiles short enough to allow it
+#define FLOW_PROFILE_TRACK_S 0.5	//!< Longest control period while the setpoint ramps or tapers
+#define FLOW_PROFILE_TAPER_RATE 5.0	//!< Time constants a taper spans, so it ends within 1% of its flow
+#define FLOW_PROFILE_TICK_NS 1000000	//!< Width of a slot of the timer wheel
+
+/*!
+ *  What a segment does
+ */
+enum FlowSegmentType
+{
+  FLOW_SEGMENT_RAMP,	//!< Linear change to flow over duration
+  FLOW_SEGMENT_HOLD,	//!< Step to flow and hold it for duration
+  FLOW_SEGMENT_TAPER,	//!< Exponential change to flow over duration
+  FLOW_SEGMENT_STOP	//!< Hold the flow until volume has been delivered
+};
+
+/*!
+ *  One line of a profile
+ */
+typedef struct
+{
+  FlowSegmentType type;
+  double flow;		//!< Flow at the end of the segment in mL/s
+  double duration;	//!< Length in seconds; for a stop, the length planned from the setpoint
+  double volume;	//!< Volume since the start of the profile that ends a stop, in mL
+  double start;		//!< Planned start in seconds from the start of the profile
+  double startFlow;	//!< Setpoint at the start in mL/s
+} FlowSegment;
+
+/*!
+ *  A profile and its precomputed trajectory
+ */
+typedef struct
+{
+  int numSegments;				//!< Valid segments
+  FlowSegment segments[FLOW_PROFILE_MAX_SEGMENTS];	//!< Segments in order
+  double duration;				//!< Planned length of the whole profile in seconds
+  double sampleS;				//!< Spacing of the trajectory in seconds
+  int numSamples;				//!< Valid points of the trajectory
+  double setpoint[FLOW_PROFILE_MAX_SAMPLES];	//!< Setpoint at each point in mL/s
+  int feedforward[FLOW_PROFILE_MAX_SAMPLES];	//!< Position the valve table predicts for it, -1 without a table
+} FlowProfile;
+
+/*!
+ *  Where a run of a profile is
+ */
+typedef struct
+{
+  int64_t startNs;		//!< Start of the run in CLOCK_MONOTONIC nanoseconds
+  double lastTime;		//!< Seconds into the run of the previous flow sample
+  double volume;		//!< Volume delivered so far in mL, from the measured flow
+  int segment;			//!< Segment under way
+  bool done;			//!< The profile has ended
+  double maxLateS;		//!< Latest a segment start has been acted on after it was due, in seconds
+  TimerWheel wheel;		//!< Starts of the segments still to come
+} FlowProfileRun;
+
+/*!
+ *  What the control loop should do at a flow sample
+ */
+typedef struct
+{
+  double target;	//!< Setpoint in mL/s
+  int feedforward;	//!< Position the valve table predicts for the setpoint, -1 without a table
+  int segment;		//!< Segment under way
+  bool segmentStarted;	//!< A segment started since the previous sample
+  double lateS;		//!< How long after it was due the latest segment start was acted on, in seconds
+  bool done;		//!< The profile has ended and the valve should close
+} FlowProfileStep;
+
+bool LoadFlowProfile(const char *fileName, FlowProfile *profile);
+void BuildFlowProfile(FlowProfile *profile, const ValveTable *table);
+double FlowProfileSetpoint(const FlowProfile *profile, double time);
+int FlowProfileFeedforward(const FlowProfile *profile, double time);
+void FlowProfileStart(FlowProfileRun *run, const FlowProfile *profile, int64_t nowNs);
+FlowProfileStep FlowProfileAdvance(FlowProfileRun *run, const FlowProfile *profile, int64_t nowNs, double flow);
+int64_t FlowProfileNextDeadline(const FlowProfileRun *run, const FlowProfile *profile, int64_t nowNs, double flow);
+
+#endif
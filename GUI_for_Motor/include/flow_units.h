@@ -0,0 +1,134 @@
+/*!
+ * \file flow_units.h
+ * \brief Conversion of the counts and rates the Teensy reports into mL and mL/s.
+ * \details Every program that turns a reply into a flow goes through these, so the controller,
+ * the device manager and the offline tools agree on a flow to the last bit. The volume of a pulse
+ * comes from the flow sensor profile in flow_sensor.h at the rate the pulses came in, with the same
+ * fixed point lookup the firmware does in its interrupt.
+ */
+#ifndef _MY__FLOW_UNITS__H
+#define _MY__FLOW_UNITS__H	//!< Used to ensure the header is only included once during compilation
+
+#include <stdint.h>
+#include <string.h>
+#include "protocol.h"
+#include "flow_sensor.h"
+
+/*!
+ * \brief Flow sensor calibration from the hello reply
+ * \param calibration is the HELLO_CALIBRATION_OFFSET field, or FlowSensorProfile::nominalUl, in microliters per pulse
+ */
+inline double CalibrationMlPerPulse(uint16_t calibration)
+{
+  return calibration / 1000.0;
+}
+
+/*!
+ * \brief Flow sensor profile from the hello reply
+ * \details The profile the firmware names with FEATURE_SENSOR_PROFILE if it is in the table, otherwise the legacy sensor
+ * if the calibration it reports is missing or the legacy one, otherwise a linear profile at that calibration.
+ */
+inline FlowSensorProfile HelloFlowSensor(const uint8_t *payload, unsigned int payloadSize)
+{
+  if(payloadSize > HELLO_NUM_COMMANDS_OFFSET && (GetU32(payload + HELLO_FEATURES_OFFSET) & FEATURE_SENSOR_PROFILE)){
+    unsigned int at = HELLO_COMMANDS_OFFSET + payload[HELLO_NUM_COMMANDS_OFFSET];
+    at += (GetU32(payload + HELLO_FEATURES_OFFSET) & FEATURE_CHANNELS) ? 1 : 0;
+    const FlowSensorProfile *sensor = at < payloadSize ? FindFlowSensor(payload[at]) : NULL;
+    if(sensor != NULL){
+      return *sensor;
+    }
+  }
+  uint16_t calibration = payloadSize > HELLO_CALIBRATION_OFFSET + 1 ? GetU16(payload + HELLO_CALIBRATION_OFFSET) : 0;
+  if(calibration == 0 || calibration == FLOW_SENSOR_PROFILES[FLOW_SENSOR_LEGACY].nominalUl){
+    return FLOW_SENSOR_PROFILES[FLOW_SENSOR_LEGACY];
+  }
+  return LinearFlowSensor("linear", FLOW_SENSOR_CUSTOM, calibration);
+}
+
+/*!
+ * \brief Profile with the given name, NULL if there is none
+ */
+inline const FlowSensorProfile *FindFlowSensorByName(const char *name)
+{
+  for(unsigned int i = 0; i < NUM_FLOW_SENSORS; i++){
+    if(strcmp(FLOW_SENSOR_PROFILES[i].name, name) == 0){
+      return &FLOW_SENSOR_PROFILES[i];
+    }
+  }
+  return NULL;
+}
+
+/*!
+ * \brief Volume of a pulse in mL at a pulse rate in pulses per second
+ */
+inline double SensorMlPerPulse(const FlowSensorProfile &sensor, double pulsesPerSecond)
+{
+  uint32_t milliHz = pulsesPerSecond <= 0.0 ? 0 : pulsesPerSecond >= 4294967.0 ? UINT32_MAX : (uint32_t)(pulsesPerSecond * 1000.0 + 0.5);
+  return FlowSensorPulseNl(sensor, milliHz) * 1e-6;
+}
+
+/*!
+ * \brief Flow from a rate the Teensy measured, as in the RATE_COMMAND reply and the loop status
+ * \param milliPulsesPerSecond is the rate in millipulses per second
+ */
+inline double RateFlow(uint32_t milliPulsesPerSecond, const FlowSensorProfile &sensor)
+{
+  return milliPulsesPerSecond * 0.001 * (FlowSensorPulseNl(sensor, milliPulsesPerSecond) * 1e-6);
+}
+
+/*!
+ * \brief Flow from the TIMED_FLOW_COMMAND reply
+ * \details 0 for an empty window.
+ */
+inline double TimedFlow(uint32_t pulses, uint32_t windowUs, const FlowSensorProfile &sensor)
+{
+  if(windowUs == 0){
+    return 0.0;
+  }
+  double pulsesPerSecond = (pulses * 1000000.0) / windowUs;
+  return pulsesPerSecond * SensorMlPerPulse(sensor, pulsesPerSecond);
+}
+
+/*!
+ * \brief Flow from a pulse count over a time measured by the host, as in the legacy FLOW_COMMAND reply
+ * \details 0 when no time has passed.
+ */
+inline double CountFlow(double pulses, double seconds, const FlowSensorProfile &sensor)
+{
+  if(seconds <= 0.0){
+    return 0.0;
+  }
+  double pulsesPerSecond = pulses / seconds;
+  return pulsesPerSecond * SensorMlPerPulse(sensor, pulsesPerSecond);
+}
+
+/*!
+ * \brief Volume of a pulse count in mL, at one calibration, as for the dose pulses the Teensy counts
+ */
+inline double PulseVolume(double pulses, double mlPerPulse)
+{
+  return pulses * mlPerPulse;
+}
+
+/*!
+ * \brief Volume of the pulses counted over a window in mL, each at the volume the profile gives for the mean rate
+ */
+inline double PulseVolume(double pulses, double seconds, const FlowSensorProfile &sensor)
+{
+  return pulses * SensorMlPerPulse(sensor, seconds > 0.0 ? pulses / seconds : 0.0);
+}
+
+/*!
+ * \brief Pulse rate in millipulses per second that gives a flow, as for the setpoint of the on-device loop
+ * \details Found by a few rounds of fixed point iteration, as the volume of a pulse depends on the rate; for setting up, not for every sample.
+ */
+inline uint32_t FlowPulseRate(double flow, const FlowSensorProfile &sensor)
+{
+  double pulsesPerSecond = flow / CalibrationMlPerPulse(sensor.nominalUl);
+  for(int i = 0; i < 4 && pulsesPerSecond > 0.0; i++){
+    pulsesPerSecond = flow / SensorMlPerPulse(sensor, pulsesPerSecond);
+  }
+  return pulsesPerSecond > 0.0 ? (uint32_t)(pulsesPerSecond * 1000.0) : 0;
+}
+
+#endif
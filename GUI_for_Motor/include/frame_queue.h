@@ -0,0 +1,49 @@
+/*!
+ * \file frame_queue.h
+ * \brief Packets waiting for the thread of one valve, held in preallocated slots.
+ * \details Serial_Read_Thread pushes every packet for a valve here with the time it was read, and
+ * the control thread of the valve pops them. The slots live in the queue itself, so passing a
+ * packet along costs two copies and no allocation. A full queue drops its oldest packet, which by
+ * then is a reply nobody is waiting for any more.
+ */
+#ifndef _MY__FRAME_QUEUE__H
+#define _MY__FRAME_QUEUE__H	//!< Used to ensure the header is only included once during compilation
+
+#include <stdint.h>
+#include <mutex>
+#include <condition_variable>
+#include "protocol.h"
+
+#define FRAME_QUEUE_SLOTS 64	//!< Packets a valve can have waiting
+
+/*!
+ *  One queued packet
+ */
+typedef struct
+{
+  uint8_t packet[PACKET_MAX_BYTES];
+  unsigned int size;
+  int64_t receivedNs;		//!< Host monotonic time the packet was read from the port
+} QueuedFrame;
+
+/*!
+ * \brief Bounded queue of packets from one producer to one consumer.
+ */
+class FrameQueue
+{
+public:
+  FrameQueue();
+  void Push(const uint8_t *packet, unsigned int size, int64_t receivedNs);
+  unsigned int Pop(uint8_t *packet, long timeoutUs, int64_t *receivedNs);
+  uint32_t Dropped() const { return dropped; }
+
+private:
+  std::mutex lock;				//!< Guards everything below
+  std::condition_variable ready;		//!< Signalled when a packet is pushed
+  QueuedFrame slots[FRAME_QUEUE_SLOTS];		//!< Ring of packets
+  unsigned int head;				//!< Slot of the oldest packet
+  unsigned int count;				//!< Packets waiting
+  uint32_t dropped;				//!< Packets dropped because the queue was full
+};
+
+#endif
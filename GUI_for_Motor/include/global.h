@@ -1,6 +1,20 @@
 #include <gtk/gtk.h>
 #include <stdlib.h>
 #include <iostream>
+#include <atomic>
+#include "status_shm.h"
+#include "valve_table.h"
+#include "pid.h"
+#include "plant_model.h"
+#include "flow_profile.h"
+#include "flow_sensor.h"
+#include "loop_rate.h"
+#include "serial_capture.h"
+#include "clock_sync.h"
+#include "flow_history.h"
+#include "frame_queue.h"
+#include "log_queue.h"
+#include "alloc_guard.h"
 #define __STDC_FORMAT_MACROS
 
 
@@ -26,26 +40,90 @@ typedef struct
   GtkWidget *FCloseButton;
   GtkWidget *TargetFlowInput;
   GtkWidget *FlowLabel;
+  GtkWidget *FOpenButton2;
+  GtkWidget *FCloseButton2;
+  GtkWidget *TargetFlowInput2;
+  GtkWidget *FlowLabel2;
 } Gui_Window_AppWidgets; 
 
 extern Gui_Window_AppWidgets *gui_app;	//!< Main pointer for all the GUI widgets
 
+/**************************************************************
+ * Teensy device stuff
+ **************************************************************/
+/*!
+ *  Struct which holds what the Teensy reported during the handshake
+ */
+typedef struct
+{
+  int protocolVersion;		//!< Packet protocol version (1 for legacy firmware)
+  int firmwareMajor;		//!< Firmware major version
+  int firmwareMinor;		//!< Firmware minor version
+  unsigned long serialNumber;	//!< Serial number of the board (0 if unknown)
+  int maxStepRate;		//!< Fastest the motor can be stepped in steps per second
+  FlowSensorProfile sensor;	//!< Calibration of the flow sensor, from the hello reply or --sensor
+  unsigned long features;	//!< FEATURE_ bits reported by the firmware
+  unsigned char commands[32];	//!< Command bytes the firmware understands
+  int numCommands;		//!< Number of valid entries in commands
+  bool useTimedFlow;		//!< True when the flow is read with the device side time window
+  bool useFilteredRate;		//!< True when the Teensy filters the flow and the host reads the filtered rate
+  bool usePreemptibleMove;	//!< True when moves are sent as absolute targets that can be retargeted or aborted
+  bool useClockSync;		//!< True when the Teensy clock is synced so its timestamps can be mapped to host time
+  int numChannels;		//!< Number of valves the Teensy drives (1 for firmware without channels)
+} Teensy_DeviceInfo;
+
+extern Teensy_DeviceInfo teensyInfo;	//!< Identity and negotiated features of the connected Teensy
+extern DeviceClock deviceClock;		//!< The Teensy clock in host time, kept up by Clock_Sync_Thread
+
 //this is the serial devices handle
 extern int ser_teensy1;		//!< Serial devices handle
 
+/**************************************************************
+ * Valve stuff
+ **************************************************************/
+#define MAX_VALVES 2	//!< Most valves one Teensy can drive
+
+/*!
+ *  Struct which holds the state of one valve and flow sensor pair on the Teensy
+ */
+typedef struct
+{
+  int channel;			//!< Channel number of the valve on the Teensy
+  int targetFlow;		//!< Stores the target flow specified by the user
+  bool makeMLThread;		//!< Used to specify if a MasterLogic thread can be made
+  int numOfSteps;		//!< Stores the number of steps the motor has taken so far
+  double shownFlow;		//!< Holds the current flow value that will be shown to the user, formatted by UpdateFlowLabel
+  ValveTable valveTable;	//!< Position to flow table of the valve (empty if not characterized)
+  PidGains pidGains;		//!< Flow loop gains tuned for the valve
+  bool pidTuned;		//!< True when pidGains were tuned for the valve
+  PlantModel plantModel;	//!< Valve to sensor model from a step test
+  bool plantIdentified;		//!< True when plantModel was identified for the valve
+  const FlowProfile *profile;	//!< Profile MasterLogic follows instead of targetFlow, NULL for none
+  FrameQueue frames;		//!< Packets from the Teensy for this valve, filled by Serial_Read_Thread
+  int uplinkUs;			//!< Time the last flow sample took to reach the host, -1 if unknown
+  int downlinkUs;		//!< Time the last flow request took to reach the Teensy, -1 if unknown
+  FlowStatusWriter status_segment;	//!< Publishes the valve status to other local programs
+  FlowHistory history;		//!< Flow of the valve over this and earlier runs
+  std::atomic<bool> historyDue;	//!< A minute of history has ended and UpdateFlowLabel should save it; set by the control thread, cleared by the GUI thread
+} Valve_Controller;
+
+extern Valve_Controller valves[MAX_VALVES];	//!< Valves of the connected Teensy
+extern int numValves;		//!< Number of valves in use
+
 //this is to gracefully shut down threads
 extern int kill_all_threads;	//!< Used to gracefully shut down threads
-extern int targetFlow;		//!< Stores the target flow specified by the user
-extern bool makeMLThread;	//!< Used to specify if a MasterLogic thread can be made
-extern int numOfSteps;	//!< Stores the number of steps the motor has taken so far
+extern int kill_read_thread;	//!< Used to shut down the serial read thread after everything else
 
-//this variable is for communicating the voltage value string
-extern char label_recieved_value[40];		//!< Holds the current flow value that will be shown to the user
+extern LoopRateConfig loopRateConfig;	//!< Bounds of the adaptive control period
+extern bool planMoves;			//!< Plan the moves of an identified valve with the MPC mode instead of the Smith mode
 
-//this is the mutex for the above variable
+//this is the mutex for the flow labels of the valves
 extern GMutex *master_logic_mutex;		//!< Mutex for protecting the creation of a MasterLogic thread
 extern GMutex *flow_label_mutex;			//!< Mutex for protecting the flow label
+extern SerialCaptureWriter serialCapture;	//!< Records the serial traffic when --capture is given
+extern LogQueue logQueue;			//!< Console output of the control and read threads
+extern GMutex *serial_write_mutex;		//!< Mutex keeping packets written by different threads from interleaving
 //prototype of function for MasterLogic thread
-gpointer MasterLogic();
+gpointer MasterLogic(Valve_Controller *valve);
 
 #endif
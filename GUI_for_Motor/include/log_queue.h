@@ -0,0 +1,68 @@
+/*!
+ * \file log_queue.h
+ * \brief Console logging for the control threads that never blocks or allocates.
+ * \details A message is formatted into the next free slot of a preallocated ring and a background
+ * thread writes the slots out, so a slow terminal or a full pipe cannot hold up a control step.
+ * Slots are claimed with a compare and swap on a sequence number per slot, which lets any thread
+ * log without a lock. When the ring is full the message is dropped and counted; the number
+ * dropped is printed once the ring drains. Before Start() and after Stop() messages are printed
+ * straight away, so start up and shut down keep their order on the console.
+ */
+#ifndef _MY__LOG_QUEUE__H
+#define _MY__LOG_QUEUE__H	//!< Used to ensure the header is only included once during compilation
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+
+#define LOG_QUEUE_ENTRIES 256		//!< Slots in the ring, a power of two
+#define LOG_TEXT_BYTES 160		//!< Longest message, longer ones are cut short
+#define LOG_DRAIN_INTERVAL_US 20000	//!< How often the background thread looks for messages
+
+/*!
+ *  Where a message goes
+ */
+enum LogLevel
+{
+  LOG_INFO = 0,		//!< Printed on stdout
+  LOG_ERROR = 1		//!< Printed on stderr
+};
+
+/*!
+ *  One slot of the ring
+ */
+typedef struct
+{
+  std::atomic<uint32_t> sequence;	//!< Position the slot is free for, or that position + 1 once it holds a message
+  LogLevel level;
+  char text[LOG_TEXT_BYTES];		//!< The message without its line feed
+} LogEntry;
+
+/*!
+ * \brief Ring of messages written out by a background thread.
+ * \details Any number of threads may log at once.
+ */
+class LogQueue
+{
+public:
+  LogQueue();
+  ~LogQueue();
+  void Start();
+  void Stop();
+  bool Printf(LogLevel level, const char *format, ...) __attribute__((format(printf, 3, 4)));
+  uint32_t Dropped() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+  bool Drain();
+  void DrainLoop();
+
+  LogEntry entries[LOG_QUEUE_ENTRIES];	//!< The ring
+  std::atomic<uint32_t> enqueuePosition;	//!< Position of the next message to be logged
+  uint32_t dequeuePosition;		//!< Position of the next message to be written, only touched by the writer
+  std::atomic<uint32_t> dropped;		//!< Messages lost to a full ring
+  uint32_t droppedReported;		//!< Value of dropped when it was last printed
+  std::atomic<bool> running;		//!< The background thread owns the output
+  std::thread writer;			//!< The background thread
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _MY__LOOP_RATE__H
+#define _MY__LOOP_RATE__H	//!< Used to ensure the header is only included once during compilation
+
+/*!
+ *  Bounds and thresholds for the adaptive control period
+ */
+typedef struct
+{
+  double minPeriod;	//!< Shortest period in seconds, used during transients
+  double maxPeriod;	//!< Longest period in seconds, reached during long steady holds
+  double backoff;	//!< Factor the period grows by after each quiet iteration
+  double errorBand;	//!< Error (as a fraction of the target) above which the loop runs at minPeriod
+  double slopeBand;	//!< Rate of change of the error (as a fraction of the target per second) above which the loop runs at minPeriod
+} LoopRateConfig;
+
+/*!
+ *  Running state of the adaptive control period
+ */
+typedef struct
+{
+  double period;	//!< Period to wait before the next iteration in seconds
+  double lastError;	//!< Error of the previous iteration in mL/s
+  bool started;		//!< False until the first iteration
+} LoopRateState;
+
+extern const LoopRateConfig LOOP_RATE_DEFAULTS;	//!< Period bounds used unless the command line changes them
+
+void LoopRateReset(LoopRateState *state, const LoopRateConfig *config);
+double LoopRateNext(LoopRateState *state, const LoopRateConfig *config, double target, double error, double dt);
+
+#endif
@@ -0,0 +1,81 @@
+/*!
+ * \file mpc.h
+ * \brief Model predictive planning of valve moves as a small quadratic program.
+ * \details Each control step plans the next MPC_MOVES moves of the valve over MPC_HORIZON
+ * periods of the identified plant model, after the dead time the Smith predictor of the flow
+ * controller takes out. The plan keeps the valve within 0..MAX_NUM_OF_STEPS, moves it no
+ * faster than the motor can step, charges for every step travelled and charges more for steps
+ * against the direction the valve last moved, since reversals wear the valve. Only the first
+ * move is carried out; the next step plans again from the new flow.
+ *
+ * Each move is split into the steps it opens and the steps it closes, which makes the costs on
+ * travel and reversals linear, and the problem is solved with the alternating direction method
+ * of multipliers. The matrices have fixed sizes and live in the solver, so a solve does not
+ * allocate, and each solve starts from the last plan moved on by one period.
+ */
+#ifndef _MY__MPC__H
+#define _MY__MPC__H	//!< Used to ensure the header is only included once during compilation
+
+#define MPC_HORIZON 20				//!< Periods the flow is predicted over
+#define MPC_MOVES 4				//!< Moves planned; the valve holds after the last one
+#define MPC_VARIABLES (2 * MPC_MOVES)		//!< Opening and closing part of each move
+#define MPC_CONSTRAINTS (3 * MPC_MOVES)	//!< Bounds of each part and of the position after each move
+#define MPC_MAX_ITERATIONS 200			//!< Iterations a solve may take
+#define MPC_TOLERANCE 1e-3			//!< Residual a solve stops at, in units of the largest move per period
+#define MPC_RHO 0.3				//!< Penalty of the constraints in the iterations
+#define MPC_SIGMA 1e-6				//!< Regularization of the variables in the iterations
+#define MPC_RELAXATION 1.6			//!< Over-relaxation of the iterations
+#define MPC_HORIZON_TIME_CONSTANTS 5.0		//!< The horizon spans at least this many time constants of the model
+
+/*!
+ *  Costs of a plan
+ */
+typedef struct
+{
+  double tracking;	//!< Cost per (mL/s)^2 of predicted error in each period
+  double move;		//!< Cost per step^2 of each move, which smooths the plan
+  double travel;	//!< Cost per step travelled
+  double reversal;	//!< Extra cost per step moved against the last direction of the valve
+} MpcWeights;
+
+/*!
+ *  One planning problem, linearized around the current position
+ */
+typedef struct
+{
+  double period;	//!< Seconds between planned moves
+  double timeConstant;	//!< Time constant of the model in seconds
+  double gain;		//!< Slope of the steady flow around the current position in mL/s per step
+  double flow;		//!< Flow the model predicts now, without the dead time, in mL/s
+  double steadyFlow;	//!< Flow the model settles at if the valve stays where it is, in mL/s
+  double offset;	//!< Measured minus modelled flow, added to every prediction, in mL/s
+  double target;	//!< Target flow in mL/s
+  double position;	//!< Position the valve is at or moving to, in steps
+  double maxMove;	//!< Most steps the motor can move in one period
+  int direction;	//!< Direction of the last move: 1 opening, -1 closing, 0 none yet
+} MpcProblem;
+
+/*!
+ *  Solver workspace and the plan kept to warm start the next solve
+ */
+typedef struct
+{
+  double kkt[MPC_VARIABLES][MPC_VARIABLES];	//!< Cholesky factor of P + sigma I + rho A'A
+  double p[MPC_VARIABLES][MPC_VARIABLES];	//!< Quadratic cost
+  double q[MPC_VARIABLES];			//!< Linear cost
+  double a[MPC_CONSTRAINTS][MPC_VARIABLES];	//!< Constraint rows
+  double lower[MPC_CONSTRAINTS];		//!< Lower bounds of the constraint rows
+  double upper[MPC_CONSTRAINTS];		//!< Upper bounds of the constraint rows
+  double x[MPC_VARIABLES];			//!< Plan, in units of maxMove
+  double z[MPC_CONSTRAINTS];			//!< Constraint rows at the plan
+  double y[MPC_CONSTRAINTS];			//!< Multipliers of the constraints
+  int iterations;				//!< Iterations the last solve took
+  bool converged;				//!< The last solve met MPC_TOLERANCE
+} MpcSolver;
+
+extern const MpcWeights MPC_DEFAULT_WEIGHTS;	//!< Costs used unless a tool changes them
+
+void MpcReset(MpcSolver *solver);
+double MpcSolve(MpcSolver *solver, const MpcWeights *weights, const MpcProblem *problem);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef _MY__PID__H
+#define _MY__PID__H	//!< Used to ensure the header is only included once during compilation
+
+#define PID_GAINS_FILE "pid_gains.txt"	//!< Name of the gains file in the device profile directory
+
+/*!
+ *  PID gains for a controller whose output is the valve position in steps and whose input is flow in mL/s
+ */
+typedef struct
+{
+  double kp;	//!< Proportional gain in steps per mL/s
+  double ki;	//!< Integral gain in steps per mL
+  double kd;	//!< Derivative gain in steps per mL/s^2
+} PidGains;
+
+/*!
+ *  Running state of a PID controller
+ */
+typedef struct
+{
+  double integral;	//!< Integral of the error in mL
+  double lastError;	//!< Error of the previous update in mL/s
+  bool started;		//!< False until the first update, so the derivative does not kick
+} PidState;
+
+void PidReset(PidState *state, const PidGains *gains, double output);
+double PidUpdate(PidState *state, const PidGains *gains, double error, double dt, double minOutput, double maxOutput);
+void RelayTuningGains(double relayAmplitude, double hysteresis, double oscillationAmplitude, double period, PidGains *gains);
+bool LoadPidGains(unsigned long serialNumber, int channel, PidGains *gains);
+bool SavePidGains(unsigned long serialNumber, int channel, const PidGains *gains);
+
+#endif
@@ -0,0 +1,38 @@
+/*!
+ * \file plant_model.h
+ * \brief First order plus dead time model of the path from the valve to the flow sensor.
+ * \details The flow reacts to a move of the valve only after the dead time, the time the water
+ * takes to reach the sensor and the sensor and its filter take to respond, and then approaches
+ * its new value with the time constant. FitStepResponse estimates the model from the flow
+ * recorded around a step of the valve, and the Smith predictor of the flow controller uses it
+ * to correct the flow before the sensor can see the result of a move.
+ */
+#ifndef _MY__PLANT_MODEL__H
+#define _MY__PLANT_MODEL__H	//!< Used to ensure the header is only included once during compilation
+
+#define PLANT_MODEL_FILE "plant_model.txt"	//!< Name of the model file in the device profile directory
+#define PLANT_MODEL_MAX_DEAD_TIME 10.0		//!< Longest dead time a fit considers, in seconds
+#define PLANT_MODEL_MAX_TIME_CONSTANT 30.0	//!< Longest time constant a fit considers, in seconds
+#define STEP_TEST_STEPS 100			//!< Size of the valve move of a step test
+#define STEP_TEST_SETTLE_S 10.0			//!< Time the flow is left to settle before a step test
+#define STEP_TEST_BASELINE_S 5.0		//!< Time the flow is recorded before the move
+#define STEP_TEST_RECORD_S 30.0			//!< Time the flow is recorded after the move
+#define STEP_TEST_SAMPLE_S 0.05			//!< Time between flow samples of a step test
+#define STEP_TEST_MAX_SAMPLES ((int)((STEP_TEST_BASELINE_S + STEP_TEST_RECORD_S) / STEP_TEST_SAMPLE_S) + 2)	//!< Samples one step can record
+
+/*!
+ *  Model of the flow as a response to the valve position
+ */
+typedef struct
+{
+  double gain;		//!< Change of the steady flow per step of the valve around the tested flow, in mL/s per step
+  double timeConstant;	//!< Seconds the flow takes to cover 63% of a change once it starts to respond
+  double deadTime;	//!< Seconds between the start of a move and the first response of the measured flow, not counting the travel of the motor
+} PlantModel;
+
+bool FitStepResponse(const double *time, const double *flow, int samples, double stepAt, double rampTime, int steps, PlantModel *model);
+void AveragePlantModels(const PlantModel *models, int count, PlantModel *model);
+bool LoadPlantModel(unsigned long serialNumber, int channel, PlantModel *model);
+bool SavePlantModel(unsigned long serialNumber, int channel, const PlantModel *model);
+
+#endif
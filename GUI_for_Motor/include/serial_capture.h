@@ -0,0 +1,91 @@
+/*!
+ * \file serial_capture.h
+ * \brief Recording of the raw bytes exchanged with the Teensy, for replaying rig problems offline.
+ * \details A capture starts with a SerialCaptureHeader followed by records of
+ * [direction][uint32 microseconds since the previous record][uint8 length][bytes], little endian like the packets.
+ * Bytes read one at a time are gathered into one record while they arrive close together in the
+ * same direction, so a capture costs little more than the traffic itself. The bytes are stored as
+ * they crossed the port, noise, partial and corrupt frames included.
+ */
+#ifndef _MY__SERIAL_CAPTURE__H
+#define _MY__SERIAL_CAPTURE__H	//!< Used to ensure the header is only included once during compilation
+
+#include <stdint.h>
+#include <stdio.h>
+#include <mutex>
+
+#define SERIAL_CAPTURE_MAGIC 0x43534650u	//!< "PFSC" little endian, marks a capture file
+#define SERIAL_CAPTURE_VERSION 1		//!< Layout version of the records
+#define SERIAL_CAPTURE_HEADER_BYTES 16		//!< Size of the file header
+#define SERIAL_CAPTURE_RECORD_BYTES 6		//!< Size of a record header
+#define SERIAL_CAPTURE_MAX_DATA 255		//!< Most bytes in one record
+#define SERIAL_CAPTURE_COALESCE_US 2000		//!< Bytes closer together than this share a record
+
+/*!
+ *  Which way the bytes of a record went
+ */
+enum SerialDirection
+{
+  SERIAL_FROM_TEENSY = 0,	//!< Read from the port
+  SERIAL_TO_TEENSY = 1		//!< Written to the port
+};
+
+/*!
+ *  One record read back from a capture
+ */
+typedef struct
+{
+  SerialDirection direction;
+  int64_t timeNs;			//!< Monotonic time of the first byte
+  unsigned int size;			//!< Number of bytes
+  uint8_t data[SERIAL_CAPTURE_MAX_DATA];
+} SerialCaptureRecord;
+
+/*!
+ * \brief Appends the traffic of a serial port to a capture file.
+ * \details Safe to call from the read thread and the writing threads at the same time.
+ */
+class SerialCaptureWriter
+{
+public:
+  SerialCaptureWriter();
+  ~SerialCaptureWriter();
+  bool Open(const char *fileName, int64_t nowNs);
+  void Record(SerialDirection direction, const uint8_t *data, size_t size, int64_t nowNs);
+  void FlushIdle(int64_t nowNs);
+  void Close();
+  bool IsOpen() const { return file != NULL; }
+
+private:
+  void Flush();
+
+  FILE *file;			//!< Capture being written, NULL when closed
+  std::mutex lock;		//!< Keeps records from different threads whole
+  int64_t lastNs;		//!< Time of the last record written
+  int64_t pendingNs;		//!< Time of the first byte of the pending record
+  int64_t pendingEndNs;		//!< Time of the last byte of the pending record
+  SerialDirection pendingDirection;
+  unsigned int pendingSize;	//!< Bytes in the pending record, 0 if there is none
+  uint8_t pending[SERIAL_CAPTURE_MAX_DATA];
+};
+
+/*!
+ * \brief Reads the records of a capture file in order.
+ */
+class SerialCaptureReader
+{
+public:
+  SerialCaptureReader();
+  ~SerialCaptureReader();
+  bool Open(const char *fileName);
+  bool Next(SerialCaptureRecord *record);
+  void Close();
+  int64_t StartNs() const { return startNs; }
+
+private:
+  FILE *file;			//!< Capture being read, NULL when closed
+  int64_t startNs;		//!< Monotonic time the capture was opened
+  int64_t lastNs;		//!< Time of the last record read
+};
+
+#endif
@@ -0,0 +1,91 @@
+/*!
+ * \file status_shm.h
+ * \brief Shared memory segment that publishes the controller status to other local programs.
+ * \details The controller writes the latest status into a POSIX shared memory segment guarded by a
+ * seqlock. Readers map the segment read-only and copy the status out without any system calls and
+ * without ever blocking the writer. The segment starts with a versioned header so readers can
+ * refuse a layout they do not understand and tolerate fields that were appended later.
+ */
+#ifndef _MY__STATUS_SHM__H
+#define _MY__STATUS_SHM__H	//!< Used to ensure the header is only included once during compilation
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#define FLOW_STATUS_SHM_NAME "/piflow_status"	//!< Default name of the shared memory segment
+#define FLOW_STATUS_MAGIC 0x574C4650		//!< "PFLW", marks an initialised segment
+#define FLOW_STATUS_VERSION 1			//!< Bumped whenever existing fields change meaning or position
+
+/*!
+ *  Status published by the controller. New fields may only be appended.
+ */
+struct FlowStatus
+{
+  uint64_t updateCount;		//!< Number of times the status has been published
+  int64_t timestampNs;		//!< CLOCK_MONOTONIC time of the sample in nanoseconds
+  double flow;			//!< Measured flow in mL/s
+  double targetFlow;		//!< Target flow in mL/s
+  int32_t position;		//!< Valve position in steps from fully closed
+  int32_t running;		//!< 1 while the flow loop is running
+  uint32_t serialNumber;	//!< Serial number of the Teensy driving the valve
+  uint32_t channel;		//!< Channel of the valve on the Teensy
+  int32_t uplinkUs;		//!< Time the flow sample took from the Teensy to the host, -1 if unknown
+  int32_t downlinkUs;		//!< Time the flow request took from the host to the Teensy, -1 if unknown
+  double clockDriftPpm;		//!< How much faster the Teensy clock runs than the host clock
+};
+
+/*!
+ *  Layout of the whole shared memory segment
+ */
+struct FlowStatusSegment
+{
+  uint32_t magic;			//!< FLOW_STATUS_MAGIC once the writer has initialised the segment
+  uint16_t version;			//!< FLOW_STATUS_VERSION of the writer
+  uint16_t statusSize;			//!< sizeof(FlowStatus) of the writer
+  uint32_t writerPid;			//!< Process id of the writer
+  std::atomic<uint32_t> sequence;	//!< Seqlock counter; odd while the writer is updating status
+  FlowStatus status;			//!< The published status
+};
+
+/*!
+ * \brief Creates the segment and publishes status into it.
+ * \details Only one writer may use a segment at a time. Publish never blocks and makes no system calls.
+ */
+class FlowStatusWriter
+{
+public:
+  FlowStatusWriter();
+  ~FlowStatusWriter();
+  bool Open(const char *name = FLOW_STATUS_SHM_NAME);
+  void Publish(const FlowStatus &status);
+  void Close();
+  bool IsOpen() const { return segment != NULL; }
+
+private:
+  FlowStatusSegment *segment;	//!< Mapped segment, NULL when closed
+  char name[64];		//!< Name the segment was created with, so Close can unlink it
+  uint64_t updateCount;		//!< Number of times Publish has been called
+};
+
+/*!
+ * \brief Maps an existing segment read-only and samples the status from it.
+ * \details Any number of readers may sample the same segment at any rate.
+ */
+class FlowStatusReader
+{
+public:
+  FlowStatusReader();
+  ~FlowStatusReader();
+  bool Open(const char *name = FLOW_STATUS_SHM_NAME);
+  bool Read(FlowStatus *status) const;
+  void Close();
+  bool IsOpen() const { return segment != NULL; }
+  uint32_t WriterPid() const;
+
+private:
+  const FlowStatusSegment *segment;	//!< Mapped segment, NULL when closed
+  size_t mappedSize;			//!< Number of bytes mapped
+};
+
+#endif
@@ -0,0 +1,48 @@
+/*!
+ * \file timer_wheel.h
+ * \brief Hashed timer wheel for events on CLOCK_MONOTONIC deadlines.
+ * \details A timer goes in the slot of its deadline tick modulo TIMER_WHEEL_SLOTS, so scheduling
+ * and expiring take the same time however many timers are pending and however far ahead they
+ * are; a timer more than one turn of the wheel ahead just stays in its slot until its turn comes.
+ * The timers come from a fixed pool, so nothing allocates once the wheel is set up and the wheel
+ * can be used from the control loop.
+ */
+#ifndef _MY__TIMER_WHEEL__H
+#define _MY__TIMER_WHEEL__H	//!< Used to ensure the header is only included once during compilation
+
+#include <stdint.h>
+
+#define TIMER_WHEEL_SLOTS 256		//!< Slots of the wheel
+#define TIMER_WHEEL_MAX_TIMERS 64	//!< Timers that can be pending at once
+#define TIMER_WHEEL_NONE INT64_MAX	//!< Deadline returned when no timer is pending
+
+/*!
+ *  One pending timer
+ */
+typedef struct
+{
+  int64_t deadlineNs;	//!< When the timer is due, in CLOCK_MONOTONIC nanoseconds
+  int arg;		//!< Passed back when the timer expires
+  int slot;		//!< Slot the timer is in
+  int next;		//!< Next timer in the same slot or the free list, -1 at the end
+} TimerWheelEntry;
+
+/*!
+ *  The wheel and its pool of timers
+ */
+typedef struct
+{
+  int64_t tickNs;				//!< Width of a slot in nanoseconds
+  int64_t tick;					//!< Tick the wheel has expired up to
+  int slots[TIMER_WHEEL_SLOTS];			//!< First timer of each slot, -1 if empty
+  TimerWheelEntry entries[TIMER_WHEEL_MAX_TIMERS];	//!< Pool of timers
+  int freeList;					//!< First unused timer, -1 if the pool is used up
+  int pending;					//!< Timers scheduled and not yet expired
+} TimerWheel;
+
+void TimerWheelInit(TimerWheel *wheel, int64_t tickNs, int64_t nowNs);
+bool TimerWheelSchedule(TimerWheel *wheel, int64_t deadlineNs, int arg);
+int TimerWheelExpire(TimerWheel *wheel, int64_t nowNs, int *args, int64_t *deadlines, int maxTimers);
+int64_t TimerWheelNextDeadline(const TimerWheel *wheel);
+
+#endif
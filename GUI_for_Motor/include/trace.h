@@ -0,0 +1,77 @@
+/*!
+ * \file trace.h
+ * \brief Always-on event tracing of the threads that talk to the Teensy, written out as Chrome trace JSON.
+ * \details A thread that calls TraceThreadStart() gets a ring of the last TRACE_EVENTS_PER_THREAD
+ * events to itself, so recording an event is two clock reads and a few stores with no lock and no
+ * allocation. A TraceScope records how long a block took, such as a command, a control step or a
+ * GUI update; TraceInstant() marks a moment, such as a frame arriving. The rings are only read
+ * when a dump is asked for: by SIGUSR1 through TraceRequestDump(), or by TraceAnomaly() when a
+ * thread notices a stall. The dump thread then writes every ring to a file that Perfetto
+ * (ui.perfetto.dev) and chrome://tracing open, showing the seconds that led up to the problem.
+ * Times are CLOCK_MONOTONIC, the same clock as the capture and the frame receive times.
+ */
+#ifndef _MY__TRACE__H
+#define _MY__TRACE__H	//!< Used to ensure the header is only included once during compilation
+
+#include <stdint.h>
+#include <atomic>
+
+#define TRACE_MAX_THREADS 16		//!< Threads that can be traced at the same time
+#define TRACE_EVENTS_PER_THREAD 4096	//!< Events kept per thread, the oldest are overwritten
+#define TRACE_MAX_NAMES 64		//!< Thread names remembered for the dump, by thread id
+#define TRACE_ANOMALY_GAP_NS 60000000000LL	//!< Shortest time between two dumps for anomalies
+#define TRACE_DEFAULT_DIRECTORY "/tmp"	//!< Where dumps go unless told otherwise
+
+/*!
+ *  One recorded event
+ */
+typedef struct
+{
+  int64_t startNs;	//!< CLOCK_MONOTONIC time the event started
+  int64_t durationNs;	//!< Length of the event, -1 for an instant
+  const char *name;	//!< Static string naming the event
+  uint32_t arg;		//!< Event specific value, such as a command byte or a channel
+  uint32_t tid;		//!< Trace id of the thread that recorded it
+} TraceEvent;
+
+/*!
+ *  Ring of events owned by one thread
+ */
+typedef struct
+{
+  std::atomic<int> owned;		//!< 1 while a thread records into the ring
+  std::atomic<uint64_t> head;		//!< Events ever written, the next goes to head % TRACE_EVENTS_PER_THREAD
+  uint32_t tid;				//!< Trace id of the owner
+  TraceEvent events[TRACE_EVENTS_PER_THREAD];
+} TraceBuffer;
+
+void TraceThreadStart(const char *name);
+void TraceThreadEnd();
+void TraceSetEnabled(bool enabled);
+int64_t TraceNowNs();
+void TraceRecord(const char *name, int64_t startNs, int64_t durationNs, uint32_t arg);
+void TraceInstant(const char *name, uint32_t arg);
+bool TraceDump(const char *fileName);
+bool TraceStartDumper(const char *directory);
+void TraceStopDumper();
+void TraceRequestDump();
+void TraceAnomaly(const char *reason);
+
+/*!
+ * \brief Records how long the enclosing block took
+ * \details The event is written when the scope ends, so a ring that wraps never holds half an event.
+ */
+class TraceScope
+{
+public:
+  TraceScope(const char *name, uint32_t arg = 0) : name(name), arg(arg), startNs(TraceNowNs()) {}
+  ~TraceScope() { TraceRecord(name, startNs, TraceNowNs() - startNs, arg); }
+  int64_t ElapsedNs() const { return TraceNowNs() - startNs; }
+
+private:
+  const char *name;
+  uint32_t arg;
+  int64_t startNs;
+};
+
+#endif
@@ -0,0 +1,27 @@
+#include <stddef.h>
+
+#ifndef _MY__VALVE_TABLE__H
+#define _MY__VALVE_TABLE__H	//!< Used to ensure the header is only included once during compilation
+
+#define VALVE_TABLE_MAX_POINTS 64		//!< Most points a characterization sweep may store
+#define VALVE_TABLE_FILE "valve_table.txt"	//!< Name of the table file in the device profile directory
+
+/*!
+ *  Measured flow at a set of valve positions. Positions are increasing and, once
+ *  MakeValveTableMonotone has been called, the flow never decreases with position.
+ */
+typedef struct
+{
+  int numPoints;				//!< Number of valid points
+  int position[VALVE_TABLE_MAX_POINTS];		//!< Valve position in steps from fully closed
+  double flow[VALVE_TABLE_MAX_POINTS];		//!< Steady flow in mL/s at that position
+} ValveTable;
+
+void MakeValveTableMonotone(ValveTable *table);
+double ValveTableFlow(const ValveTable *table, double position);
+int ValveTablePosition(const ValveTable *table, double flow);
+double ValveTableSlope(const ValveTable *table, double position);
+bool LoadValveTable(unsigned long serialNumber, int channel, ValveTable *table);
+bool SaveValveTable(unsigned long serialNumber, int channel, const ValveTable *table);
+
+#endif
@@ -0,0 +1,59 @@
+/*!
+ * \file work_pool.h
+ * \brief Fixed size thread pool with one task queue per thread and work stealing.
+ * \details Each thread runs tasks from the back of its own queue. Once that queue is empty it
+ * steals from the front of the others, so uneven tasks (a controller that never settles runs
+ * its whole scenario, a stable one does not) still keep every core busy. Tasks submitted from
+ * inside a task go onto the submitting thread's own queue.
+ */
+#ifndef _MY__WORK_POOL__H
+#define _MY__WORK_POOL__H	//!< Used to ensure the header is only included once during compilation
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*!
+ * \brief Runs submitted tasks on a fixed set of threads.
+ */
+class WorkStealingPool
+{
+public:
+  explicit WorkStealingPool(int threads);
+  ~WorkStealingPool();
+  void Submit(std::function<void()> task);
+  void Wait();
+  int NumThreads() const { return (int)workers.size(); }
+  uint64_t Steals() const { return steals; }
+
+private:
+  /*!
+   *  Queue and thread of one worker
+   */
+  struct Worker
+  {
+    std::deque<std::function<void()> > tasks;	//!< Owner pops the back, thieves take the front
+    std::mutex lock;
+    std::thread thread;
+  };
+
+  void Run(int index);
+  bool TakeTask(int index, std::function<void()> *task);
+
+  std::vector<Worker *> workers;
+  std::mutex idleLock;			//!< Guards sleeping and waking
+  std::condition_variable workAvailable;
+  std::condition_variable allDone;
+  std::atomic<int> queued;		//!< Tasks sitting in a queue
+  std::atomic<int> unfinished;		//!< Tasks submitted but not finished
+  std::atomic<unsigned int> nextQueue;	//!< Round robin for tasks submitted from outside the pool
+  std::atomic<uint64_t> steals;		//!< Tasks run by a thread other than the one they were queued on
+  bool stopping;
+};
+
+#endif
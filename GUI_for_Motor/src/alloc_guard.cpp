@@ -0,0 +1,133 @@
+#include "alloc_guard.h"
+
+#ifdef COUNT_ALLOCATIONS
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <new>
+
+//the allocator glibc exports under these names, so the replacements below can reach it
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *pointer, size_t size);
+extern "C" void __libc_free(void *pointer);
+
+static std::atomic<uint64_t> allocations(0);	//!< Allocations made by every thread
+static thread_local const char *hotSection = NULL;	//!< Section the thread is in, NULL outside one
+
+/*!
+ * \brief Counts an allocation and aborts if the thread is in a marked section
+ * \details Writes the report with write() because printing through stdio could allocate again.
+ */
+static void CountAllocation()
+{
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  const char *section = hotSection;
+  if(section != NULL){
+    hotSection = NULL;
+    static const char message[] = "allocation in the control path: ";
+    ssize_t written = write(STDERR_FILENO, message, sizeof(message) - 1);
+    written += write(STDERR_FILENO, section, strlen(section));
+    written += write(STDERR_FILENO, "\n", 1);
+    (void)written;
+    abort();
+  }
+}
+
+/*!
+ * \brief Starts a section of the control path that must not allocate
+ * \param section names the section in the report
+ */
+void HotPathEnter(const char *section)
+{
+  hotSection = section;
+}
+
+/*!
+ * \brief Ends the section started by HotPathEnter()
+ */
+void HotPathLeave()
+{
+  hotSection = NULL;
+}
+
+/*!
+ * \brief Allocations made by the whole program so far
+ */
+uint64_t AllocationCount()
+{
+  return allocations.load(std::memory_order_relaxed);
+}
+
+extern "C" void *malloc(size_t size)
+{
+  CountAllocation();
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+  CountAllocation();
+  return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *pointer, size_t size)
+{
+  CountAllocation();
+  return __libc_realloc(pointer, size);
+}
+
+extern "C" void free(void *pointer)
+{
+  __libc_free(pointer);
+}
+
+void *operator new(size_t size)
+{
+  CountAllocation();
+  void *pointer = __libc_malloc(size != 0 ? size : 1);
+  if(pointer == NULL){
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+  CountAllocation();
+  return __libc_malloc(size != 0 ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+  return operator new(size, std::nothrow);
+}
+
+void operator delete(void *pointer) noexcept
+{
+  __libc_free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept
+{
+  __libc_free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+  __libc_free(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept
+{
+  __libc_free(pointer);
+}
+
+#endif
@@ -0,0 +1,227 @@
+#include "clock_sync.h"
+#include <math.h>
+
+DeviceClock::DeviceClock()
+{
+  Reset();
+}
+
+/*!
+ * \brief Forgets every exchange, for example after the Teensy was reconnected
+ */
+void DeviceClock::Reset()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  numSamples = 0;
+  nextSample = 0;
+  exchanges = 0;
+  for(unsigned int i = 0; i < CLOCK_SYNC_PENDING; i++){
+    pendingSequence[i] = 0;
+    pendingSendNs[i] = 0;
+  }
+  nextSequence = 1;
+  haveReference = false;
+  referenceUs = 0;
+  referenceUnwrapped = 0;
+  fitDeviceUs = 0.0;
+  fitHostNs = 0.0;
+  fitSlope = 1000.0;
+  bestRttNs = 0;
+}
+
+/*!
+ * \brief Picks the sequence number of a request about to be sent
+ * \param sendNs is the host time the request is written
+ * \details Call it right before writing the request; the reply is matched back to the time by AddReply.
+ */
+uint32_t DeviceClock::NextRequest(int64_t sendNs)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  uint32_t sequence = nextSequence++;
+  pendingSequence[sequence % CLOCK_SYNC_PENDING] = sequence;
+  pendingSendNs[sequence % CLOCK_SYNC_PENDING] = sendNs;
+  return sequence;
+}
+
+/*!
+ * \brief Adds the reply to a request made with NextRequest
+ * \param receiveUs and transmitUs are the device times from the reply
+ * \param replyNs is the host time the reply was read
+ * \details Returns false for a reply to an unknown, answered or forgotten request, or an exchange too slow to trust.
+ */
+bool DeviceClock::AddReply(uint32_t sequence, uint32_t receiveUs, uint32_t transmitUs, int64_t replyNs)
+{
+  int64_t sendNs;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    unsigned int slot = sequence % CLOCK_SYNC_PENDING;
+    if(pendingSequence[slot] != sequence || pendingSendNs[slot] == 0){
+      return false;
+    }
+    sendNs = pendingSendNs[slot];
+    pendingSendNs[slot] = 0;
+  }
+  return AddExchange(sendNs, receiveUs, transmitUs, replyNs);
+}
+
+/*!
+ * \brief Adds one exchange and refits the clock
+ * \param sendNs and replyNs are the host times the request left and the reply arrived
+ * \param receiveUs and transmitUs are the device times the request arrived and the reply left
+ */
+bool DeviceClock::AddExchange(int64_t sendNs, uint32_t receiveUs, uint32_t transmitUs, int64_t replyNs)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  //the time the Teensy held the request is not part of the link
+  int64_t heldUs = (int32_t)(transmitUs - receiveUs);
+  int64_t rttNs = (replyNs - sendNs) - heldUs * 1000;
+  if(heldUs < 0 || rttNs < 0 || rttNs > CLOCK_SYNC_MAX_RTT_NS){
+    return false;
+  }
+  if(!haveReference){
+    haveReference = true;
+    referenceUs = receiveUs;
+    referenceUnwrapped = receiveUs;
+  }
+  ClockExchange *sample = &samples[nextSample];
+  sample->sendNs = sendNs;
+  sample->receiveUs = Unwrap(receiveUs);
+  sample->transmitUs = sample->receiveUs + heldUs;
+  sample->replyNs = replyNs;
+  referenceUs = transmitUs;
+  referenceUnwrapped = sample->transmitUs;
+  nextSample = (nextSample + 1) % CLOCK_SYNC_SAMPLES;
+  if(numSamples < CLOCK_SYNC_SAMPLES){
+    numSamples++;
+  }
+  exchanges++;
+  Fit();
+  return true;
+}
+
+/*!
+ * \brief Counts a 32 bit device time past the wraps of micros()
+ * \details Good for times within 35 minutes either side of the last exchange. The caller holds the lock.
+ */
+int64_t DeviceClock::Unwrap(uint32_t deviceUs) const
+{
+  return referenceUnwrapped + (int32_t)(deviceUs - referenceUs);
+}
+
+/*!
+ * \brief Fits the line from device to host time through the trusted exchanges
+ * \details The midpoint of each exchange on the device is matched to its midpoint on the host, which is exact when both legs took as long. Until the trusted exchanges span CLOCK_SYNC_MIN_SPAN_S the clocks are taken to run at the same rate and only the offset is averaged. The caller holds the lock.
+ */
+void DeviceClock::Fit()
+{
+  bestRttNs = CLOCK_SYNC_MAX_RTT_NS;
+  for(unsigned int i = 0; i < numSamples; i++){
+    int64_t rttNs = (samples[i].replyNs - samples[i].sendNs) - (samples[i].transmitUs - samples[i].receiveUs) * 1000;
+    if(rttNs < bestRttNs){
+      bestRttNs = rttNs;
+    }
+  }
+  int64_t trustedNs = (int64_t)(bestRttNs * CLOCK_SYNC_RTT_FACTOR) + CLOCK_SYNC_RTT_SLACK_NS;
+
+  //work relative to the newest exchange so the sums keep their precision
+  const ClockExchange *newest = &samples[(nextSample + CLOCK_SYNC_SAMPLES - 1) % CLOCK_SYNC_SAMPLES];
+  int64_t baseUs = newest->receiveUs;
+  int64_t baseNs = newest->sendNs;
+  double sumX = 0.0, sumY = 0.0, sumXX = 0.0, sumXY = 0.0;
+  double firstNs = 0.0, lastNs = 0.0;
+  int n = 0;
+  for(unsigned int i = 0; i < numSamples; i++){
+    const ClockExchange *s = &samples[i];
+    if((s->replyNs - s->sendNs) - (s->transmitUs - s->receiveUs) * 1000 > trustedNs){
+      continue;
+    }
+    double x = ((s->receiveUs - baseUs) + (s->transmitUs - baseUs)) / 2.0;
+    double y = ((s->sendNs - baseNs) + (s->replyNs - baseNs)) / 2.0;
+    if(n == 0 || y < firstNs){
+      firstNs = y;
+    }
+    if(n == 0 || y > lastNs){
+      lastNs = y;
+    }
+    sumX += x;
+    sumY += y;
+    sumXX += x * x;
+    sumXY += x * y;
+    n++;
+  }
+  if(n == 0){
+    return;
+  }
+  double meanX = sumX / n;
+  double meanY = sumY / n;
+  double slope = 1000.0;
+  double spread = sumXX - sumX * meanX;
+  if((lastNs - firstNs) / 1e9 >= CLOCK_SYNC_MIN_SPAN_S && spread > 0.0){
+    double fitted = (sumXY - sumX * meanY) / spread;
+    if(fitted > 0.0 && fabs(1000.0 / fitted - 1.0) * 1e6 <= CLOCK_SYNC_MAX_DRIFT_PPM){
+      slope = fitted;
+    }
+  }
+  fitDeviceUs = baseUs + meanX;
+  fitHostNs = baseNs + meanY;
+  fitSlope = slope;
+}
+
+/*!
+ * \brief Maps a device micros() time onto the host monotonic clock
+ * \details Returns the host time in nanoseconds, or 0 before any exchange was made.
+ */
+int64_t DeviceClock::ToHostNs(uint32_t deviceUs) const
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if(numSamples == 0){
+    return 0;
+  }
+  return (int64_t)(fitHostNs + fitSlope * ((double)Unwrap(deviceUs) - fitDeviceUs));
+}
+
+/*!
+ * \brief True once enough exchanges were made to trust ToHostNs
+ */
+bool DeviceClock::IsSynced() const
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return numSamples >= CLOCK_SYNC_MIN_EXCHANGES;
+}
+
+/*!
+ * \brief How much faster the Teensy clock runs than the host clock, in parts per million
+ * \details 0 until the trusted exchanges span CLOCK_SYNC_MIN_SPAN_S.
+ */
+double DeviceClock::DriftPpm() const
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return (1000.0 / fitSlope - 1.0) * 1e6;
+}
+
+/*!
+ * \brief Shortest round trip of the link among the kept exchanges, without the time the Teensy held the request
+ */
+int64_t DeviceClock::BestRttNs() const
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return numSamples == 0 ? 0 : bestRttNs;
+}
+
+/*!
+ * \brief Most the offset can be wrong by
+ * \details Half the shortest round trip, reached if one leg of that exchange took no time at all.
+ */
+int64_t DeviceClock::ErrorBoundNs() const
+{
+  return BestRttNs() / 2;
+}
+
+/*!
+ * \brief Exchanges accepted since the last Reset
+ */
+unsigned int DeviceClock::Exchanges() const
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return exchanges;
+}
@@ -0,0 +1,468 @@
+#include "device_manager.h"
+#include "flow_units.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+#define EPOLL_BATCH 64		//!< Events taken from epoll per wake up
+#define WAKE_EVENT 0		//!< epoll data of the wake up event
+#define TIMER_EVENT 1		//!< epoll data of the deadline timer
+#define FIRST_DEVICE_EVENT 2	//!< epoll data of the first board; the others follow in order
+#define READ_CHUNK 256		//!< Bytes read from a serial port at a time
+
+/*!
+ * \brief Current CLOCK_MONOTONIC time in nanoseconds
+ */
+int64_t MonotonicNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void LoopJitterStats::Add(double latenessUs)
+{
+  if(count == 0 || latenessUs < minUs){
+    minUs = latenessUs;
+  }
+  if(count == 0 || latenessUs > maxUs){
+    maxUs = latenessUs;
+  }
+  count++;
+  sumUs += latenessUs;
+  sumSqUs += latenessUs * latenessUs;
+  int bucket = latenessUs > 0.0 ? (int)(latenessUs / JITTER_BUCKET_US) : 0;
+  buckets[bucket < JITTER_BUCKETS ? bucket : JITTER_BUCKETS - 1]++;
+}
+
+double LoopJitterStats::MeanUs() const
+{
+  return count ? sumUs / count : 0.0;
+}
+
+double LoopJitterStats::StdDevUs() const
+{
+  if(count < 2){
+    return 0.0;
+  }
+  double mean = sumUs / count;
+  double variance = sumSqUs / count - mean * mean;
+  return variance > 0.0 ? sqrt(variance) : 0.0;
+}
+
+/*!
+ * \brief Upper edge of the histogram bucket holding the given fraction of the samples
+ * \details Accurate to JITTER_BUCKET_US, and never more than the largest sample.
+ */
+double LoopJitterStats::PercentileUs(double fraction) const
+{
+  uint64_t wanted = (uint64_t)ceil(fraction * count);
+  uint64_t seen = 0;
+  for(int i = 0; i < JITTER_BUCKETS; i++){
+    seen += buckets[i];
+    if(seen >= wanted && seen > 0){
+      double edge = (i + 1) * (double)JITTER_BUCKET_US;
+      return edge < maxUs ? edge : maxUs;
+    }
+  }
+  return maxUs;
+}
+
+DeviceManager::DeviceManager(int ioThreads, int controlThreads)
+  : numIoThreads(ioThreads > 0 ? ioThreads : 1), numControlThreads(controlThreads > 0 ? controlThreads : 1),
+    stopping(false), started(false), loadProfiles(true)
+{
+}
+
+DeviceManager::~DeviceManager()
+{
+  Stop();
+  for(size_t i = 0; i < devices.size(); i++){
+    if(devices[i]->fd >= 0){
+      close(devices[i]->fd);
+    }
+    delete devices[i];
+  }
+}
+
+/*!
+ * \brief Opens the serial port of a board and adds it to the manager
+ * \param targetFlow is the flow the loop holds in mL/s
+ * \param defaultGains are used unless gains were tuned for the board and stored in its profile
+ * \param periodS is the control period in seconds
+ * \details Must be called before Start. Returns NULL if the port cannot be opened.
+ */
+TeensyDevice *DeviceManager::Add(const char *path, double targetFlow, const PidGains &defaultGains, double periodS)
+{
+  if(started){
+    return NULL;
+  }
+  int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if(fd < 0){
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  struct termios port;
+  memset(&port, 0, sizeof(port));
+  cfmakeraw(&port);
+  port.c_cflag |= CLOCAL | CREAD;
+  cfsetspeed(&port, B115200);
+  port.c_cc[VMIN] = 0;
+  port.c_cc[VTIME] = 0;
+  tcsetattr(fd, TCSANOW, &port);
+  tcflush(fd, TCIOFLUSH);
+
+  TeensyDevice *device = new TeensyDevice;
+  snprintf(device->path, sizeof(device->path), "%s", path);
+  device->fd = fd;
+  device->targetFlow = targetFlow;
+  device->gains = defaultGains;
+  device->periodNs = (int64_t)(periodS * 1e9);
+  devices.push_back(device);
+  return device;
+}
+
+/*!
+ * \brief Spreads the boards over the I/O threads and starts all threads
+ */
+bool DeviceManager::Start()
+{
+  if(started){
+    return false;
+  }
+  for(int i = 0; i < numIoThreads; i++){
+    IoWorker *worker = new IoWorker;
+    worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    worker->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    worker->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    workers.push_back(worker);
+    if(worker->epollFd < 0 || worker->timerFd < 0 || worker->wakeFd < 0){
+      perror("DeviceManager::Start");
+      Stop();
+      return false;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = WAKE_EVENT;
+    epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->wakeFd, &event);
+    event.data.u64 = TIMER_EVENT;
+    epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->timerFd, &event);
+  }
+  for(size_t i = 0; i < devices.size(); i++){
+    IoWorker *worker = workers[i % workers.size()];
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = FIRST_DEVICE_EVENT + worker->devices.size();
+    worker->devices.push_back(devices[i]);
+    epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, devices[i]->fd, &event);
+  }
+  started = true;
+  stopping = false;
+  for(int i = 0; i < numControlThreads; i++){
+    controllers.push_back(std::thread(&DeviceManager::ControlLoop, this));
+  }
+  for(size_t i = 0; i < workers.size(); i++){
+    workers[i]->thread = std::thread(&DeviceManager::IoLoop, this, workers[i]);
+  }
+  return true;
+}
+
+/*!
+ * \brief Stops and joins all threads
+ * \details The valves are left where they are.
+ */
+void DeviceManager::Stop()
+{
+  stopping = true;
+  for(size_t i = 0; i < workers.size(); i++){
+    uint64_t one = 1;
+    if(workers[i]->wakeFd >= 0 && write(workers[i]->wakeFd, &one, sizeof(one)) < 0){
+      perror("eventfd");
+    }
+  }
+  {
+    std::lock_guard<std::mutex> guard(jobsLock);
+    jobsReady.notify_all();
+  }
+  for(size_t i = 0; i < workers.size(); i++){
+    IoWorker *worker = workers[i];
+    if(worker->thread.joinable()){
+      worker->thread.join();
+    }
+    if(worker->epollFd >= 0) close(worker->epollFd);
+    if(worker->timerFd >= 0) close(worker->timerFd);
+    if(worker->wakeFd >= 0) close(worker->wakeFd);
+    delete worker;
+  }
+  workers.clear();
+  for(size_t i = 0; i < controllers.size(); i++){
+    controllers[i].join();
+  }
+  controllers.clear();
+  jobs.clear();
+  started = false;
+}
+
+/*!
+ * \brief Body of an I/O thread
+ * \details Sleeps in epoll_wait until a board sends data, the deadline timer fires or Stop wakes it.
+ */
+void DeviceManager::IoLoop(IoWorker *worker)
+{
+  struct epoll_event events[EPOLL_BATCH];
+  ServiceDeadlines(worker, MonotonicNs());
+  while(!stopping){
+    int n = epoll_wait(worker->epollFd, events, EPOLL_BATCH, -1);
+    if(n < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      perror("epoll_wait");
+      break;
+    }
+    int64_t nowNs = MonotonicNs();
+    for(int i = 0; i < n; i++){
+      uint64_t id = events[i].data.u64;
+      if(id == WAKE_EVENT){
+        continue;
+      }
+      if(id == TIMER_EVENT){
+        uint64_t expirations;
+        if(read(worker->timerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN){
+          perror("timerfd");
+        }
+        continue;
+      }
+      TeensyDevice *device = worker->devices[id - FIRST_DEVICE_EVENT];
+      if(events[i].events & EPOLLIN){
+        ReadDevice(device, nowNs);
+      }
+      if(events[i].events & (EPOLLERR | EPOLLHUP)){
+        fprintf(stderr, "%s: the port went away\n", device->path);
+        device->state = DEVICE_FAILED;
+      }
+      if(device->state == DEVICE_FAILED){
+        epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, device->fd, NULL);
+      }
+    }
+    ServiceDeadlines(worker, nowNs);
+  }
+}
+
+/*!
+ * \brief Body of a control thread
+ */
+void DeviceManager::ControlLoop()
+{
+  while(true){
+    ControlJob job;
+    {
+      std::unique_lock<std::mutex> guard(jobsLock);
+      while(jobs.empty() && !stopping){
+        jobsReady.wait(guard);
+      }
+      if(stopping){
+        return;
+      }
+      job = jobs.front();
+      jobs.pop_front();
+    }
+    RunControlStep(job);
+  }
+}
+
+/*!
+ * \brief Reads everything a board has sent and handles the complete packets
+ */
+void DeviceManager::ReadDevice(TeensyDevice *device, int64_t nowNs)
+{
+  uint8_t chunk[READ_CHUNK];
+  ssize_t n;
+  while((n = read(device->fd, chunk, sizeof(chunk))) > 0){
+    for(ssize_t i = 0; i < n; i++){
+      if(device->parser.Feed(chunk[i])){
+        HandleFrame(device, device->parser.Packet(), device->parser.Size(), nowNs);
+      }
+    }
+  }
+  if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+    fprintf(stderr, "%s: %s\n", device->path, strerror(errno));
+    device->state = DEVICE_FAILED;
+  }
+}
+
+/*!
+ * \brief Acts on one valid packet from a board
+ * \details Runs on the I/O thread that owns the board. Flow readings are queued for the control threads; everything else is handled here.
+ */
+void DeviceManager::HandleFrame(TeensyDevice *device, const uint8_t *packet, unsigned int size, int64_t nowNs)
+{
+  const uint8_t *payload = packet + 2;
+  unsigned int payloadSize = size - PACKET_OVERHEAD_BYTES;
+  double flow;
+
+  if(payload[0] == HELLO_COMMAND && device->state == DEVICE_CONNECTING && payloadSize >= HELLO_COMMANDS_OFFSET){
+    device->serialNumber = GetU32(payload + HELLO_SERIAL_OFFSET);
+    device->features = GetU32(payload + HELLO_FEATURES_OFFSET);
+    device->maxStepRate = GetU16(payload + HELLO_STEP_RATE_OFFSET);
+    device->sensor = HelloFlowSensor(payload, payloadSize);
+    //a board that blocks while stepping cannot share a thread with others
+    if(!(device->features & FEATURE_PREEMPTIBLE_MOVE) ||
+       !(device->features & (FEATURE_FILTERED_RATE | FEATURE_TIMED_FLOW)) || GetU16(payload + HELLO_CALIBRATION_OFFSET) == 0){
+      fprintf(stderr, "%s: firmware %d.%d cannot be driven by the device manager\n", device->path,
+              payload[HELLO_FW_MAJOR_OFFSET], payload[HELLO_FW_MINOR_OFFSET]);
+      device->state = DEVICE_FAILED;
+      return;
+    }
+    std::lock_guard<std::mutex> guard(device->lock);
+    PidGains tuned;
+    if(loadProfiles && LoadPidGains(device->serialNumber, 0, &tuned)){
+      device->gains = tuned;
+      device->pidTuned = true;
+    }
+    PidReset(&device->pid, &device->gains, device->position);
+    device->nextDeadlineNs = nowNs + device->periodNs;
+    device->lastDeadlineNs = 0;
+    device->state = DEVICE_RUNNING;
+    return;
+  }
+  if(payload[0] == MOVE_DONE_FRAME && payloadSize == MOVE_DONE_BYTES){
+    std::lock_guard<std::mutex> guard(device->lock);
+    device->position = GetU16(payload + MOVE_DONE_POSITION_OFFSET);
+    return;
+  }
+  if(!device->requestPending){
+    return;
+  }
+  if(payload[0] == RATE_COMMAND && payloadSize == RATE_BYTES){
+    flow = RateFlow(GetU32(payload + RATE_KALMAN_OFFSET), device->sensor);
+  }
+  else if(payload[0] == TIMED_FLOW_COMMAND && payloadSize == TIMED_FLOW_BYTES){
+    flow = TimedFlow(GetU32(payload + TIMED_FLOW_PULSES_OFFSET), GetU32(payload + TIMED_FLOW_WINDOW_OFFSET), device->sensor);
+  }
+  else{
+    return;
+  }
+  device->requestPending = false;
+  ControlJob job = {device, flow, device->requestDeadlineNs};
+  std::lock_guard<std::mutex> guard(jobsLock);
+  jobs.push_back(job);
+  jobsReady.notify_one();
+}
+
+/*!
+ * \brief Sends whatever is due on the boards of one I/O thread and arms the timer for the next deadline
+ * \details Deadlines advance by whole periods from the first one, so a late wake up does not shift the schedule. If a thread falls more than a period behind, the missed deadlines are counted as overruns and skipped.
+ */
+void DeviceManager::ServiceDeadlines(IoWorker *worker, int64_t nowNs)
+{
+  int64_t earliestNs = 0;
+  for(size_t i = 0; i < worker->devices.size(); i++){
+    TeensyDevice *device = worker->devices[i];
+    int64_t dueNs;
+    if(device->state == DEVICE_CONNECTING){
+      dueNs = device->helloSentNs + DEVICE_HELLO_TIMEOUT_MS * 1000000LL;
+      if(device->helloAttempts == 0 || dueNs <= nowNs){
+        if(device->helloAttempts >= DEVICE_HELLO_RETRIES){
+          fprintf(stderr, "%s: no answer to the hello\n", device->path);
+          device->state = DEVICE_FAILED;
+          continue;
+        }
+        uint8_t command = HELLO_COMMAND;
+        SendFrame(device, 1, &command);
+        device->helloAttempts++;
+        device->helloSentNs = nowNs;
+        dueNs = nowNs + DEVICE_HELLO_TIMEOUT_MS * 1000000LL;
+      }
+    }
+    else if(device->state == DEVICE_RUNNING){
+      if(device->nextDeadlineNs <= nowNs){
+        int64_t behind = (nowNs - device->nextDeadlineNs) / device->periodNs;
+        if(behind > 0){
+          device->overruns += behind;
+          device->nextDeadlineNs += behind * device->periodNs;
+        }
+        if(device->requestPending){
+          device->missed++;
+        }
+        uint8_t command = (device->features & FEATURE_FILTERED_RATE) ? RATE_COMMAND : TIMED_FLOW_COMMAND;
+        device->requestPending = true;
+        device->requestDeadlineNs = device->nextDeadlineNs;
+        device->nextDeadlineNs += device->periodNs;
+        SendFrame(device, 1, &command);
+      }
+      dueNs = device->nextDeadlineNs;
+    }
+    else{
+      continue;
+    }
+    if(earliestNs == 0 || dueNs < earliestNs){
+      earliestNs = dueNs;
+    }
+  }
+  struct itimerspec timer;
+  memset(&timer, 0, sizeof(timer));
+  if(earliestNs != 0){
+    timer.it_value.tv_sec = earliestNs / 1000000000LL;
+    timer.it_value.tv_nsec = earliestNs % 1000000000LL;
+  }
+  timerfd_settime(worker->timerFd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+/*!
+ * \brief Runs the PID of one board on a flow reading and sends the new valve target
+ * \details dt is taken from the deadlines rather than the arrival times, so the controller sees the period it was designed for while the lateness goes into the jitter statistics.
+ */
+void DeviceManager::RunControlStep(const ControlJob &job)
+{
+  TeensyDevice *device = job.device;
+  std::lock_guard<std::mutex> guard(device->lock);
+  double dt = device->lastDeadlineNs ? (job.deadlineNs - device->lastDeadlineNs) / 1e9 : device->periodNs / 1e9;
+  device->lastDeadlineNs = job.deadlineNs;
+  device->flow = job.flow;
+  double output = PidUpdate(&device->pid, &device->gains, device->targetFlow - job.flow, dt, 0.0, MAX_NUM_OF_STEPS);
+  int command = (int)(output + 0.5);
+  if(command != device->command){
+    uint8_t payload[MOVE_BYTES];
+    payload[0] = MOVE_COMMAND;
+    PutU16(payload + MOVE_TARGET_OFFSET, command);
+    PutU16(payload + MOVE_RATE_OFFSET, 0);
+    SendFrame(device, MOVE_BYTES, payload);
+    device->command = command;
+  }
+  device->jitter.Add((MonotonicNs() - job.deadlineNs) / 1000.0);
+}
+
+/*!
+ * \brief Frames and writes a packet to a board
+ * \details The port is non-blocking; a packet that does not fit in the output buffer is dropped and counted rather than stalling the thread.
+ */
+bool DeviceManager::SendFrame(TeensyDevice *device, unsigned int payloadSize, const uint8_t *payload)
+{
+  uint8_t packet[PACKET_MAX_BYTES];
+  unsigned int size = payloadSize + PACKET_OVERHEAD_BYTES;
+  packet[0] = PACKET_START_BYTE;
+  packet[1] = size;
+  memcpy(packet + 2, payload, payloadSize);
+  uint8_t checksum = 0;
+  for(unsigned int i = 0; i + 1 < size; i++){
+    checksum ^= packet[i];
+  }
+  packet[size - 1] = checksum;
+  std::lock_guard<std::mutex> guard(device->writeLock);
+  if(write(device->fd, packet, size) != (ssize_t)size){
+    device->writeErrors++;
+    return false;
+  }
+  return true;
+}
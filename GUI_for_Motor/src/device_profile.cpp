@@ -0,0 +1,44 @@
+#include "device_profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+bool DeviceProfilePath(unsigned long serialNumber, int channel, const char *fileName, char *path, size_t size)
+{
+  char dir[512];		//Holds the directory for this Teensy
+  const char *base = getenv(DEVICE_PROFILE_DIR_ENV);
+  int n;
+  if(base != NULL && base[0] != '\0'){
+    n = snprintf(dir, sizeof(dir), "%s", base);
+  }
+  else{
+    const char *home = getenv("HOME");
+    n = snprintf(dir, sizeof(dir), "%s/%s", home ? home : ".", DEVICE_PROFILE_DEFAULT_DIR);
+  }
+  if(n < 0 || n >= (int)sizeof(dir)){
+    return false;
+  }
+  if(mkdir(dir, 0755) != 0 && errno != EEXIST){
+    return false;
+  }
+  n = snprintf(dir + n, sizeof(dir) - n, "/%lu", serialNumber) + n;
+  if(n >= (int)sizeof(dir)){
+    return false;
+  }
+  if(mkdir(dir, 0755) != 0 && errno != EEXIST){
+    return false;
+  }
+  if(channel != 0){
+    n = snprintf(dir + n, sizeof(dir) - n, "/channel%d", channel) + n;
+    if(n >= (int)sizeof(dir)){
+      return false;
+    }
+    if(mkdir(dir, 0755) != 0 && errno != EEXIST){
+      return false;
+    }
+  }
+  n = snprintf(path, size, "%s/%s", dir, fileName);
+  return n >= 0 && n < (int)size;
+}
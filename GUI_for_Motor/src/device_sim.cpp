@@ -0,0 +1,252 @@
+#include "device_sim.h"
+#include <string.h>
+#include <math.h>
+
+#define SIM_SUBSTEP_S 0.001		//!< Longest integration step of the plant in seconds
+#define SIM_VALVE_CURVE 3.0		//!< Shape of the valve curve; 0 would be linear
+
+static const uint8_t SIM_COMMANDS[] = {HELLO_COMMAND, TIMED_FLOW_COMMAND, FILTER_CONFIG_COMMAND, RATE_COMMAND, MOVE_COMMAND, ABORT_COMMAND, SYNC_COMMAND};	//!< Commands listed in the hello reply
+
+SimulatedTeensy::SimulatedTeensy(uint32_t serialNumber, const SimPlant &plant)
+  : serialNumber(serialNumber), plant(plant), supply(1.0), clockOffsetUs(0), clockDriftPpm(0.0), position(0.0), target(0), reportMove(false),
+    aborted(false), flow(0.0), delayedIndex(0), delayedElapsed(0.0), pulses(0.0), travel(0.0), windowPulses(0.0),
+    windowStartNs(-1), lastNs(-1), random(serialNumber * 2654435761ULL + 1)
+{
+  memset(delayed, 0, sizeof(delayed));
+  delayedStep = plant.deadTime / (sizeof(delayed) / sizeof(delayed[0]));
+}
+
+/*!
+ * \brief Feeds bytes sent by the host
+ * \param nowNs is the current time in nanoseconds
+ * \param reply receives any frames the board sends back
+ * \details Returns the number of reply bytes. Bytes that do not form a valid packet are dropped the way the firmware drops them.
+ */
+size_t SimulatedTeensy::Receive(const uint8_t *data, size_t size, int64_t nowNs, uint8_t *reply, size_t replySize)
+{
+  size_t replyBytes = Advance(nowNs, reply, replySize);
+  for(size_t i = 0; i < size; i++){
+    if(parser.Feed(data[i])){
+      replyBytes += HandlePacket(parser.Packet(), parser.Size(), nowNs, reply + replyBytes, replySize - replyBytes);
+    }
+  }
+  return replyBytes;
+}
+
+/*!
+ * \brief Runs the motor and the plant up to the given time
+ * \details Returns the size of the MOVE_DONE_FRAME written to reply when a requested move finished, otherwise 0.
+ */
+size_t SimulatedTeensy::Advance(int64_t nowNs, uint8_t *reply, size_t replySize)
+{
+  size_t replyBytes = 0;
+  if(lastNs < 0){
+    lastNs = nowNs;
+    windowStartNs = nowNs;
+  }
+  double remaining = (nowNs - lastNs) / 1e9;
+  lastNs = nowNs;
+  while(remaining > 0.0){
+    double h = remaining < SIM_SUBSTEP_S ? remaining : SIM_SUBSTEP_S;
+    remaining -= h;
+    double distance = target - position;
+    double reach = SIM_STEP_RATE * h;
+    if(fabs(distance) <= reach){
+      travel += fabs(distance);
+      position = target;
+    }
+    else{
+      travel += reach;
+      position += distance > 0 ? reach : -reach;
+    }
+
+    double valveFlow = ValveFlow(position);
+    if(plant.deadTime > 0.0){
+      delayedElapsed += h;
+      while(delayedElapsed >= delayedStep){
+        delayed[delayedIndex] = valveFlow;
+        delayedIndex = (delayedIndex + 1) % (sizeof(delayed) / sizeof(delayed[0]));
+        delayedElapsed -= delayedStep;
+      }
+      valveFlow = delayed[delayedIndex];
+    }
+    if(plant.timeConstant > 0.0){
+      flow += (valveFlow - flow) * (h < plant.timeConstant ? h / plant.timeConstant : 1.0);
+    }
+    else{
+      flow = valveFlow;
+    }
+    pulses += flow / SIM_ML_PER_PULSE * h;
+    windowPulses += flow / SIM_ML_PER_PULSE * h;
+  }
+  if(reportMove && position == target){
+    uint8_t payload[MOVE_DONE_BYTES];
+    payload[0] = MOVE_DONE_FRAME;
+    PutU16(payload + MOVE_DONE_POSITION_OFFSET, target);
+    PutU16(payload + MOVE_DONE_TARGET_OFFSET, target);
+    payload[MOVE_DONE_ABORTED_OFFSET] = aborted ? 1 : 0;
+    replyBytes = Frame(MOVE_DONE_BYTES, payload, reply, replySize);
+    reportMove = false;
+    aborted = false;
+  }
+  return replyBytes;
+}
+
+/*!
+ * \brief Starts moving the motor to a position without a MOVE_DONE_FRAME at the end
+ * \details Used by tools that run the plant without the packet layer.
+ */
+void SimulatedTeensy::MoveTo(int position)
+{
+  target = position < 0 ? 0 : position > MAX_NUM_OF_STEPS ? MAX_NUM_OF_STEPS : position;
+}
+
+/*!
+ * \brief Flow seen by the sensor plus measurement noise, in mL/s
+ */
+double SimulatedTeensy::MeasuredFlow()
+{
+  return flow + Noise();
+}
+
+/*!
+ * \brief Builds the valve table a characterization sweep would measure
+ * \param spacing is the number of steps between the points of the table
+ * \details Uses the settled flow at the present supply, without measurement noise.
+ */
+void SimulatedTeensy::Characterize(int spacing, ValveTable *table) const
+{
+  table->numPoints = 0;
+  for(int steps = 0; steps <= MAX_NUM_OF_STEPS && table->numPoints < VALVE_TABLE_MAX_POINTS; steps += spacing){
+    table->position[table->numPoints] = steps;
+    table->flow[table->numPoints] = ValveFlow(steps);
+    table->numPoints++;
+  }
+  MakeValveTableMonotone(table);
+}
+
+/*!
+ * \brief Answers one valid packet
+ */
+size_t SimulatedTeensy::HandlePacket(const uint8_t *packet, unsigned int size, int64_t nowNs, uint8_t *reply, size_t replySize)
+{
+  const uint8_t *payload = packet + 2;
+  unsigned int payloadSize = size - PACKET_OVERHEAD_BYTES;
+  uint8_t out[PACKET_MAX_BYTES];
+  if(payload[0] == HELLO_COMMAND){
+    out[0] = HELLO_COMMAND;
+    out[HELLO_PROTOCOL_OFFSET] = PROTOCOL_VERSION;
+    out[HELLO_FW_MAJOR_OFFSET] = FIRMWARE_VERSION_MAJOR;
+    out[HELLO_FW_MINOR_OFFSET] = FIRMWARE_VERSION_MINOR;
+    PutU32(out + HELLO_SERIAL_OFFSET, serialNumber);
+    PutU16(out + HELLO_STEP_RATE_OFFSET, SIM_STEP_RATE);
+    PutU16(out + HELLO_CALIBRATION_OFFSET, (uint16_t)(SIM_ML_PER_PULSE * 1000.0 + 0.5));
+    PutU32(out + HELLO_FEATURES_OFFSET, FEATURE_TIMED_FLOW | FEATURE_FILTERED_RATE | FEATURE_PREEMPTIBLE_MOVE |
+                                              FEATURE_CLOCK_SYNC);
+    out[HELLO_NUM_COMMANDS_OFFSET] = sizeof(SIM_COMMANDS);
+    memcpy(out + HELLO_COMMANDS_OFFSET, SIM_COMMANDS, sizeof(SIM_COMMANDS));
+    return Frame(HELLO_COMMANDS_OFFSET + sizeof(SIM_COMMANDS), out, reply, replySize);
+  }
+  if(payload[0] == RATE_COMMAND){
+    double measured = MeasuredFlow();
+    uint32_t rate = measured > 0.0 ? (uint32_t)(measured / SIM_ML_PER_PULSE * 1000.0 + 0.5) : 0;
+    out[0] = RATE_COMMAND;
+    PutU32(out + RATE_TIME_OFFSET, DeviceMicros(nowNs));
+    PutU32(out + RATE_RAW_OFFSET, rate);
+    PutU32(out + RATE_AVERAGE_OFFSET, rate);
+    PutU32(out + RATE_IIR_OFFSET, rate);
+    PutU32(out + RATE_KALMAN_OFFSET, rate);
+    return Frame(RATE_BYTES, out, reply, replySize);
+  }
+  if(payload[0] == SYNC_COMMAND && payloadSize == SYNC_REQUEST_BYTES){
+    //the simulated board answers the moment the request arrives
+    out[0] = SYNC_COMMAND;
+    memcpy(out + SYNC_SEQUENCE_OFFSET, payload + SYNC_SEQUENCE_OFFSET, 4);
+    PutU32(out + SYNC_RECEIVE_OFFSET, DeviceMicros(nowNs));
+    PutU32(out + SYNC_TRANSMIT_OFFSET, DeviceMicros(nowNs));
+    return Frame(SYNC_BYTES, out, reply, replySize);
+  }
+  if(payload[0] == TIMED_FLOW_COMMAND){
+    out[0] = TIMED_FLOW_COMMAND;
+    PutU32(out + TIMED_FLOW_PULSES_OFFSET, (uint32_t)windowPulses);
+    PutU32(out + TIMED_FLOW_WINDOW_OFFSET, (uint32_t)((nowNs - windowStartNs) / 1000));
+    windowPulses -= (uint32_t)windowPulses;
+    windowStartNs = nowNs;
+    return Frame(TIMED_FLOW_BYTES, out, reply, replySize);
+  }
+  if(payload[0] == MOVE_COMMAND && payloadSize == MOVE_BYTES){
+    target = GetU16(payload + MOVE_TARGET_OFFSET);
+    if(target > MAX_NUM_OF_STEPS){
+      target = MAX_NUM_OF_STEPS;
+    }
+    reportMove = true;
+    aborted = false;
+    return 0;
+  }
+  if(payload[0] == ABORT_COMMAND){
+    target = (int)position;
+    position = target;
+    reportMove = true;
+    aborted = true;
+    return 0;
+  }
+  return 0;
+}
+
+/*!
+ * \brief The board's micros() at a host time
+ * \details Wraps every 71 minutes like the real counter.
+ */
+uint32_t SimulatedTeensy::DeviceMicros(int64_t nowNs) const
+{
+  return (uint32_t)(int64_t)(nowNs / 1000.0 * (1.0 + clockDriftPpm * 1e-6) + clockOffsetUs);
+}
+
+/*!
+ * \brief Frames a payload as [start][length][payload][checksum]
+ */
+size_t SimulatedTeensy::Frame(unsigned int payloadSize, const uint8_t *payload, uint8_t *reply, size_t replySize)
+{
+  size_t size = payloadSize + PACKET_OVERHEAD_BYTES;
+  if(size > replySize){
+    return 0;
+  }
+  reply[0] = PACKET_START_BYTE;
+  reply[1] = size;
+  memcpy(reply + 2, payload, payloadSize);
+  uint8_t checksum = 0;
+  for(size_t i = 0; i + 1 < size; i++){
+    checksum ^= reply[i];
+  }
+  reply[size - 1] = checksum;
+  return size;
+}
+
+/*!
+ * \brief Flow through the valve at a position
+ * \details Follows the measured curve when the plant has one, otherwise the built-in curve from 0 closed to plant.maxFlow fully open, scaled by the supply.
+ */
+double SimulatedTeensy::ValveFlow(double steps) const
+{
+  if(plant.curve != NULL && plant.curve->numPoints >= 2){
+    return supply * ValveTableFlow(plant.curve, steps);
+  }
+  double x = steps / MAX_NUM_OF_STEPS;
+  return supply * plant.maxFlow * (exp(SIM_VALVE_CURVE * x) - 1.0) / (exp(SIM_VALVE_CURVE) - 1.0);
+}
+
+/*!
+ * \brief Gaussian measurement noise from a per board generator, so runs are repeatable
+ */
+double SimulatedTeensy::Noise()
+{
+  if(plant.noise <= 0.0){
+    return 0.0;
+  }
+  double sum = 0.0;
+  for(int i = 0; i < 12; i++){
+    random = random * 6364136223846793005ULL + 1442695040888963407ULL;
+    sum += (random >> 11) * (1.0 / 9007199254740992.0);
+  }
+  return (sum - 6.0) * plant.noise;
+}
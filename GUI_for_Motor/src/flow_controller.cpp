@@ -0,0 +1,300 @@
+#include "flow_controller.h"
+#include "protocol.h"
+#include <math.h>
+#include <stdlib.h>
+
+/*!
+ * \brief Fills in the tuning MasterLogic has always used
+ * \param filtered is true when the Teensy filters the rate, which allows a tighter deadband
+ * \details The bounds of the control period depend on the mode, and MasterLogic keeps them unless the command line sets its own.
+ */
+void FlowControllerDefaults(FlowControllerConfig *config, FlowControlMode mode, bool filtered)
+{
+  config->mode = mode;
+  config->errorBand = filtered ? FLOW_FILTERED_ERROR_BAND : FLOW_ERROR_BAND;
+  config->stepSize = FLOW_STEP_SIZE;
+  config->feedbackMaxSteps = FLOW_FEEDBACK_MAX_STEPS;
+  config->feedforward = true;
+  config->gains.kp = 0.0;
+  config->gains.ki = 0.0;
+  config->gains.kd = 0.0;
+  config->model.gain = 0.0;
+  config->model.timeConstant = 0.0;
+  config->model.deadTime = 0.0;
+  config->closedLoop = FLOW_SMITH_CLOSED_LOOP;
+  config->stepRate = 0.0;
+  config->mpcWeights = MPC_DEFAULT_WEIGHTS;
+  config->rate = LOOP_RATE_DEFAULTS;
+  if(mode == FLOW_CONTROL_SMITH || mode == FLOW_CONTROL_MPC){
+    //the predictor hides the dead time, so the loop need not wait for the sensor before the next correction
+    config->rate.minPeriod = FLOW_SMITH_MIN_PERIOD;
+    config->rate.maxPeriod = FLOW_SMITH_MAX_PERIOD;
+  }
+  else if(mode == FLOW_CONTROL_TABLE || mode == FLOW_CONTROL_DEADBAND){
+    //without a model of the plant a correction made before the last move reaches the sensor is made twice
+    config->rate.minPeriod = FLOW_TABLE_MIN_PERIOD;
+  }
+}
+
+/*!
+ * \brief Records the model flow at the present clock
+ * \details Records closer together than FLOW_SMITH_HISTORY / 2 of them per dead time are skipped, so the history always reaches back a dead time however fast the loop runs.
+ */
+static void SmithRecord(SmithPredictor *smith, const PlantModel *model)
+{
+  if(smith->count > 0){
+    int newest = (smith->head + smith->count - 1) % FLOW_SMITH_HISTORY;
+    if(smith->clock - smith->time[newest] < model->deadTime / (FLOW_SMITH_HISTORY / 2)){
+      return;
+    }
+  }
+  if(smith->count == FLOW_SMITH_HISTORY){
+    smith->head = (smith->head + 1) % FLOW_SMITH_HISTORY;
+    smith->count--;
+  }
+  int slot = (smith->head + smith->count) % FLOW_SMITH_HISTORY;
+  smith->time[slot] = smith->clock;
+  smith->past[slot] = smith->flow;
+  smith->count++;
+}
+
+/*!
+ * \brief Model flow at an earlier clock, interpolated between the records and the present flow
+ */
+static double SmithDelayed(const SmithPredictor *smith, double when)
+{
+  double laterTime = smith->clock;
+  double laterFlow = smith->flow;
+  for(int i = smith->count - 1; i >= 0; i--){
+    int slot = (smith->head + i) % FLOW_SMITH_HISTORY;
+    if(smith->time[slot] <= when){
+      double span = laterTime - smith->time[slot];
+      if(span <= 0.0){
+        return laterFlow;
+      }
+      return smith->past[slot] + (laterFlow - smith->past[slot]) * (when - smith->time[slot]) / span;
+    }
+    laterTime = smith->time[slot];
+    laterFlow = smith->past[slot];
+  }
+  return laterFlow;
+}
+
+/*!
+ * \brief Steady flow the model gives at a position
+ */
+static double SmithSteadyFlow(const SmithPredictor *smith, const ValveTable *table, double position)
+{
+  return table != NULL ? ValveTableFlow(table, position) : smith->gain * position;
+}
+
+/*!
+ * \brief Prepares the Smith predictor as if the flow had settled at the current position
+ * \details A usable valve table gives the model the curve of the valve; without one the model is linear with the gain from the step test.
+ */
+static void SmithStart(SmithPredictor *smith, const FlowControllerConfig *config, const ValveTable *table, int position)
+{
+  smith->gain = config->model.gain;
+  smith->useTable = table != NULL && table->numPoints >= 2;
+  smith->valve = position;
+  smith->flow = SmithSteadyFlow(smith, smith->useTable ? table : NULL, position);
+  smith->clock = 0.0;
+  smith->mismatch = 0.0;
+  smith->started = false;
+  smith->head = 0;
+  smith->count = 0;
+  SmithRecord(smith, &config->model);
+}
+
+/*!
+ * \brief Runs the Smith predictor up to a new sample
+ * \param curve is the valve table when the model follows it, otherwise NULL
+ * \details Moves the model motor towards position at the step rate over dt, then updates the filtered mismatch between the sample and the model flow a dead time ago.
+ */
+static void SmithAdvance(SmithPredictor *smith, const FlowControllerConfig *config, const ValveTable *curve, double flow, int position, double dt)
+{
+  const PlantModel *model = &config->model;
+  //run the model over the time the valve held this position, with the motor travelling at its step rate
+  for(double left = dt; left > 0.0; left -= FLOW_SMITH_SUBSTEP){
+    double h = left < FLOW_SMITH_SUBSTEP ? left : FLOW_SMITH_SUBSTEP;
+    double reach = config->stepRate > 0.0 ? config->stepRate * h : MAX_NUM_OF_STEPS;
+    double distance = position - smith->valve;
+    smith->valve = fabs(distance) <= reach ? position : smith->valve + (distance > 0.0 ? reach : -reach);
+    double steady = SmithSteadyFlow(smith, curve, smith->valve);
+    smith->flow += (steady - smith->flow) * (model->timeConstant > 0.0 ? 1.0 - exp(-h / model->timeConstant) : 1.0);
+    smith->clock += h;
+  }
+  SmithRecord(smith, model);
+  //what the model missed, seen through the dead time and filtered with the closed loop time constant so sensor noise is not chased
+  double lambda = config->closedLoop * model->timeConstant;
+  double mismatch = flow - SmithDelayed(smith, smith->clock - model->deadTime);
+  smith->mismatch += (mismatch - smith->mismatch) * (smith->started && lambda > 0.0 ? 1.0 - exp(-dt / lambda) : 1.0);
+  smith->started = true;
+}
+
+/*!
+ * \brief Time the table mode waits after a move before it corrects again
+ * \param steps is the size of the move
+ * \details The travel of the motor at the step rate, then the dead time and a few time constants of the plant model, or FLOW_TABLE_SETTLE_S without one.
+ */
+static double TableSettleTime(const FlowControllerConfig *config, int steps)
+{
+  double travel = config->stepRate > 0.0 ? abs(steps) / config->stepRate : 0.0;
+  const PlantModel *model = &config->model;
+  if(model->timeConstant > 0.0){
+    return travel + model->deadTime + FLOW_TABLE_SETTLE_TIME_CONSTANTS * model->timeConstant;
+  }
+  return travel + FLOW_TABLE_SETTLE_S;
+}
+
+/*!
+ * \brief Prepares the controller for a new target
+ * \param table is the valve table, which may be empty
+ * \param position is where the valve is now
+ * \details Returns the position to start from: the one the valve table predicts for the target when feedforward is on and the table is usable, otherwise the current one. The PID starts bumplessly from that position, and the table mode waits for the move to it to settle.
+ */
+int FlowControllerStart(FlowControllerState *state, const FlowControllerConfig *config, const ValveTable *table, double target, int position)
+{
+  if(config->mode == FLOW_CONTROL_SMITH || config->mode == FLOW_CONTROL_MPC){
+    SmithStart(&state->smith, config, table, position);
+  }
+  if(config->mode == FLOW_CONTROL_MPC){
+    MpcReset(&state->mpc);
+    state->lastDirection = 0;
+  }
+  state->settleLeft = 0.0;
+  state->lastFlow = 0.0;
+  state->tableCorrecting = false;
+  if(config->feedforward && table != NULL && table->numPoints >= 2){
+    int start = ValveTablePosition(table, target);
+    if(start != position){
+      state->settleLeft = TableSettleTime(config, start - position);
+    }
+    position = start;
+  }
+  PidReset(&state->pid, &config->gains, position);
+  LoopRateReset(&state->schedule, &config->rate);
+  return position;
+}
+
+/*!
+ * \brief Tells the controller the valve was moved by steps outside it, such as by the feedforward of a flow profile
+ * \details The PID carries on from the moved position instead of pulling the valve back, and the table mode waits for the move to settle. The other modes start from the position they are given at each step already.
+ */
+void FlowControllerShift(FlowControllerState *state, const FlowControllerConfig *config, int steps)
+{
+  if(config->mode == FLOW_CONTROL_PID && config->gains.ki != 0.0){
+    state->pid.integral += steps / config->gains.ki;
+  }
+  else if(config->mode == FLOW_CONTROL_TABLE && steps != 0){
+    state->settleLeft = TableSettleTime(config, steps);
+  }
+}
+
+/*!
+ * \brief Decides what to do with one flow sample
+ * \param target is the target flow in mL/s
+ * \param flow is the measured flow in mL/s
+ * \param position is where the valve is now
+ * \param dt is the time since the previous sample in seconds
+ */
+FlowControlAction FlowControllerStep(FlowControllerState *state, const FlowControllerConfig *config, const ValveTable *table,
+                                     double target, double flow, int position, double dt)
+{
+  FlowControlAction action;
+  double error = target - flow;
+  double band = target * config->errorBand;
+  int next = position;
+  action.period = LoopRateNext(&state->schedule, &config->rate, target, error, dt);
+  state->settleLeft = state->settleLeft > dt ? state->settleLeft - dt : 0.0;
+
+  if(config->mode == FLOW_CONTROL_PID){
+    next = (int)(PidUpdate(&state->pid, &config->gains, error, dt, 0, MAX_NUM_OF_STEPS) + 0.5);
+  }
+  else if(config->mode == FLOW_CONTROL_SMITH){
+    SmithPredictor *smith = &state->smith;
+    const PlantModel *model = &config->model;
+    const ValveTable *curve = smith->useTable && table != NULL && table->numPoints >= 2 ? table : NULL;
+    SmithAdvance(smith, config, curve, flow, position, dt);
+    double lambda = config->closedLoop * model->timeConstant;
+    //ask the model for the flow that closes as much of the gap by the next sample as the closed loop time constant would,
+    //which is more than its own time constant would for a short period and no more than the whole gap for a long one
+    double speedup = 1.0;
+    if(lambda > 0.0 && model->timeConstant > 0.0){
+      speedup = (1.0 - exp(-action.period / lambda)) / (1.0 - exp(-action.period / model->timeConstant));
+    }
+    double wanted = smith->flow + speedup * (target - smith->mismatch - smith->flow);
+    if(curve != NULL){
+      next = ValveTablePosition(curve, wanted);
+    }
+    else if(smith->gain > 0.0){
+      next = (int)(wanted / smith->gain + 0.5);
+    }
+  }
+  else if(config->mode == FLOW_CONTROL_MPC){
+    //plan from the same predictor as the Smith mode, linearized around the position the valve is moving to
+    SmithPredictor *smith = &state->smith;
+    const PlantModel *model = &config->model;
+    const ValveTable *curve = smith->useTable && table != NULL && table->numPoints >= 2 ? table : NULL;
+    SmithAdvance(smith, config, curve, flow, position, dt);
+    MpcProblem problem;
+    double span = model->timeConstant * MPC_HORIZON_TIME_CONSTANTS / MPC_HORIZON;
+    problem.period = action.period > span ? action.period : span;
+    problem.timeConstant = model->timeConstant;
+    problem.gain = curve != NULL ? ValveTableSlope(curve, position) : smith->gain;
+    if(problem.gain <= 0.0){
+      problem.gain = model->gain;
+    }
+    problem.flow = smith->flow;
+    problem.steadyFlow = SmithSteadyFlow(smith, curve, position);
+    problem.offset = smith->mismatch;
+    problem.target = target;
+    problem.position = position;
+    problem.maxMove = config->stepRate > 0.0 ? config->stepRate * problem.period : MAX_NUM_OF_STEPS;
+    problem.direction = state->lastDirection;
+    double move = MpcSolve(&state->mpc, &config->mpcWeights, &problem);
+    next = position + (int)(move + (move > 0.0 ? 0.5 : -0.5));
+    if(next != position){
+      state->lastDirection = next > position ? 1 : -1;
+    }
+  }
+  else if(config->mode == FLOW_CONTROL_TABLE){
+    //once outside the band keep correcting until the error is well inside it, so the flow does not rest at its edge
+    if(fabs(error) > band){
+      state->tableCorrecting = true;
+    }
+    else if(fabs(error) <= band * FLOW_TABLE_HYSTERESIS){
+      state->tableCorrecting = false;
+    }
+    //the last move has shown in full at the sensor once it had time to settle and the flow stopped changing
+    bool settled = state->settleLeft <= 0.0 && fabs(flow - state->lastFlow) <= band;
+    state->lastFlow = flow;
+    //correct the residual using the gain of the valve from the table
+    double slope = (table != NULL && table->numPoints >= 2) ? ValveTableSlope(table, position) : 0.0;
+    if(state->tableCorrecting && settled && slope > 0.0){
+      int correction = (int)(error / slope);
+      if(correction > config->feedbackMaxSteps){
+        correction = config->feedbackMaxSteps;
+      }
+      else if(correction < -config->feedbackMaxSteps){
+        correction = -config->feedbackMaxSteps;
+      }
+      next = position + correction;
+      if(correction != 0){
+        state->settleLeft = TableSettleTime(config, correction);
+      }
+    }
+  }
+  else if(error > band || error < -band){
+    next = position + (error > 0.0 ? config->stepSize : -config->stepSize);
+  }
+  if(next > MAX_NUM_OF_STEPS){
+    next = MAX_NUM_OF_STEPS;
+  }
+  else if(next < 0){
+    next = 0;
+  }
+  action.position = next;
+  action.move = next != position;
+  return action;
+}
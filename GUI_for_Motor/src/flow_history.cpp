@@ -0,0 +1,335 @@
+#include "flow_history.h"
+#include "device_profile.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <string.h>
+
+#define FLOW_HISTORY_HEADER_BYTES 16		//!< Size of the saved file header
+#define FLOW_HISTORY_LEVEL_BYTES 8		//!< Size of the header of each saved level
+#define FLOW_HISTORY_MAX_MERGE 60		//!< Most buckets merged into one point before a coarser level is used
+#define FLOW_HISTORY_SUMMARY_POINTS 60		//!< Points merged by Summary
+
+static const int64_t LEVEL_WIDTH_NS[FLOW_HISTORY_LEVELS] = {1000000000LL, 60000000000LL, 3600000000000LL};	//!< Bucket length of each level
+static const unsigned int LEVEL_BUCKETS[FLOW_HISTORY_LEVELS] = {FLOW_HISTORY_SECOND_BUCKETS, FLOW_HISTORY_MINUTE_BUCKETS,
+                                                               FLOW_HISTORY_HOUR_BUCKETS};	//!< Ring size of each level
+
+FlowHistory::FlowHistory()
+{
+  levels[0] = seconds;
+  levels[1] = minutes;
+  levels[2] = hours;
+  Clear();
+}
+
+/*!
+ * \brief Forgets every sample and rollup
+ */
+void FlowHistory::Clear()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  rawCount = 0;
+  rawNext = 0;
+  for(int l = 0; l < FLOW_HISTORY_LEVELS; l++){
+    memset(levels[l], 0, LEVEL_BUCKETS[l] * sizeof(FlowRollup));
+  }
+  newestNs = 0;
+}
+
+/*!
+ * \brief Adds one flow sample
+ * \param timeNs is the CLOCK_REALTIME time of the sample in nanoseconds
+ * \param flow is the measured flow in mL/s
+ * \details Updates the raw window and the bucket of each level the sample falls in, reusing the ring slot of a bucket that has aged out. A sample older than the bucket now holding its slot is too late to count and only goes into the raw window. Returns true when the sample started a new minute, which is a good moment to save.
+ */
+bool FlowHistory::Add(int64_t timeNs, double flow)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  rawTimeNs[rawNext] = timeNs;
+  rawFlow[rawNext] = flow;
+  rawNext = (rawNext + 1) % FLOW_HISTORY_RAW_SAMPLES;
+  if(rawCount < FLOW_HISTORY_RAW_SAMPLES){
+    rawCount++;
+  }
+  bool newMinute = false;
+  for(int l = 0; l < FLOW_HISTORY_LEVELS; l++){
+    int64_t bucket = timeNs / LEVEL_WIDTH_NS[l];
+    int64_t startNs = bucket * LEVEL_WIDTH_NS[l];
+    FlowRollup *r = &levels[l][bucket % LEVEL_BUCKETS[l]];
+    if(r->count == 0 || r->startNs != startNs){
+      if(r->count > 0 && r->startNs > startNs){
+        continue;
+      }
+      r->startNs = startNs;
+      r->widthNs = LEVEL_WIDTH_NS[l];
+      r->min = flow;
+      r->max = flow;
+      r->sum = 0.0;
+      r->count = 0;
+      newMinute = newMinute || l == 1;
+    }
+    if(flow < r->min){
+      r->min = flow;
+    }
+    if(flow > r->max){
+      r->max = flow;
+    }
+    r->sum += flow;
+    r->count++;
+  }
+  if(timeNs > newestNs){
+    newestNs = timeNs;
+  }
+  return newMinute;
+}
+
+/*!
+ * \brief Flow over a span of time in at most maxPoints points
+ * \param fromNs and toNs bound the span, toNs excluded
+ * \param points receives the points in time order and must hold maxPoints entries
+ * \details Raw samples are returned when the raw window reaches back to fromNs and there are few enough of them. Otherwise the points come from the finest level that still holds fromNs and needs no more than FLOW_HISTORY_MAX_MERGE buckets merged into each point, so the work is bounded by maxPoints whatever the span. Empty buckets are left out, so fewer points than the span suggests may be returned. Returns the number of points.
+ */
+int FlowHistory::Query(int64_t fromNs, int64_t toNs, int maxPoints, FlowRollup *points) const
+{
+  if(maxPoints <= 0 || toNs <= fromNs){
+    return 0;
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  int n = QueryRaw(fromNs, toNs, maxPoints, points);
+  if(n >= 0){
+    return n;
+  }
+  int finest = FLOW_HISTORY_LEVELS - 1;
+  for(int l = FLOW_HISTORY_LEVELS - 1; l >= 0; l--){
+    int64_t oldestNs = (newestNs / LEVEL_WIDTH_NS[l] - LEVEL_BUCKETS[l] + 1) * LEVEL_WIDTH_NS[l];
+    if(fromNs >= oldestNs){
+      finest = l;
+    }
+  }
+  for(int l = finest; l < FLOW_HISTORY_LEVELS; l++){
+    int64_t buckets = (toNs - 1) / LEVEL_WIDTH_NS[l] - fromNs / LEVEL_WIDTH_NS[l] + 1;
+    if(buckets <= (int64_t)maxPoints * FLOW_HISTORY_MAX_MERGE){
+      return QueryLevel(l, fromNs, toNs, maxPoints, points);
+    }
+  }
+  return QueryLevel(FLOW_HISTORY_LEVELS - 1, fromNs, toNs, maxPoints, points);
+}
+
+/*!
+ * \brief Flow over a span of time as one point
+ * \details Merges a query of FLOW_HISTORY_SUMMARY_POINTS points, so the edges of the span are as sharp as a chart of it would be. Returns false if there were no samples in the span.
+ */
+bool FlowHistory::Summary(int64_t fromNs, int64_t toNs, FlowRollup *summary) const
+{
+  FlowRollup points[FLOW_HISTORY_SUMMARY_POINTS];
+  int n = Query(fromNs, toNs, FLOW_HISTORY_SUMMARY_POINTS, points);
+  if(n == 0){
+    return false;
+  }
+  *summary = points[0];
+  for(int i = 1; i < n; i++){
+    if(points[i].min < summary->min){
+      summary->min = points[i].min;
+    }
+    if(points[i].max > summary->max){
+      summary->max = points[i].max;
+    }
+    summary->sum += points[i].sum;
+    summary->count += points[i].count;
+  }
+  summary->widthNs = points[n - 1].startNs + points[n - 1].widthNs - summary->startNs;
+  return true;
+}
+
+/*!
+ * \brief Time of the newest sample in CLOCK_REALTIME nanoseconds, 0 if there is none
+ */
+int64_t FlowHistory::NewestNs() const
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return newestNs;
+}
+
+/*!
+ * \brief Copies the raw samples of a span
+ * \details Returns -1 if the raw window does not reach back to fromNs or holds more than maxPoints samples in the span. The caller holds the lock.
+ */
+int FlowHistory::QueryRaw(int64_t fromNs, int64_t toNs, int maxPoints, FlowRollup *points) const
+{
+  unsigned int oldest = (rawNext + FLOW_HISTORY_RAW_SAMPLES - rawCount) % FLOW_HISTORY_RAW_SAMPLES;
+  if(rawCount == 0 || rawTimeNs[oldest] > fromNs){
+    return -1;
+  }
+  int n = 0;
+  for(unsigned int i = 0; i < rawCount; i++){
+    unsigned int slot = (oldest + i) % FLOW_HISTORY_RAW_SAMPLES;
+    if(rawTimeNs[slot] < fromNs || rawTimeNs[slot] >= toNs){
+      continue;
+    }
+    if(n == maxPoints){
+      return -1;
+    }
+    FlowRollup *p = &points[n++];
+    p->startNs = rawTimeNs[slot];
+    p->widthNs = 0;
+    p->min = rawFlow[slot];
+    p->max = rawFlow[slot];
+    p->sum = rawFlow[slot];
+    p->count = 1;
+    p->reserved = 0;
+  }
+  return n;
+}
+
+/*!
+ * \brief Copies the buckets of one level over a span, merging neighbours to fit in maxPoints
+ * \details The caller holds the lock.
+ */
+int FlowHistory::QueryLevel(int level, int64_t fromNs, int64_t toNs, int maxPoints, FlowRollup *points) const
+{
+  int64_t width = LEVEL_WIDTH_NS[level];
+  int64_t first = fromNs / width;
+  int64_t last = (toNs - 1) / width;
+  //buckets older than the ring have been overwritten
+  if(last - first + 1 > LEVEL_BUCKETS[level]){
+    first = last - LEVEL_BUCKETS[level] + 1;
+  }
+  int64_t perPoint = (last - first + maxPoints) / maxPoints;
+  int n = 0;
+  for(int64_t group = first; group <= last; group += perPoint){
+    FlowRollup merged;
+    memset(&merged, 0, sizeof(merged));
+    int64_t end = group + perPoint - 1 < last ? group + perPoint - 1 : last;
+    for(int64_t b = group; b <= end; b++){
+      const FlowRollup *r = &levels[level][b % LEVEL_BUCKETS[level]];
+      if(r->count == 0 || r->startNs != b * width){
+        continue;
+      }
+      if(merged.count == 0 || r->min < merged.min){
+        merged.min = r->min;
+      }
+      if(merged.count == 0 || r->max > merged.max){
+        merged.max = r->max;
+      }
+      merged.sum += r->sum;
+      merged.count += r->count;
+    }
+    if(merged.count > 0){
+      merged.startNs = group * width;
+      merged.widthNs = (end - group + 1) * width;
+      points[n++] = merged;
+    }
+  }
+  return n;
+}
+
+/*!
+ * \brief Writes the rollups to a file
+ * \details The rollups are copied to the snapshot under the lock and written after it is released, so the control thread adding samples never waits on the disk.
+ * Written to a temporary file first and renamed over the old one, so a crash never leaves half a history behind.
+ */
+bool FlowHistory::Save(const char *fileName) const
+{
+  char tempName[600];
+  if(snprintf(tempName, sizeof(tempName), "%s.tmp", fileName) >= (int)sizeof(tempName)){
+    return false;
+  }
+  std::lock_guard<std::mutex> saving(saveLock);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    FlowRollup *to = snapshot;
+    for(int l = 0; l < FLOW_HISTORY_LEVELS; l++){
+      memcpy(to, levels[l], LEVEL_BUCKETS[l] * sizeof(FlowRollup));
+      to += LEVEL_BUCKETS[l];
+    }
+  }
+  FILE *f = fopen(tempName, "wb");
+  if(f == NULL){
+    return false;
+  }
+  uint8_t header[FLOW_HISTORY_HEADER_BYTES];
+  memset(header, 0, sizeof(header));
+  PutU32(header, FLOW_HISTORY_MAGIC);
+  PutU16(header + 4, FLOW_HISTORY_VERSION);
+  PutU16(header + 6, FLOW_HISTORY_LEVELS);
+  PutU32(header + 8, sizeof(FlowRollup));
+  bool ok = fwrite(header, sizeof(header), 1, f) == 1;
+  const FlowRollup *from = snapshot;
+  for(int l = 0; l < FLOW_HISTORY_LEVELS && ok; l++){
+    uint8_t levelHeader[FLOW_HISTORY_LEVEL_BYTES];
+    PutU32(levelHeader, (uint32_t)(LEVEL_WIDTH_NS[l] / 1000000000LL));
+    PutU32(levelHeader + 4, LEVEL_BUCKETS[l]);
+    ok = fwrite(levelHeader, sizeof(levelHeader), 1, f) == 1 &&
+         fwrite(from, sizeof(FlowRollup), LEVEL_BUCKETS[l], f) == LEVEL_BUCKETS[l];
+    from += LEVEL_BUCKETS[l];
+  }
+  if(fclose(f) != 0 || !ok){
+    remove(tempName);
+    return false;
+  }
+  return rename(tempName, fileName) == 0;
+}
+
+/*!
+ * \brief Reads rollups written by Save
+ * \details Replaces the rollups and empties the raw window. Returns false and leaves the history empty if the file is missing or was written with a different layout.
+ */
+bool FlowHistory::Load(const char *fileName)
+{
+  Clear();
+  FILE *f = fopen(fileName, "rb");
+  if(f == NULL){
+    return false;
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  uint8_t header[FLOW_HISTORY_HEADER_BYTES];
+  bool ok = fread(header, sizeof(header), 1, f) == 1 && GetU32(header) == FLOW_HISTORY_MAGIC &&
+            GetU16(header + 4) == FLOW_HISTORY_VERSION && GetU16(header + 6) == FLOW_HISTORY_LEVELS &&
+            GetU32(header + 8) == sizeof(FlowRollup);
+  for(int l = 0; l < FLOW_HISTORY_LEVELS && ok; l++){
+    uint8_t levelHeader[FLOW_HISTORY_LEVEL_BYTES];
+    ok = fread(levelHeader, sizeof(levelHeader), 1, f) == 1 &&
+         GetU32(levelHeader) == LEVEL_WIDTH_NS[l] / 1000000000LL && GetU32(levelHeader + 4) == LEVEL_BUCKETS[l] &&
+         fread(levels[l], sizeof(FlowRollup), LEVEL_BUCKETS[l], f) == LEVEL_BUCKETS[l];
+  }
+  fclose(f);
+  if(!ok){
+    for(int l = 0; l < FLOW_HISTORY_LEVELS; l++){
+      memset(levels[l], 0, LEVEL_BUCKETS[l] * sizeof(FlowRollup));
+    }
+    return false;
+  }
+  //the newest second bucket holds the newest sample
+  for(unsigned int i = 0; i < LEVEL_BUCKETS[0]; i++){
+    const FlowRollup *r = &levels[0][i];
+    if(r->count > 0 && r->startNs + r->widthNs - 1 > newestNs){
+      newestNs = r->startNs + r->widthNs - 1;
+    }
+  }
+  return true;
+}
+
+/*!
+ * \brief Loads the saved rollups of a valve
+ * \details Returns false and leaves the history empty if the valve has none yet.
+ */
+bool LoadFlowHistory(unsigned long serialNumber, int channel, FlowHistory *history)
+{
+  char path[512];	//Holds the path of the history file
+  if(!DeviceProfilePath(serialNumber, channel, FLOW_HISTORY_FILE, path, sizeof(path))){
+    history->Clear();
+    return false;
+  }
+  return history->Load(path);
+}
+
+/*!
+ * \brief Saves the rollups of a valve so the next run carries on from them
+ */
+bool SaveFlowHistory(unsigned long serialNumber, int channel, const FlowHistory *history)
+{
+  char path[512];	//Holds the path of the history file
+  if(!DeviceProfilePath(serialNumber, channel, FLOW_HISTORY_FILE, path, sizeof(path))){
+    return false;
+  }
+  return history->Save(path);
+}
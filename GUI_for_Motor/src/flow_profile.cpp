@@ -0,0 +1,310 @@
+#include "flow_profile.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define FLOW_PROFILE_HEADER "# piflow flow profile v1"	//!< First line of a profile file
+#define FLOW_PROFILE_EXPIRE_BATCH 8			//!< Segment starts taken off the wheel per call
+
+/*!
+ * \brief Setpoint a segment asks for a time into it
+ */
+static double SegmentFlow(const FlowSegment *segment, double elapsed)
+{
+  double span = segment->duration > 0.0 ? elapsed / segment->duration : 1.0;
+  if(span > 1.0){
+    span = 1.0;
+  }
+  switch(segment->type){
+    case FLOW_SEGMENT_RAMP:
+      return segment->startFlow + (segment->flow - segment->startFlow) * span;
+    case FLOW_SEGMENT_TAPER:
+    {
+      double end = exp(-FLOW_PROFILE_TAPER_RATE);
+      return segment->flow + (segment->startFlow - segment->flow) * (exp(-FLOW_PROFILE_TAPER_RATE * span) - end) / (1.0 - end);
+    }
+    case FLOW_SEGMENT_HOLD:
+      return segment->flow;
+    default:
+      return segment->startFlow;
+  }
+}
+
+/*!
+ * \brief Volume a segment delivers if the flow follows the setpoint, in mL
+ */
+static double SegmentVolume(const FlowSegment *segment)
+{
+  switch(segment->type){
+    case FLOW_SEGMENT_RAMP:
+      return (segment->startFlow + segment->flow) / 2.0 * segment->duration;
+    case FLOW_SEGMENT_TAPER:
+    {
+      double end = exp(-FLOW_PROFILE_TAPER_RATE);
+      double shape = ((1.0 - end) / FLOW_PROFILE_TAPER_RATE - end) / (1.0 - end);
+      return (segment->flow + (segment->startFlow - segment->flow) * shape) * segment->duration;
+    }
+    default:
+      return segment->flow * segment->duration;
+  }
+}
+
+/*!
+ * \brief Reads a profile and plans when each segment starts
+ * \details Reports the first line that is wrong on stderr and returns false. A stop must be the last segment, must come after some flow and must ask for more than the segments before it deliver.
+ */
+bool LoadFlowProfile(const char *fileName, FlowProfile *profile)
+{
+  char line[256];	//Holds one line of the file
+  FILE *f = fopen(fileName, "r");
+  if(f == NULL){
+    perror(fileName);
+    return false;
+  }
+  profile->numSegments = 0;
+  profile->numSamples = 0;
+  profile->duration = 0.0;
+  int lineNumber = 0;
+  double flow = 0.0;	//setpoint the next segment starts from
+  double volume = 0.0;	//volume planned up to the next segment
+  const char *problem = NULL;
+  if(fgets(line, sizeof(line), f) == NULL || strncmp(line, FLOW_PROFILE_HEADER, strlen(FLOW_PROFILE_HEADER)) != 0){
+    fprintf(stderr, "%s: not a flow profile, the first line must be \"%s\"\n", fileName, FLOW_PROFILE_HEADER);
+    fclose(f);
+    return false;
+  }
+  lineNumber++;
+  while(problem == NULL && fgets(line, sizeof(line), f) != NULL){
+    lineNumber++;
+    char type[16];
+    double first = 0.0, second = 0.0;
+    int fields = sscanf(line, "%15s %lf %lf", type, &first, &second);
+    if(fields < 1 || type[0] == '#'){
+      continue;
+    }
+    if(profile->numSegments > 0 && profile->segments[profile->numSegments - 1].type == FLOW_SEGMENT_STOP){
+      problem = "nothing may follow a stop";
+      break;
+    }
+    if(profile->numSegments == FLOW_PROFILE_MAX_SEGMENTS){
+      problem = "too many segments";
+      break;
+    }
+    FlowSegment *segment = &profile->segments[profile->numSegments];
+    segment->start = profile->duration;
+    segment->startFlow = flow;
+    segment->volume = 0.0;
+    if(strcmp(type, "stop") == 0){
+      segment->type = FLOW_SEGMENT_STOP;
+      segment->flow = flow;
+      segment->volume = first;
+      if(fields != 2 || first <= volume){
+        problem = "a stop needs a volume in mL larger than the segments before it deliver";
+      }
+      else if(flow <= 0.0){
+        problem = "a stop needs a flow to hold";
+      }
+      else{
+        segment->duration = (first - volume) / flow;
+      }
+    }
+    else{
+      segment->type = strcmp(type, "ramp") == 0 ? FLOW_SEGMENT_RAMP : strcmp(type, "hold") == 0 ? FLOW_SEGMENT_HOLD : FLOW_SEGMENT_TAPER;
+      segment->flow = first;
+      segment->duration = second;
+      if(segment->type == FLOW_SEGMENT_TAPER && strcmp(type, "taper") != 0){
+        problem = "unknown segment, expected ramp, hold, taper or stop";
+      }
+      else if(fields != 3 || first < 0.0 || second <= 0.0){
+        problem = "expected a flow in mL/s and a positive time in s";
+      }
+    }
+    if(problem == NULL){
+      volume += SegmentVolume(segment);
+      flow = segment->flow;
+      profile->duration += segment->duration;
+      profile->numSegments++;
+    }
+  }
+  fclose(f);
+  if(problem == NULL && profile->numSegments == 0){
+    problem = "no segments";
+  }
+  if(problem != NULL){
+    fprintf(stderr, "%s:%d: %s\n", fileName, lineNumber, problem);
+    return false;
+  }
+  return true;
+}
+
+/*!
+ * \brief Segment under way a time into the profile
+ */
+static int SegmentAt(const FlowProfile *profile, double time)
+{
+  int segment = 0;
+  while(segment + 1 < profile->numSegments && profile->segments[segment + 1].start <= time){
+    segment++;
+  }
+  return segment;
+}
+
+/*!
+ * \brief Precomputes the setpoint and the feedforward position over the whole profile
+ * \param table is the valve table; without a usable one the feedforward positions are -1
+ * \details The trajectory is sampled every FLOW_PROFILE_SAMPLE_S, or coarser if the profile is too long for FLOW_PROFILE_MAX_SAMPLES points.
+ */
+void BuildFlowProfile(FlowProfile *profile, const ValveTable *table)
+{
+  profile->sampleS = FLOW_PROFILE_SAMPLE_S;
+  if(profile->duration / profile->sampleS > FLOW_PROFILE_MAX_SAMPLES - 1){
+    profile->sampleS = profile->duration / (FLOW_PROFILE_MAX_SAMPLES - 1);
+  }
+  profile->numSamples = (int)ceil(profile->duration / profile->sampleS) + 1;
+  if(profile->numSamples > FLOW_PROFILE_MAX_SAMPLES){
+    profile->numSamples = FLOW_PROFILE_MAX_SAMPLES;
+  }
+  bool haveTable = table != NULL && table->numPoints >= 2;
+  for(int i = 0; i < profile->numSamples; i++){
+    double time = i * profile->sampleS;
+    const FlowSegment *segment = &profile->segments[SegmentAt(profile, time)];
+    profile->setpoint[i] = SegmentFlow(segment, time - segment->start);
+    profile->feedforward[i] = haveTable ? ValveTablePosition(table, profile->setpoint[i]) : -1;
+  }
+}
+
+/*!
+ * \brief Point of the trajectory at or before a time and how far it is to the next one
+ * \details The two points never straddle the start of a segment, so the step of a hold is not smeared over a sample.
+ */
+static int SampleAt(const FlowProfile *profile, double time, double *fraction)
+{
+  *fraction = 0.0;
+  if(time <= 0.0 || profile->numSamples < 2){
+    return 0;
+  }
+  int index = (int)(time / profile->sampleS);
+  if(index >= profile->numSamples - 1){
+    return profile->numSamples - 1;
+  }
+  const FlowSegment *segment = &profile->segments[SegmentAt(profile, time)];
+  double segmentEnd = segment->start + segment->duration;
+  if(index * profile->sampleS < segment->start){
+    return index + 1;
+  }
+  if((index + 1) * profile->sampleS >= segmentEnd && segment->type != FLOW_SEGMENT_STOP){
+    return index;
+  }
+  *fraction = time / profile->sampleS - index;
+  return index;
+}
+
+/*!
+ * \brief Setpoint a time into the profile in mL/s, interpolated from the trajectory
+ * \details Past the planned end the setpoint of the end is held, which is how a stop waits for its volume.
+ */
+double FlowProfileSetpoint(const FlowProfile *profile, double time)
+{
+  double fraction;
+  int index = SampleAt(profile, time, &fraction);
+  if(fraction <= 0.0){
+    return profile->setpoint[index];
+  }
+  return profile->setpoint[index] + (profile->setpoint[index + 1] - profile->setpoint[index]) * fraction;
+}
+
+/*!
+ * \brief Feedforward position a time into the profile, -1 without a valve table
+ */
+int FlowProfileFeedforward(const FlowProfile *profile, double time)
+{
+  double fraction;
+  int index = SampleAt(profile, time, &fraction);
+  return profile->feedforward[fraction < 0.5 ? index : index + 1];
+}
+
+/*!
+ * \brief Starts a run of a profile now
+ * \details The start of every segment after the first, and the end of a profile without a stop, go on the timer wheel.
+ */
+void FlowProfileStart(FlowProfileRun *run, const FlowProfile *profile, int64_t nowNs)
+{
+  run->startNs = nowNs;
+  run->lastTime = 0.0;
+  run->volume = 0.0;
+  run->segment = 0;
+  run->done = false;
+  run->maxLateS = 0.0;
+  TimerWheelInit(&run->wheel, FLOW_PROFILE_TICK_NS, nowNs);
+  for(int i = 1; i < profile->numSegments; i++){
+    TimerWheelSchedule(&run->wheel, nowNs + (int64_t)(profile->segments[i].start * 1e9), i);
+  }
+  if(profile->segments[profile->numSegments - 1].type != FLOW_SEGMENT_STOP){
+    TimerWheelSchedule(&run->wheel, nowNs + (int64_t)(profile->duration * 1e9), profile->numSegments);
+  }
+}
+
+/*!
+ * \brief Moves a run on to a flow sample
+ * \param flow is the measured flow in mL/s, added to the delivered volume
+ * \details Does not block or allocate, so it can be called in the control step.
+ */
+FlowProfileStep FlowProfileAdvance(FlowProfileRun *run, const FlowProfile *profile, int64_t nowNs, double flow)
+{
+  FlowProfileStep step;
+  double time = (nowNs - run->startNs) / 1e9;
+  if(time > run->lastTime){
+    run->volume += flow * (time - run->lastTime);
+    run->lastTime = time;
+  }
+  step.segmentStarted = false;
+  step.lateS = 0.0;
+  int args[FLOW_PROFILE_EXPIRE_BATCH];
+  int64_t deadlines[FLOW_PROFILE_EXPIRE_BATCH];
+  int expired;
+  do{
+    expired = TimerWheelExpire(&run->wheel, nowNs, args, deadlines, FLOW_PROFILE_EXPIRE_BATCH);
+    for(int i = 0; i < expired; i++){
+      step.lateS = (nowNs - deadlines[i]) / 1e9;
+      if(step.lateS > run->maxLateS){
+        run->maxLateS = step.lateS;
+      }
+      if(args[i] >= profile->numSegments){
+        run->done = true;
+      }
+      else{
+        run->segment = args[i];
+        step.segmentStarted = true;
+      }
+    }
+  }while(expired == FLOW_PROFILE_EXPIRE_BATCH);
+  const FlowSegment *segment = &profile->segments[run->segment];
+  if(segment->type == FLOW_SEGMENT_STOP && run->volume >= segment->volume){
+    run->done = true;
+  }
+  step.segment = run->segment;
+  step.done = run->done;
+  step.target = run->done ? 0.0 : FlowProfileSetpoint(profile, time);
+  step.feedforward = run->done ? 0 : FlowProfileFeedforward(profile, time);
+  return step;
+}
+
+/*!
+ * \brief Latest CLOCK_MONOTONIC time the control loop may sleep until
+ * \param flow is the last measured flow in mL/s
+ * \details The start of the next segment, a sample every FLOW_PROFILE_TRACK_S while the setpoint moves, and during a stop the moment the volume is due at the present flow.
+ */
+int64_t FlowProfileNextDeadline(const FlowProfileRun *run, const FlowProfile *profile, int64_t nowNs, double flow)
+{
+  int64_t deadline = TimerWheelNextDeadline(&run->wheel);
+  const FlowSegment *segment = &profile->segments[run->segment];
+  int64_t limit = TIMER_WHEEL_NONE;
+  if(segment->type == FLOW_SEGMENT_RAMP || segment->type == FLOW_SEGMENT_TAPER){
+    limit = nowNs + (int64_t)(FLOW_PROFILE_TRACK_S * 1e9);
+  }
+  else if(segment->type == FLOW_SEGMENT_STOP && flow > 0.0){
+    double left = segment->volume - run->volume;
+    limit = nowNs + (left > 0.0 ? (int64_t)(left / flow * 1e9) : 0);
+  }
+  return limit < deadline ? limit : deadline;
+}
@@ -0,0 +1,55 @@
+#include "frame_queue.h"
+#include <string.h>
+#include <chrono>
+
+FrameQueue::FrameQueue()
+  : head(0), count(0), dropped(0)
+{
+}
+
+/*!
+ * \brief Queues a copy of a packet
+ * \param size must be at most PACKET_MAX_BYTES
+ */
+void FrameQueue::Push(const uint8_t *packet, unsigned int size, int64_t receivedNs)
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if(count == FRAME_QUEUE_SLOTS){
+      head = (head + 1) % FRAME_QUEUE_SLOTS;
+      count--;
+      dropped++;
+    }
+    QueuedFrame *frame = &slots[(head + count) % FRAME_QUEUE_SLOTS];
+    memcpy(frame->packet, packet, size);
+    frame->size = size;
+    frame->receivedNs = receivedNs;
+    count++;
+  }
+  ready.notify_one();
+}
+
+/*!
+ * \brief Takes the oldest packet, waiting up to timeoutUs for one to arrive
+ * \param packet must hold at least PACKET_MAX_BYTES bytes
+ * \param receivedNs receives the time the packet was read if it is not NULL
+ * \details Returns the size of the packet, or 0 if none arrived in time.
+ */
+unsigned int FrameQueue::Pop(uint8_t *packet, long timeoutUs, int64_t *receivedNs)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  if(count == 0 && timeoutUs > 0){
+    ready.wait_for(guard, std::chrono::microseconds(timeoutUs), [this]{ return count > 0; });
+  }
+  if(count == 0){
+    return 0;
+  }
+  QueuedFrame *frame = &slots[head];
+  memcpy(packet, frame->packet, frame->size);
+  if(receivedNs != NULL){
+    *receivedNs = frame->receivedNs;
+  }
+  head = (head + 1) % FRAME_QUEUE_SLOTS;
+  count--;
+  return frame->size;
+}
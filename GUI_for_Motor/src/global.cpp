@@ -1,16 +1,22 @@
 #include "global.h"
 
 Gui_Window_AppWidgets *gui_app; //!< Structure to keep all interesting widgets
+Teensy_DeviceInfo teensyInfo;	//!< Identity and negotiated features of the connected Teensy
+DeviceClock deviceClock;	//!< The Teensy clock in host time, kept up by Clock_Sync_Thread
 
 
 int ser_teensy1=-1;
 
-char label_recieved_value[40];	//!< Holds the current flow value that will be shown to the user
+Valve_Controller valves[MAX_VALVES];	//!< Valves of the connected Teensy
+int numValves = 1;		//!< Number of valves in use
 
 int kill_all_threads;		//!< Used to gracefully shut down threads
-int targetFlow;			//!< Stores the target flow specified by the user
-bool makeMLThread = true;	//!< Used to specify if a MasterLogic thread can be made
-int numOfSteps = 0;		//!< Stores the number of steps the motor has taken so far
+int kill_read_thread;		//!< Used to shut down the serial read thread after everything else
+LoopRateConfig loopRateConfig = LOOP_RATE_DEFAULTS;	//!< Bounds of the adaptive control period
+bool planMoves = false;	//!< Plan the moves of an identified valve with the MPC mode instead of the Smith mode
+SerialCaptureWriter serialCapture;	//!< Records the serial traffic when --capture is given
+LogQueue logQueue;		//!< Console output of the control and read threads
 
 GMutex *master_logic_mutex;	//!< Mutex for protecting the creation of a MasterLogic thread
 GMutex *flow_label_mutex;	//!< Mutex for protecting the flow label
+GMutex *serial_write_mutex;	//!< Mutex keeping packets written by different threads from interleaving
@@ -0,0 +1,127 @@
+#include "log_queue.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+LogQueue::LogQueue()
+  : enqueuePosition(0), dequeuePosition(0), dropped(0), droppedReported(0), running(false)
+{
+  for(uint32_t i = 0; i < LOG_QUEUE_ENTRIES; i++){
+    entries[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+LogQueue::~LogQueue()
+{
+  Stop();
+}
+
+/*!
+ * \brief Starts the background thread; messages are queued from then on
+ */
+void LogQueue::Start()
+{
+  if(running.load()){
+    return;
+  }
+  running.store(true);
+  writer = std::thread(&LogQueue::DrainLoop, this);
+}
+
+/*!
+ * \brief Writes out what is still queued and stops the background thread
+ */
+void LogQueue::Stop()
+{
+  if(!running.load()){
+    return;
+  }
+  running.store(false);
+  writer.join();
+  Drain();
+}
+
+/*!
+ * \brief Logs a message in the style of printf
+ * \details Returns false if the ring was full and the message was dropped. Does not block and does not allocate while the background thread runs.
+ */
+bool LogQueue::Printf(LogLevel level, const char *format, ...)
+{
+  va_list args;
+  if(!running.load(std::memory_order_acquire)){
+    FILE *stream = level == LOG_ERROR ? stderr : stdout;
+    va_start(args, format);
+    vfprintf(stream, format, args);
+    va_end(args);
+    fputc('\n', stream);
+    return true;
+  }
+  //claim a slot; a producer that loses the race tries the next position
+  LogEntry *entry;
+  uint32_t position = enqueuePosition.load(std::memory_order_relaxed);
+  while(true){
+    entry = &entries[position & (LOG_QUEUE_ENTRIES - 1)];
+    int32_t lag = (int32_t)(entry->sequence.load(std::memory_order_acquire) - position);
+    if(lag == 0){
+      if(enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)){
+        break;
+      }
+    }
+    else if(lag < 0){
+      //the writer has not freed the slot from the last time around
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    else{
+      position = enqueuePosition.load(std::memory_order_relaxed);
+    }
+  }
+  entry->level = level;
+  va_start(args, format);
+  vsnprintf(entry->text, sizeof(entry->text), format, args);
+  va_end(args);
+  entry->sequence.store(position + 1, std::memory_order_release);
+  return true;
+}
+
+/*!
+ * \brief Writes out every message that is ready
+ * \details Returns true if there was at least one. Only the background thread, or Stop() once it has ended, calls this.
+ */
+bool LogQueue::Drain()
+{
+  bool wrote = false;
+  while(true){
+    LogEntry *entry = &entries[dequeuePosition & (LOG_QUEUE_ENTRIES - 1)];
+    if(entry->sequence.load(std::memory_order_acquire) != dequeuePosition + 1){
+      break;
+    }
+    FILE *stream = entry->level == LOG_ERROR ? stderr : stdout;
+    fputs(entry->text, stream);
+    fputc('\n', stream);
+    entry->sequence.store(dequeuePosition + LOG_QUEUE_ENTRIES, std::memory_order_release);
+    dequeuePosition++;
+    wrote = true;
+  }
+  uint32_t lost = dropped.load(std::memory_order_relaxed);
+  if(lost != droppedReported){
+    fprintf(stderr, "%u log messages dropped\n", lost - droppedReported);
+    droppedReported = lost;
+  }
+  if(wrote){
+    fflush(stdout);
+  }
+  return wrote;
+}
+
+/*!
+ * \brief Body of the background thread
+ */
+void LogQueue::DrainLoop()
+{
+  while(running.load()){
+    if(!Drain()){
+      usleep(LOG_DRAIN_INTERVAL_US);
+    }
+  }
+}
@@ -0,0 +1,43 @@
+#include "loop_rate.h"
+#include <math.h>
+
+const LoopRateConfig LOOP_RATE_DEFAULTS = {0.25, 8.0, 1.5, 0.15, 0.10};
+
+/*!
+ * \brief Starts the schedule over at the shortest period
+ * \details Call this whenever the setpoint changes so the response is sampled closely.
+ */
+void LoopRateReset(LoopRateState *state, const LoopRateConfig *config)
+{
+  state->period = config->minPeriod;
+  state->lastError = 0.0;
+  state->started = false;
+}
+
+/*!
+ * \brief Picks the period to wait before the next control iteration
+ * \param target is the current setpoint in mL/s
+ * \param error is the setpoint minus the measured flow in mL/s
+ * \param dt is the time since the previous iteration in seconds
+ * \details A large error or a quickly changing error (a setpoint change or a disturbance) drops the period straight to the minimum. Otherwise the period grows geometrically by the backoff factor until it reaches the maximum.
+ */
+double LoopRateNext(LoopRateState *state, const LoopRateConfig *config, double target, double error, double dt)
+{
+  double scale = fabs(target) > 0.0 ? fabs(target) : 1.0;
+  double slope = (state->started && dt > 0.0) ? fabs(error - state->lastError) / dt : 0.0;
+  state->lastError = error;
+  state->started = true;
+  if(fabs(error) > config->errorBand * scale || slope > config->slopeBand * scale){
+    state->period = config->minPeriod;
+  }
+  else{
+    state->period *= config->backoff;
+    if(state->period > config->maxPeriod){
+      state->period = config->maxPeriod;
+    }
+  }
+  if(state->period < config->minPeriod){
+    state->period = config->minPeriod;
+  }
+  return state->period;
+}
@@ -13,10 +13,37 @@
  * The following will explain how to complie the code using CMake and Make
  * \subsection CMake
  * While in the build directory run the command "cmake .."
+ * Adding -DCOUNT_ALLOCATIONS=ON builds a version that aborts if a control thread allocates memory in the steady state loop.
+ * "ctest" runs the benchmark and the parser corpus built that way, and fails if the control path allocates.
  * \subsection Make
  * After CMake has been executed run the "make" command while still in the build directory
+ * \section usage_sec Usage
+ * Run TeensyControl with no options to bring up the GUI. The following options are also understood:
+ * - --identify blinks the LED on the Teensy so the board can be found
+ * - --dose <mL> dispenses the given volume, prints the achieved volume and exits without the GUI
+ * - --characterize sweeps the valve, stores the position to flow table for this Teensy and exits without the GUI
+ * - --min-period <s> and --max-period <s> bound the adaptive control period (default 0.1 s to 2 s with a plant model, 0.25 s to 8 s with tuned gains, 1 s to 8 s otherwise)
+ * - --autotune <mL/s> runs a relay feedback experiment around the given flow, stores the PID gains for this Teensy and exits without the GUI
+ * - --step-test <mL/s> steps the valve up and down around the given flow, fits a dead time model to the response, stores it for this Teensy and exits without the GUI
+ * - --mpc plans the moves of a valve with a step test model over the next few seconds, keeping travel and reversals of the valve down, instead of correcting every sample with the Smith predictor
+ * - --profile <file> runs the valve through a flow profile of ramps, holds, tapers and a stop at a volume, closes it at the end and exits without the GUI; see flow_profile.h for the format
+ * - --sensor <name> converts pulses to flow with a profile from flow_sensor.h, for firmware built before it reported one; ignored when the Teensy reports its profile
+ * - --channel <n> picks the valve that --dose, --characterize, --autotune, --step-test and --profile act on (default 0)
+ * - --capture <file> records every byte read from and written to the Teensy, with monotonic timestamps, for serial_replay
+ * - --trace-dir <dir> is where traces are written (default /tmp); --no-trace stops recording them
+ *
+ * A valve with a stored step test model is controlled by a Smith predictor, which corrects the flow before the sensor sees the result of a move. Otherwise tuned gains give a PID loop and a valve table gives table corrections.
+ *
+ * The threads that talk to the Teensy record what they do in memory all the time. Sending SIGUSR1 to TeensyControl, or a control step or write that stalls, writes the last few thousand events of every thread to a piflow-trace-*.json file that Perfetto or chrome://tracing opens.
+ *
+ * A Teensy that drives two valves shows a second set of controls in the GUI. Each valve publishes its status to its own shared memory segment, /piflow_status for valve 0 and /piflow_status1 for valve 1.
  */
 #include "global.h"
+#include "protocol.h"
+#include "flow_controller.h"
+#include "frame_parser.h"
+#include "flow_units.h"
+#include "trace.h"
 #include "string.h"
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -25,11 +52,39 @@
 #include <termios.h>
 #include <glib.h>
 #include <errno.h>
+#include <signal.h>
 #include <ctime>
 
 #define FLOW_LABEL_UPDATE_MS 100	//!< Time(in milliseconds) between calling the UpdateFlowLabel function
 #define READ_THREAD_SLEEP_DURATION_US 100000	//!< Duration to sleep while waiting for input
 #define BETWEEN_CHARACTERS_TIMEOUT_US 1000		//!< Timeout time between character input
+#define HELLO_TIMEOUT_US 250000		//!< How long to wait for the hello reply before trying the legacy handshake
+#define LEGACY_TEST_TIMEOUT_US 3000000	//!< How long to wait for the legacy test reply (old firmware blinks for a second first)
+#define DEVICE_LOOP_KP 20.0		//!< Proportional gain of the on-device flow loop in steps per pulse/s
+#define DEVICE_LOOP_KI 10.0		//!< Integral gain of the on-device flow loop in steps per pulse
+#define DEVICE_LOOP_KD 0.0		//!< Derivative gain of the on-device flow loop in steps per pulse/s^2
+#define DEVICE_LOOP_PERIOD_US 10000	//!< Control period of the on-device flow loop (100 Hz)
+#define DEVICE_LOOP_STATUS_EVERY 10	//!< Control periods between status frames from the Teensy at the start of a run
+#define FILTER_AVERAGE_LENGTH 16	//!< Moving average length on the Teensy in filter periods (1 ms each)
+#define FILTER_IIR_ALPHA 3277		//!< Low pass coefficient on the Teensy in 1/65536ths
+#define FILTER_KALMAN_Q 10000		//!< Kalman process noise per filter period in (millipulses/s)^2
+#define FILTER_KALMAN_R 4000000		//!< Kalman measurement noise in (millipulses/s)^2
+#define DOSE_OPEN_POSITION MAX_NUM_OF_STEPS	//!< Valve position used while dispensing a dose
+#define DOSE_SLOWEST_FLOW 1.0			//!< Flow in mL/s the wait for a dose report assumes without a valve table
+#define DOSE_TIMEOUT_MARGIN_S 10.0		//!< Time allowed past the expected end of a dose before it is cancelled
+#define CHARACTERIZE_STEP_SIZE 100		//!< Steps between the points of the characterization sweep
+#define CHARACTERIZE_SETTLE_US 2000000		//!< Time to let the flow settle after each move of the sweep
+#define CHARACTERIZE_MEASURE_US 5000000		//!< Time the flow is averaged over at each point of the sweep
+#define AUTOTUNE_RELAY_STEPS 200		//!< Half the distance between the two valve positions of the relay
+#define AUTOTUNE_HYSTERESIS 0.05		//!< Relay hysteresis as a fraction of the setpoint
+#define AUTOTUNE_SAMPLE_US 1000000		//!< Time between flow samples during the relay experiment
+#define AUTOTUNE_CYCLES 4			//!< Oscillation periods averaged to find the ultimate period
+#define AUTOTUNE_TIMEOUT_S 600			//!< Give up if the relay has not produced enough periods by then
+#define ABORT_TIMEOUT_US 2000000		//!< How long to wait for the Teensy to report where an aborted move stopped
+#define MOVE_TIMEOUT_MARGIN_S 2.0		//!< Time allowed past the travel of a move for its report before it is aborted
+#define RECEIVE_POLL_US 10000			//!< How often a thread waiting for a frame checks whether it has been killed
+#define CONTROL_STALL_US 1000000		//!< A control step longer than this writes out the trace
+#define WRITE_STALL_US 100000			//!< A write to the port longer than this writes out the trace
 
  #define GuiappGET(xx) gui_app->xx=GTK_WIDGET(gtk_builder_get_object(p_builder,#xx)) //!< Defines an easier way to access a widget
 
@@ -48,117 +103,678 @@ void ObtainGuiWidgets(GtkBuilder *p_builder)
   GuiappGET(FCloseButton);
   GuiappGET(TargetFlowInput);
   GuiappGET(FlowLabel);
+  GuiappGET(FOpenButton2);
+  GuiappGET(FCloseButton2);
+  GuiappGET(TargetFlowInput2);
+  GuiappGET(FlowLabel2);
 }
 /*
 **Constants and function prototypes
 */
-const char PACKET_START_BYTE = 0xAA;
-const char MOTOR_COMMAND = 'M';
-const char FLOW_COMMAND = 'F';
-const char TEST_COMMAND = 'T';
-const unsigned int PACKET_OVERHEAD_BYTES = 3;
-const unsigned int PACKET_MIN_BYTES = PACKET_OVERHEAD_BYTES + 1;
-const unsigned int PACKET_MAX_BYTES = 255;
-const int MAX_NUM_OF_STEPS = 2000;
-
-bool TurnMotor(char, int, int);
-double GetFlow(time_t);
-int GetSerialPacket();
+bool TurnMotor(Valve_Controller *, char, int, int);
+double GetFlow(Valve_Controller *, time_t);
+double GetFilteredFlow(Valve_Controller *, double *, int64_t *);
+int GetSerialPacket(Valve_Controller *);
+unsigned int ReceivePacket(Valve_Controller *, unsigned char *, long);
+unsigned int ReceivePacketAt(Valve_Controller *, unsigned char *, long, int64_t *);
+bool SendPacket(unsigned int, const unsigned char *);
+bool SendChannelPacket(Valve_Controller *, unsigned int, const unsigned char *);
+bool AbortMotion(Valve_Controller *);
+double MonotonicSeconds();
 
 /*!
  * \brief Updates the current flow that is displayed to the user.
+ * \details Also saves the history of a valve once a minute of it has ended. Both are done here, on the GUI thread, so the control threads never format text or touch files.
  */
 gboolean  UpdateFlowLabel(gpointer p_gptr)
 {
-  // do not change this function
+  TraceScope trace("GUI update");
+  char label[2][40];
   g_mutex_lock(flow_label_mutex);
-  gtk_label_set_text(GTK_LABEL(gui_app->FlowLabel),label_recieved_value);
+  snprintf(label[0], sizeof(label[0]), "%.2f", valves[0].shownFlow);
+  snprintf(label[1], sizeof(label[1]), "%.2f", valves[1].shownFlow);
   g_mutex_unlock(flow_label_mutex);
+  gtk_label_set_text(GTK_LABEL(gui_app->FlowLabel),label[0]);
+  gtk_label_set_text(GTK_LABEL(gui_app->FlowLabel2),label[1]);
+  for(int i = 0; i < numValves; i++){
+    if(valves[i].historyDue.exchange(false)){
+      SaveFlowHistory(teensyInfo.serialNumber, valves[i].channel, &valves[i].history);
+    }
+  }
   return true;
 }
 
 /*!
- * \brief Fully opens the valve from wherever it is.
+ * \brief SIGUSR1 handler that asks for the trace to be written out
+ */
+void DumpTraceSignal(int signalNumber)
+{
+  TraceRequestDump();
+}
+
+/*!
+ * \brief Publishes the latest flow reading to the shared memory status segment of a valve
+ * \param valve is the valve the reading belongs to
+ * \param flowRate is the measured flow in mL/s
+ * \param running is true while a flow loop is controlling the valve
  */
-bool FullyOpen()
+void PublishStatus(Valve_Controller *valve, double flowRate, bool running)
 {
-    int steps = MAX_NUM_OF_STEPS - numOfSteps;
+    FlowStatus status;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    memset(&status, 0, sizeof(status));
+    status.timestampNs = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+    status.flow = flowRate;
+    status.targetFlow = valve->targetFlow;
+    status.position = valve->numOfSteps;
+    status.running = running;
+    status.serialNumber = teensyInfo.serialNumber;
+    status.channel = valve->channel;
+    status.uplinkUs = valve->uplinkUs;
+    status.downlinkUs = valve->downlinkUs;
+    status.clockDriftPpm = deviceClock.DriftPpm();
+    valve->status_segment.Publish(status);
+    if(running){
+        //the rollups are kept in wall clock time so they carry over to the next run
+        clock_gettime(CLOCK_REALTIME, &now);
+        if(valve->history.Add((int64_t)now.tv_sec * 1000000000LL + now.tv_nsec, flowRate)){
+            valve->historyDue = true;
+        }
+    }
+}
+
+/*!
+ * \brief Sends an absolute move to the Teensy without waiting for it to finish
+ * \param position is the target in steps from fully closed
+ * \details The Teensy retargets the move in flight, ramping down and turning around if it has to.
+ */
+bool SendMove(Valve_Controller *valve, int position)
+{
+    unsigned char payload[MOVE_BYTES];	//Holds the command sent to the Teensy
+    payload[0] = MOVE_COMMAND;
+    PutU16(payload + MOVE_TARGET_OFFSET, position);
+    PutU16(payload + MOVE_RATE_OFFSET, 0);
+    return SendChannelPacket(valve, MOVE_BYTES, payload);
+}
+
+/*!
+ * \brief Waits for the Teensy to report that a move has stopped
+ * \param position is the target the move was sent with
+ * \param timeoutUs is how long to wait in all, or a negative number to wait until the threads are killed
+ * \param aborted is true to accept the report of an aborted move wherever it stopped
+ * \details Reports left over from earlier moves that were not waited for are skipped, and do not restart the wait. Updates numOfSteps with the position the motor stopped at.
+ */
+bool WaitForMove(Valve_Controller *valve, int position, long timeoutUs, bool aborted)
+{
+    unsigned char packet[PACKET_MAX_BYTES];	//Holds the frames recieved from the Teensy
+    unsigned int packetSize;
+    double deadline = MonotonicSeconds() + timeoutUs / 1e6;
+    while(true){
+        long leftUs = -1;
+        if(timeoutUs >= 0){
+            leftUs = (long)((deadline - MonotonicSeconds()) * 1e6);
+            if(leftUs <= 0){
+                break;
+            }
+        }
+        if((packetSize = ReceivePacket(valve, packet, leftUs)) == 0){
+            break;
+        }
+        if(packetSize != MOVE_DONE_BYTES + PACKET_OVERHEAD_BYTES || packet[2] != MOVE_DONE_FRAME){
+            continue;
+        }
+        int reached = GetU16(packet + 2 + MOVE_DONE_POSITION_OFFSET);
+        bool wasAborted = packet[2 + MOVE_DONE_ABORTED_OFFSET] != 0;
+        if(aborted ? wasAborted : (!wasAborted && reached == position)){
+            valve->numOfSteps = reached;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*!
+ * \brief Moves the valve to a position from wherever it is and waits until it gets there.
+ * \param position is the target in steps from fully closed; it is clamped to 0..MAX_NUM_OF_STEPS
+ * \details Firmware without preemptible moves gets the move split into 200 step chunks because a single motor command can only carry 255 steps.
+ * With preemptible moves the wait is bounded by the travel at the step rate from the hello reply plus a margin; if the report does not come by then the move is aborted, and numOfSteps only changes to a position the Teensy reported.
+ */
+bool MoveToPosition(Valve_Controller *valve, int position)
+{
+    if(position < 0){
+        position = 0;
+    }
+    else if(position > MAX_NUM_OF_STEPS){
+        position = MAX_NUM_OF_STEPS;
+    }
+    if(teensyInfo.usePreemptibleMove){
+        double travelS = teensyInfo.maxStepRate > 0 ? abs(position - valve->numOfSteps) / (double)teensyInfo.maxStepRate : 0.0;
+        if(!SendMove(valve, position)){
+            return false;
+        }
+        if(WaitForMove(valve, position, (long)((travelS + MOVE_TIMEOUT_MARGIN_S) * 1e6), false)){
+            return true;
+        }
+        if(!kill_all_threads){
+            cerr<<"Valve "<<valve->channel<<": no report of the move to "<<position<<" after "<<travelS + MOVE_TIMEOUT_MARGIN_S<<" s; aborting it"<<endl;
+        }
+        AbortMotion(valve);
+        return false;
+    }
+    char direction = (position > valve->numOfSteps) ? 'B' : 'F';
+    int steps = abs(position - valve->numOfSteps);
     int multi = 0;
+    bool result = true;
     while(steps >= 200){
         steps -= 200;
         multi++;
     }
-    TurnMotor('B', 200, multi);
-    TurnMotor('B', steps, 1);
-    numOfSteps = MAX_NUM_OF_STEPS;
+    if(multi > 0){
+        result = TurnMotor(valve, direction, 200, multi) && result;
+    }
+    if(steps > 0){
+        result = TurnMotor(valve, direction, steps, 1) && result;
+    }
+    valve->numOfSteps = position;
+    return result;
+}
+
+/*!
+ * \brief Points the valve at a new position without waiting for the move to finish.
+ * \param position is the target in steps from fully closed; it is clamped to 0..MAX_NUM_OF_STEPS
+ * \details Used for corrections, which replace the move in flight instead of queueing behind it. numOfSteps holds the commanded position afterwards. Falls back to MoveToPosition when the firmware cannot retarget a move.
+ */
+bool RetargetValve(Valve_Controller *valve, int position)
+{
+    if(!teensyInfo.usePreemptibleMove){
+        return MoveToPosition(valve, position);
+    }
+    if(position < 0){
+        position = 0;
+    }
+    else if(position > MAX_NUM_OF_STEPS){
+        position = MAX_NUM_OF_STEPS;
+    }
+    valve->numOfSteps = position;
+    return SendMove(valve, position);
+}
+
+/*!
+ * \brief Stops the valve where it is, ramping down from the move in flight.
+ * \details Updates numOfSteps with the exact position the Teensy stopped at. Does nothing on firmware without preemptible moves, where every move has already finished by the time it returns.
+ */
+bool AbortMotion(Valve_Controller *valve)
+{
+    unsigned char command = ABORT_COMMAND;
+    if(!teensyInfo.usePreemptibleMove){
+        return true;
+    }
+    return SendChannelPacket(valve, 1, &command) && WaitForMove(valve, 0, ABORT_TIMEOUT_US, true);
+}
+
+/*!
+ * \brief Fully opens the valve from wherever it is.
+ */
+bool FullyOpen(Valve_Controller *valve)
+{
+    RetargetValve(valve, MAX_NUM_OF_STEPS);
     return true;
 }
 /*!
  * \brief Fully closes the valve from wherever it is.
  */
-bool FullyClose()
+bool FullyClose(Valve_Controller *valve)
 {
-    int steps = numOfSteps;
-    int multi = 0;
-    while(steps >= 200){
-        steps -= 200;
-        multi++;
+    RetargetValve(valve, 0);
+    return true;
+}
+
+/*!
+ * \brief Measures the flow averaged over a window
+ * \param windowUs is how long to count pulses for
+ * \details Clears the count on the Teensy, waits for the window and reads the flow accumulated since.
+ */
+double GetSteadyFlow(Valve_Controller *valve, unsigned long windowUs)
+{
+    time_t startTime = time(0);
+    GetFlow(valve, startTime);
+    startTime = time(0);
+    usleep(windowUs);
+    return GetFlow(valve, startTime);
+}
+
+/*!
+ * \brief Current CLOCK_MONOTONIC time in seconds
+ */
+double MonotonicSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*!
+ * \brief Sleeps until a CLOCK_MONOTONIC time in nanoseconds
+ * \details An absolute deadline does not drift by the time the caller took before sleeping, and a signal does not cut the sleep short.
+ */
+void SleepUntilNs(int64_t deadlineNs)
+{
+    struct timespec deadline;
+    deadline.tv_sec = deadlineNs / 1000000000LL;
+    deadline.tv_nsec = deadlineNs % 1000000000LL;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR){
+    }
+}
+
+/*!
+ * \brief Tunes the PID gains with a relay feedback experiment around a setpoint
+ * \param setpoint is the flow in mL/s to tune around
+ * \param gains receives the tuned gains
+ * \details Drives the valve between two positions AUTOTUNE_RELAY_STEPS either side of the position expected to give the setpoint, switching whenever the flow crosses the setpoint (with hysteresis). The first switches are ignored while the oscillation builds up; the amplitude and period of the next AUTOTUNE_CYCLES periods give the ultimate gain and period.
+ */
+bool AutotuneValve(Valve_Controller *valve, double setpoint, PidGains *gains)
+{
+    int center = (valve->valveTable.numPoints >= 2) ? ValveTablePosition(&valve->valveTable, setpoint) : valve->numOfSteps;
+    if(center < AUTOTUNE_RELAY_STEPS){
+        center = AUTOTUNE_RELAY_STEPS;
+    }
+    else if(center > MAX_NUM_OF_STEPS - AUTOTUNE_RELAY_STEPS){
+        center = MAX_NUM_OF_STEPS - AUTOTUNE_RELAY_STEPS;
+    }
+    double hysteresis = setpoint * AUTOTUNE_HYSTERESIS;
+    double switchTime[AUTOTUNE_CYCLES + 3];	//Times the relay switched high
+    double peakToPeak[AUTOTUNE_CYCLES + 3];	//Flow swing in each period
+    int periods = 0;
+    bool high = true;
+    double highest = 0.0, lowest = 1e9;
+    double startTime = MonotonicSeconds();
+
+    MoveToPosition(valve, center + AUTOTUNE_RELAY_STEPS);
+    GetFlow(valve, time(0));
+    time_t flowStart = time(0);
+    while(!kill_all_threads && periods < AUTOTUNE_CYCLES + 3){
+        if(MonotonicSeconds() - startTime > AUTOTUNE_TIMEOUT_S){
+            cerr<<"Autotune timed out without a steady oscillation"<<endl;
+            break;
+        }
+        usleep(AUTOTUNE_SAMPLE_US);
+        double flow = GetFlow(valve, flowStart);
+        flowStart = time(0);
+        if(flow > highest){
+            highest = flow;
+        }
+        if(flow < lowest){
+            lowest = flow;
+        }
+        if(high && flow > setpoint + hysteresis){
+            high = false;
+            MoveToPosition(valve, center - AUTOTUNE_RELAY_STEPS);
+            flowStart = time(0);
+        }
+        else if(!high && flow < setpoint - hysteresis){
+            //a switch to high closes one period
+            high = true;
+            switchTime[periods] = MonotonicSeconds();
+            peakToPeak[periods] = highest - lowest;
+            periods++;
+            highest = 0.0;
+            lowest = 1e9;
+            MoveToPosition(valve, center + AUTOTUNE_RELAY_STEPS);
+            flowStart = time(0);
+            printf("Autotune: period %d, swing %.2f mL/s\n", periods, peakToPeak[periods - 1]);
+        }
+    }
+    MoveToPosition(valve, center);
+    if(periods < AUTOTUNE_CYCLES + 3){
+        return false;
+    }
+    //skip the start up periods; each swing is measured over the period that ends at its switch
+    double period = (switchTime[periods - 1] - switchTime[periods - 1 - AUTOTUNE_CYCLES]) / AUTOTUNE_CYCLES;
+    double amplitude = 0.0;
+    for(int i = periods - AUTOTUNE_CYCLES; i < periods; i++){
+        amplitude += peakToPeak[i] / 2.0;
+    }
+    amplitude /= AUTOTUNE_CYCLES;
+    if(amplitude <= hysteresis || period <= 0.0){
+        return false;
+    }
+    RelayTuningGains(AUTOTUNE_RELAY_STEPS, hysteresis, amplitude, period, gains);
+    printf("Autotune: ultimate period %.2f s, amplitude %.2f mL/s, kp %.3f ki %.3f kd %.3f\n",
+           period, amplitude, gains->kp, gains->ki, gains->kd);
+    return true;
+}
+
+/*!
+ * \brief Sweeps the valve and records the steady flow at each position
+ * \param table receives the measured points, made monotone
+ * \details Closes the valve, then opens it CHARACTERIZE_STEP_SIZE steps at a time, waits for the flow to settle and measures it. The valve is closed again at the end.
+ */
+bool CharacterizeValve(Valve_Controller *valve, ValveTable *table)
+{
+    table->numPoints = 0;
+    FullyClose(valve);
+    for(int position = 0; position <= MAX_NUM_OF_STEPS && !kill_all_threads; position += CHARACTERIZE_STEP_SIZE){
+        if(table->numPoints >= VALVE_TABLE_MAX_POINTS){
+            break;
+        }
+        MoveToPosition(valve, position);
+        usleep(CHARACTERIZE_SETTLE_US);
+        double flow = GetSteadyFlow(valve, CHARACTERIZE_MEASURE_US);
+        table->position[table->numPoints] = position;
+        table->flow[table->numPoints] = flow;
+        table->numPoints++;
+        printf("Characterize: %4d steps %8.2f mL/s\n", position, flow);
+    }
+    FullyClose(valve);
+    if(kill_all_threads || table->numPoints < 2){
+        return false;
+    }
+    MakeValveTableMonotone(table);
+    return true;
+}
+
+/*!
+ * \brief Records the filtered flow around one move of the valve and fits the model to it
+ */
+bool StepTestMove(Valve_Controller *valve, int from, int to, PlantModel *model)
+{
+    double time[STEP_TEST_MAX_SAMPLES];	//Seconds since the start of the recording
+    double flow[STEP_TEST_MAX_SAMPLES];	//Filtered flow at those times
+    int samples = 0;
+    double startTime = MonotonicSeconds();
+    double movedAt = 0.0;	//Seconds since the start of the recording the move was sent
+    bool moved = false;
+    while(!kill_all_threads && samples < STEP_TEST_MAX_SAMPLES){
+        double now = MonotonicSeconds() - startTime;
+        if(now >= STEP_TEST_BASELINE_S + STEP_TEST_RECORD_S){
+            break;
+        }
+        if(!moved && now >= STEP_TEST_BASELINE_S){
+            //do not wait for the move to finish; the fit ramps the input over the travel of the motor
+            movedAt = MonotonicSeconds() - startTime;
+            RetargetValve(valve, to);
+            moved = true;
+        }
+        int64_t sampleNs = 0;
+        flow[samples] = GetFilteredFlow(valve, NULL, &sampleNs);
+        time[samples] = (sampleNs != 0 ? sampleNs / 1e9 : MonotonicSeconds()) - startTime;
+        samples++;
+        usleep(STEP_TEST_SAMPLE_S * 1000000);
+    }
+    double travel = teensyInfo.maxStepRate > 0 ? abs(to - from) / (double)teensyInfo.maxStepRate : 0.0;
+    return moved && FitStepResponse(time, flow, samples, movedAt, travel, to - from, model);
+}
+
+/*!
+ * \brief Identifies the valve to sensor model with a step test up and down around a flow
+ * \param setpoint is the flow in mL/s to test around
+ * \param model receives the average of the two fits
+ * \details Needs the filtered rate, since counting whole seconds hides the dead time.
+ */
+bool StepTestValve(Valve_Controller *valve, double setpoint, PlantModel *model)
+{
+    if(!teensyInfo.useFilteredRate){
+        cerr<<"The step test needs firmware that filters the flow rate"<<endl;
+        return false;
+    }
+    int low = (valve->valveTable.numPoints >= 2) ? ValveTablePosition(&valve->valveTable, setpoint) : valve->numOfSteps;
+    if(low > MAX_NUM_OF_STEPS - STEP_TEST_STEPS){
+        low = MAX_NUM_OF_STEPS - STEP_TEST_STEPS;
     }
-    TurnMotor('F', 200, multi);
-    TurnMotor('F', steps, 1);
-    numOfSteps = 0;
+    MoveToPosition(valve, low);
+    usleep(STEP_TEST_SETTLE_S * 1000000);
+    PlantModel steps[2];
+    if(!StepTestMove(valve, low, low + STEP_TEST_STEPS, &steps[0]) || !StepTestMove(valve, low + STEP_TEST_STEPS, low, &steps[1])){
+        return false;
+    }
+    for(int i = 0; i < 2; i++){
+        printf("Step test: %s gain %.4f mL/s per step, time constant %.2f s, dead time %.2f s\n", i == 0 ? "up  " : "down",
+               steps[i].gain, steps[i].timeConstant, steps[i].deadTime);
+    }
+    AveragePlantModels(steps, 2, model);
     return true;
 }
 
+/*!
+ * \brief Downloads the gains and timing of the on-device flow loop
+ * \param statusEvery is the number of control periods between status frames
+ * \details Tuned gains in steps per mL/s are scaled by the calibration because the Teensy works in pulses. Sending the config again while the loop runs does not disturb it.
+ */
+bool SendLoopConfig(Valve_Controller *valve, unsigned int statusEvery)
+{
+    unsigned char payload[LOOP_CONFIG_BYTES];	//Holds the command sent to the Teensy
+    double mlPerPulse = CalibrationMlPerPulse(teensyInfo.sensor.nominalUl);
+    double kp = valve->pidTuned ? valve->pidGains.kp * mlPerPulse : DEVICE_LOOP_KP;
+    double ki = valve->pidTuned ? valve->pidGains.ki * mlPerPulse : DEVICE_LOOP_KI;
+    double kd = valve->pidTuned ? valve->pidGains.kd * mlPerPulse : DEVICE_LOOP_KD;
+    payload[0] = LOOP_CONFIG_COMMAND;
+    PutU32(payload + LOOP_CONFIG_KP_OFFSET, (uint32_t)(int32_t)(kp * 1000));
+    PutU32(payload + LOOP_CONFIG_KI_OFFSET, (uint32_t)(int32_t)(ki * 1000));
+    PutU32(payload + LOOP_CONFIG_KD_OFFSET, (uint32_t)(int32_t)(kd * 1000));
+    PutU32(payload + LOOP_CONFIG_PERIOD_OFFSET, DEVICE_LOOP_PERIOD_US);
+    PutU16(payload + LOOP_CONFIG_STATUS_OFFSET, statusEvery > 0xFFFF ? 0xFFFF : statusEvery);
+    return SendChannelPacket(valve, LOOP_CONFIG_BYTES, payload);
+}
+
+/*!
+ * \brief Supervises the flow loop running on the Teensy.
+ * \details Downloads the gains and the setpoint, then only reads the status frames the Teensy streams back until the threads are killed, at which point the loop on the Teensy is stopped.
+ */
+gpointer DeviceLoopLogic(Valve_Controller *valve)
+{
+    unsigned char payload[PACKET_MAX_BYTES];	//Holds the command sent to the Teensy
+    unsigned char packet[PACKET_MAX_BYTES];	//Holds the frames recieved from the Teensy
+
+    //jump straight to the predicted position; the loop on the Teensy starts from there and only corrects the residual
+    if(valve->valveTable.numPoints >= 2){
+        MoveToPosition(valve, ValveTablePosition(&valve->valveTable, valve->targetFlow));
+    }
+
+    //status frames are only needed quickly while the flow is settling
+    LoopRateConfig rate = loopRateConfig;
+    LoopRateState schedule;
+    double lastSample = MonotonicSeconds();
+    unsigned int statusEvery = DEVICE_LOOP_STATUS_EVERY;
+    if(rate.maxPeriod < rate.minPeriod){
+        rate.maxPeriod = rate.minPeriod;
+    }
+    LoopRateReset(&schedule, &rate);
+    SendLoopConfig(valve, statusEvery);
+
+    payload[0] = LOOP_SETPOINT_COMMAND;
+    payload[LOOP_SETPOINT_RUN_OFFSET] = 1;
+    PutU32(payload + LOOP_SETPOINT_RATE_OFFSET, FlowPulseRate(valve->targetFlow, teensyInfo.sensor));
+    SendChannelPacket(valve, LOOP_SETPOINT_BYTES, payload);
+
+    while(!kill_all_threads){
+        HotPathEnter("DeviceLoopLogic");
+        unsigned int packetSize = ReceivePacket(valve, packet, -1);
+        if(packetSize == LOOP_STATUS_BYTES + PACKET_OVERHEAD_BYTES && packet[2] == LOOP_STATUS_FRAME){
+            TraceScope trace("device loop status", valve->channel);
+            double flowRate = RateFlow(GetU32(packet + 2 + LOOP_STATUS_RATE_OFFSET), teensyInfo.sensor);
+            valve->numOfSteps = GetU16(packet + 2 + LOOP_STATUS_POSITION_OFFSET);
+            g_mutex_lock(flow_label_mutex);
+            valve->shownFlow = flowRate;
+            g_mutex_unlock(flow_label_mutex);
+            PublishStatus(valve, flowRate, true);
+
+            //slow the status stream down while the flow holds steady
+            double now = MonotonicSeconds();
+            double period = LoopRateNext(&schedule, &rate, valve->targetFlow, valve->targetFlow - flowRate, now - lastSample);
+            lastSample = now;
+            unsigned int every = (unsigned int)(period * 1000000.0 / DEVICE_LOOP_PERIOD_US + 0.5);
+            if(every < 1){
+                every = 1;
+            }
+            if(every != statusEvery){
+                statusEvery = every;
+                SendLoopConfig(valve, statusEvery);
+            }
+        }
+        HotPathLeave();
+    }
+
+    //hand the valve back to the host; it stays where the loop left it
+    payload[0] = LOOP_SETPOINT_COMMAND;
+    payload[LOOP_SETPOINT_RUN_OFFSET] = 0;
+    PutU32(payload + LOOP_SETPOINT_RATE_OFFSET, 0);
+    SendChannelPacket(valve, LOOP_SETPOINT_BYTES, payload);
+    PublishStatus(valve, 0.0, false);
+    return NULL;
+}
+
 /*!
  * \brief Controls the valve based on the current flow from the flow sensor.
-* \details This function is created as a thread when the Start Button is pressed. Once created, this function will read the current flow from the flow sensor and then either open or close the valve to better achieve the target flow.
+* \details This function is created as a thread when the Start Button is pressed. Once created, this function will read the current flow from the flow sensor and then either open or close the valve to better achieve the target flow. When the Teensy can run the flow loop itself the work is handed to DeviceLoopLogic instead.
  */
-gpointer MasterLogic()
+gpointer MasterLogic(Valve_Controller *valve)
 {
+    //the on-device loop holds one target, so a profile runs on the host loop
+    if((teensyInfo.features & FEATURE_DEVICE_LOOP) && valve->profile == NULL){
+        TraceThreadStart("DeviceLoopLogic");
+        DeviceLoopLogic(valve);
+        TraceThreadEnd();
+        return NULL;
+    }
+    TraceThreadStart("MasterLogic");
+
     time_t startTime;
-    int steps = 0, multi = 0;
-    double smallError = targetFlow*0.25;
+    //a filtered rate from the Teensy allows a tighter band
+    bool filtered = teensyInfo.useFilteredRate;
+    //predict past the dead time when the valve has a model, otherwise use the tuned gains or correct from the valve table
+    FlowControllerConfig control;
+    FlowControllerState controller;
+    FlowControlMode predictive = planMoves ? FLOW_CONTROL_MPC : FLOW_CONTROL_SMITH;
+    FlowControllerDefaults(&control, valve->plantIdentified && filtered ? predictive : valve->pidTuned ? FLOW_CONTROL_PID :
+                           valve->valveTable.numPoints >= 2 ? FLOW_CONTROL_TABLE : FLOW_CONTROL_DEADBAND, filtered);
+    control.gains = valve->pidGains;
+    control.model = valve->plantModel;
+    control.stepRate = teensyInfo.maxStepRate;
+    //sample quickly while the flow settles and back off while it holds steady
+    LoopRateConfig modeRate = control.rate;
+    control.rate = loopRateConfig;
+    //each mode keeps its own bounds unless the command line set them
+    if(loopRateConfig.minPeriod == LOOP_RATE_DEFAULTS.minPeriod){
+        control.rate.minPeriod = modeRate.minPeriod;
+    }
+    if(loopRateConfig.maxPeriod == LOOP_RATE_DEFAULTS.maxPeriod){
+        control.rate.maxPeriod = modeRate.maxPeriod;
+    }
+    if(!filtered && !teensyInfo.useTimedFlow && control.rate.minPeriod < 1.0){
+        //the legacy flow read counts whole seconds
+        control.rate.minPeriod = 1.0;
+    }
+    if(control.rate.maxPeriod < control.rate.minPeriod){
+        control.rate.maxPeriod = control.rate.minPeriod;
+    }
+    double lastSample;
     double flowRate;
+    //a profile moves the target over time; without one the target from the GUI holds for the whole run
+    const FlowProfile *profile = valve->profile;
+    FlowProfileRun profileRun;
+    double target = profile != NULL ? FlowProfileSetpoint(profile, 0.0) : valve->targetFlow;
+    int feedforward = profile != NULL ? FlowProfileFeedforward(profile, 0.0) : -1;
+    //the Smith and MPC modes move the valve for a new setpoint through their model, the others take the precomputed feedforward
+    bool shiftFeedforward = control.mode == FLOW_CONTROL_PID || control.mode == FLOW_CONTROL_TABLE || control.mode == FLOW_CONTROL_DEADBAND;
+    bool profileDone = false;
+    //feedforward: jump straight to the position the valve table predicts for the target
+    int startPosition = FlowControllerStart(&controller, &control, &valve->valveTable, target, valve->numOfSteps);
+    double period = controller.schedule.period;
+    if(startPosition != valve->numOfSteps){
+        RetargetValve(valve, startPosition);
+    }
+    if(profile != NULL){
+        FlowProfileStart(&profileRun, profile, TraceNowNs());
+    }
     startTime = time(0);
-    flowRate = GetFlow(startTime);
+    flowRate = GetFlow(valve, startTime);
+    lastSample = MonotonicSeconds();
     startTime = time(0);
-    usleep(1000000); //sleep for 1 second
+    usleep(controller.schedule.period * 1000000);
     while(!kill_all_threads){
-        flowRate = GetFlow(startTime);
+        //from the flow request to the correction nothing may allocate or wait on the console
+        HotPathEnter("MasterLogic");
+        int64_t stepNs = TraceNowNs();
+        int64_t sampleNs = 0;
+        flowRate = filtered ? GetFilteredFlow(valve, NULL, &sampleNs) : GetFlow(valve, startTime);
         startTime = time(0);
 
         g_mutex_lock(flow_label_mutex);
-        sprintf(label_recieved_value,"%.2f", flowRate);
+        valve->shownFlow = flowRate;
         g_mutex_unlock(flow_label_mutex);
+        PublishStatus(valve, flowRate, true);
 
-        //Handle Small Error
-        if(flowRate < (targetFlow - smallError)){
-            steps = 200;
-            multi = 1;
-            if((numOfSteps+(steps*multi)) > MAX_NUM_OF_STEPS){
-                steps -= (((numOfSteps+(steps*multi)) - MAX_NUM_OF_STEPS) / multi);
+        //time the step between the moments the Teensy took the samples, not when they reached this thread
+        double now = sampleNs != 0 ? sampleNs / 1e9 : MonotonicSeconds();
+        if(profile != NULL){
+            FlowProfileStep profileStep = FlowProfileAdvance(&profileRun, profile, (int64_t)(now * 1e9), flowRate);
+            if(profileStep.segmentStarted){
+                logQueue.Printf(LOG_INFO, "Valve %d: profile segment %d started %.0f ms after it was due", valve->channel,
+                                profileStep.segment + 1, profileStep.lateS * 1000.0);
+                if(profileStep.lateS > period){
+                    TraceAnomaly("a late profile segment");
+                }
             }
-            TurnMotor('B', steps, multi);
-            startTime = time(0);
-            numOfSteps += (steps*multi);
-  printf("Opening Small Error\n"); //Removing these print statements caused the program to not behave properly
-        }
-        else if(flowRate > (targetFlow + smallError)){
-            steps = 200;
-            multi = 1;
-            if((numOfSteps-(steps*multi)) < 0){
-                steps += ((numOfSteps-(steps*multi)) / multi);
+            if(profileStep.done){
+                profileDone = true;
+                HotPathLeave();
+                break;
+            }
+            target = profileStep.target;
+            if(shiftFeedforward && feedforward >= 0 && profileStep.feedforward != feedforward){
+                //move with the setpoint rather than wait for the error to show
+                int steps = profileStep.feedforward - feedforward;
+                FlowControllerShift(&controller, &control, steps);
+                RetargetValve(valve, valve->numOfSteps + steps);
             }
-            TurnMotor('F', steps, multi);
+            feedforward = profileStep.feedforward;
+        }
+        FlowControlAction action = FlowControllerStep(&controller, &control, &valve->valveTable, target,
+                                                      flowRate, valve->numOfSteps, now - lastSample);
+        lastSample = now;
+        //Handle Small Error with the legacy relative move
+        if(action.move && control.mode == FLOW_CONTROL_DEADBAND){
+            int steps = action.position - valve->numOfSteps;
+            TurnMotor(valve, steps > 0 ? 'B' : 'F', steps > 0 ? steps : -steps, 1);
+            startTime = time(0);
+            valve->numOfSteps = action.position;
+            logQueue.Printf(LOG_INFO, "Valve %d: %s %d steps for a small error", valve->channel, steps > 0 ? "opening" : "closing",
+                            steps > 0 ? steps : -steps);
+        }
+        else if(action.move){
+            RetargetValve(valve, action.position);
             startTime = time(0);
-            numOfSteps -= (steps*multi);
-  printf("Closing Small Error\n"); //Removing these print statements caused the program to not behave properly
         }
-        usleep(1000000); //sleep for 1 second
+        int64_t stepTookNs = TraceNowNs() - stepNs;
+        TraceRecord("control step", stepNs, stepTookNs, valve->channel);
+        if(stepTookNs > CONTROL_STALL_US * 1000LL){
+            TraceAnomaly("a slow control step");
+        }
+        HotPathLeave();
+        //wake on the deadline even if the step ran long, and earlier if the profile has something due
+        period = action.period;
+        int64_t deadlineNs = stepNs + (int64_t)(action.period * 1e9);
+        if(profile != NULL){
+            int64_t dueNs = FlowProfileNextDeadline(&profileRun, profile, TraceNowNs(), flowRate);
+            deadlineNs = dueNs < deadlineNs ? dueNs : deadlineNs;
+        }
+        SleepUntilNs(deadlineNs);
 
     }//end of while loop
-
+    if(profileDone){
+        //the profile has ended: close the valve and wait for it
+        MoveToPosition(valve, 0);
+        logQueue.Printf(LOG_INFO, "Valve %d: profile finished after %.1f s, %.1f mL delivered, segments started at most %.0f ms late",
+                        valve->channel, profileRun.lastTime, profileRun.volume, profileRun.maxLateS * 1000.0);
+    }
+    else{
+        //stop a correction that is still under way where it is
+        AbortMotion(valve);
+    }
+    PublishStatus(valve, flowRate, false);
+    TraceThreadEnd();
+    return NULL;
 }//end of MasterLogic
 /*!
  * \brief Sends a message to the Teensy to turn the motor.
@@ -167,30 +783,20 @@ gpointer MasterLogic()
 * \param stepMultiplier indicates how many times numOfSteps should be executed.
 * \details Sends a message to the Teensy and then waits for a response. If the correct response is recieved this function returns true.
  */
-bool TurnMotor(char motorDirection, int numOfSteps, int stepMultiplier)
+bool TurnMotor(Valve_Controller *valve, char motorDirection, int numOfSteps, int stepMultiplier)
 {
     if(!(motorDirection == 'F' || motorDirection == 'B')){
         return false;
     }
-    int length_send_buff = 7;				//Length of the package to be sent to the Teensy
-    char send_buff[length_send_buff];		//Character array to hold the package that will be sent to the Teensy
-
-    //Set up the buffer with the start byte, packet size, command byte, and checksum
-    send_buff[0] = PACKET_START_BYTE;
-    send_buff[1] = length_send_buff;
-    send_buff[2] = MOTOR_COMMAND;
-    send_buff[3] = motorDirection;
-    send_buff[4] = numOfSteps;
-    send_buff[5] = stepMultiplier;
-    send_buff[6] = send_buff[0] ^ send_buff[1];
-    send_buff[6] = send_buff[6] ^ send_buff[2];
-    send_buff[6] = send_buff[6] ^ send_buff[3];
-    send_buff[6] = send_buff[6] ^ send_buff[4];
-    send_buff[6] = send_buff[6] ^ send_buff[5];    
-    //this is how you send an array out on the serial port:
-    write(ser_teensy1, send_buff, length_send_buff);
-
-    if(GetSerialPacket() == 1){
+    TraceScope trace("TurnMotor", numOfSteps * stepMultiplier);
+    unsigned char payload[4];		//Holds the command sent to the Teensy
+    payload[0] = MOTOR_COMMAND;
+    payload[1] = motorDirection;
+    payload[2] = numOfSteps;
+    payload[3] = stepMultiplier;
+    SendChannelPacket(valve, sizeof(payload), payload);
+
+    if(GetSerialPacket(valve) == 1){
         return true;
     }
     else{
@@ -202,140 +808,302 @@ bool TurnMotor(char motorDirection, int numOfSteps, int stepMultiplier)
  * \param System time
  * \details Using the system time parameter, this function will return the flow rate since that time.
  */
-double GetFlow(time_t startTime)
+double GetFlow(Valve_Controller *valve, time_t startTime)
 {
+    TraceScope trace("flow request", valve->channel);
     time_t endTime;
     double flowRate;
-    int length_send_buff = 4;				//Length of the package to be sent to the Teensy
-    char send_buff[length_send_buff];		//Character array to hold the package that will be sent to the Teensy
-    //Set up the buffer with the start byte, packet size, command byte, and checksum
-    send_buff[0] = PACKET_START_BYTE;
-    send_buff[1] = length_send_buff;
-    send_buff[2] = FLOW_COMMAND;
-    send_buff[3] = send_buff[0] ^ send_buff[1];
-    send_buff[3] = send_buff[3] ^ send_buff[2];
-    //this is how you send an array out on the serial port:
-    write(ser_teensy1, send_buff, length_send_buff);
-
-    flowRate = GetSerialPacket();
-    endTime = time(0);
-    if((endTime - startTime) == 0){
+    if(teensyInfo.useTimedFlow){
+        //the Teensy measures the window itself, so the rate does not depend on whole seconds of host time
+        unsigned char request = TIMED_FLOW_COMMAND;
+        unsigned char packet[PACKET_MAX_BYTES];
+        SendChannelPacket(valve, 1, &request);
+        while(!kill_all_threads){
+            unsigned int packetSize = ReceivePacket(valve, packet, FLOW_REPLY_TIMEOUT_US);
+            if(packetSize == 0){
+                //the request or the reply was lost; ask again rather than stall the loop
+                SendChannelPacket(valve, 1, &request);
+                continue;
+            }
+            if(packetSize == TIMED_FLOW_BYTES + PACKET_OVERHEAD_BYTES && packet[2] == TIMED_FLOW_COMMAND){
+                unsigned long pulses = GetU32(packet + 2 + TIMED_FLOW_PULSES_OFFSET);
+                unsigned long windowUs = GetU32(packet + 2 + TIMED_FLOW_WINDOW_OFFSET);
+                return TimedFlow(pulses, windowUs, teensyInfo.sensor);
+            }
+        }
         return 0.0;
     }
-    flowRate = (flowRate * 6.50) / (endTime - startTime);
-    return flowRate;
+    unsigned char request = FLOW_COMMAND;
+    SendChannelPacket(valve, 1, &request);
+
+    flowRate = GetSerialPacket(valve);
+    endTime = time(0);
+    return CountFlow(flowRate, endTime - startTime, teensyInfo.sensor);
 }
 /*!
- * \brief Validates a packet
- * \param Size of the packet and a pointer to the packet
- * \details This function validates a packet recieved from the Teensy.
+ * \brief Reads the flow filtered on the Teensy
+ * \param rawFlow receives the unfiltered flow in mL/s if it is not NULL
+ * \param sampleNs receives the host monotonic time in nanoseconds the Teensy read the rates at if it is not NULL
+ * \details Returns the Kalman filtered flow in mL/s. Unlike GetFlow, this does not depend on how long ago the flow was last read.
+ * Once the clocks are synced the time of the sample comes from the Teensy and the time the request and the reply spent on the link are kept in the valve; until then the sample is timed when it arrived.
  */
-bool validatePacket(unsigned int packetSize, unsigned char *packet)
+double GetFilteredFlow(Valve_Controller *valve, double *rawFlow, int64_t *sampleNs)
 {
-    //check the packet size      
-    if(packetSize < PACKET_MIN_BYTES || packetSize > PACKET_MAX_BYTES){
-        return false;
+    TraceScope trace("rate request", valve->channel);
+    unsigned char request = RATE_COMMAND;
+    unsigned char packet[PACKET_MAX_BYTES];
+    int64_t sentNs = (int64_t)(MonotonicSeconds() * 1e9);
+    SendChannelPacket(valve, 1, &request);
+    while(!kill_all_threads){
+        int64_t receivedNs;
+        unsigned int packetSize = ReceivePacketAt(valve, packet, FLOW_REPLY_TIMEOUT_US, &receivedNs);
+        if(packetSize == 0){
+            //the request or the reply was lost; ask again rather than stall the loop
+            sentNs = (int64_t)(MonotonicSeconds() * 1e9);
+            SendChannelPacket(valve, 1, &request);
+            continue;
+        }
+        if(packetSize == RATE_BYTES + PACKET_OVERHEAD_BYTES && packet[2] == RATE_COMMAND){
+            int64_t takenNs = receivedNs;
+            valve->uplinkUs = -1;
+            valve->downlinkUs = -1;
+            if(teensyInfo.useClockSync && deviceClock.IsSynced()){
+                takenNs = deviceClock.ToHostNs(GetU32(packet + 2 + RATE_TIME_OFFSET));
+                valve->downlinkUs = (takenNs - sentNs) / 1000;
+                valve->uplinkUs = (receivedNs - takenNs) / 1000;
+            }
+            if(sampleNs != NULL){
+                *sampleNs = takenNs;
+            }
+            if(rawFlow != NULL){
+                *rawFlow = RateFlow(GetU32(packet + 2 + RATE_RAW_OFFSET), teensyInfo.sensor);
+            }
+            return RateFlow(GetU32(packet + 2 + RATE_KALMAN_OFFSET), teensyInfo.sensor);
+        }
     }
-    //check the start byte
-    if(packet[0] != PACKET_START_BYTE){
+    return 0.0;
+}
+/*!
+ * \brief Sends a packet to the Teensy
+ * \param payloadSize is the number of payload bytes, starting with the command byte
+ * \param payload points to the command byte and the data that follows it
+ * \details Adds the start byte, length and checksum around the payload and writes it to the serial port.
+ */
+bool SendPacket(unsigned int payloadSize, const unsigned char *payload)
+{
+    unsigned int packetSize = payloadSize + PACKET_OVERHEAD_BYTES;
+    if(packetSize > PACKET_MAX_BYTES){
         return false;
     }
-    //check the length byte
-    if(packet[1] != packetSize){
-        return false;
+    unsigned char packet[PACKET_MAX_BYTES];	//Holds the package that will be sent to the Teensy
+    packet[0] = PACKET_START_BYTE;
+    packet[1] = packetSize;
+    unsigned char checksum = packet[0] ^ packet[1];
+    for(unsigned int i = 0; i < payloadSize; i++){
+        packet[i + 2] = payload[i];
+        checksum = checksum ^ payload[i];
     }
-    //compute the checksum
-    char checksum = 0x00;		//The calculated checksum of the packet
-    for(unsigned int i = 0; i < packetSize - 1; i++){
-        checksum = checksum ^ packet[i];
+    packet[packetSize - 1] = checksum;
+    //the valves share the port, so keep their packets from interleaving
+    TraceScope trace("tx frame", payload[0]);
+    g_mutex_lock(serial_write_mutex);
+    bool written = write(ser_teensy1, packet, packetSize) == (ssize_t)packetSize;
+    serialCapture.Record(SERIAL_TO_TEENSY, packet, packetSize, (int64_t)(MonotonicSeconds() * 1e9));
+    g_mutex_unlock(serial_write_mutex);
+    if(trace.ElapsedNs() > WRITE_STALL_US * 1000LL){
+        TraceAnomaly("a slow write to the port");
+    }
+    return written;
+}
+/*!
+ * \brief Sends a packet to one valve on the Teensy
+ * \param valve is the valve the command is for
+ * \param payloadSize is the number of payload bytes, starting with the command byte
+ * \param payload points to the command byte and the data that follows it
+ * \details Commands for channel 0 are sent as they are so firmware without channels still understands them. Commands for the other channels are wrapped in a CHANNEL_COMMAND packet.
+ */
+bool SendChannelPacket(Valve_Controller *valve, unsigned int payloadSize, const unsigned char *payload)
+{
+    if(valve->channel == 0){
+        return SendPacket(payloadSize, payload);
     }
-    // check to see if the computed checksum and packet checksum are equal
-    if(packet[packetSize - 1] != checksum){
+    unsigned char wrapped[PACKET_MAX_BYTES];	//Holds the command inside the channel wrapper
+    if(payloadSize + CHANNEL_INNER_OFFSET > PACKET_MAX_BYTES - PACKET_OVERHEAD_BYTES){
         return false;
     }
-    // all validation checks passed, the packet is valid
-    return true;
+    wrapped[0] = CHANNEL_COMMAND;
+    wrapped[CHANNEL_INDEX_OFFSET] = valve->channel;
+    memcpy(wrapped + CHANNEL_INNER_OFFSET, payload, payloadSize);
+    return SendPacket(payloadSize + CHANNEL_INNER_OFFSET, wrapped);
 }
 /*!
- * \brief Function that recieves a packet from the Teensy
- * \details This function collects a packet from the Teensy, validates it, and then returns the important information from it. 
+ * \brief Function that recieves a raw packet from the Teensy
+ * \param packet must hold at least PACKET_MAX_BYTES bytes
+ * \param receivedNs receives the host monotonic time in nanoseconds the last byte of the packet was read
+ * \details Collects bytes from the Teensy until a valid packet has been received and returns its size. Returns 0 once the read thread is told to stop. Only Serial_Read_Thread reads the port; everything else waits on the frames it hands out.
  */
-int GetSerialPacket()
+unsigned int ReadPacket(unsigned char *packet, int64_t *receivedNs)
 {
     ssize_t r_res;
     char ob[50];					//Holds the bytes of the package sent by the Teensy
-    unsigned int count=0;		// Counts how many bytes of the current package have been recieved
-    static unsigned char buffer[PACKET_MAX_BYTES];	//Holds the full package recieved from the Teensy
-    unsigned int packetSize = PACKET_MIN_BYTES;		//Holds the size of the packet recieved from the Teensy
+    FrameParser parser;				//Reassembles the packet from the bytes
 
     //Continuously listen for packets from teensy
-    while(!kill_all_threads){  
+    while(!kill_read_thread){
         if(ser_teensy1!=-1){  
             r_res = read(ser_teensy1,ob,1);
             if(r_res==0){
+                //the port is quiet; write out the bytes the capture was holding back for more
+                serialCapture.FlushIdle((int64_t)(MonotonicSeconds() * 1e9));
                 usleep(BETWEEN_CHARACTERS_TIMEOUT_US);
             }
             else if(r_res<0){
-                cerr<<"Read error:"<<(int)errno<<" ("<<strerror(errno)<<")"<<endl;
+                logQueue.Printf(LOG_ERROR, "Read error:%d (%s)", errno, strerror(errno));
+                usleep(BETWEEN_CHARACTERS_TIMEOUT_US);
             }
             //this means we have received a byte, the byte is in ob[0]
             else{
-                //handle the byte according to the current count
-                if(count == 0 && ob[0] == PACKET_START_BYTE){
-                    //this byte signals the beginning of a new packet
-                    buffer[count] = ob[0];
-                    count++;
-  	            continue;
-                }
-       	        else if(count == 0){
-                    //the first byte is not valid, ignore it and continue
-       	            continue;
-       	        }
-       	        else if(count == 1){    
-                    //this byte contains the overall packet length
-       	            buffer[count] = ob[0];
-                    //reset the count if the packet length is not in range
-                    if(buffer[count] < PACKET_MIN_BYTES || buffer[count] > PACKET_MAX_BYTES){  
-                        count = 0;
-                    }
-                    else{  //Otherwise store the packet size and increment count
-                        packetSize = ob[0];
-                        count++;
-                    }
-                    continue;
-                }  
-                else if(count < packetSize){ //If the byte is part of the payload
-                    //store the byte
-                    buffer[count] = ob[0];
-                    count++;
+                *receivedNs = (int64_t)(MonotonicSeconds() * 1e9);
+                serialCapture.Record(SERIAL_FROM_TEENSY, (const uint8_t *)ob, 1, *receivedNs);
+                if(parser.Feed(ob[0])){
+                    TraceInstant("rx frame", parser.Packet()[2]);
+                    memcpy(packet, parser.Packet(), parser.Size());
+                    return parser.Size();
                 }
-                //check to see if we have acquired enough bytes for a full packet
-                if(count >= packetSize){
-                    if(validatePacket(packetSize, buffer)){  //If the packet is valid,
-                        //Use the data from the packet
-                        if(buffer[2] == 'M'){
-                            return 1;
-                        }
-                        else if(buffer[2] == 'F'){
-                            return (buffer[3] + (buffer[4]*256));
-                        }
-                        else if(buffer[2] == 'T'){
-                            return 1007;
-                        }
-                        else{
-                            return 0;
-                        }
-                    }
-                    //reset the count
-                    count = 0;
-                }  
             }
         }
-        else
+        else{
             usleep(READ_THREAD_SLEEP_DURATION_US);
+        }
     }
     return 0;
 }
+/*!
+ * \brief Reads packets from the Teensy and hands each one to the valve it belongs to
+ * \details Frames wrapped in a CHANNEL_COMMAND packet are unwrapped into an ordinary packet and queued for their channel; everything else belongs to channel 0. Each frame is queued with the time it was read. Clock sync replies go straight to deviceClock instead, so their time is not held up by a queue. Runs until kill_read_thread is set.
+ */
+gpointer Serial_Read_Thread()
+{
+    unsigned char packet[PACKET_MAX_BYTES];	//Holds the packet recieved from the Teensy
+    unsigned char frame[PACKET_MAX_BYTES];	//Holds a packet unwrapped from a CHANNEL_COMMAND packet
+    unsigned int packetSize;
+    int64_t receivedNs;
+    TraceThreadStart("serial read");
+    HotPathEnter("Serial_Read_Thread");
+    while((packetSize = ReadPacket(packet, &receivedNs)) != 0){
+        if(packet[2] == SYNC_COMMAND && packetSize == SYNC_BYTES + PACKET_OVERHEAD_BYTES){
+            deviceClock.AddReply(GetU32(packet + 2 + SYNC_SEQUENCE_OFFSET), GetU32(packet + 2 + SYNC_RECEIVE_OFFSET),
+                                 GetU32(packet + 2 + SYNC_TRANSMIT_OFFSET), receivedNs);
+            continue;
+        }
+        if(packet[2] != CHANNEL_COMMAND){
+            valves[0].frames.Push(packet, packetSize, receivedNs);
+            continue;
+        }
+        unsigned int payloadSize = packetSize - PACKET_OVERHEAD_BYTES;
+        if(payloadSize <= CHANNEL_INNER_OFFSET || packet[2 + CHANNEL_INDEX_OFFSET] >= numValves){
+            continue;
+        }
+        payloadSize -= CHANNEL_INNER_OFFSET;
+        frame[0] = PACKET_START_BYTE;
+        frame[1] = payloadSize + PACKET_OVERHEAD_BYTES;
+        unsigned char checksum = frame[0] ^ frame[1];
+        for(unsigned int i = 0; i < payloadSize; i++){
+            frame[i + 2] = packet[2 + CHANNEL_INNER_OFFSET + i];
+            checksum = checksum ^ frame[i + 2];
+        }
+        frame[payloadSize + 2] = checksum;
+        valves[packet[2 + CHANNEL_INDEX_OFFSET]].frames.Push(frame, payloadSize + PACKET_OVERHEAD_BYTES, receivedNs);
+    }
+    HotPathLeave();
+    TraceThreadEnd();
+    return NULL;
+}
+/*!
+ * \brief Keeps deviceClock in step with the Teensy
+ * \details Sends a burst of SYNC_COMMAND requests to get a first estimate quickly, then one every CLOCK_SYNC_PERIOD_US so the drift can be followed. Serial_Read_Thread hands the replies to deviceClock as they arrive. Runs until kill_all_threads is set.
+ */
+gpointer Clock_Sync_Thread()
+{
+    unsigned char request[SYNC_REQUEST_BYTES];
+    int sent = 0;
+    TraceThreadStart("clock sync");
+    while(!kill_all_threads){
+        request[0] = SYNC_COMMAND;
+        PutU32(request + SYNC_SEQUENCE_OFFSET, deviceClock.NextRequest((int64_t)(MonotonicSeconds() * 1e9)));
+        TraceInstant("sync request", GetU32(request + SYNC_SEQUENCE_OFFSET));
+        SendPacket(sizeof(request), request);
+        sent++;
+        long waitUs = sent < CLOCK_SYNC_BURST ? CLOCK_SYNC_BURST_GAP_US : CLOCK_SYNC_PERIOD_US;
+        for(long waitedUs = 0; waitedUs < waitUs && !kill_all_threads; waitedUs += RECEIVE_POLL_US){
+            usleep(RECEIVE_POLL_US);
+        }
+    }
+    TraceThreadEnd();
+    return NULL;
+}
+/*!
+ * \brief Waits for the next packet from one valve
+ * \param valve is the valve to wait on
+ * \param packet must hold at least PACKET_MAX_BYTES bytes
+ * \param timeoutUs is how long to wait for a valid packet, or a negative number to wait until the threads are killed
+ * \details Returns the size of the packet, or 0 if none arrived in time. A bounded wait runs to its timeout even after the threads are killed, so a thread can still collect the reply to its last command on the way out.
+ */
+unsigned int ReceivePacket(Valve_Controller *valve, unsigned char *packet, long timeoutUs)
+{
+    return ReceivePacketAt(valve, packet, timeoutUs, NULL);
+}
+/*!
+ * \brief Waits for the next packet from one valve and tells when it was read
+ * \param receivedNs receives the host monotonic time in nanoseconds the packet was read from the port if it is not NULL
+ * \details Otherwise the same as ReceivePacket.
+ */
+unsigned int ReceivePacketAt(Valve_Controller *valve, unsigned char *packet, long timeoutUs, int64_t *receivedNs)
+{
+    TraceScope trace("wait frame", valve->channel);
+    long waitedUs = 0;			//How long we have waited for a packet so far
+    while(timeoutUs < 0 ? !kill_all_threads : waitedUs < timeoutUs){
+        long sliceUs = RECEIVE_POLL_US;
+        if(timeoutUs >= 0 && timeoutUs - waitedUs < sliceUs){
+            sliceUs = timeoutUs - waitedUs;
+        }
+        unsigned int packetSize = valve->frames.Pop(packet, sliceUs, receivedNs);
+        if(packetSize != 0){
+            return packetSize;
+        }
+        waitedUs += sliceUs;
+    }
+    return 0;
+}
+/*!
+ * \brief Function that recieves a packet from the Teensy
+ * \details This function collects a packet from the Teensy, validates it, and then returns the important information from it. 
+ */
+int GetSerialPacket(Valve_Controller *valve)
+{
+    TraceScope trace("GetSerialPacket", valve->channel);
+    unsigned char buffer[PACKET_MAX_BYTES];	//Holds the full package recieved from the Teensy
+
+    //skip frames the Teensy sends on its own, such as flow loop status
+    do{
+        if(ReceivePacket(valve, buffer, -1) == 0){
+            return 0;
+        }
+    }while(IsStreamFrame(buffer[2]));
+    //Use the data from the packet
+    if(buffer[2] == MOTOR_COMMAND){
+        return 1;
+    }
+    else if(buffer[2] == FLOW_COMMAND){
+        return (buffer[3] + (buffer[4]*256));
+    }
+    else if(buffer[2] == TEST_COMMAND){
+        return 1007;
+    }
+    else{
+        return 0;
+    }
+}
 /*!
  * \brief Callback for when the FullyClose button is clicked
  * \param Standard parameters for callback function
@@ -343,7 +1111,7 @@ int GetSerialPacket()
  */
 extern "C" void FO_Button_Clicked(GtkWidget *p_wdgt, gpointer p_data )
 {
-    FullyOpen();
+    FullyOpen(&valves[0]);
 }
 /*!
  * \brief Callback for when the FullyClose button is clicked
@@ -352,34 +1120,70 @@ extern "C" void FO_Button_Clicked(GtkWidget *p_wdgt, gpointer p_data )
  */
 extern "C" void FC_Button_Clicked(GtkWidget *p_wdgt, gpointer p_data )
 {
-    FullyClose();
+    FullyClose(&valves[0]);
+}
+/*!
+ * \brief Callback for when the FullyOpen button of the second valve is clicked
+ * \param Standard parameters for callback function
+ * \details Fully opens the second valve.
+ */
+extern "C" void FO2_Button_Clicked(GtkWidget *p_wdgt, gpointer p_data )
+{
+    if(numValves > 1){
+        FullyOpen(&valves[1]);
+    }
+}
+/*!
+ * \brief Callback for when the FullyClose button of the second valve is clicked
+ * \param Standard parameters for callback function
+ * \details Fully closes the second valve.
+ */
+extern "C" void FC2_Button_Clicked(GtkWidget *p_wdgt, gpointer p_data )
+{
+    if(numValves > 1){
+        FullyClose(&valves[1]);
+    }
+}
+/*!
+ * \brief Enables or disables the buttons that move the valves by hand
+ */
+void SetManualButtons(gboolean sensitive)
+{
+    gtk_widget_set_sensitive (gui_app->FCloseButton,sensitive);
+    gtk_widget_set_sensitive (gui_app->FOpenButton,sensitive);
+    gtk_widget_set_sensitive (gui_app->FCloseButton2,sensitive && numValves > 1);
+    gtk_widget_set_sensitive (gui_app->FOpenButton2,sensitive && numValves > 1);
+    gtk_widget_set_sensitive (gui_app->TargetFlowInput2,sensitive && numValves > 1);
 }
 /*!
  * \brief Callback for when the Start button is clicked
  * \param Standard parameters for callback function
- * \details Creates a MasterLogic thread if there isn't one already and then disables all buttons except the exit button and enables the pause button.
+ * \details Creates a MasterLogic thread for every valve with a target flow that does not have one already and then disables all buttons except the exit button and enables the pause button.
  */
 extern "C" void Start_Button_Clicked(GtkWidget *p_wdgt, gpointer p_data ) 
 {
+    GtkWidget *targetInputs[MAX_VALVES] = {gui_app->TargetFlowInput, gui_app->TargetFlowInput2};
+    bool started = false;
     g_mutex_lock(master_logic_mutex);
-    targetFlow = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(gui_app->TargetFlowInput));
-    if(targetFlow > 0){
-        if(makeMLThread){
-            makeMLThread = false;
-            //this is how you disable a button:
-            gtk_widget_set_sensitive (gui_app->StartButton,FALSE);
-            gtk_widget_set_sensitive (gui_app->FCloseButton,FALSE);
-            gtk_widget_set_sensitive (gui_app->FOpenButton,FALSE);
-            //this is how you enable a button:
-            gtk_widget_set_sensitive (gui_app->PauseButton,TRUE);
-
-            // this is used to signal all threads to exit
-            kill_all_threads=false;
-            GThread *master_thread;
-            //spawn the master logic thread
-            master_thread = g_thread_new(NULL,(GThreadFunc)MasterLogic,NULL);
+    // this is used to signal all threads to exit
+    kill_all_threads=false;
+    for(int i = 0; i < numValves; i++){
+        Valve_Controller *valve = &valves[i];
+        valve->targetFlow = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(targetInputs[i]));
+        if(valve->targetFlow > 0 && valve->makeMLThread){
+            valve->makeMLThread = false;
+            //spawn the master logic thread of the valve
+            g_thread_unref(g_thread_new(NULL,(GThreadFunc)MasterLogic,valve));
+            started = true;
         }
     }
+    if(started){
+        //this is how you disable a button:
+        gtk_widget_set_sensitive (gui_app->StartButton,FALSE);
+        SetManualButtons(FALSE);
+        //this is how you enable a button:
+        gtk_widget_set_sensitive (gui_app->PauseButton,TRUE);
+    }
     g_mutex_unlock(master_logic_mutex);
 
 }
@@ -393,10 +1197,11 @@ extern "C" void Pause_Button_Clicked(GtkWidget *p_wdgt, gpointer p_data )
     g_mutex_lock(master_logic_mutex);
     kill_all_threads=true;
     gtk_widget_set_sensitive (gui_app->StartButton,TRUE);
-    gtk_widget_set_sensitive (gui_app->FCloseButton,TRUE);
-    gtk_widget_set_sensitive (gui_app->FOpenButton,TRUE);
+    SetManualButtons(TRUE);
     gtk_widget_set_sensitive (gui_app->PauseButton,FALSE);
-    makeMLThread = true;
+    for(int i = 0; i < numValves; i++){
+        valves[i].makeMLThread = true;
+    }
     g_mutex_unlock(master_logic_mutex);
 }
 
@@ -414,6 +1219,27 @@ extern "C" void button_exit_clicked(GtkWidget *p_wdgt, gpointer p_data )
   gtk_main_quit();
 }
 
+bool HandshakeTeensy();
+
+/*!
+ * \brief Sends the flow filter settings for one valve to the Teensy
+ * \details The Kalman estimate feeds both the on-device loop and GetFilteredFlow.
+ */
+bool ConfigureFilters(Valve_Controller *valve)
+{
+  unsigned char payload[FILTER_CONFIG_BYTES];	//Holds the command sent to the Teensy
+  payload[0] = FILTER_CONFIG_COMMAND;
+  payload[FILTER_CONFIG_AVERAGE_OFFSET] = FILTER_AVERAGE_LENGTH;
+  PutU16(payload + FILTER_CONFIG_ALPHA_OFFSET, FILTER_IIR_ALPHA);
+  PutU32(payload + FILTER_CONFIG_Q_OFFSET, FILTER_KALMAN_Q);
+  PutU32(payload + FILTER_CONFIG_R_OFFSET, FILTER_KALMAN_R);
+  payload[FILTER_CONFIG_LOOP_OFFSET] = FILTER_KALMAN;
+  return SendChannelPacket(valve, FILTER_CONFIG_BYTES, payload);
+}
+
+/*!
+ * \brief Opens the serial port to the Teensy and performs the handshake
+ */
 bool ConnectTeensy()
 {
   //do not change  the next few lines
@@ -433,23 +1259,150 @@ bool ConnectTeensy()
   tcflush(ser_teensy1, TCIFLUSH);
   tcsetattr(ser_teensy1,TCSANOW,&my_serial);
   //You can add code beyond this line but do not change anything above this line
-  int length_send_buff = 4;				//Length of the package to be sent to the Teensy
-  char send_buff[length_send_buff];		//Character array to hold the package that will be sent to the Teensy
-  //Set up the buffer with the start byte, packet size, command byte, and checksum
-  send_buff[0] = PACKET_START_BYTE;
-  send_buff[1] = length_send_buff;
-  send_buff[2] = TEST_COMMAND;
-  send_buff[3] = send_buff[0] ^ send_buff[1];
-  send_buff[3] = send_buff[3] ^ send_buff[2];
-  //this is how you send an array out on the serial port:
-  write(ser_teensy1, send_buff, length_send_buff);
-
-  if(GetSerialPacket() == 1007){
+  return HandshakeTeensy();
+}
+
+/*!
+ * \brief Asks the Teensy who it is and what it supports
+ * \details Sends the hello command and fills in teensyInfo from the reply. Firmware that does not answer the hello is tried with the legacy test command, in which case only the version 1 protocol is used.
+ */
+bool HandshakeTeensy()
+{
+  unsigned char packet[PACKET_MAX_BYTES];	//Holds the reply from the Teensy
+  unsigned char command = HELLO_COMMAND;
+  unsigned int packetSize;
+
+  memset(&teensyInfo, 0, sizeof(teensyInfo));
+  SendPacket(1, &command);
+  packetSize = ReceivePacket(&valves[0], packet, HELLO_TIMEOUT_US);
+  if(packetSize >= HELLO_COMMANDS_OFFSET + PACKET_OVERHEAD_BYTES && packet[2] == HELLO_COMMAND){
+    unsigned char *payload = packet + 2;
+    teensyInfo.protocolVersion = payload[HELLO_PROTOCOL_OFFSET];
+    teensyInfo.firmwareMajor = payload[HELLO_FW_MAJOR_OFFSET];
+    teensyInfo.firmwareMinor = payload[HELLO_FW_MINOR_OFFSET];
+    teensyInfo.serialNumber = GetU32(payload + HELLO_SERIAL_OFFSET);
+    teensyInfo.maxStepRate = GetU16(payload + HELLO_STEP_RATE_OFFSET);
+    teensyInfo.features = GetU32(payload + HELLO_FEATURES_OFFSET);
+    teensyInfo.numCommands = payload[HELLO_NUM_COMMANDS_OFFSET];
+    if(teensyInfo.numCommands > (int)sizeof(teensyInfo.commands)){
+      teensyInfo.numCommands = sizeof(teensyInfo.commands);
+    }
+    if(HELLO_COMMANDS_OFFSET + teensyInfo.numCommands > packetSize - PACKET_OVERHEAD_BYTES){
+      teensyInfo.numCommands = packetSize - PACKET_OVERHEAD_BYTES - HELLO_COMMANDS_OFFSET;
+    }
+    memcpy(teensyInfo.commands, payload + HELLO_COMMANDS_OFFSET, teensyInfo.numCommands);
+    teensyInfo.numChannels = 1;
+    if((teensyInfo.features & FEATURE_CHANNELS) &&
+       HELLO_COMMANDS_OFFSET + teensyInfo.numCommands < packetSize - PACKET_OVERHEAD_BYTES){
+      teensyInfo.numChannels = payload[HELLO_COMMANDS_OFFSET + teensyInfo.numCommands];
+    }
+    numValves = teensyInfo.numChannels < MAX_VALVES ? teensyInfo.numChannels : MAX_VALVES;
+    if(numValves < 1){
+      numValves = 1;
+    }
+    teensyInfo.sensor = HelloFlowSensor(payload, packetSize - PACKET_OVERHEAD_BYTES);
+    //pick the fastest features both sides support
+    teensyInfo.useTimedFlow = (teensyInfo.features & FEATURE_TIMED_FLOW) != 0;
+    teensyInfo.useFilteredRate = (teensyInfo.features & FEATURE_FILTERED_RATE) != 0;
+    teensyInfo.usePreemptibleMove = (teensyInfo.features & FEATURE_PREEMPTIBLE_MOVE) != 0;
+    teensyInfo.useClockSync = (teensyInfo.features & FEATURE_CLOCK_SYNC) != 0;
+    deviceClock.Reset();
+    if(teensyInfo.useFilteredRate){
+      for(int i = 0; i < numValves; i++){
+        ConfigureFilters(&valves[i]);
+      }
+    }
+    printf("Connected to Teensy %lu: firmware %d.%d, protocol %d, %d valves, %d steps/s, %s flow sensor at %.3f mL/pulse\n",
+           teensyInfo.serialNumber, teensyInfo.firmwareMajor, teensyInfo.firmwareMinor,
+           teensyInfo.protocolVersion, numValves, teensyInfo.maxStepRate, teensyInfo.sensor.name,
+           CalibrationMlPerPulse(teensyInfo.sensor.nominalUl));
     return true;
   }
+
+  //fall back to the legacy handshake for old firmware
+  command = TEST_COMMAND;
+  SendPacket(1, &command);
+  while((packetSize = ReceivePacket(&valves[0], packet, LEGACY_TEST_TIMEOUT_US)) != 0){
+    if(packet[2] == TEST_COMMAND){
+      teensyInfo.protocolVersion = 1;
+      teensyInfo.numChannels = 1;
+      numValves = 1;
+      teensyInfo.sensor = FLOW_SENSOR_PROFILES[FLOW_SENSOR_LEGACY];
+      return true;
+    }
+  }
+  return false;
+}
+
+/*!
+ * \brief Dispenses a volume and closes the valve
+ * \param volumeMl is the volume to dispense in mL
+ * \details The Teensy opens the valve and starts closing it from the flow sensor interrupt as soon as the pulse total is reached, starting early by the overshoot it measured on earlier doses. Waits for the report, prints the achieved volume and the error, and returns false if the Teensy cannot dose or the wait was interrupted.
+ * The wait is bounded by the time the dose should take at the flow the valve table gives for the open valve, plus the travel of the valve both ways and a margin, so a lost report cancels the dose rather than hanging.
+ */
+bool DoseVolume(Valve_Controller *valve, double volumeMl)
+{
+  unsigned char payload[DOSE_BYTES];		//Holds the command sent to the Teensy
+  unsigned char packet[PACKET_MAX_BYTES];	//Holds the frames recieved from the Teensy
+  if(!(teensyInfo.features & FEATURE_DOSE) || volumeMl <= 0.0){
+    return false;
+  }
+  double mlPerPulse = CalibrationMlPerPulse(teensyInfo.sensor.nominalUl);	//The Teensy counts doses in units of its calibration
+  unsigned long targetPulses = (unsigned long)(volumeMl / mlPerPulse + 0.5);
+  if(targetPulses == 0){
+    targetPulses = 1;
+  }
+  payload[0] = DOSE_COMMAND;
+  PutU32(payload + DOSE_TARGET_OFFSET, targetPulses);
+  PutU32(payload + DOSE_EARLY_CLOSE_OFFSET, DOSE_AUTO_EARLY_CLOSE);
+  PutU16(payload + DOSE_OPEN_POSITION_OFFSET, DOSE_OPEN_POSITION);
+  SendChannelPacket(valve, DOSE_BYTES, payload);
+
+  double openFlow = valve->valveTable.numPoints >= 2 ? ValveTableFlow(&valve->valveTable, DOSE_OPEN_POSITION) : 0.0;
+  double travelS = teensyInfo.maxStepRate > 0 ? 2.0 * MAX_NUM_OF_STEPS / teensyInfo.maxStepRate : 0.0;
+  double timeoutS = volumeMl / (openFlow > DOSE_SLOWEST_FLOW ? openFlow : DOSE_SLOWEST_FLOW) + travelS + DOSE_TIMEOUT_MARGIN_S;
+  double startTime = MonotonicSeconds();
+  while(!kill_all_threads){
+    double waitedS = MonotonicSeconds() - startTime;
+    if(waitedS >= timeoutS){
+      cerr<<"No dose report after "<<timeoutS<<" s; cancelling the dose"<<endl;
+      break;
+    }
+    unsigned int packetSize = ReceivePacket(valve, packet, (long)((timeoutS - waitedS) * 1e6) + 1);
+    if(packetSize == DOSE_REPORT_BYTES + PACKET_OVERHEAD_BYTES && packet[2] == DOSE_REPORT_FRAME){
+      unsigned long trigger = GetU32(packet + 2 + DOSE_REPORT_TRIGGER_OFFSET);
+      unsigned long delivered = GetU32(packet + 2 + DOSE_REPORT_DELIVERED_OFFSET);
+      unsigned long closeUs = GetU32(packet + 2 + DOSE_REPORT_CLOSE_TIME_OFFSET);
+      double deliveredMl = PulseVolume(delivered, mlPerPulse);
+      valve->numOfSteps = 0;
+      printf("Dose: target %.1f mL (%lu pulses), closed at %lu pulses, delivered %.1f mL (%lu pulses), error %+.1f mL, close took %.1f ms\n",
+             volumeMl, targetPulses, trigger, deliveredMl, delivered, deliveredMl - volumeMl, closeUs / 1000.0);
+      PublishStatus(valve, 0.0, false);
+      return true;
+    }
+  }
+  //stop dispensing if we were interrupted or the report never came
+  payload[0] = DOSE_COMMAND;
+  PutU32(payload + DOSE_TARGET_OFFSET, 0);
+  SendChannelPacket(valve, DOSE_BYTES, payload);
   return false;
 }
 
+/*!
+ * \brief Blinks the LED on the Teensy so an operator can tell which board is connected
+ * \details Only sent when the firmware reported FEATURE_IDENTIFY during the handshake.
+ */
+bool IdentifyTeensy()
+{
+  unsigned char packet[PACKET_MAX_BYTES];	//Holds the reply from the Teensy
+  unsigned char command = IDENTIFY_COMMAND;
+  if(!(teensyInfo.features & FEATURE_IDENTIFY)){
+    return false;
+  }
+  SendPacket(1, &command);
+  return ReceivePacket(&valves[0], packet, HELLO_TIMEOUT_US) != 0 && packet[2] == IDENTIFY_COMMAND;
+}
+
 
 
 //********************************************************************
@@ -466,8 +1419,21 @@ int main(int argc, char **argv)
 {
   GtkBuilder *builder;
   GError *err = NULL;
-        sprintf(label_recieved_value,"%.2f", 0.00);
-  //GThread *read_thread;
+  GThread *read_thread;
+  GThread *sync_thread = NULL;
+
+  for(int i = 0; i < MAX_VALVES; i++){
+    valves[i].channel = i;
+    valves[i].targetFlow = 0;
+    valves[i].makeMLThread = true;
+    valves[i].numOfSteps = 0;
+    valves[i].shownFlow = 0.0;
+    valves[i].historyDue = false;
+    valves[i].pidTuned = false;
+    valves[i].plantIdentified = false;
+    valves[i].uplinkUs = -1;
+    valves[i].downlinkUs = -1;
+  }
 
   //this is how you allocate a Glib mutex
   g_assert(master_logic_mutex == NULL);
@@ -476,12 +1442,43 @@ int main(int argc, char **argv)
   g_assert(flow_label_mutex == NULL);
   flow_label_mutex = new GMutex;
   g_mutex_init(flow_label_mutex);
+  g_assert(serial_write_mutex == NULL);
+  serial_write_mutex = new GMutex;
+  g_mutex_init(serial_write_mutex);
 
   // this is used to signal all threads to exit
   kill_all_threads=false;
-  
+  kill_read_thread=false;
+
+  //record what the threads do from the start, and write it out on SIGUSR1 or a stall
+  const char *traceDirectory = NULL;
+  bool trace = true;
+  for(int i = 1; i < argc; i++){
+    if(strcmp(argv[i], "--trace-dir") == 0 && i + 1 < argc){
+      traceDirectory = argv[++i];
+    }
+    else if(strcmp(argv[i], "--no-trace") == 0){
+      trace = false;
+    }
+  }
+  TraceSetEnabled(trace);
+  TraceThreadStart("GTK main");
+  if(trace && TraceStartDumper(traceDirectory)){
+    signal(SIGUSR1, DumpTraceSignal);
+  }
+
+  //start the capture before the read thread so it holds the handshake too
+  for(int i = 1; i + 1 < argc; i++){
+    if(strcmp(argv[i], "--capture") == 0 && !serialCapture.Open(argv[i + 1], (int64_t)(MonotonicSeconds() * 1e9))){
+      cerr<<"Could not create the capture "<<argv[i + 1]<<endl;
+    }
+  }
+
+  //from here on the threads log through the queue so the console cannot hold them up
+  logQueue.Start();
+
   //spawn the serial read thread
-  //read_thread = g_thread_new(NULL,(GThreadFunc)Serial_Read_Thread,NULL);
+  read_thread = g_thread_new(NULL,(GThreadFunc)Serial_Read_Thread,NULL);
   
   // Now we initialize GTK+ 
   gtk_init(&argc, &argv);
@@ -520,8 +1517,152 @@ int main(int argc, char **argv)
 
   //Try to connect to the Teensy
   if(ConnectTeensy()){
-    //the main loop
-    gtk_main();
+    //map the Teensy's timestamps onto host time for as long as it is connected
+    if(teensyInfo.useClockSync){
+      sync_thread = g_thread_new(NULL,(GThreadFunc)Clock_Sync_Thread,NULL);
+    }
+    double doseMl = 0.0;
+    double autotuneFlow = 0.0;
+    double stepTestFlow = 0.0;
+    const char *profileName = NULL;
+    bool characterize = false;
+    int channel = 0;
+    for(int i = 0; i < numValves; i++){
+      Valve_Controller *valve = &valves[i];
+      char segmentName[32];
+      if(LoadValveTable(teensyInfo.serialNumber, valve->channel, &valve->valveTable)){
+        printf("Valve %d: loaded a %d point valve table\n", valve->channel, valve->valveTable.numPoints);
+      }
+      valve->pidTuned = LoadPidGains(teensyInfo.serialNumber, valve->channel, &valve->pidGains);
+      valve->plantIdentified = LoadPlantModel(teensyInfo.serialNumber, valve->channel, &valve->plantModel);
+      LoadFlowHistory(teensyInfo.serialNumber, valve->channel, &valve->history);
+      if(valve->pidTuned){
+        printf("Valve %d: loaded tuned gains kp %.3f ki %.3f kd %.3f\n", valve->channel,
+               valve->pidGains.kp, valve->pidGains.ki, valve->pidGains.kd);
+      }
+      if(valve->plantIdentified){
+        printf("Valve %d: loaded a plant model with a %.2f s dead time and a %.2f s time constant\n", valve->channel,
+               valve->plantModel.deadTime, valve->plantModel.timeConstant);
+      }
+      //let other local programs see the flow without going through the GUI
+      if(valve->channel == 0){
+        snprintf(segmentName, sizeof(segmentName), "%s", FLOW_STATUS_SHM_NAME);
+      }
+      else{
+        snprintf(segmentName, sizeof(segmentName), "%s%d", FLOW_STATUS_SHM_NAME, valve->channel);
+      }
+      valve->status_segment.Open(segmentName);
+    }
+    for(int i = 1; i < argc; i++){
+      //blink the LED on request so the operator can find the board
+      if(strcmp(argv[i], "--identify") == 0){
+        IdentifyTeensy();
+      }
+      else if(strcmp(argv[i], "--dose") == 0 && i + 1 < argc){
+        doseMl = atof(argv[++i]);
+      }
+      else if(strcmp(argv[i], "--characterize") == 0){
+        characterize = true;
+      }
+      else if(strcmp(argv[i], "--autotune") == 0 && i + 1 < argc){
+        autotuneFlow = atof(argv[++i]);
+      }
+      else if(strcmp(argv[i], "--step-test") == 0 && i + 1 < argc){
+        stepTestFlow = atof(argv[++i]);
+      }
+      else if(strcmp(argv[i], "--min-period") == 0 && i + 1 < argc){
+        loopRateConfig.minPeriod = atof(argv[++i]);
+      }
+      else if(strcmp(argv[i], "--max-period") == 0 && i + 1 < argc){
+        loopRateConfig.maxPeriod = atof(argv[++i]);
+      }
+      else if(strcmp(argv[i], "--profile") == 0 && i + 1 < argc){
+        profileName = argv[++i];
+      }
+      else if(strcmp(argv[i], "--mpc") == 0){
+        planMoves = true;
+      }
+      else if(strcmp(argv[i], "--sensor") == 0 && i + 1 < argc){
+        const FlowSensorProfile *sensor = FindFlowSensorByName(argv[++i]);
+        //the firmware counts doses in the units of the profile it was built with, so that one wins
+        if(teensyInfo.features & FEATURE_SENSOR_PROFILE){
+          cerr<<"Ignoring --sensor "<<argv[i]<<": the Teensy reports its flow sensor as "<<teensyInfo.sensor.name<<endl;
+        }
+        else if(sensor != NULL){
+          teensyInfo.sensor = *sensor;
+        }
+        else{
+          cerr<<"Unknown flow sensor "<<argv[i]<<"; the profiles are in flow_sensor.h"<<endl;
+        }
+      }
+      else if(strcmp(argv[i], "--channel") == 0 && i + 1 < argc){
+        channel = atoi(argv[++i]);
+      }
+      else if((strcmp(argv[i], "--capture") == 0 || strcmp(argv[i], "--trace-dir") == 0) && i + 1 < argc){
+        //already handled before connecting
+        i++;
+      }
+    }
+    if(channel < 0 || channel >= numValves){
+      cerr<<"The Teensy has no valve "<<channel<<endl;
+      channel = 0;
+      characterize = false;
+      autotuneFlow = 0.0;
+      stepTestFlow = 0.0;
+      profileName = NULL;
+      doseMl = 0.0;
+    }
+    Valve_Controller *valve = &valves[channel];
+    if(characterize){
+      //sweep the valve and store the table for this Teensy
+      if(CharacterizeValve(valve, &valve->valveTable) && SaveValveTable(teensyInfo.serialNumber, valve->channel, &valve->valveTable)){
+        printf("Saved a %d point valve table\n", valve->valveTable.numPoints);
+      }
+      else{
+        cerr<<"Valve characterization failed"<<endl;
+      }
+    }
+    else if(autotuneFlow > 0.0){
+      //run the relay experiment and store the gains for this Teensy
+      if(AutotuneValve(valve, autotuneFlow, &valve->pidGains) && SavePidGains(teensyInfo.serialNumber, valve->channel, &valve->pidGains)){
+        printf("Saved the tuned gains\n");
+      }
+      else{
+        cerr<<"Autotune failed"<<endl;
+      }
+    }
+    else if(stepTestFlow > 0.0){
+      //step the valve and store the fitted model for this Teensy
+      if(StepTestValve(valve, stepTestFlow, &valve->plantModel) && SavePlantModel(teensyInfo.serialNumber, valve->channel, &valve->plantModel)){
+        printf("Saved a plant model: gain %.4f mL/s per step, time constant %.2f s, dead time %.2f s\n",
+               valve->plantModel.gain, valve->plantModel.timeConstant, valve->plantModel.deadTime);
+      }
+      else{
+        cerr<<"Step test failed"<<endl;
+      }
+    }
+    else if(profileName != NULL){
+      //follow the profile unattended, without bringing up the GUI
+      static FlowProfile profile;
+      if(LoadFlowProfile(profileName, &profile)){
+        BuildFlowProfile(&profile, &valve->valveTable);
+        printf("Running a %d segment profile planned to take %.1f s\n", profile.numSegments, profile.duration);
+        valve->profile = &profile;
+        valve->makeMLThread = false;
+        MasterLogic(valve);
+        valve->profile = NULL;
+      }
+    }
+    else if(doseMl > 0.0){
+      //dispense the volume without bringing up the GUI
+      if(!DoseVolume(valve, doseMl)){
+        cerr<<"The Teensy could not dispense the dose"<<endl;
+      }
+    }
+    else{
+      //the main loop
+      gtk_main();
+    }
   }
   else{
     close(ser_teensy1);
@@ -529,10 +1670,25 @@ int main(int argc, char **argv)
     gtk_main_quit();
   }
 
-  //signal all threads to die and wait for them (only one child thread)
+  //signal all threads to die and wait for the serial read thread
   kill_all_threads=true;
-  //g_thread_join(read_thread);
+  if(sync_thread != NULL){
+    g_thread_join(sync_thread);
+  }
+  kill_read_thread=true;
+  g_thread_join(read_thread);
+  logQueue.Stop();
+  TraceStopDumper();
+  serialCapture.Close();
   
+  for(int i = 0; i < MAX_VALVES; i++){
+    valves[i].status_segment.Close();
+    //keep the last partial minute of the run
+    if(valves[i].history.NewestNs() != 0){
+      SaveFlowHistory(teensyInfo.serialNumber, valves[i].channel, &valves[i].history);
+    }
+  }
+
   //destroy gui if it still exists
   if(gui_app)
     g_slice_free(Gui_Window_AppWidgets, gui_app);
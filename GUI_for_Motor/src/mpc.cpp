@@ -0,0 +1,238 @@
+#include "mpc.h"
+#include "protocol.h"
+#include <math.h>
+#include <string.h>
+
+const MpcWeights MPC_DEFAULT_WEIGHTS = {1.0, 1e-3, 0.5, 2.0};
+
+/*!
+ * \brief Forgets the last plan, for a new target or a valve that was moved by hand
+ */
+void MpcReset(MpcSolver *solver)
+{
+  memset(solver->x, 0, sizeof(solver->x));
+  memset(solver->z, 0, sizeof(solver->z));
+  memset(solver->y, 0, sizeof(solver->y));
+  solver->iterations = 0;
+  solver->converged = false;
+}
+
+/*!
+ * \brief Moves the plan and the multipliers of each move on by one period, the last move becoming a hold
+ */
+static void ShiftBlock(double *values)
+{
+  for(int k = 0; k + 1 < MPC_MOVES; k++){
+    values[k] = values[k + 1];
+  }
+  values[MPC_MOVES - 1] = 0.0;
+}
+
+/*!
+ * \brief Builds the cost and constraints of a problem
+ * \details Variables are the opening and closing part of each move in units of maxMove, so every bound is of order one whatever the motor and the period.
+ */
+static void BuildProblem(MpcSolver *solver, const MpcWeights *weights, const MpcProblem *problem, double maxMove)
+{
+  double decay = problem->timeConstant > 0.0 ? exp(-problem->period / problem->timeConstant) : 0.0;
+  double response[MPC_HORIZON][MPC_MOVES];	//Change of the predicted flow in each period per unit of each move
+  double error[MPC_HORIZON];			//Predicted error in each period if the valve holds
+  double power = 1.0;				//decay to the power of the period
+  for(int j = 0; j < MPC_HORIZON; j++){
+    power *= decay;
+    error[j] = power * problem->flow + (1.0 - power) * problem->steadyFlow + problem->offset - problem->target;
+    //a move at the start of period k has run for j + 1 - k periods by the end of period j
+    double lag = 1.0;
+    for(int k = MPC_MOVES - 1; k >= 0; k--){
+      response[j][k] = 0.0;
+    }
+    for(int k = j; k >= 0; k--){
+      lag *= decay;
+      if(k < MPC_MOVES){
+        response[j][k] = problem->gain * maxMove * (1.0 - lag);
+      }
+    }
+  }
+
+  //quadratic cost of the moves, then scaled so its largest term is one
+  double hessian[MPC_MOVES][MPC_MOVES];
+  double gradient[MPC_MOVES];
+  double scale = 0.0;
+  for(int k = 0; k < MPC_MOVES; k++){
+    gradient[k] = 0.0;
+    for(int j = 0; j < MPC_HORIZON; j++){
+      gradient[k] += 2.0 * weights->tracking * response[j][k] * error[j];
+    }
+    for(int l = 0; l < MPC_MOVES; l++){
+      double sum = 0.0;
+      for(int j = 0; j < MPC_HORIZON; j++){
+        sum += response[j][k] * response[j][l];
+      }
+      hessian[k][l] = 2.0 * weights->tracking * sum + (k == l ? 2.0 * weights->move * maxMove * maxMove : 0.0);
+    }
+    if(hessian[k][k] > scale){
+      scale = hessian[k][k];
+    }
+  }
+  scale = scale > 0.0 ? 1.0 / scale : 1.0;
+
+  //a move is its opening part minus its closing part, so the quadratic cost repeats with signs
+  for(int k = 0; k < MPC_MOVES; k++){
+    for(int l = 0; l < MPC_MOVES; l++){
+      double h = hessian[k][l] * scale;
+      solver->p[k][l] = h;
+      solver->p[k][MPC_MOVES + l] = -h;
+      solver->p[MPC_MOVES + k][l] = -h;
+      solver->p[MPC_MOVES + k][MPC_MOVES + l] = h;
+    }
+    double travel = weights->travel * maxMove;
+    double reversal = weights->reversal * maxMove;
+    solver->q[k] = (gradient[k] + travel + (problem->direction < 0 ? reversal : 0.0)) * scale;
+    solver->q[MPC_MOVES + k] = (-gradient[k] + travel + (problem->direction > 0 ? reversal : 0.0)) * scale;
+  }
+
+  //each part moves at most maxMove, and the position after each move stays on the valve
+  memset(solver->a, 0, sizeof(solver->a));
+  for(int k = 0; k < MPC_MOVES; k++){
+    solver->a[k][k] = 1.0;
+    solver->lower[k] = 0.0;
+    solver->upper[k] = 1.0;
+    solver->a[MPC_MOVES + k][MPC_MOVES + k] = 1.0;
+    solver->lower[MPC_MOVES + k] = 0.0;
+    solver->upper[MPC_MOVES + k] = 1.0;
+    int row = 2 * MPC_MOVES + k;
+    for(int i = 0; i <= k; i++){
+      solver->a[row][i] = 1.0;
+      solver->a[row][MPC_MOVES + i] = -1.0;
+    }
+    solver->lower[row] = -problem->position / maxMove;
+    solver->upper[row] = (MAX_NUM_OF_STEPS - problem->position) / maxMove;
+  }
+}
+
+/*!
+ * \brief Factors P + sigma I + rho A'A into its Cholesky factor in place
+ */
+static void FactorKkt(MpcSolver *solver)
+{
+  double (*l)[MPC_VARIABLES] = solver->kkt;
+  for(int i = 0; i < MPC_VARIABLES; i++){
+    for(int j = 0; j < MPC_VARIABLES; j++){
+      double sum = solver->p[i][j] + (i == j ? MPC_SIGMA : 0.0);
+      for(int r = 0; r < MPC_CONSTRAINTS; r++){
+        sum += MPC_RHO * solver->a[r][i] * solver->a[r][j];
+      }
+      l[i][j] = sum;
+    }
+  }
+  for(int j = 0; j < MPC_VARIABLES; j++){
+    double diagonal = l[j][j];
+    for(int k = 0; k < j; k++){
+      diagonal -= l[j][k] * l[j][k];
+    }
+    l[j][j] = sqrt(diagonal > 1e-12 ? diagonal : 1e-12);
+    for(int i = j + 1; i < MPC_VARIABLES; i++){
+      double sum = l[i][j];
+      for(int k = 0; k < j; k++){
+        sum -= l[i][k] * l[j][k];
+      }
+      l[i][j] = sum / l[j][j];
+    }
+  }
+}
+
+/*!
+ * \brief Solves L L' x = b with the factor from FactorKkt, overwriting b
+ */
+static void SolveKkt(const MpcSolver *solver, double *b)
+{
+  const double (*l)[MPC_VARIABLES] = solver->kkt;
+  for(int i = 0; i < MPC_VARIABLES; i++){
+    for(int k = 0; k < i; k++){
+      b[i] -= l[i][k] * b[k];
+    }
+    b[i] /= l[i][i];
+  }
+  for(int i = MPC_VARIABLES - 1; i >= 0; i--){
+    for(int k = i + 1; k < MPC_VARIABLES; k++){
+      b[i] -= l[k][i] * b[k];
+    }
+    b[i] /= l[i][i];
+  }
+}
+
+/*!
+ * \brief Plans the moves for one control step
+ * \details Returns the first move in steps, positive to open. The rest of the plan is kept to start the next solve from.
+ */
+double MpcSolve(MpcSolver *solver, const MpcWeights *weights, const MpcProblem *problem)
+{
+  double maxMove = problem->maxMove > 0.0 ? problem->maxMove : MAX_NUM_OF_STEPS;
+  BuildProblem(solver, weights, problem, maxMove);
+  FactorKkt(solver);
+
+  //start from the last plan, one period on
+  ShiftBlock(solver->x);
+  ShiftBlock(solver->x + MPC_MOVES);
+  ShiftBlock(solver->y);
+  ShiftBlock(solver->y + MPC_MOVES);
+  ShiftBlock(solver->y + 2 * MPC_MOVES);
+  for(int r = 0; r < MPC_CONSTRAINTS; r++){
+    double row = 0.0;
+    for(int i = 0; i < MPC_VARIABLES; i++){
+      row += solver->a[r][i] * solver->x[i];
+    }
+    solver->z[r] = row < solver->lower[r] ? solver->lower[r] : row > solver->upper[r] ? solver->upper[r] : row;
+  }
+
+  solver->converged = false;
+  int iteration;
+  for(iteration = 0; iteration < MPC_MAX_ITERATIONS && !solver->converged; iteration++){
+    double next[MPC_VARIABLES];
+    for(int i = 0; i < MPC_VARIABLES; i++){
+      double sum = MPC_SIGMA * solver->x[i] - solver->q[i];
+      for(int r = 0; r < MPC_CONSTRAINTS; r++){
+        sum += solver->a[r][i] * (MPC_RHO * solver->z[r] - solver->y[r]);
+      }
+      next[i] = sum;
+    }
+    SolveKkt(solver, next);
+    double primal = 0.0;
+    for(int r = 0; r < MPC_CONSTRAINTS; r++){
+      double row = 0.0;
+      for(int i = 0; i < MPC_VARIABLES; i++){
+        row += solver->a[r][i] * next[i];
+      }
+      double relaxed = MPC_RELAXATION * row + (1.0 - MPC_RELAXATION) * solver->z[r];
+      double z = relaxed + solver->y[r] / MPC_RHO;
+      z = z < solver->lower[r] ? solver->lower[r] : z > solver->upper[r] ? solver->upper[r] : z;
+      solver->y[r] += MPC_RHO * (relaxed - z);
+      solver->z[r] = z;
+    }
+    for(int i = 0; i < MPC_VARIABLES; i++){
+      solver->x[i] = MPC_RELAXATION * next[i] + (1.0 - MPC_RELAXATION) * solver->x[i];
+    }
+    //stop once the plan meets the constraints and is optimal to within the tolerance
+    double dual = 0.0;
+    for(int i = 0; i < MPC_VARIABLES; i++){
+      double sum = solver->q[i];
+      for(int j = 0; j < MPC_VARIABLES; j++){
+        sum += solver->p[i][j] * solver->x[j];
+      }
+      for(int r = 0; r < MPC_CONSTRAINTS; r++){
+        sum += solver->a[r][i] * solver->y[r];
+      }
+      dual = fabs(sum) > dual ? fabs(sum) : dual;
+    }
+    for(int r = 0; r < MPC_CONSTRAINTS; r++){
+      double row = 0.0;
+      for(int i = 0; i < MPC_VARIABLES; i++){
+        row += solver->a[r][i] * solver->x[i];
+      }
+      primal = fabs(row - solver->z[r]) > primal ? fabs(row - solver->z[r]) : primal;
+    }
+    solver->converged = primal < MPC_TOLERANCE && dual < MPC_TOLERANCE;
+  }
+  solver->iterations = iteration;
+  return (solver->x[0] - solver->x[MPC_MOVES]) * maxMove;
+}
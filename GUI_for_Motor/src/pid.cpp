@@ -0,0 +1,110 @@
+#include "pid.h"
+#include "device_profile.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define PID_GAINS_HEADER "# piflow pid gains v1"	//!< First line of a gains file
+
+/*!
+ * \brief Prepares a controller so its first output equals the given one
+ * \param output is usually the current valve position, which makes switching the controller on bumpless
+ */
+void PidReset(PidState *state, const PidGains *gains, double output)
+{
+  state->integral = (gains->ki != 0.0) ? output / gains->ki : 0.0;
+  state->lastError = 0.0;
+  state->started = false;
+}
+
+/*!
+ * \brief Runs one update of a position form PID controller
+ * \param error is the target minus the measured flow
+ * \param dt is the time since the previous update in seconds
+ * \details The output is clamped to the given range and the integral is frozen while the output is clamped, so it does not wind up against the end stops of the valve.
+ */
+double PidUpdate(PidState *state, const PidGains *gains, double error, double dt, double minOutput, double maxOutput)
+{
+  double derivative = 0.0;
+  if(state->started && dt > 0.0){
+    derivative = (error - state->lastError) / dt;
+  }
+  double integral = state->integral + error * dt;
+  double output = gains->kp * error + gains->ki * integral + gains->kd * derivative;
+  state->lastError = error;
+  state->started = true;
+  if(output > maxOutput){
+    return maxOutput;
+  }
+  if(output < minOutput){
+    return minOutput;
+  }
+  state->integral = integral;
+  return output;
+}
+
+/*!
+ * \brief Computes PID gains from a relay feedback experiment
+ * \param relayAmplitude is half the difference between the two valve positions of the relay, in steps
+ * \param hysteresis is the flow band around the setpoint in which the relay does not switch, in mL/s
+ * \param oscillationAmplitude is half the peak to peak flow of the oscillation, in mL/s
+ * \param period is the period of the oscillation in seconds
+ * \details The ultimate gain comes from the describing function of a relay with hysteresis, Ku = 4d / (pi * sqrt(a^2 - e^2)), and the gains use the classic Ziegler-Nichols PID rules.
+ */
+void RelayTuningGains(double relayAmplitude, double hysteresis, double oscillationAmplitude, double period, PidGains *gains)
+{
+  double a2 = oscillationAmplitude * oscillationAmplitude - hysteresis * hysteresis;
+  double ku = 4.0 * relayAmplitude / (M_PI * sqrt(a2 > 0.0 ? a2 : oscillationAmplitude * oscillationAmplitude));
+  double ti = period / 2.0;
+  double td = period / 8.0;
+  gains->kp = 0.6 * ku;
+  gains->ki = gains->kp / ti;
+  gains->kd = gains->kp * td;
+}
+
+/*!
+ * \brief Reads the gains stored for one valve channel of a Teensy
+ * \details Returns false if there are no stored gains.
+ */
+bool LoadPidGains(unsigned long serialNumber, int channel, PidGains *gains)
+{
+  char path[512];	//Holds the path of the gains file
+  char line[128];	//Holds one line of the file
+  if(!DeviceProfilePath(serialNumber, channel, PID_GAINS_FILE, path, sizeof(path))){
+    return false;
+  }
+  FILE *f = fopen(path, "r");
+  if(f == NULL){
+    return false;
+  }
+  bool found = false;
+  if(fgets(line, sizeof(line), f) != NULL && strncmp(line, PID_GAINS_HEADER, strlen(PID_GAINS_HEADER)) == 0){
+    while(fgets(line, sizeof(line), f) != NULL){
+      if(line[0] == '#'){
+        continue;
+      }
+      found = sscanf(line, "%lf %lf %lf", &gains->kp, &gains->ki, &gains->kd) == 3;
+      break;
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+/*!
+ * \brief Stores the gains for one valve channel of a Teensy
+ */
+bool SavePidGains(unsigned long serialNumber, int channel, const PidGains *gains)
+{
+  char path[512];	//Holds the path of the gains file
+  if(!DeviceProfilePath(serialNumber, channel, PID_GAINS_FILE, path, sizeof(path))){
+    return false;
+  }
+  FILE *f = fopen(path, "w");
+  if(f == NULL){
+    return false;
+  }
+  fprintf(f, "%s\n# kp(steps per mL/s) ki(steps per mL) kd(steps per mL/s^2)\n", PID_GAINS_HEADER);
+  fprintf(f, "%.6f %.6f %.6f\n", gains->kp, gains->ki, gains->kd);
+  return fclose(f) == 0;
+}
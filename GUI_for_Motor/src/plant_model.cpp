@@ -0,0 +1,200 @@
+#include "plant_model.h"
+#include "device_profile.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+#define PLANT_MODEL_HEADER "# piflow plant model v1"	//!< First line of a model file
+#define FIT_GRID_POINTS 40		//!< Dead times and time constants tried by the coarse search
+#define FIT_REFINE_ROUNDS 40		//!< Halvings of the search step once the coarse search is done
+#define FIT_MIN_TIME_CONSTANT 0.01	//!< Shortest time constant a fit considers, in seconds
+#define FIT_FINAL_FRACTION 0.25		//!< Share of the samples after the step the final flow is averaged over
+
+/*!
+ * \brief Normalized response of a first order lag to a valve move that ramps over rampTime
+ * \param t is the time since the response started, after the dead time
+ * \details A step when rampTime is 0.
+ */
+static double RampResponse(double t, double timeConstant, double rampTime)
+{
+  if(t <= 0.0){
+    return 0.0;
+  }
+  if(rampTime <= 0.0){
+    return 1.0 - exp(-t / timeConstant);
+  }
+  if(t <= rampTime){
+    return (t - timeConstant * (1.0 - exp(-t / timeConstant))) / rampTime;
+  }
+  return 1.0 - timeConstant / rampTime * (exp(-(t - rampTime) / timeConstant) - exp(-t / timeConstant));
+}
+
+/*!
+ * \brief Squared error between a normalized step response and the model response
+ * \param response is the change of the flow since the step over the whole change, sampled at time
+ */
+static double FitError(const double *time, const double *response, int samples, double stepAt, double rampTime, double deadTime, double timeConstant)
+{
+  double sum = 0.0;
+  for(int i = 0; i < samples; i++){
+    double predicted = RampResponse(time[i] - stepAt - deadTime, timeConstant, rampTime);
+    double error = response[i] - predicted;
+    sum += error * error;
+  }
+  return sum;
+}
+
+/*!
+ * \brief Fits a first order plus dead time model to the flow recorded around a step of the valve
+ * \param time and flow are the samples in seconds and mL/s, in time order, from a while before the step until the flow has settled again
+ * \param stepAt is the time the move was sent to the valve
+ * \param steps is the size of the move, negative for a move towards closed
+ * \param rampTime is the time the motor takes to travel the move, 0 if it is not known
+ * \details The input is taken to ramp from stepAt over rampTime, so the travel of the motor, which the Smith predictor simulates at the step rate itself, is kept out of the dead time and time constant. The gain comes from the mean flow before the step and the mean flow over the last FIT_FINAL_FRACTION of the samples after it. The dead time and time constant minimize the squared error of the normalized response: a coarse grid first, with the time constant spaced logarithmically, then a pattern search that halves its step. Returns false if there is no baseline, the flow did not settle long enough to average, or it moved the wrong way.
+ */
+bool FitStepResponse(const double *time, const double *flow, int samples, double stepAt, double rampTime, int steps, PlantModel *model)
+{
+  double before = 0.0;
+  int first = 0;
+  while(first < samples && time[first] < stepAt){
+    before += flow[first];
+    first++;
+  }
+  int after = samples - first;
+  int finalCount = (int)(after * FIT_FINAL_FRACTION);
+  if(first == 0 || finalCount < 4 || steps == 0){
+    return false;
+  }
+  before /= first;
+  double settled = 0.0;
+  for(int i = samples - finalCount; i < samples; i++){
+    settled += flow[i];
+  }
+  settled /= finalCount;
+  double change = settled - before;
+  double gain = change / steps;
+  if(gain <= 0.0){
+    return false;
+  }
+
+  //normalize so the response goes from 0 to 1 whichever way the valve moved
+  double span = time[samples - 1] - stepAt;
+  std::vector<double> response(after);
+  for(int i = 0; i < after; i++){
+    response[i] = (flow[first + i] - before) / change;
+  }
+  const double *t = time + first;
+  double maxDead = span / 2.0 < PLANT_MODEL_MAX_DEAD_TIME ? span / 2.0 : PLANT_MODEL_MAX_DEAD_TIME;
+  double maxTau = span / 2.0 < PLANT_MODEL_MAX_TIME_CONSTANT ? span / 2.0 : PLANT_MODEL_MAX_TIME_CONSTANT;
+  if(maxTau <= FIT_MIN_TIME_CONSTANT){
+    return false;
+  }
+  double ratio = pow(maxTau / FIT_MIN_TIME_CONSTANT, 1.0 / (FIT_GRID_POINTS - 1));
+  double bestDead = 0.0, bestTau = maxTau;
+  double best = FitError(t, response.data(), after, stepAt, rampTime, bestDead, bestTau);
+  for(int i = 0; i < FIT_GRID_POINTS; i++){
+    double dead = maxDead * i / (FIT_GRID_POINTS - 1);
+    double tau = FIT_MIN_TIME_CONSTANT;
+    for(int j = 0; j < FIT_GRID_POINTS; j++, tau *= ratio){
+      double error = FitError(t, response.data(), after, stepAt, rampTime, dead, tau);
+      if(error < best){
+        best = error;
+        bestDead = dead;
+        bestTau = tau;
+      }
+    }
+  }
+  //the time constant is searched in proportion to itself, like the grid
+  double deadStep = maxDead / (FIT_GRID_POINTS - 1);
+  double tauStep = ratio - 1.0;
+  for(int round = 0; round < FIT_REFINE_ROUNDS; round++){
+    bool improved = false;
+    for(int k = 0; k < 4; k++){
+      double dead = bestDead + (k == 0 ? deadStep : k == 1 ? -deadStep : 0.0);
+      double tau = bestTau * (k == 2 ? 1.0 + tauStep : k == 3 ? 1.0 / (1.0 + tauStep) : 1.0);
+      if(dead < 0.0 || dead > maxDead || tau < FIT_MIN_TIME_CONSTANT || tau > maxTau){
+        continue;
+      }
+      double error = FitError(t, response.data(), after, stepAt, rampTime, dead, tau);
+      if(error < best){
+        best = error;
+        bestDead = dead;
+        bestTau = tau;
+        improved = true;
+      }
+    }
+    if(!improved){
+      deadStep /= 2.0;
+      tauStep /= 2.0;
+    }
+  }
+  model->gain = gain;
+  model->deadTime = bestDead;
+  model->timeConstant = bestTau;
+  return true;
+}
+
+/*!
+ * \brief Combines the models fitted to several steps, such as one up and one down
+ */
+void AveragePlantModels(const PlantModel *models, int count, PlantModel *model)
+{
+  PlantModel sum = {0.0, 0.0, 0.0};
+  for(int i = 0; i < count; i++){
+    sum.gain += models[i].gain;
+    sum.timeConstant += models[i].timeConstant;
+    sum.deadTime += models[i].deadTime;
+  }
+  model->gain = count > 0 ? sum.gain / count : 0.0;
+  model->timeConstant = count > 0 ? sum.timeConstant / count : 0.0;
+  model->deadTime = count > 0 ? sum.deadTime / count : 0.0;
+}
+
+/*!
+ * \brief Reads the model stored for one valve channel of a Teensy
+ * \details Returns false if there is no stored model.
+ */
+bool LoadPlantModel(unsigned long serialNumber, int channel, PlantModel *model)
+{
+  char path[512];	//Holds the path of the model file
+  char line[128];	//Holds one line of the file
+  if(!DeviceProfilePath(serialNumber, channel, PLANT_MODEL_FILE, path, sizeof(path))){
+    return false;
+  }
+  FILE *f = fopen(path, "r");
+  if(f == NULL){
+    return false;
+  }
+  bool found = false;
+  if(fgets(line, sizeof(line), f) != NULL && strncmp(line, PLANT_MODEL_HEADER, strlen(PLANT_MODEL_HEADER)) == 0){
+    while(fgets(line, sizeof(line), f) != NULL){
+      if(line[0] == '#'){
+        continue;
+      }
+      found = sscanf(line, "%lf %lf %lf", &model->gain, &model->timeConstant, &model->deadTime) == 3 &&
+              model->gain > 0.0 && model->timeConstant > 0.0 && model->deadTime >= 0.0;
+      break;
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+/*!
+ * \brief Stores the model for one valve channel of a Teensy
+ */
+bool SavePlantModel(unsigned long serialNumber, int channel, const PlantModel *model)
+{
+  char path[512];	//Holds the path of the model file
+  if(!DeviceProfilePath(serialNumber, channel, PLANT_MODEL_FILE, path, sizeof(path))){
+    return false;
+  }
+  FILE *f = fopen(path, "w");
+  if(f == NULL){
+    return false;
+  }
+  fprintf(f, "%s\n# gain(mL/s per step) time_constant(s) dead_time(s)\n", PLANT_MODEL_HEADER);
+  fprintf(f, "%.6f %.6f %.6f\n", model->gain, model->timeConstant, model->deadTime);
+  return fclose(f) == 0;
+}
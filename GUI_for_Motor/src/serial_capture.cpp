@@ -0,0 +1,175 @@
+#include "serial_capture.h"
+#include "protocol.h"
+#include <string.h>
+
+SerialCaptureWriter::SerialCaptureWriter()
+  : file(NULL), lastNs(0), pendingNs(0), pendingEndNs(0), pendingDirection(SERIAL_FROM_TEENSY), pendingSize(0)
+{
+}
+
+SerialCaptureWriter::~SerialCaptureWriter()
+{
+  Close();
+}
+
+/*!
+ * \brief Creates a capture file, replacing any file of the same name
+ * \param nowNs is the monotonic time the record times count from
+ */
+bool SerialCaptureWriter::Open(const char *fileName, int64_t nowNs)
+{
+  Close();
+  std::lock_guard<std::mutex> guard(lock);
+  file = fopen(fileName, "wb");
+  if(file == NULL){
+    return false;
+  }
+  uint8_t header[SERIAL_CAPTURE_HEADER_BYTES];
+  memset(header, 0, sizeof(header));
+  PutU32(header, SERIAL_CAPTURE_MAGIC);
+  PutU16(header + 4, SERIAL_CAPTURE_VERSION);
+  PutU32(header + 8, (uint32_t)nowNs);
+  PutU32(header + 12, (uint32_t)((uint64_t)nowNs >> 32));
+  if(fwrite(header, sizeof(header), 1, file) != 1){
+    fclose(file);
+    file = NULL;
+    return false;
+  }
+  fflush(file);
+  lastNs = nowNs;
+  pendingSize = 0;
+  return true;
+}
+
+/*!
+ * \brief Adds bytes that crossed the port
+ * \param nowNs is the monotonic time the bytes were read or written
+ */
+void SerialCaptureWriter::Record(SerialDirection direction, const uint8_t *data, size_t size, int64_t nowNs)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if(file == NULL){
+    return;
+  }
+  for(size_t i = 0; i < size; i++){
+    if(pendingSize > 0 && (direction != pendingDirection || pendingSize == SERIAL_CAPTURE_MAX_DATA ||
+                           nowNs - pendingEndNs > SERIAL_CAPTURE_COALESCE_US * 1000LL)){
+      Flush();
+    }
+    if(pendingSize == 0){
+      pendingDirection = direction;
+      pendingNs = nowNs;
+    }
+    pending[pendingSize++] = data[i];
+    pendingEndNs = nowNs;
+  }
+  //writes are whole packets, so they do not need to wait for more bytes
+  if(direction == SERIAL_TO_TEENSY){
+    Flush();
+  }
+}
+
+/*!
+ * \brief Writes the pending record out once no byte has joined it for the coalesce window
+ * \param nowNs is the monotonic time now
+ * \details Called by the read thread while the port is quiet, so the bytes just before a hang or a crash reach the file instead of waiting for the next ones.
+ */
+void SerialCaptureWriter::FlushIdle(int64_t nowNs)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if(file != NULL && pendingSize > 0 && nowNs - pendingEndNs > SERIAL_CAPTURE_COALESCE_US * 1000LL){
+    Flush();
+  }
+}
+
+/*!
+ * \brief Writes the pending record out
+ * \details Flushed to the file each time so a capture survives the program crashing.
+ */
+void SerialCaptureWriter::Flush()
+{
+  if(pendingSize == 0){
+    return;
+  }
+  int64_t deltaUs = (pendingNs - lastNs) / 1000;
+  uint8_t header[SERIAL_CAPTURE_RECORD_BYTES];
+  header[0] = pendingDirection;
+  PutU32(header + 1, deltaUs < 0 ? 0 : deltaUs > 0xFFFFFFFFLL ? 0xFFFFFFFFu : (uint32_t)deltaUs);
+  header[5] = pendingSize;
+  fwrite(header, sizeof(header), 1, file);
+  fwrite(pending, pendingSize, 1, file);
+  fflush(file);
+  //keep the times exact to the microsecond instead of letting the rounding add up
+  lastNs += (deltaUs < 0 ? 0 : deltaUs) * 1000;
+  pendingSize = 0;
+}
+
+void SerialCaptureWriter::Close()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if(file == NULL){
+    return;
+  }
+  Flush();
+  fclose(file);
+  file = NULL;
+}
+
+SerialCaptureReader::SerialCaptureReader()
+  : file(NULL), startNs(0), lastNs(0)
+{
+}
+
+SerialCaptureReader::~SerialCaptureReader()
+{
+  Close();
+}
+
+/*!
+ * \brief Opens a capture and checks its header
+ */
+bool SerialCaptureReader::Open(const char *fileName)
+{
+  Close();
+  file = fopen(fileName, "rb");
+  if(file == NULL){
+    return false;
+  }
+  uint8_t header[SERIAL_CAPTURE_HEADER_BYTES];
+  if(fread(header, sizeof(header), 1, file) != 1 || GetU32(header) != SERIAL_CAPTURE_MAGIC ||
+     GetU16(header + 4) != SERIAL_CAPTURE_VERSION){
+    Close();
+    return false;
+  }
+  startNs = (int64_t)((uint64_t)GetU32(header + 8) | ((uint64_t)GetU32(header + 12) << 32));
+  lastNs = startNs;
+  return true;
+}
+
+/*!
+ * \brief Reads the next record
+ * \details Returns false at the end of the capture. A record cut short by a crash ends the capture.
+ */
+bool SerialCaptureReader::Next(SerialCaptureRecord *record)
+{
+  uint8_t header[SERIAL_CAPTURE_RECORD_BYTES];
+  if(file == NULL || fread(header, sizeof(header), 1, file) != 1 || header[0] > SERIAL_TO_TEENSY){
+    return false;
+  }
+  record->direction = (SerialDirection)header[0];
+  record->size = header[5];
+  if(record->size > 0 && fread(record->data, record->size, 1, file) != 1){
+    return false;
+  }
+  lastNs += (int64_t)GetU32(header + 1) * 1000;
+  record->timeNs = lastNs;
+  return true;
+}
+
+void SerialCaptureReader::Close()
+{
+  if(file != NULL){
+    fclose(file);
+    file = NULL;
+  }
+}
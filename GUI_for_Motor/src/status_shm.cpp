@@ -0,0 +1,181 @@
+#include "status_shm.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+
+#define READ_RETRIES 1000	//!< Give up on a sample if the writer keeps updating it this many times in a row
+
+FlowStatusWriter::FlowStatusWriter() : segment(NULL), updateCount(0)
+{
+  name[0] = '\0';
+}
+
+FlowStatusWriter::~FlowStatusWriter()
+{
+  Close();
+}
+
+/*!
+ * \brief Creates (or takes over) the shared memory segment
+ * \param name is the POSIX shared memory name, starting with '/'
+ * \details The segment is sized for this version of the layout and the header is filled in last, so a reader never sees the magic before the rest of the header is valid.
+ */
+bool FlowStatusWriter::Open(const char *name)
+{
+  Close();
+  int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+  if(fd < 0){
+    perror("shm_open");
+    return false;
+  }
+  if(ftruncate(fd, sizeof(FlowStatusSegment)) != 0){
+    perror("ftruncate");
+    close(fd);
+    return false;
+  }
+  void *p = mmap(NULL, sizeof(FlowStatusSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED){
+    perror("mmap");
+    return false;
+  }
+  segment = (FlowStatusSegment *)p;
+  segment->magic = 0;
+  std::atomic_thread_fence(std::memory_order_release);
+  segment->version = FLOW_STATUS_VERSION;
+  segment->statusSize = sizeof(FlowStatus);
+  segment->writerPid = getpid();
+  segment->sequence.store(0, std::memory_order_relaxed);
+  memset(&segment->status, 0, sizeof(segment->status));
+  std::atomic_thread_fence(std::memory_order_release);
+  segment->magic = FLOW_STATUS_MAGIC;
+  strncpy(this->name, name, sizeof(this->name) - 1);
+  this->name[sizeof(this->name) - 1] = '\0';
+  updateCount = 0;
+  return true;
+}
+
+/*!
+ * \brief Publishes a new status
+ * \details The sequence number is odd while the status is being written, which tells readers to retry.
+ */
+void FlowStatusWriter::Publish(const FlowStatus &status)
+{
+  if(segment == NULL){
+    return;
+  }
+  uint32_t seq = segment->sequence.load(std::memory_order_relaxed);
+  segment->sequence.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  segment->status = status;
+  segment->status.updateCount = ++updateCount;
+  segment->sequence.store(seq + 2, std::memory_order_release);
+}
+
+/*!
+ * \brief Unmaps and removes the segment
+ */
+void FlowStatusWriter::Close()
+{
+  if(segment == NULL){
+    return;
+  }
+  segment->magic = 0;
+  munmap(segment, sizeof(FlowStatusSegment));
+  shm_unlink(name);
+  segment = NULL;
+}
+
+FlowStatusReader::FlowStatusReader() : segment(NULL), mappedSize(0)
+{
+}
+
+FlowStatusReader::~FlowStatusReader()
+{
+  Close();
+}
+
+/*!
+ * \brief Maps an existing segment read-only
+ * \param name is the POSIX shared memory name, starting with '/'
+ * \details Fails if the segment does not exist, is not initialised or was written by an incompatible version.
+ */
+bool FlowStatusReader::Open(const char *name)
+{
+  Close();
+  int fd = shm_open(name, O_RDONLY, 0);
+  if(fd < 0){
+    return false;
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < offsetof(FlowStatusSegment, status)){
+    close(fd);
+    return false;
+  }
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED){
+    return false;
+  }
+  segment = (const FlowStatusSegment *)p;
+  mappedSize = st.st_size;
+  if(segment->magic != FLOW_STATUS_MAGIC || segment->version != FLOW_STATUS_VERSION ||
+     offsetof(FlowStatusSegment, status) + segment->statusSize > mappedSize){
+    Close();
+    return false;
+  }
+  return true;
+}
+
+/*!
+ * \brief Copies a consistent snapshot of the status
+ * \param status receives the snapshot; fields the writer does not know about are zeroed
+ * \details Retries while the writer is in the middle of an update. Returns false if the segment was closed by the writer or no consistent copy could be taken.
+ */
+bool FlowStatusReader::Read(FlowStatus *status) const
+{
+  if(segment == NULL){
+    return false;
+  }
+  size_t size = segment->statusSize < sizeof(FlowStatus) ? segment->statusSize : sizeof(FlowStatus);
+  for(int i = 0; i < READ_RETRIES; i++){
+    if(segment->magic != FLOW_STATUS_MAGIC){
+      return false;
+    }
+    uint32_t before = segment->sequence.load(std::memory_order_acquire);
+    if(before & 1){
+      continue;
+    }
+    memset(status, 0, sizeof(FlowStatus));
+    memcpy(status, (const void *)&segment->status, size);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(segment->sequence.load(std::memory_order_relaxed) == before){
+      return true;
+    }
+  }
+  return false;
+}
+
+/*!
+ * \brief Process id of the writer, or 0 when not open
+ */
+uint32_t FlowStatusReader::WriterPid() const
+{
+  return segment ? segment->writerPid : 0;
+}
+
+/*!
+ * \brief Unmaps the segment
+ */
+void FlowStatusReader::Close()
+{
+  if(segment == NULL){
+    return;
+  }
+  munmap((void *)segment, mappedSize);
+  segment = NULL;
+  mappedSize = 0;
+}
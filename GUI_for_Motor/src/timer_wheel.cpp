@@ -0,0 +1,126 @@
+#include "timer_wheel.h"
+
+/*!
+ * \brief Empties the wheel and starts it at the present time
+ * \param tickNs is the width of a slot; timers expire no earlier than their deadline and at most one call of TimerWheelExpire late
+ */
+void TimerWheelInit(TimerWheel *wheel, int64_t tickNs, int64_t nowNs)
+{
+  wheel->tickNs = tickNs > 0 ? tickNs : 1;
+  wheel->tick = nowNs / wheel->tickNs;
+  for(int i = 0; i < TIMER_WHEEL_SLOTS; i++){
+    wheel->slots[i] = -1;
+  }
+  for(int i = 0; i < TIMER_WHEEL_MAX_TIMERS; i++){
+    wheel->entries[i].next = i + 1 < TIMER_WHEEL_MAX_TIMERS ? i + 1 : -1;
+  }
+  wheel->freeList = 0;
+  wheel->pending = 0;
+}
+
+/*!
+ * \brief Adds a timer
+ * \details A deadline already passed expires on the next call of TimerWheelExpire. Returns false if the pool is used up.
+ */
+bool TimerWheelSchedule(TimerWheel *wheel, int64_t deadlineNs, int arg)
+{
+  int index = wheel->freeList;
+  if(index < 0){
+    return false;
+  }
+  TimerWheelEntry *entry = &wheel->entries[index];
+  wheel->freeList = entry->next;
+  int64_t tick = deadlineNs / wheel->tickNs;
+  if(tick < wheel->tick){
+    tick = wheel->tick;
+  }
+  int slot = (int)(tick % TIMER_WHEEL_SLOTS);
+  entry->slot = slot;
+  entry->deadlineNs = deadlineNs;
+  entry->arg = arg;
+  entry->next = wheel->slots[slot];
+  wheel->slots[slot] = index;
+  wheel->pending++;
+  return true;
+}
+
+/*!
+ * \brief Removes the timers that are due
+ * \param args and deadlines receive the expired timers in deadline order, at most maxTimers of them
+ * \details Returns the number expired. If more are due, the earliest are taken and the rest stay pending for the next call.
+ */
+int TimerWheelExpire(TimerWheel *wheel, int64_t nowNs, int *args, int64_t *deadlines, int maxTimers)
+{
+  int64_t last = nowNs / wheel->tickNs;
+  //a gap of more than a turn only needs every slot looked at once
+  int64_t first = last - wheel->tick >= TIMER_WHEEL_SLOTS ? last - TIMER_WHEEL_SLOTS + 1 : wheel->tick;
+  int expired = 0;
+  bool more = false;
+  //pick the earliest due timers, holding their indexes in args until they are unlinked
+  for(int64_t tick = first; tick <= last && wheel->pending > 0; tick++){
+    for(int index = wheel->slots[tick % TIMER_WHEEL_SLOTS]; index >= 0; index = wheel->entries[index].next){
+      int64_t deadline = wheel->entries[index].deadlineNs;
+      if(deadline > nowNs){
+        continue;
+      }
+      if(expired == maxTimers){
+        more = true;
+        if(maxTimers == 0 || deadline >= deadlines[maxTimers - 1]){
+          continue;
+        }
+        expired--;
+      }
+      int at = expired++;
+      while(at > 0 && deadlines[at - 1] > deadline){
+        deadlines[at] = deadlines[at - 1];
+        args[at] = args[at - 1];
+        at--;
+      }
+      deadlines[at] = deadline;
+      args[at] = index;
+    }
+  }
+  for(int i = 0; i < expired; i++){
+    int index = args[i];
+    TimerWheelEntry *entry = &wheel->entries[index];
+    int *link = &wheel->slots[entry->slot];
+    while(*link != index){
+      link = &wheel->entries[*link].next;
+    }
+    *link = entry->next;
+    entry->next = wheel->freeList;
+    wheel->freeList = index;
+    wheel->pending--;
+    args[i] = entry->arg;
+  }
+  //the present tick may still hold timers due later in it, and ticks still holding due timers are looked at again
+  if(!more && last > wheel->tick){
+    wheel->tick = last;
+  }
+  return expired;
+}
+
+/*!
+ * \brief Deadline of the earliest pending timer, TIMER_WHEEL_NONE if there is none
+ * \details Looks through the slots of the next turn and stops at the first one holding a timer due in it, so a loop can sleep until the next event without walking every timer.
+ */
+int64_t TimerWheelNextDeadline(const TimerWheel *wheel)
+{
+  if(wheel->pending == 0){
+    return TIMER_WHEEL_NONE;
+  }
+  int64_t earliest = TIMER_WHEEL_NONE;
+  for(int64_t tick = wheel->tick; tick < wheel->tick + TIMER_WHEEL_SLOTS; tick++){
+    for(int index = wheel->slots[tick % TIMER_WHEEL_SLOTS]; index >= 0; index = wheel->entries[index].next){
+      int64_t deadline = wheel->entries[index].deadlineNs;
+      if(deadline < earliest){
+        earliest = deadline;
+      }
+    }
+    //anything in a later slot of this turn is due later than a timer of this tick
+    if(earliest != TIMER_WHEEL_NONE && earliest / wheel->tickNs <= tick){
+      return earliest;
+    }
+  }
+  return earliest;
+}
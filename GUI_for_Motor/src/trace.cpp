@@ -0,0 +1,260 @@
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <thread>
+#include <vector>
+
+static TraceBuffer buffers[TRACE_MAX_THREADS];		//!< Rings handed out to the traced threads
+static const char *threadNames[TRACE_MAX_NAMES];	//!< Names of the traced threads by tid % TRACE_MAX_NAMES
+static std::atomic<uint32_t> nextTid(1);		//!< Trace id of the next thread
+static std::atomic<bool> enabled(true);			//!< Events are recorded
+static thread_local TraceBuffer *threadBuffer = NULL;	//!< Ring of the calling thread, NULL if it is not traced
+
+static sem_t dumpRequests;				//!< Posted to wake the dump thread
+static std::thread dumper;				//!< Writes the dumps
+static std::atomic<bool> dumperRunning(false);
+static std::atomic<bool> dumperStopping(false);
+static std::atomic<const char *> dumpReason(NULL);	//!< Anomaly behind the next dump, NULL for a request
+static std::atomic<int64_t> lastAnomalyNs(0);		//!< When an anomaly last asked for a dump
+static char dumpDirectory[256];
+
+/*!
+ * \brief Current CLOCK_MONOTONIC time in nanoseconds
+ */
+int64_t TraceNowNs()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*!
+ * \brief Gives the calling thread a ring of its own
+ * \param name is a static string shown for the thread in the trace
+ * \details Call before the thread records anything and outside its loop. A thread that finds every ring taken is not traced.
+ */
+void TraceThreadStart(const char *name)
+{
+  if(threadBuffer != NULL){
+    return;
+  }
+  for(int i = 0; i < TRACE_MAX_THREADS; i++){
+    int free = 0;
+    if(buffers[i].owned.compare_exchange_strong(free, 1)){
+      uint32_t tid = nextTid.fetch_add(1);
+      threadNames[tid % TRACE_MAX_NAMES] = name;
+      buffers[i].tid = tid;
+      threadBuffer = &buffers[i];
+      return;
+    }
+  }
+}
+
+/*!
+ * \brief Hands the ring of the calling thread back
+ * \details Its events stay in the dumps until another thread takes the ring over.
+ */
+void TraceThreadEnd()
+{
+  if(threadBuffer != NULL){
+    threadBuffer->owned.store(0);
+    threadBuffer = NULL;
+  }
+}
+
+/*!
+ * \brief Turns recording on or off for every thread
+ */
+void TraceSetEnabled(bool on)
+{
+  enabled.store(on, std::memory_order_relaxed);
+}
+
+/*!
+ * \brief Records an event that started at startNs
+ * \param durationNs is the length of the event, or -1 for an instant
+ */
+void TraceRecord(const char *name, int64_t startNs, int64_t durationNs, uint32_t arg)
+{
+  TraceBuffer *buffer = threadBuffer;
+  if(buffer == NULL || !enabled.load(std::memory_order_relaxed)){
+    return;
+  }
+  uint64_t head = buffer->head.load(std::memory_order_relaxed);
+  TraceEvent *event = &buffer->events[head % TRACE_EVENTS_PER_THREAD];
+  event->startNs = startNs;
+  event->durationNs = durationNs;
+  event->name = name;
+  event->arg = arg;
+  event->tid = buffer->tid;
+  buffer->head.store(head + 1, std::memory_order_release);
+}
+
+/*!
+ * \brief Marks a moment, such as a frame arriving
+ */
+void TraceInstant(const char *name, uint32_t arg)
+{
+  if(threadBuffer != NULL){
+    TraceRecord(name, TraceNowNs(), -1, arg);
+  }
+}
+
+/*!
+ * \brief Copies the events of one ring that were not overwritten while they were read
+ */
+static void CollectEvents(TraceBuffer *buffer, std::vector<TraceEvent> &events)
+{
+  uint64_t head = buffer->head.load(std::memory_order_acquire);
+  uint64_t first = head > TRACE_EVENTS_PER_THREAD ? head - TRACE_EVENTS_PER_THREAD : 0;
+  size_t start = events.size();
+  for(uint64_t i = first; i < head; i++){
+    events.push_back(buffer->events[i % TRACE_EVENTS_PER_THREAD]);
+  }
+  //the owner kept writing while the ring was copied; drop what it may have overwritten, and the
+  //slot of after, which it may be writing right now
+  uint64_t after = buffer->head.load(std::memory_order_acquire);
+  uint64_t overwritten = after + 1 > TRACE_EVENTS_PER_THREAD ? after + 1 - TRACE_EVENTS_PER_THREAD : 0;
+  if(overwritten > first){
+    size_t lost = overwritten - first < head - first ? overwritten - first : head - first;
+    events.erase(events.begin() + start, events.begin() + start + lost);
+  }
+}
+
+/*!
+ * \brief Writes every ring to a Chrome trace JSON file
+ * \details Can be called from any thread while the others keep recording.
+ */
+bool TraceDump(const char *fileName)
+{
+  std::vector<TraceEvent> events;
+  events.reserve(TRACE_MAX_THREADS * TRACE_EVENTS_PER_THREAD);
+  for(int i = 0; i < TRACE_MAX_THREADS; i++){
+    CollectEvents(&buffers[i], events);
+  }
+  FILE *file = fopen(fileName, "w");
+  if(file == NULL){
+    return false;
+  }
+  int pid = getpid();
+  fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"TeensyControl\"}}", pid);
+  uint32_t newestTid = nextTid.load();
+  uint32_t oldestTid = newestTid > TRACE_MAX_NAMES ? newestTid - TRACE_MAX_NAMES : 1;
+  for(uint32_t tid = oldestTid; tid < newestTid; tid++){
+    const char *name = threadNames[tid % TRACE_MAX_NAMES];
+    if(name != NULL){
+      fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", pid, tid, name);
+    }
+  }
+  for(size_t i = 0; i < events.size(); i++){
+    const TraceEvent *e = &events[i];
+    if(e->durationNs < 0){
+      fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u,\"args\":{\"arg\":%u}}",
+              e->name, e->startNs / 1000.0, pid, e->tid, e->arg);
+    }
+    else{
+      fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,\"args\":{\"arg\":%u}}",
+              e->name, e->startNs / 1000.0, e->durationNs / 1000.0, pid, e->tid, e->arg);
+    }
+  }
+  fprintf(file, "\n]}\n");
+  return fclose(file) == 0;
+}
+
+/*!
+ * \brief Body of the dump thread
+ */
+static void DumpLoop()
+{
+  int dumps = 0;
+  while(true){
+    while(sem_wait(&dumpRequests) != 0){
+    }
+    if(dumperStopping.load()){
+      return;
+    }
+    char fileName[512];
+    char stamp[32];
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+    snprintf(fileName, sizeof(fileName), "%s/piflow-trace-%s-%d.json", dumpDirectory, stamp, dumps++);
+    const char *reason = dumpReason.exchange(NULL);
+    if(TraceDump(fileName)){
+      fprintf(stderr, "Trace written to %s%s%s\n", fileName, reason != NULL ? " after " : "", reason != NULL ? reason : "");
+    }
+    else{
+      fprintf(stderr, "Could not write the trace %s\n", fileName);
+    }
+  }
+}
+
+/*!
+ * \brief Starts the thread that writes the dumps
+ * \param directory is where the files go, NULL for TRACE_DEFAULT_DIRECTORY
+ */
+bool TraceStartDumper(const char *directory)
+{
+  if(dumperRunning.load()){
+    return true;
+  }
+  snprintf(dumpDirectory, sizeof(dumpDirectory), "%s", directory != NULL ? directory : TRACE_DEFAULT_DIRECTORY);
+  if(sem_init(&dumpRequests, 0, 0) != 0){
+    return false;
+  }
+  dumperStopping.store(false);
+  dumperRunning.store(true);
+  dumper = std::thread(DumpLoop);
+  return true;
+}
+
+/*!
+ * \brief Stops the dump thread
+ */
+void TraceStopDumper()
+{
+  if(!dumperRunning.load()){
+    return;
+  }
+  dumperStopping.store(true);
+  sem_post(&dumpRequests);
+  dumper.join();
+  sem_destroy(&dumpRequests);
+  dumperRunning.store(false);
+}
+
+/*!
+ * \brief Asks the dump thread for a dump
+ * \details Only posts a semaphore, so it is safe in a signal handler.
+ */
+void TraceRequestDump()
+{
+  if(dumperRunning.load()){
+    sem_post(&dumpRequests);
+  }
+}
+
+/*!
+ * \brief Asks for a dump because a thread saw something go wrong
+ * \param reason is a static string naming the problem
+ * \details At most one dump every TRACE_ANOMALY_GAP_NS, so a rig that keeps stalling does not fill the disk. Safe in the control loop: it neither blocks nor allocates.
+ */
+void TraceAnomaly(const char *reason)
+{
+  int64_t nowNs = TraceNowNs();
+  int64_t last = lastAnomalyNs.load();
+  if(last != 0 && nowNs - last < TRACE_ANOMALY_GAP_NS){
+    return;
+  }
+  if(!lastAnomalyNs.compare_exchange_strong(last, nowNs)){
+    return;
+  }
+  TraceInstant(reason, 0);
+  dumpReason.store(reason);
+  TraceRequestDump();
+}
@@ -0,0 +1,166 @@
+#include "valve_table.h"
+#include "device_profile.h"
+#include <stdio.h>
+#include <string.h>
+
+#define VALVE_TABLE_HEADER "# piflow valve table v1"	//!< First line of a table file
+
+/*!
+ * \brief Forces the flow to be non-decreasing with position
+ * \param table is the table to fix in place
+ * \details Uses the pool adjacent violators algorithm, so measurement noise is averaged out instead of being clipped. This keeps the table invertible for ValveTablePosition.
+ */
+void MakeValveTableMonotone(ValveTable *table)
+{
+  double value[VALVE_TABLE_MAX_POINTS];	//Mean flow of each pooled block
+  int weight[VALVE_TABLE_MAX_POINTS];	//Number of points in each pooled block
+  int blocks = 0;
+  for(int i = 0; i < table->numPoints; i++){
+    value[blocks] = table->flow[i];
+    weight[blocks] = 1;
+    blocks++;
+    //merge blocks while they are out of order
+    while(blocks > 1 && value[blocks - 2] > value[blocks - 1]){
+      int w = weight[blocks - 2] + weight[blocks - 1];
+      value[blocks - 2] = (value[blocks - 2] * weight[blocks - 2] + value[blocks - 1] * weight[blocks - 1]) / w;
+      weight[blocks - 2] = w;
+      blocks--;
+    }
+  }
+  int i = 0;
+  for(int b = 0; b < blocks; b++){
+    for(int k = 0; k < weight[b]; k++){
+      table->flow[i++] = value[b];
+    }
+  }
+}
+
+/*!
+ * \brief Predicted flow at a valve position
+ * \details Interpolates linearly between points and holds the end values outside the table.
+ */
+double ValveTableFlow(const ValveTable *table, double position)
+{
+  int n = table->numPoints;
+  if(n == 0){
+    return 0.0;
+  }
+  if(position <= table->position[0]){
+    return table->flow[0];
+  }
+  for(int i = 0; i + 1 < n; i++){
+    if(position <= table->position[i + 1]){
+      double t = (position - table->position[i]) / (double)(table->position[i + 1] - table->position[i]);
+      return table->flow[i] + t * (table->flow[i + 1] - table->flow[i]);
+    }
+  }
+  return table->flow[n - 1];
+}
+
+/*!
+ * \brief Valve position predicted to give a flow
+ * \details Returns the smallest position that reaches the flow, clamped to the ends of the table. The table must be monotone.
+ */
+int ValveTablePosition(const ValveTable *table, double flow)
+{
+  int n = table->numPoints;
+  if(n == 0){
+    return 0;
+  }
+  if(flow <= table->flow[0]){
+    return table->position[0];
+  }
+  for(int i = 0; i + 1 < n; i++){
+    //the first point at or above the flow has a point below it, so the segment is rising
+    if(table->flow[i + 1] >= flow){
+      double t = (flow - table->flow[i]) / (table->flow[i + 1] - table->flow[i]);
+      return (int)(table->position[i] + t * (table->position[i + 1] - table->position[i]) + 0.5);
+    }
+  }
+  return table->position[n - 1];
+}
+
+/*!
+ * \brief Gain of the valve at a position in mL/s per step
+ * \details Uses the segment the position falls in. Flat segments borrow the slope of the nearest rising one so that feedback corrections never divide by zero; 0 is returned only when the whole table is flat.
+ */
+double ValveTableSlope(const ValveTable *table, double position)
+{
+  int n = table->numPoints;
+  int seg = 0;
+  if(n < 2){
+    return 0.0;
+  }
+  while(seg + 2 < n && position > table->position[seg + 1]){
+    seg++;
+  }
+  for(int d = 0; d < n; d++){
+    int candidates[2] = {seg + d, seg - d};
+    for(int c = 0; c < 2; c++){
+      int i = candidates[c];
+      if(i >= 0 && i + 1 < n && table->flow[i + 1] > table->flow[i]){
+        return (table->flow[i + 1] - table->flow[i]) / (table->position[i + 1] - table->position[i]);
+      }
+    }
+  }
+  return 0.0;
+}
+
+/*!
+ * \brief Reads the table stored for one valve channel of a Teensy
+ * \details Returns false if there is no table or it could not be parsed.
+ */
+bool LoadValveTable(unsigned long serialNumber, int channel, ValveTable *table)
+{
+  char path[512];	//Holds the path of the table file
+  char line[128];	//Holds one line of the file
+  table->numPoints = 0;
+  if(!DeviceProfilePath(serialNumber, channel, VALVE_TABLE_FILE, path, sizeof(path))){
+    return false;
+  }
+  FILE *f = fopen(path, "r");
+  if(f == NULL){
+    return false;
+  }
+  if(fgets(line, sizeof(line), f) == NULL || strncmp(line, VALVE_TABLE_HEADER, strlen(VALVE_TABLE_HEADER)) != 0){
+    fclose(f);
+    return false;
+  }
+  while(table->numPoints < VALVE_TABLE_MAX_POINTS && fgets(line, sizeof(line), f) != NULL){
+    int position;
+    double flow;
+    if(sscanf(line, "%d %lf", &position, &flow) != 2){
+      continue;
+    }
+    //positions must increase for the interpolation to work
+    if(table->numPoints > 0 && position <= table->position[table->numPoints - 1]){
+      continue;
+    }
+    table->position[table->numPoints] = position;
+    table->flow[table->numPoints] = flow;
+    table->numPoints++;
+  }
+  fclose(f);
+  MakeValveTableMonotone(table);
+  return table->numPoints >= 2;
+}
+
+/*!
+ * \brief Stores the table for one valve channel of a Teensy
+ */
+bool SaveValveTable(unsigned long serialNumber, int channel, const ValveTable *table)
+{
+  char path[512];	//Holds the path of the table file
+  if(!DeviceProfilePath(serialNumber, channel, VALVE_TABLE_FILE, path, sizeof(path))){
+    return false;
+  }
+  FILE *f = fopen(path, "w");
+  if(f == NULL){
+    return false;
+  }
+  fprintf(f, "%s\n# position(steps) flow(mL/s)\n", VALVE_TABLE_HEADER);
+  for(int i = 0; i < table->numPoints; i++){
+    fprintf(f, "%d %.4f\n", table->position[i], table->flow[i]);
+  }
+  return fclose(f) == 0;
+}
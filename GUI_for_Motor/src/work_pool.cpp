@@ -0,0 +1,117 @@
+#include "work_pool.h"
+
+static thread_local int currentWorker = -1;	//!< Index of the pool thread running the caller, -1 outside the pool
+
+/*!
+ * \param threads is the number of threads; 0 or less uses one per core
+ */
+WorkStealingPool::WorkStealingPool(int threads)
+  : queued(0), unfinished(0), nextQueue(0), steals(0), stopping(false)
+{
+  if(threads <= 0){
+    threads = std::thread::hardware_concurrency();
+    if(threads <= 0){
+      threads = 1;
+    }
+  }
+  for(int i = 0; i < threads; i++){
+    workers.push_back(new Worker);
+  }
+  for(int i = 0; i < threads; i++){
+    workers[i]->thread = std::thread(&WorkStealingPool::Run, this, i);
+  }
+}
+
+/*!
+ * \details Finishes the tasks already submitted before the threads exit.
+ */
+WorkStealingPool::~WorkStealingPool()
+{
+  Wait();
+  {
+    std::lock_guard<std::mutex> guard(idleLock);
+    stopping = true;
+  }
+  workAvailable.notify_all();
+  for(size_t i = 0; i < workers.size(); i++){
+    workers[i]->thread.join();
+    delete workers[i];
+  }
+}
+
+void WorkStealingPool::Submit(std::function<void()> task)
+{
+  int index = currentWorker >= 0 ? currentWorker : (int)(nextQueue++ % workers.size());
+  unfinished++;
+  {
+    std::lock_guard<std::mutex> guard(workers[index]->lock);
+    workers[index]->tasks.push_back(std::move(task));
+  }
+  std::lock_guard<std::mutex> guard(idleLock);
+  queued++;
+  workAvailable.notify_one();
+}
+
+/*!
+ * \brief Blocks until every submitted task has finished
+ */
+void WorkStealingPool::Wait()
+{
+  std::unique_lock<std::mutex> guard(idleLock);
+  while(unfinished > 0){
+    allDone.wait(guard);
+  }
+}
+
+/*!
+ * \brief Takes the newest task of a thread's own queue, or steals the oldest one from another queue
+ */
+bool WorkStealingPool::TakeTask(int index, std::function<void()> *task)
+{
+  int count = (int)workers.size();
+  for(int i = 0; i < count; i++){
+    Worker *worker = workers[(index + i) % count];
+    std::lock_guard<std::mutex> guard(worker->lock);
+    if(worker->tasks.empty()){
+      continue;
+    }
+    if(i == 0){
+      *task = std::move(worker->tasks.back());
+      worker->tasks.pop_back();
+    }
+    else{
+      *task = std::move(worker->tasks.front());
+      worker->tasks.pop_front();
+      steals++;
+    }
+    queued--;
+    return true;
+  }
+  return false;
+}
+
+/*!
+ * \brief Body of a pool thread
+ */
+void WorkStealingPool::Run(int index)
+{
+  currentWorker = index;
+  while(true){
+    std::function<void()> task;
+    if(TakeTask(index, &task)){
+      task();
+      if(--unfinished == 0){
+        std::lock_guard<std::mutex> guard(idleLock);
+        allDone.notify_all();
+      }
+      continue;
+    }
+    std::unique_lock<std::mutex> guard(idleLock);
+    while(queued == 0 && !stopping){
+      workAvailable.wait(guard);
+    }
+    if(stopping && queued == 0){
+      return;
+    }
+  }
+}
@@ -0,0 +1,822 @@
+/*!
+ * \file control_bench.cpp
+ * \brief Step response benchmark of the flow loop against a simulated Teensy and valve
+ * \details Usage: control_bench [-s scenario] [-m pid|table|deadband|smith|mpc] [-P kp] [-I ki] [-D kd]
+ * [-o results.csv] [-c baseline.csv] [-t tolerance_%] [-w capture] [-T] [-p profile [-L load_ms]] [-l]
+ *
+ * Each scripted scenario runs the loop MasterLogic runs: the hello handshake, the filtered
+ * rate request with a retry after FLOW_REPLY_TIMEOUT_US, FlowControllerStep and absolute
+ * moves, with deadband moves waiting for the move to finish. Every command and reply goes
+ * through the packet layer of a SimulatedTeensy, so lost frames behave as on the wire. Time is
+ * simulated, so a run takes milliseconds and gives the same numbers on every machine.
+ *
+ * Rise time is from 10% to 90% of the step. Settling time counts from the moment the setpoint
+ * reaches its final value until the flow stays within SETTLE_BAND of it. Overshoot is a
+ * percentage of the step, or for a supply disturbance the largest deviation as a percentage
+ * of the target. The steady state error is the mean absolute error over the last
+ * STEADY_WINDOW_S of the run. -l lists the scenarios.
+ *
+ * The smith mode first identifies the plant of the scenario with a step test up and down, as
+ * TeensyControl --step-test does on the rig, and runs the Smith predictor with the fitted model.
+ * The mpc mode identifies the plant the same way and plans its moves over the same predictor.
+ *
+ * -T also times every controller step on the machine the benchmark runs on and prints, for
+ * each run, the distribution of the step time against the CONTROL_BUDGET_US a step may take on
+ * a Raspberry Pi, the mean and largest solver iterations of the mpc mode, and the reversals of
+ * the valve, which wear it more than travel in one direction. Run it on the Pi itself for the
+ * numbers that matter.
+ *
+ * -p runs a flow profile, in the format of TeensyControl --profile, through each mode instead of
+ * the scenarios. It prints when the profile ended, the latest a segment start was acted on after
+ * it was due, the volume delivered until the valve closed, and the error from the planned
+ * setpoint. -L makes every wake up of the loop late by a random time up to the given
+ * milliseconds, as on a busy host.
+ *
+ * -o writes the results as CSV. -c compares them with a CSV from an earlier revision and exits
+ * with status 2 if any metric got worse by more than the tolerance, so a drop in control
+ * quality fails a build the same way a slower benchmark would. -w records the serial traffic of
+ * the last run in the format of TeensyControl --capture, for serial_replay.
+ *
+ * In a build configured with -DCOUNT_ALLOCATIONS=ON, and as control_bench_counted in every
+ * build, a controller step that allocates aborts the run; ctest runs it in the pid and mpc modes
+ * to check the control path stays allocation free.
+ */
+#include "flow_controller.h"
+#include "flow_profile.h"
+#include "plant_model.h"
+#include "device_sim.h"
+#include "serial_capture.h"
+#include "flow_units.h"
+#include "alloc_guard.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#define DEFAULT_KP 3.0		//!< Proportional gain, as flowrig uses for boards without tuned gains
+#define DEFAULT_KI 1.5		//!< Integral gain, as flowrig uses for boards without tuned gains
+#define DEFAULT_TOLERANCE 10.0	//!< Relative worsening in percent before a metric counts as a regression
+#define BENCH_SERIAL 1000	//!< Serial number of the simulated board, which seeds its noise
+#define BENCH_NOISE 0.2		//!< Sensor noise of the scenarios that do not set their own, in mL/s
+#define LINK_LATENCY_S 0.001	//!< Time for a frame to cross the USB serial link
+#define METRIC_DT 0.01		//!< Longest step between samples of the true flow
+#define SETTLE_BAND 0.05	//!< Settled once the flow stays within this fraction of the target
+#define STEADY_WINDOW_S 10.0	//!< Window at the end of the run the steady state error is taken over
+#define TABLE_STEP 100		//!< Step between the points of the valve table, like the characterization sweep
+#define CONTROL_BUDGET_US 1000.0	//!< Longest a controller step may take on a Raspberry Pi
+#define PROFILE_TAIL_S 10.0	//!< Time a profile run is given past twice its planned length, and the valve to close after it
+#define MOVE_TIMEOUT_S (MAX_NUM_OF_STEPS / (double)SIM_STEP_RATE + 1.0)	//!< Longest wait for a deadband move to finish
+
+/*!
+ *  One scripted run
+ */
+typedef struct
+{
+  const char *name;
+  const char *description;
+  double duration;	//!< Length of the run in seconds
+  double startFlow;	//!< Setpoint at the start in mL/s
+  double endFlow;	//!< Setpoint after the change in mL/s
+  double changeAt;	//!< Time the setpoint starts to change
+  double rampTime;	//!< Seconds the change takes; 0 for a step
+  double supplyAt;	//!< Time the supply pressure changes, or negative for none
+  double supply;	//!< Supply after the change relative to the nominal one
+  double noise;		//!< Sensor noise in mL/s
+  double dropRate;	//!< Fraction of the frames lost in each direction
+  double deadTime;	//!< Transport delay between the valve and the sensor in seconds
+} Scenario;
+
+static const Scenario SCENARIOS[] = {
+  {"step", "closed valve to 30 mL/s", 60.0, 30.0, 30.0, 0.0, 0.0, -1.0, 1.0, BENCH_NOISE, 0.0, 0.0},
+  {"step_up", "settled at 20 mL/s, step to 50 mL/s", 90.0, 20.0, 50.0, 40.0, 0.0, -1.0, 1.0, BENCH_NOISE, 0.0, 0.0},
+  {"step_down", "settled at 50 mL/s, step to 20 mL/s", 90.0, 50.0, 20.0, 40.0, 0.0, -1.0, 1.0, BENCH_NOISE, 0.0, 0.0},
+  {"ramp", "settled at 10 mL/s, ramp to 50 mL/s over 30 s", 120.0, 10.0, 50.0, 40.0, 30.0, -1.0, 1.0, BENCH_NOISE, 0.0, 0.0},
+  {"supply_drop", "settled at 30 mL/s, supply pressure falls by 30%", 100.0, 30.0, 30.0, 0.0, 0.0, 40.0, 0.7, BENCH_NOISE, 0.0, 0.0},
+  {"noise", "closed valve to 30 mL/s with 2 mL/s of sensor noise", 60.0, 30.0, 30.0, 0.0, 0.0, -1.0, 1.0, 2.0, 0.0, 0.0},
+  {"dropped_frames", "closed valve to 30 mL/s losing 10% of the frames", 60.0, 30.0, 30.0, 0.0, 0.0, -1.0, 1.0, BENCH_NOISE, 0.10, 0.0},
+  {"dead_time", "settled at 20 mL/s, step to 50 mL/s through 1.5 s of transport delay", 90.0, 20.0, 50.0, 40.0, 0.0, -1.0, 1.0, BENCH_NOISE, 0.0, 1.5},
+};
+#define NUM_SCENARIOS (sizeof(SCENARIOS) / sizeof(SCENARIOS[0]))
+
+static const char *MODE_NAMES[] = {"deadband", "table", "pid", "smith", "mpc"};	//!< Indexed by FlowControlMode
+#define NUM_MODES (int)(sizeof(MODE_NAMES) / sizeof(MODE_NAMES[0]))
+
+/*!
+ *  Metrics of one run
+ */
+typedef struct
+{
+  double rise;		//!< Seconds from 10% to 90% of the step, negative without a step
+  double settle;	//!< Seconds to settle after the setpoint reached its final value
+  bool settled;		//!< False if the flow was outside the band at the end of the run
+  double overshoot;	//!< Percent of the step, or of the target for a disturbance
+  double sse;		//!< Mean absolute error at the end of the run in mL/s
+  double iae;		//!< Integral of the absolute error after the change in mL
+  double steps;		//!< Steps moved by the motor
+  int sent;		//!< Frames sent to the board
+  int received;		//!< Frames that reached the host
+  int lost;		//!< Frames lost in either direction
+  int reversals;	//!< Moves against the direction of the one before
+  double iterations;	//!< Mean solver iterations per step of the mpc mode
+  int maxIterations;	//!< Most solver iterations of one step of the mpc mode
+} BenchResult;
+
+/*!
+ * \brief Setpoint of a scenario at a time
+ */
+static double Setpoint(const Scenario &scenario, double t)
+{
+  if(t < scenario.changeAt){
+    return scenario.startFlow;
+  }
+  if(t < scenario.changeAt + scenario.rampTime){
+    return scenario.startFlow + (scenario.endFlow - scenario.startFlow) * (t - scenario.changeAt) / scenario.rampTime;
+  }
+  return scenario.endFlow;
+}
+
+/*!
+ * \brief One scenario run: the simulated board, the link to it and the true flow over time
+ */
+class BenchRun
+{
+public:
+  BenchRun(const Scenario &scenario, const SimPlant &plant, SerialCaptureWriter *capture)
+    : scenario(scenario), board(BENCH_SERIAL, plant), now(0.0), capture(capture),
+      random(BENCH_SERIAL * 2862933555777941757ULL + 3037000493ULL), sent(0), received(0), lost(0)
+  {
+    board.Advance(0, NULL, 0);
+  }
+
+  /*!
+   * \brief Runs the board up to a time, recording the true flow
+   */
+  void RunUntil(double until)
+  {
+    while(now < until){
+      double h = until - now < METRIC_DT ? until - now : METRIC_DT;
+      now += h;
+      if(scenario.supplyAt >= 0.0 && now >= scenario.supplyAt){
+        board.SetSupply(scenario.supply);
+      }
+      uint8_t reply[PACKET_MAX_BYTES * 2];
+      Deliver(reply, board.Advance((int64_t)(now * 1e9), reply, sizeof(reply)));
+      time.push_back(now);
+      flow.push_back(board.Flow());
+    }
+  }
+
+  /*!
+   * \brief Frames a command and sends it to the board
+   */
+  void Send(unsigned int payloadSize, const uint8_t *payload)
+  {
+    uint8_t frame[PACKET_MAX_BYTES];
+    unsigned int size = payloadSize + PACKET_OVERHEAD_BYTES;
+    frame[0] = PACKET_START_BYTE;
+    frame[1] = size;
+    memcpy(frame + 2, payload, payloadSize);
+    uint8_t checksum = 0;
+    for(unsigned int i = 0; i + 1 < size; i++){
+      checksum ^= frame[i];
+    }
+    frame[size - 1] = checksum;
+    sent++;
+    if(capture != NULL){
+      capture->Record(SERIAL_TO_TEENSY, frame, size, (int64_t)(now * 1e9));
+    }
+    if(Lost()){
+      return;
+    }
+    RunUntil(now + LINK_LATENCY_S);
+    uint8_t reply[PACKET_MAX_BYTES * 2];
+    Deliver(reply, board.Receive(frame, size, (int64_t)(now * 1e9), reply, sizeof(reply)));
+  }
+
+  /*!
+   * \brief Waits for a frame with the given command byte, dropping any others
+   * \details Returns false if none arrived within the timeout.
+   */
+  bool Await(uint8_t command, double timeout, uint8_t *packet)
+  {
+    double deadline = now + timeout;
+    while(true){
+      while(!inbox.empty() && inbox.front().first <= now){
+        std::string frame = inbox.front().second;
+        inbox.pop_front();
+        if((uint8_t)frame[2] == command){
+          memcpy(packet, frame.data(), frame.size());
+          return true;
+        }
+      }
+      if(now >= deadline){
+        return false;
+      }
+      double until = deadline;
+      if(!inbox.empty() && inbox.front().first < until){
+        until = inbox.front().first;
+      }
+      RunUntil(until < now + METRIC_DT ? until : now + METRIC_DT);
+    }
+  }
+
+  const Scenario &scenario;
+  SimulatedTeensy board;
+  double now;			//!< Simulated time in seconds
+  std::vector<double> time;	//!< Times the true flow was recorded at
+  std::vector<double> flow;	//!< True flow at those times
+
+private:
+  /*!
+   * \brief Queues the frames the board sent, minus the ones the link loses
+   */
+  void Deliver(const uint8_t *bytes, size_t size)
+  {
+    for(size_t i = 0; i + 1 < size; i += bytes[i + 1]){
+      if(Lost()){
+        continue;
+      }
+      inbox.push_back(std::make_pair(now + LINK_LATENCY_S, std::string((const char *)bytes + i, bytes[i + 1])));
+      received++;
+      if(capture != NULL){
+        capture->Record(SERIAL_FROM_TEENSY, bytes + i, bytes[i + 1], (int64_t)((now + LINK_LATENCY_S) * 1e9));
+      }
+    }
+  }
+
+  bool Lost()
+  {
+    if(scenario.dropRate <= 0.0){
+      return false;
+    }
+    random = random * 6364136223846793005ULL + 1442695040888963407ULL;
+    if((random >> 11) * (1.0 / 9007199254740992.0) < scenario.dropRate){
+      lost++;
+      return true;
+    }
+    return false;
+  }
+
+  std::deque<std::pair<double, std::string> > inbox;	//!< Frames on their way to the host and when they arrive
+  SerialCaptureWriter *capture;				//!< Records the traffic as the host port sees it, or NULL
+  uint64_t random;					//!< State of the frame loss generator
+
+public:
+  int sent;
+  int received;
+  int lost;
+};
+
+/*!
+ * \brief Records the flow around one move of the valve and fits the model to it
+ */
+static bool StepTest(SimulatedTeensy &board, double &now, int from, int to, PlantModel *model)
+{
+  double time[STEP_TEST_MAX_SAMPLES];
+  double flow[STEP_TEST_MAX_SAMPLES];
+  int samples = 0;
+  double stepAt = now + STEP_TEST_BASELINE_S;
+  double end = stepAt + STEP_TEST_RECORD_S;
+  board.MoveTo(from);
+  while(now < end && samples < STEP_TEST_MAX_SAMPLES){
+    if(now >= stepAt){
+      board.MoveTo(to);
+    }
+    now += STEP_TEST_SAMPLE_S;
+    board.Advance((int64_t)(now * 1e9), NULL, 0);
+    time[samples] = now;
+    flow[samples] = board.MeasuredFlow();
+    samples++;
+  }
+  return FitStepResponse(time, flow, samples, stepAt, abs(to - from) / (double)SIM_STEP_RATE, to - from, model);
+}
+
+/*!
+ * \brief Identifies the plant of a scenario with a step test up and down around a flow
+ * \details Runs on a board of its own, so the scenario starts from a closed valve as before.
+ */
+static bool IdentifyPlant(const SimPlant &plant, const ValveTable &table, double flow, PlantModel *model)
+{
+  SimulatedTeensy board(BENCH_SERIAL, plant);
+  double now = 0.0;
+  int low = ValveTablePosition(&table, flow);
+  if(low > MAX_NUM_OF_STEPS - STEP_TEST_STEPS){
+    low = MAX_NUM_OF_STEPS - STEP_TEST_STEPS;
+  }
+  board.Advance(0, NULL, 0);
+  board.MoveTo(low);
+  now += STEP_TEST_SETTLE_S;
+  board.Advance((int64_t)(now * 1e9), NULL, 0);
+  PlantModel steps[2];
+  if(!StepTest(board, now, low, low + STEP_TEST_STEPS, &steps[0]) || !StepTest(board, now, low + STEP_TEST_STEPS, low, &steps[1])){
+    return false;
+  }
+  AveragePlantModels(steps, 2, model);
+  return true;
+}
+
+/*!
+ * \brief Current CLOCK_MONOTONIC time in microseconds
+ */
+static double NowUs()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+/*!
+ * \brief Handshakes with the board, characterizes the valve and sets up the controller, like MasterLogic
+ * \details The smith and mpc modes get a model from a step test around the final flow of the scenario. Returns the flow sensor profile the board reported.
+ */
+static FlowSensorProfile SetUpController(BenchRun &run, const SimPlant &plant, FlowControlMode mode, const PidGains &gains, ValveTable *table,
+                              FlowControllerConfig *config)
+{
+  const Scenario &scenario = run.scenario;
+  uint8_t packet[PACKET_MAX_BYTES] = {0};
+  uint8_t command = HELLO_COMMAND;
+
+  //handshake for the calibration, like HandshakeTeensy
+  FlowSensorProfile sensor = FLOW_SENSOR_PROFILES[FLOW_SENSOR_LEGACY];
+  int stepRate = 0;
+  do{
+    run.Send(1, &command);
+  }while(!run.Await(HELLO_COMMAND, FLOW_REPLY_TIMEOUT_US / 1e6, packet) && run.now < scenario.duration);
+  if(packet[0] == PACKET_START_BYTE && packet[2] == HELLO_COMMAND){
+    sensor = HelloFlowSensor(packet + 2, packet[1] - PACKET_OVERHEAD_BYTES);
+    stepRate = GetU16(packet + 2 + HELLO_STEP_RATE_OFFSET);
+  }
+
+  run.board.Characterize(TABLE_STEP, table);
+  FlowControllerDefaults(config, mode, true);
+  config->gains = gains;
+  config->stepRate = stepRate;
+  if((mode == FLOW_CONTROL_SMITH || mode == FLOW_CONTROL_MPC) && !IdentifyPlant(plant, *table, scenario.endFlow, &config->model)){
+    fprintf(stderr, "%s: the step test did not give a model\n", scenario.name);
+  }
+  return sensor;
+}
+
+/*!
+ * \brief Sends an absolute move
+ */
+static void SendMoveTo(BenchRun &run, int position)
+{
+  uint8_t move[MOVE_BYTES];
+  move[0] = MOVE_COMMAND;
+  PutU16(move + MOVE_TARGET_OFFSET, position);
+  PutU16(move + MOVE_RATE_OFFSET, 0);
+  run.Send(MOVE_BYTES, move);
+}
+
+/*!
+ * \brief Runs one scenario through the flow loop
+ * \param stepTimes receives the wall time of every controller step in microseconds, or is NULL
+ */
+static void RunScenario(const Scenario &scenario, FlowControlMode mode, const PidGains &gains, SerialCaptureWriter *capture,
+                        BenchResult *result, std::vector<double> *stepTimes)
+{
+  SimPlant plant = {SIM_MAX_FLOW, SIM_FLOW_TIME_CONSTANT, scenario.deadTime, scenario.noise, NULL};
+  BenchRun run(scenario, plant, capture);
+  uint8_t packet[PACKET_MAX_BYTES] = {0};
+  uint8_t command;
+  ValveTable table;
+  FlowControllerConfig config;
+  FlowControllerState state;
+  FlowSensorProfile sensor = SetUpController(run, plant, mode, gains, &table, &config);
+  int position = FlowControllerStart(&state, &config, &table, Setpoint(scenario, run.now), 0);
+  if(position != 0){
+    SendMoveTo(run, position);
+  }
+  run.RunUntil(run.now + state.schedule.period);
+  double lastSample = run.now;
+  int lastDirection = 0;
+  int reversals = 0;
+  int solves = 0;
+  long iterations = 0;
+  int maxIterations = 0;
+  while(run.now < scenario.duration){
+    command = RATE_COMMAND;
+    run.Send(1, &command);
+    bool replied;
+    while(!(replied = run.Await(RATE_COMMAND, FLOW_REPLY_TIMEOUT_US / 1e6, packet)) && run.now < scenario.duration){
+      run.Send(1, &command);
+    }
+    if(!replied){
+      break;
+    }
+    //decoding the reply, the step and encoding the move are what MasterLogic does on the rig; the link above is simulated
+    HotPathEnter("control_bench step");
+    double measured = RateFlow(GetU32(packet + 2 + RATE_KALMAN_OFFSET), sensor);
+    double startUs = stepTimes != NULL ? NowUs() : 0.0;
+    FlowControlAction action = FlowControllerStep(&state, &config, &table, Setpoint(scenario, run.now), measured, position,
+                                                  run.now - lastSample);
+    double stepUs = stepTimes != NULL ? NowUs() - startUs : 0.0;
+    lastSample = run.now;
+    uint8_t move[MOVE_BYTES];
+    move[0] = MOVE_COMMAND;
+    PutU16(move + MOVE_TARGET_OFFSET, action.position);
+    PutU16(move + MOVE_RATE_OFFSET, 0);
+    HotPathLeave();
+    if(stepTimes != NULL){
+      stepTimes->push_back(stepUs);
+    }
+    if(mode == FLOW_CONTROL_MPC){
+      solves++;
+      iterations += state.mpc.iterations;
+      maxIterations = state.mpc.iterations > maxIterations ? state.mpc.iterations : maxIterations;
+    }
+    if(action.move){
+      int direction = action.position > position ? 1 : -1;
+      reversals += lastDirection != 0 && direction != lastDirection ? 1 : 0;
+      lastDirection = direction;
+      run.Send(MOVE_BYTES, move);
+      position = action.position;
+      if(mode == FLOW_CONTROL_DEADBAND){
+        //the legacy move command answers once the motor has stopped
+        while(run.Await(MOVE_DONE_FRAME, MOVE_TIMEOUT_S, packet) && GetU16(packet + 2 + MOVE_DONE_TARGET_OFFSET) != position){
+        }
+      }
+    }
+    run.RunUntil(run.now + action.period);
+  }
+  run.RunUntil(scenario.duration);
+
+  //measure the response to the change
+  bool disturbance = scenario.supplyAt >= 0.0;
+  double changeAt = disturbance ? scenario.supplyAt : scenario.changeAt;
+  double finalAt = disturbance ? scenario.supplyAt : scenario.changeAt + scenario.rampTime;
+  double target = scenario.endFlow;
+  size_t first = 0;
+  while(first < run.time.size() && run.time[first] < changeAt){
+    first++;
+  }
+  double start = first < run.flow.size() ? run.flow[first] : 0.0;
+  double step = disturbance ? 0.0 : target - start;
+  double t10 = -1.0, t90 = -1.0, lastOutside = -1.0, peak = 0.0, steady = 0.0;
+  int steadySamples = 0;
+  memset(result, 0, sizeof(*result));
+  for(size_t i = first; i < run.time.size(); i++){
+    double t = run.time[i];
+    double q = run.flow[i];
+    double h = t - (i > 0 ? run.time[i - 1] : 0.0);
+    double error = fabs(Setpoint(scenario, t) - q);
+    result->iae += error * h;
+    if(step != 0.0){
+      double progress = (q - start) / step;
+      if(t10 < 0.0 && progress >= 0.1){
+        t10 = t;
+      }
+      if(t90 < 0.0 && progress >= 0.9){
+        t90 = t;
+      }
+      double beyond = step > 0.0 ? q - target : target - q;
+      if(t >= finalAt && beyond > peak){
+        peak = beyond;
+      }
+    }
+    else if(error > peak){
+      peak = error;
+    }
+    if(t >= finalAt && fabs(q - target) > SETTLE_BAND * target){
+      lastOutside = t;
+    }
+    if(t >= scenario.duration - STEADY_WINDOW_S){
+      steady += fabs(target - q);
+      steadySamples++;
+    }
+  }
+  result->rise = (t10 >= 0.0 && t90 >= 0.0) ? t90 - t10 : -1.0;
+  result->settled = lastOutside < scenario.duration - METRIC_DT;
+  result->settle = lastOutside < finalAt ? 0.0 : lastOutside - finalAt;
+  result->overshoot = step != 0.0 ? 100.0 * peak / fabs(step) : 100.0 * peak / target;
+  result->sse = steadySamples > 0 ? steady / steadySamples : 0.0;
+  result->steps = run.board.Travel();
+  result->sent = run.sent;
+  result->received = run.received;
+  result->lost = run.lost;
+  result->reversals = reversals;
+  result->iterations = solves > 0 ? (double)iterations / solves : 0.0;
+  result->maxIterations = maxIterations;
+}
+
+/*!
+ *  Metrics of one run of a flow profile
+ */
+typedef struct
+{
+  double finished;	//!< Seconds from the start until the profile ended
+  double maxLate;	//!< Latest a segment start was acted on after it was due, in seconds
+  double volume;	//!< Volume delivered until the valve had closed, in mL
+  double iae;		//!< Integral of the absolute error from the planned setpoint, in mL
+  double steps;		//!< Steps moved by the motor
+} ProfileResult;
+
+/*!
+ * \brief Runs a flow profile through the flow loop, as TeensyControl --profile does
+ * \param loadS delays every wake up of the loop by a random time up to this long, like a busy host
+ * \details The loop sleeps until the earlier of its control period and the next deadline of the profile, and the modes without a model take the feedforward, like MasterLogic.
+ */
+static void RunProfile(FlowProfile *profile, FlowControlMode mode, const PidGains &gains, double loadS, ProfileResult *result)
+{
+  double peak = 0.0;
+  for(int i = 0; i < profile->numSegments; i++){
+    peak = profile->segments[i].flow > peak ? profile->segments[i].flow : peak;
+  }
+  Scenario scenario = {"profile", "", 2.0 * profile->duration + PROFILE_TAIL_S, 0.0, peak, 0.0, 0.0, -1.0, 1.0, BENCH_NOISE, 0.0, 0.0};
+  SimPlant plant = {SIM_MAX_FLOW, SIM_FLOW_TIME_CONSTANT, scenario.deadTime, scenario.noise, NULL};
+  BenchRun run(scenario, plant, NULL);
+  uint8_t packet[PACKET_MAX_BYTES] = {0};
+  uint8_t command;
+  ValveTable table;
+  FlowControllerConfig config;
+  FlowControllerState state;
+  FlowSensorProfile sensor = SetUpController(run, plant, mode, gains, &table, &config);
+  BuildFlowProfile(profile, &table);
+  bool shiftFeedforward = mode == FLOW_CONTROL_PID || mode == FLOW_CONTROL_TABLE || mode == FLOW_CONTROL_DEADBAND;
+  int feedforward = FlowProfileFeedforward(profile, 0.0);
+  int position = FlowControllerStart(&state, &config, &table, FlowProfileSetpoint(profile, 0.0), 0);
+  if(position != 0){
+    SendMoveTo(run, position);
+  }
+  FlowProfileRun profileRun;
+  double startAt = run.now;
+  FlowProfileStart(&profileRun, profile, (int64_t)(startAt * 1e9));
+  run.RunUntil(run.now + state.schedule.period);
+  double lastSample = run.now;
+  uint64_t random = BENCH_SERIAL;
+  while(run.now < scenario.duration){
+    double stepAt = run.now;
+    command = RATE_COMMAND;
+    run.Send(1, &command);
+    bool replied;
+    while(!(replied = run.Await(RATE_COMMAND, FLOW_REPLY_TIMEOUT_US / 1e6, packet)) && run.now < scenario.duration){
+      run.Send(1, &command);
+    }
+    if(!replied){
+      break;
+    }
+    double measured = RateFlow(GetU32(packet + 2 + RATE_KALMAN_OFFSET), sensor);
+    FlowProfileStep profileStep = FlowProfileAdvance(&profileRun, profile, (int64_t)(run.now * 1e9), measured);
+    if(profileStep.done){
+      break;
+    }
+    if(shiftFeedforward && feedforward >= 0 && profileStep.feedforward != feedforward){
+      int steps = profileStep.feedforward - feedforward;
+      FlowControllerShift(&state, &config, steps);
+      position = position + steps < 0 ? 0 : position + steps > MAX_NUM_OF_STEPS ? MAX_NUM_OF_STEPS : position + steps;
+      SendMoveTo(run, position);
+    }
+    feedforward = profileStep.feedforward;
+    FlowControlAction action = FlowControllerStep(&state, &config, &table, profileStep.target, measured, position,
+                                                  run.now - lastSample);
+    lastSample = run.now;
+    if(action.move){
+      SendMoveTo(run, action.position);
+      position = action.position;
+      if(mode == FLOW_CONTROL_DEADBAND){
+        while(run.Await(MOVE_DONE_FRAME, MOVE_TIMEOUT_S, packet) && GetU16(packet + 2 + MOVE_DONE_TARGET_OFFSET) != position){
+        }
+      }
+    }
+    double deadline = stepAt + action.period;
+    double due = (FlowProfileNextDeadline(&profileRun, profile, (int64_t)(run.now * 1e9), measured) - profileRun.startNs) / 1e9 + startAt;
+    deadline = due < deadline ? due : deadline;
+    random = random * 6364136223846793005ULL + 1442695040888963407ULL;
+    deadline += loadS * ((random >> 11) * (1.0 / 9007199254740992.0));
+    run.RunUntil(deadline > run.now ? deadline : run.now);
+  }
+  result->finished = run.now - startAt;
+  result->maxLate = profileRun.maxLateS;
+  //close the valve and let the flow die away, so the volume includes what the close lets through
+  SendMoveTo(run, 0);
+  run.RunUntil(run.now + MOVE_TIMEOUT_S + PROFILE_TAIL_S);
+  result->volume = 0.0;
+  result->iae = 0.0;
+  for(size_t i = 0; i < run.time.size(); i++){
+    double t = run.time[i];
+    double h = t - (i > 0 ? run.time[i - 1] : 0.0);
+    if(t <= startAt){
+      continue;
+    }
+    result->volume += run.flow[i] * h;
+    if(t <= startAt + result->finished){
+      result->iae += fabs(run.flow[i] - FlowProfileSetpoint(profile, t - startAt)) * h;
+    }
+  }
+  result->steps = run.board.Travel();
+}
+
+/*!
+ * \brief Value below which a fraction of the sorted samples lie
+ */
+static double Percentile(const std::vector<double> &sorted, double fraction)
+{
+  if(sorted.empty()){
+    return 0.0;
+  }
+  size_t index = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+  return sorted[index];
+}
+
+/*!
+ * \brief Checks one metric against the baseline
+ * \param slack is an absolute allowance on top of the relative tolerance, so metrics near zero do not trip on noise
+ */
+static bool Regressed(const char *key, const char *metric, double base, double now, double tolerance, double slack)
+{
+  if(now <= base * (1.0 + tolerance / 100.0) + slack){
+    return false;
+  }
+  printf("REGRESSION %-28s %-14s %10.3f -> %10.3f\n", key, metric, base, now);
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  const char *only = NULL;
+  int onlyMode = -1;
+  PidGains gains = {DEFAULT_KP, DEFAULT_KI, 0.0};
+  const char *csvName = NULL;
+  const char *baselineName = NULL;
+  const char *captureName = NULL;
+  double tolerance = DEFAULT_TOLERANCE;
+  bool timing = false;
+  const char *profileName = NULL;
+  double loadMs = 0.0;
+  int opt;
+  while((opt = getopt(argc, argv, "s:m:P:I:D:o:c:t:w:Tp:L:l")) != -1){
+    switch(opt){
+      case 's': only = optarg; break;
+      case 'm':
+        for(int m = 0; m < NUM_MODES; m++){
+          if(strcmp(optarg, MODE_NAMES[m]) == 0){
+            onlyMode = m;
+          }
+        }
+        if(onlyMode < 0){
+          fprintf(stderr, "%s: unknown mode %s\n", argv[0], optarg);
+          return 1;
+        }
+        break;
+      case 'P': gains.kp = atof(optarg); break;
+      case 'I': gains.ki = atof(optarg); break;
+      case 'D': gains.kd = atof(optarg); break;
+      case 'o': csvName = optarg; break;
+      case 'c': baselineName = optarg; break;
+      case 't': tolerance = atof(optarg); break;
+      case 'w': captureName = optarg; break;
+      case 'T': timing = true; break;
+      case 'p': profileName = optarg; break;
+      case 'L': loadMs = atof(optarg); break;
+      case 'l':
+        for(size_t i = 0; i < NUM_SCENARIOS; i++){
+          printf("%-16s %s\n", SCENARIOS[i].name, SCENARIOS[i].description);
+        }
+        return 0;
+      default:
+        fprintf(stderr, "usage: %s [-s scenario] [-m pid|table|deadband|smith|mpc] [-P kp] [-I ki] [-D kd] [-o results.csv] [-c baseline.csv] [-t tolerance_%%] [-w capture] [-T] [-p profile [-L load_ms]] [-l]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if(profileName != NULL){
+    static FlowProfile profile;
+    if(!LoadFlowProfile(profileName, &profile)){
+      return 1;
+    }
+    const FlowSegment *last = &profile.segments[profile.numSegments - 1];
+    printf("%d segments planned to take %.1f s", profile.numSegments, profile.duration);
+    if(last->type == FLOW_SEGMENT_STOP){
+      printf(" and stop at %.1f mL", last->volume);
+    }
+    printf(", wake ups up to %.0f ms late\n", loadMs);
+    printf("%-9s %10s %8s %10s %8s %7s\n", "mode", "finished s", "late ms", "volume mL", "IAE mL", "steps");
+    for(int m = 0; m < NUM_MODES; m++){
+      if(onlyMode >= 0 && m != onlyMode){
+        continue;
+      }
+      ProfileResult r;
+      RunProfile(&profile, (FlowControlMode)m, gains, loadMs / 1000.0, &r);
+      printf("%-9s %10.1f %8.1f %10.1f %8.1f %7.0f\n", MODE_NAMES[m], r.finished, r.maxLate * 1000.0, r.volume, r.iae, r.steps);
+    }
+    return 0;
+  }
+
+  bool known = only == NULL;
+  for(size_t i = 0; i < NUM_SCENARIOS; i++){
+    known = known || strcmp(only, SCENARIOS[i].name) == 0;
+  }
+  if(!known){
+    fprintf(stderr, "%s: no scenario called %s, -l lists them\n", argv[0], only);
+    return 1;
+  }
+
+  std::vector<std::string> keys;
+  std::vector<BenchResult> results;
+  std::vector<std::vector<double> > timings;
+  printf("%-16s %-9s %7s %8s %10s %8s %8s %7s %6s %6s %5s\n", "scenario", "mode", "rise s", "settle s", "overshoot%",
+         "sse mL/s", "IAE mL", "steps", "sent", "recvd", "lost");
+  for(size_t i = 0; i < NUM_SCENARIOS; i++){
+    if(only != NULL && strcmp(only, SCENARIOS[i].name) != 0){
+      continue;
+    }
+    for(int m = 0; m < NUM_MODES; m++){
+      if(onlyMode >= 0 && m != onlyMode){
+        continue;
+      }
+      BenchResult r;
+      SerialCaptureWriter capture;
+      if(captureName != NULL && !capture.Open(captureName, 0)){
+        perror(captureName);
+        return 1;
+      }
+      std::vector<double> stepTimes;
+      RunScenario(SCENARIOS[i], (FlowControlMode)m, gains, captureName ? &capture : NULL, &r, timing ? &stepTimes : NULL);
+      printf("%-16s %-9s %7.2f %7.1f%s %10.1f %8.3f %8.1f %7.0f %6d %6d %5d\n", SCENARIOS[i].name, MODE_NAMES[m], r.rise,
+             r.settle, r.settled ? " " : "+", r.overshoot, r.sse, r.iae, r.steps, r.sent, r.received, r.lost);
+      keys.push_back(std::string(SCENARIOS[i].name) + "," + MODE_NAMES[m]);
+      results.push_back(r);
+      timings.push_back(stepTimes);
+    }
+  }
+  if(timing){
+    printf("\n%-16s %-9s %6s %8s %8s %8s %8s %6s %7s %7s %9s\n", "scenario", "mode", "steps", "p50 us", "p90 us", "p99 us",
+           "max us", "over", "iter", "max it", "reversals");
+    for(size_t i = 0; i < results.size(); i++){
+      std::vector<double> &t = timings[i];
+      std::sort(t.begin(), t.end());
+      int over = (int)(t.end() - std::upper_bound(t.begin(), t.end(), CONTROL_BUDGET_US));
+      size_t comma = keys[i].find(',');
+      printf("%-16s %-9s %6zu %8.2f %8.2f %8.2f %8.2f %6d %7.1f %7d %9d\n", keys[i].substr(0, comma).c_str(),
+             keys[i].substr(comma + 1).c_str(), t.size(), Percentile(t, 0.5), Percentile(t, 0.9), Percentile(t, 0.99),
+             t.empty() ? 0.0 : t.back(), over, results[i].iterations, results[i].maxIterations, results[i].reversals);
+    }
+  }
+  if(csvName != NULL){
+    FILE *csv = fopen(csvName, "w");
+    if(csv == NULL){
+      perror(csvName);
+      return 1;
+    }
+    fprintf(csv, "scenario,mode,rise_s,settle_s,settled,overshoot_pct,sse_mls,iae_ml,motor_steps,frames_sent,frames_received,frames_lost\n");
+    for(size_t i = 0; i < results.size(); i++){
+      const BenchResult &r = results[i];
+      fprintf(csv, "%s,%.3f,%.3f,%d,%.3f,%.4f,%.3f,%.0f,%d,%d,%d\n", keys[i].c_str(), r.rise, r.settle, r.settled ? 1 : 0,
+              r.overshoot, r.sse, r.iae, r.steps, r.sent, r.received, r.lost);
+    }
+    fclose(csv);
+  }
+
+  if(baselineName != NULL){
+    FILE *baseline = fopen(baselineName, "r");
+    if(baseline == NULL){
+      perror(baselineName);
+      return 1;
+    }
+    bool regressed = false;
+    int compared = 0;
+    char line[512];
+    while(fgets(line, sizeof(line), baseline)){
+      char scenario[64], mode[16];
+      BenchResult b;
+      int settled;
+      if(sscanf(line, "%63[^,],%15[^,],%lf,%lf,%d,%lf,%lf,%lf,%lf,%d,%d,%d", scenario, mode, &b.rise, &b.settle, &settled,
+                &b.overshoot, &b.sse, &b.iae, &b.steps, &b.sent, &b.received, &b.lost) != 12){
+        continue;
+      }
+      std::string key = std::string(scenario) + "," + mode;
+      for(size_t i = 0; i < keys.size(); i++){
+        if(keys[i] != key){
+          continue;
+        }
+        const BenchResult &r = results[i];
+        const char *name = key.c_str();
+        compared++;
+        if(settled && !r.settled){
+          printf("REGRESSION %-28s no longer settles\n", name);
+          regressed = true;
+        }
+        regressed = Regressed(name, "rise_s", b.rise, r.rise, tolerance, 0.1) || regressed;
+        regressed = Regressed(name, "settle_s", b.settle, r.settle, tolerance, 0.5) || regressed;
+        regressed = Regressed(name, "overshoot_pct", b.overshoot, r.overshoot, tolerance, 1.0) || regressed;
+        regressed = Regressed(name, "sse_mls", b.sse, r.sse, tolerance, 0.05) || regressed;
+        regressed = Regressed(name, "iae_ml", b.iae, r.iae, tolerance, 1.0) || regressed;
+        regressed = Regressed(name, "motor_steps", b.steps, r.steps, tolerance, 20.0) || regressed;
+        regressed = Regressed(name, "frames", b.sent + b.received, r.sent + r.received, tolerance, 10.0) || regressed;
+      }
+    }
+    fclose(baseline);
+    printf("\n%d runs compared with %s: %s\n", compared, baselineName, regressed ? "control quality regressed" : "no regressions");
+    if(regressed){
+      return 2;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,100 @@
+/*!
+ * \file flowhistory.cpp
+ * \brief Prints the saved flow history of a valve
+ * \details Usage: flowhistory [-S serial] [-c channel] [-b seconds_back] [-w seconds] [-n points] [file]
+ *
+ * Reads the rollups TeensyControl saves in the device profile of a board, or the given file,
+ * and prints time,seconds,count,min,mean,max for the span ending -b seconds before the newest
+ * sample and lasting -w seconds, in at most -n points. The span is a day in 200 points unless
+ * told otherwise. The last line summarises the whole span.
+ */
+#include "flow_history.h"
+#include "device_profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_WINDOW_S 86400		//!< Span printed unless -w is given
+#define DEFAULT_POINTS 200		//!< Most points printed unless -n is given
+#define MAX_POINTS 10000		//!< Most points -n may ask for
+
+static FlowHistory history;		//!< Too big for the stack
+static FlowRollup points[MAX_POINTS];	//!< Points of the span
+
+/*!
+ * \brief Prints one point as a CSV line
+ */
+static void PrintRollup(const char *label, const FlowRollup *r)
+{
+  time_t seconds = r->startNs / 1000000000LL;
+  struct tm local;
+  char when[32];
+  localtime_r(&seconds, &local);
+  strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &local);
+  printf("%s%s,%.0f,%u,%.3f,%.3f,%.3f\n", label, when, r->widthNs / 1e9, r->count, r->min, FlowRollupMean(r), r->max);
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long serialNumber = 0;
+  int channel = 0;
+  double backS = 0.0;
+  double windowS = DEFAULT_WINDOW_S;
+  int maxPoints = DEFAULT_POINTS;
+  int opt;
+  while((opt = getopt(argc, argv, "S:c:b:w:n:")) != -1){
+    if(opt == 'S'){
+      serialNumber = strtoul(optarg, NULL, 0);
+    }
+    else if(opt == 'c'){
+      channel = atoi(optarg);
+    }
+    else if(opt == 'b'){
+      backS = atof(optarg);
+    }
+    else if(opt == 'w'){
+      windowS = atof(optarg);
+    }
+    else if(opt == 'n'){
+      maxPoints = atoi(optarg);
+    }
+    else{
+      fprintf(stderr, "usage: %s [-S serial] [-c channel] [-b seconds_back] [-w seconds] [-n points] [file]\n", argv[0]);
+      return 1;
+    }
+  }
+  if(maxPoints < 1 || maxPoints > MAX_POINTS || windowS <= 0.0){
+    fprintf(stderr, "%s: -n must be 1 to %d and -w above 0\n", argv[0], MAX_POINTS);
+    return 1;
+  }
+  char path[512];
+  if(optind < argc){
+    snprintf(path, sizeof(path), "%s", argv[optind]);
+  }
+  else if(!DeviceProfilePath(serialNumber, channel, FLOW_HISTORY_FILE, path, sizeof(path))){
+    fprintf(stderr, "%s: no profile directory for Teensy %lu\n", argv[0], serialNumber);
+    return 1;
+  }
+  if(!history.Load(path)){
+    fprintf(stderr, "%s: %s is missing or not a flow history\n", argv[0], path);
+    return 1;
+  }
+  if(history.NewestNs() == 0){
+    fprintf(stderr, "%s: %s holds no samples\n", argv[0], path);
+    return 1;
+  }
+
+  int64_t toNs = history.NewestNs() + 1 - (int64_t)(backS * 1e9);
+  int64_t fromNs = toNs - (int64_t)(windowS * 1e9);
+  int n = history.Query(fromNs, toNs, maxPoints, points);
+  printf("time,seconds,count,min,mean,max\n");
+  for(int i = 0; i < n; i++){
+    PrintRollup("", &points[i]);
+  }
+  FlowRollup summary;
+  if(history.Summary(fromNs, toNs, &summary)){
+    PrintRollup("# all ", &summary);
+  }
+  return 0;
+}
@@ -0,0 +1,77 @@
+/*!
+ * \file flowrig.cpp
+ * \brief Holds a flow on every board of a multi-board rig without the GUI
+ * \details Usage: flowrig -f target_mL/s [-p period_ms] [-i io_threads] [-c control_threads] port...
+ *
+ * Every port is driven by the device manager with the gains stored in the profile of its board,
+ * or with the default gains below if the board was never tuned. A status line per board is
+ * printed every second until the program is interrupted.
+ */
+#include "device_manager.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define DEFAULT_PERIOD_MS 100		//!< Control period
+#define DEFAULT_IO_THREADS 1		//!< I/O threads of the manager
+#define DEFAULT_CONTROL_THREADS 2	//!< Control threads of the manager
+#define DEFAULT_KP 3.0			//!< Proportional gain for boards without tuned gains, in steps per mL/s
+#define DEFAULT_KI 1.5			//!< Integral gain for boards without tuned gains, in steps per mL
+#define STATUS_PERIOD_S 1		//!< Time between status lines
+
+static volatile sig_atomic_t quit = 0;	//!< Set by the signal handler to stop the rig
+
+static void HandleSignal(int)
+{
+  quit = 1;
+}
+
+int main(int argc, char **argv)
+{
+  double targetFlow = 0.0;
+  double periodMs = DEFAULT_PERIOD_MS;
+  int ioThreads = DEFAULT_IO_THREADS;
+  int controlThreads = DEFAULT_CONTROL_THREADS;
+  int opt;
+  while((opt = getopt(argc, argv, "f:p:i:c:")) != -1){
+    switch(opt){
+      case 'f': targetFlow = atof(optarg); break;
+      case 'p': periodMs = atof(optarg); break;
+      case 'i': ioThreads = atoi(optarg); break;
+      case 'c': controlThreads = atoi(optarg); break;
+      default: targetFlow = -1.0; break;
+    }
+  }
+  if(targetFlow <= 0.0 || periodMs <= 0.0 || optind >= argc){
+    fprintf(stderr, "usage: %s -f target_mL/s [-p period_ms] [-i io_threads] [-c control_threads] port...\n", argv[0]);
+    return 1;
+  }
+
+  DeviceManager manager(ioThreads, controlThreads);
+  PidGains gains = {DEFAULT_KP, DEFAULT_KI, 0.0};
+  for(int i = optind; i < argc; i++){
+    if(manager.Add(argv[i], targetFlow, gains, periodMs / 1000.0) == NULL){
+      return 1;
+    }
+  }
+  signal(SIGINT, HandleSignal);
+  signal(SIGTERM, HandleSignal);
+  if(!manager.Start()){
+    return 1;
+  }
+  while(!quit){
+    sleep(STATUS_PERIOD_S);
+    for(int i = 0; i < manager.NumDevices(); i++){
+      TeensyDevice *device = manager.Device(i);
+      const char *state = device->state == DEVICE_RUNNING ? "running" : device->state == DEVICE_FAILED ? "failed" : "connecting";
+      printf("%s %-10s serial %-8u flow %7.2f mL/s  valve %4d  p99 %7.1f us%s\n", device->path, state,
+             device->serialNumber, device->flow, device->command, device->jitter.PercentileUs(0.99),
+             device->pidTuned ? "" : "  (default gains)");
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+  manager.Stop();
+  return 0;
+}
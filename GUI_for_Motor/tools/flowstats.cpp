@@ -0,0 +1,513 @@
+/*!
+ * \file flowstats.cpp
+ * \brief Totals and statistics of a run from a capture of its serial traffic
+ * \details Usage: flowstats [-c channel] [-f target_mL/s] [-t tolerance_mL/s] [-b bins] [-g samples] capture...
+ *
+ * Each capture made with TeensyControl --capture or control_bench -w is decoded into columns:
+ * the time and flow of every flow reply and the time and position of every move the host sent.
+ * The flows are converted with the functions of flow_units.h, so they are the flows the
+ * controller acted on. The columns are then reduced in flat loops with several independent
+ * accumulators, which the compiler turns into vector code.
+ *
+ * The report gives the volume delivered, the flow mean, spread and percentiles, a histogram,
+ * the valve travel and reversals and a check for oscillation. The volume is the sum of the
+ * pulses the Teensy counted when the flow was read with the timed or legacy flow command, and
+ * the integral of the flow otherwise. With -f it also gives the share of the time the flow was
+ * within -t of the target (5% of the target unless told otherwise) and the error integrals.
+ * -c picks the valve of a two valve Teensy. -g skips the captures and analyses that many
+ * generated samples instead, to time the analysis on a long run.
+ */
+#include "serial_capture.h"
+#include "frame_parser.h"
+#include "flow_units.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#define STATS_LANES 4			//!< Independent accumulators per loop, enough to fill a vector register of doubles
+#define DEFAULT_BINS 20			//!< Histogram bins unless -b is given
+#define MAX_BINS 200			//!< Most bins -b may ask for
+#define DEFAULT_TOLERANCE 0.05		//!< Tolerance as a fraction of the target unless -t is given
+#define OSCILLATION_BAND 0.02		//!< Band around the mean, as a fraction of it, the flow must leave to count a crossing without -f
+#define OSCILLATION_MIN_CROSSINGS 6	//!< Crossings of the band (three periods) before the flow counts as oscillating
+#define GENERATED_RATE_HZ 100.0		//!< Sample rate of the runs -g generates
+#define HISTOGRAM_WIDTH 50		//!< Characters in the longest histogram bar
+
+/*!
+ *  One run decoded into columns
+ */
+typedef struct
+{
+  std::vector<double> timeS;		//!< Time of each flow sample in seconds from the start of the capture
+  std::vector<double> flow;		//!< Flow of each sample in mL/s
+  std::vector<double> countedMl;	//!< Volume the Teensy counted since the previous read, 0 for a rate sample
+  std::vector<double> moveTimeS;	//!< Time of each move in seconds from the start of the capture
+  std::vector<double> movePosition;	//!< Position each move went to, in steps from fully closed
+  size_t countedSamples;		//!< Samples that came with a pulse count
+  FlowSensorProfile sensor;		//!< Flow sensor profile from the hello reply
+} RunColumns;
+
+/*!
+ *  Everything reported about one run
+ */
+typedef struct
+{
+  double duration;			//!< Seconds from the first to the last sample
+  double volume;			//!< mL delivered
+  bool countedVolume;			//!< The volume is the sum of counted pulses rather than an integral
+  double mean;				//!< Mean of the samples in mL/s
+  double timeMean;			//!< Mean over time in mL/s
+  double stddev;			//!< Standard deviation of the samples in mL/s
+  double min;
+  double max;
+  double percentiles[7];		//!< At PERCENTILES
+  double inTolerance;			//!< Share of the time within the tolerance of the target
+  double iae;				//!< Integral of the absolute error in mL
+  double rmsError;			//!< Root mean square error in mL/s
+  double travel;			//!< Steps the valve was commanded to move
+  int reversals;			//!< Changes of direction of the valve
+  int crossings;			//!< Times the flow went from one side of the band to the other
+  double period;			//!< Mean period of those crossings in seconds, 0 if there were none
+  unsigned int histogram[MAX_BINS];	//!< Samples per bin from min to max
+} RunStats;
+
+static const double PERCENTILES[7] = {1.0, 5.0, 25.0, 50.0, 75.0, 95.0, 99.0};	//!< Percentiles reported
+
+static int64_t NowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*!
+ * \brief Sum of term(i) for i from begin to end, end excluded
+ * \details Keeps STATS_LANES partial sums so consecutive terms do not wait on each other and can share a vector instruction.
+ */
+template <typename Term>
+static double LaneSum(size_t begin, size_t end, Term term)
+{
+  double lanes[STATS_LANES] = {0.0};
+  size_t i = begin;
+  for(; i + STATS_LANES <= end; i += STATS_LANES){
+    for(size_t l = 0; l < STATS_LANES; l++){
+      lanes[l] += term(i + l);
+    }
+  }
+  double sum = 0.0;
+  for(size_t l = 0; l < STATS_LANES; l++){
+    sum += lanes[l];
+  }
+  for(; i < end; i++){
+    sum += term(i);
+  }
+  return sum;
+}
+
+/*!
+ * \brief Lowest and highest value of a column
+ */
+static void MinMax(const double *x, size_t n, double *min, double *max)
+{
+  double lo[STATS_LANES], hi[STATS_LANES];
+  for(size_t l = 0; l < STATS_LANES; l++){
+    lo[l] = x[0];
+    hi[l] = x[0];
+  }
+  size_t i = 0;
+  for(; i + STATS_LANES <= n; i += STATS_LANES){
+    for(size_t l = 0; l < STATS_LANES; l++){
+      lo[l] = x[i + l] < lo[l] ? x[i + l] : lo[l];
+      hi[l] = x[i + l] > hi[l] ? x[i + l] : hi[l];
+    }
+  }
+  for(; i < n; i++){
+    lo[0] = x[i] < lo[0] ? x[i] : lo[0];
+    hi[0] = x[i] > hi[0] ? x[i] : hi[0];
+  }
+  *min = lo[0];
+  *max = hi[0];
+  for(size_t l = 1; l < STATS_LANES; l++){
+    *min = lo[l] < *min ? lo[l] : *min;
+    *max = hi[l] > *max ? hi[l] : *max;
+  }
+}
+
+/*!
+ * \brief Counts the times a signal goes from one side of a band to the other
+ * \param x is the signal, relative to the middle of the band
+ * \param band is the half width of the band; values inside it belong to neither side
+ * \param times receives the time of the first crossing in first and of the last in last
+ * \details The side of every sample is worked out in one flat pass; only the pass that follows the sides is sequential.
+ */
+static int CountCrossings(const double *x, size_t n, double band, const double *timeS, double *first, double *last)
+{
+  std::vector<signed char> side(n);
+  for(size_t i = 0; i < n; i++){
+    side[i] = (x[i] > band) - (x[i] < -band);
+  }
+  int crossings = 0;
+  signed char previous = 0;
+  for(size_t i = 0; i < n; i++){
+    if(side[i] == 0){
+      continue;
+    }
+    if(previous != 0 && side[i] != previous){
+      if(crossings == 0){
+        *first = timeS[i];
+      }
+      *last = timeS[i];
+      crossings++;
+    }
+    previous = side[i];
+  }
+  return crossings;
+}
+
+/*!
+ * \brief Reduces the columns of a run to its statistics
+ * \param target is the flow to hold in mL/s, or 0 for none
+ */
+static void Analyse(const RunColumns &run, double target, double tolerance, int bins, RunStats *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  size_t n = run.flow.size();
+  if(n == 0){
+    return;
+  }
+  const double *t = run.timeS.data();
+  const double *f = run.flow.data();
+  stats->duration = t[n - 1] - t[0];
+
+  //each sample holds until the next one, so the last sample carries no time
+  stats->countedVolume = run.countedSamples == n;
+  if(stats->countedVolume){
+    //the first count covers time before the capture started
+    const double *counted = run.countedMl.data();
+    stats->volume = LaneSum(1, n, [=](size_t i){ return counted[i]; });
+  }
+  else{
+    stats->volume = LaneSum(1, n, [=](size_t i){ return 0.5 * (f[i] + f[i - 1]) * (t[i] - t[i - 1]); });
+  }
+  double sum = LaneSum(0, n, [=](size_t i){ return f[i]; });
+  stats->mean = sum / n;
+  double mean = stats->mean;
+  double squares = LaneSum(0, n, [=](size_t i){ return (f[i] - mean) * (f[i] - mean); });
+  stats->stddev = sqrt(squares / n);
+  stats->timeMean = stats->duration > 0.0 ? LaneSum(0, n - 1, [=](size_t i){ return f[i] * (t[i + 1] - t[i]); }) / stats->duration : mean;
+  MinMax(f, n, &stats->min, &stats->max);
+
+  //percentiles from successive partial sorts of one copy
+  std::vector<double> sorted(run.flow);
+  size_t from = 0;
+  for(int p = 0; p < 7; p++){
+    size_t k = (size_t)(PERCENTILES[p] / 100.0 * (n - 1) + 0.5);
+    std::nth_element(sorted.begin() + from, sorted.begin() + k, sorted.end());
+    stats->percentiles[p] = sorted[k];
+    from = k;
+  }
+
+  //bin numbers in one flat pass, then the counts
+  double span = stats->max - stats->min;
+  double scale = span > 0.0 ? bins / span : 0.0;
+  double lowest = stats->min;
+  std::vector<int> bin(n);
+  for(size_t i = 0; i < n; i++){
+    int b = (int)((f[i] - lowest) * scale);
+    bin[i] = b < bins ? b : bins - 1;
+  }
+  for(size_t i = 0; i < n; i++){
+    stats->histogram[bin[i]]++;
+  }
+
+  double middle = target > 0.0 ? target : mean;
+  double band = target > 0.0 ? tolerance : fabs(mean) * OSCILLATION_BAND;
+  if(target > 0.0 && stats->duration > 0.0){
+    double inside = LaneSum(0, n - 1, [=](size_t i){ return fabs(f[i] - target) <= tolerance ? t[i + 1] - t[i] : 0.0; });
+    stats->inTolerance = inside / stats->duration;
+    stats->iae = LaneSum(0, n - 1, [=](size_t i){ return fabs(f[i] - target) * (t[i + 1] - t[i]); });
+    stats->rmsError = sqrt(LaneSum(0, n, [=](size_t i){ return (f[i] - target) * (f[i] - target); }) / n);
+  }
+  std::vector<double> error(n);
+  for(size_t i = 0; i < n; i++){
+    error[i] = f[i] - middle;
+  }
+  double firstS = 0.0, lastS = 0.0;
+  stats->crossings = CountCrossings(error.data(), n, band, t, &firstS, &lastS);
+  stats->period = stats->crossings > 1 ? 2.0 * (lastS - firstS) / (stats->crossings - 1) : 0.0;
+
+  size_t moves = run.movePosition.size();
+  if(moves > 1){
+    const double *p = run.movePosition.data();
+    stats->travel = LaneSum(1, moves, [=](size_t i){ return fabs(p[i] - p[i - 1]); });
+    std::vector<double> step(moves - 1);
+    for(size_t i = 1; i < moves; i++){
+      step[i - 1] = p[i] - p[i - 1];
+    }
+    double unused;
+    stats->reversals = CountCrossings(step.data(), moves - 1, 0.0, run.moveTimeS.data() + 1, &unused, &unused);
+  }
+}
+
+/*!
+ *  Decoding state of one capture
+ */
+typedef struct
+{
+  int channel;			//!< Valve being analysed
+  int64_t startNs;		//!< Time of the start of the capture
+  int64_t lastLegacyNs;		//!< Time of the previous legacy flow reply
+  double position;		//!< Position the host last commanded
+  RunColumns *run;
+} CaptureDecoder;
+
+/*!
+ * \brief Finds the channel of a frame and its inner payload
+ */
+static int Unwrap(const uint8_t *packet, unsigned int size, const uint8_t **payload, unsigned int *payloadSize)
+{
+  *payload = packet + 2;
+  *payloadSize = size - PACKET_OVERHEAD_BYTES;
+  if((*payload)[0] == CHANNEL_COMMAND && *payloadSize > CHANNEL_INNER_OFFSET){
+    int channel = (*payload)[CHANNEL_INDEX_OFFSET];
+    *payload += CHANNEL_INNER_OFFSET;
+    *payloadSize -= CHANNEL_INNER_OFFSET;
+    return channel;
+  }
+  return 0;
+}
+
+/*!
+ * \brief Adds a move to the columns
+ */
+static void AddMove(CaptureDecoder *decoder, double position, int64_t timeNs)
+{
+  decoder->position = position;
+  decoder->run->moveTimeS.push_back((timeNs - decoder->startNs) / 1e9);
+  decoder->run->movePosition.push_back(position);
+}
+
+/*!
+ * \brief Adds a flow sample to the columns
+ */
+static void AddSample(CaptureDecoder *decoder, double flow, double countedMl, bool counted, int64_t timeNs)
+{
+  decoder->run->timeS.push_back((timeNs - decoder->startNs) / 1e9);
+  decoder->run->flow.push_back(flow);
+  decoder->run->countedMl.push_back(countedMl);
+  if(counted){
+    decoder->run->countedSamples++;
+  }
+}
+
+/*!
+ * \brief Decodes one frame of the capture
+ */
+static void DecodeFrame(CaptureDecoder *decoder, SerialDirection direction, const uint8_t *packet, unsigned int size, int64_t timeNs)
+{
+  const uint8_t *payload;
+  unsigned int payloadSize;
+  int channel = Unwrap(packet, size, &payload, &payloadSize);
+  //the hello reply holds the calibration of the whole board
+  if(direction == SERIAL_FROM_TEENSY && payload[0] == HELLO_COMMAND && payloadSize > HELLO_NUM_COMMANDS_OFFSET){
+    decoder->run->sensor = HelloFlowSensor(payload, payloadSize);
+    return;
+  }
+  if(channel != decoder->channel){
+    return;
+  }
+  const FlowSensorProfile &sensor = decoder->run->sensor;
+  if(direction == SERIAL_TO_TEENSY){
+    if(payload[0] == MOVE_COMMAND && payloadSize == MOVE_BYTES){
+      AddMove(decoder, GetU16(payload + MOVE_TARGET_OFFSET), timeNs);
+    }
+    else if(payload[0] == MOTOR_COMMAND && payloadSize == 4){
+      int steps = payload[2] * payload[3];
+      AddMove(decoder, decoder->position + (payload[1] == 'B' ? steps : -steps), timeNs);
+    }
+    return;
+  }
+  if(payload[0] == RATE_COMMAND && payloadSize == RATE_BYTES){
+    AddSample(decoder, RateFlow(GetU32(payload + RATE_KALMAN_OFFSET), sensor), 0.0, false, timeNs);
+  }
+  else if(payload[0] == TIMED_FLOW_COMMAND && payloadSize == TIMED_FLOW_BYTES){
+    uint32_t pulses = GetU32(payload + TIMED_FLOW_PULSES_OFFSET);
+    uint32_t windowUs = GetU32(payload + TIMED_FLOW_WINDOW_OFFSET);
+    AddSample(decoder, TimedFlow(pulses, windowUs, sensor), PulseVolume(pulses, windowUs / 1e6, sensor), true, timeNs);
+  }
+  else if(payload[0] == FLOW_COMMAND && payloadSize >= 3){
+    //the host divides by whole seconds of wall time, which the capture cannot reproduce exactly
+    unsigned int pulses = payload[1] + payload[2] * 256;
+    double seconds = decoder->lastLegacyNs != 0 ? (timeNs - decoder->lastLegacyNs) / 1e9 : 0.0;
+    decoder->lastLegacyNs = timeNs;
+    AddSample(decoder, CountFlow(pulses, seconds, sensor), PulseVolume(pulses, seconds, sensor), true, timeNs);
+  }
+  else if(payload[0] == MOVE_DONE_FRAME && payloadSize == MOVE_DONE_BYTES && payload[MOVE_DONE_ABORTED_OFFSET]){
+    //an aborted move stopped short of its target
+    AddMove(decoder, GetU16(payload + MOVE_DONE_POSITION_OFFSET), timeNs);
+  }
+}
+
+/*!
+ * \brief Decodes a capture into columns
+ * \details Returns false if the file is not a capture.
+ */
+static bool LoadCapture(const char *fileName, int channel, RunColumns *run)
+{
+  SerialCaptureReader reader;
+  SerialCaptureRecord record;
+  if(!reader.Open(fileName)){
+    return false;
+  }
+  CaptureDecoder decoder;
+  decoder.channel = channel;
+  decoder.startNs = reader.StartNs();
+  decoder.lastLegacyNs = 0;
+  decoder.position = 0.0;
+  decoder.run = run;
+  run->countedSamples = 0;
+  run->sensor = FLOW_SENSOR_PROFILES[FLOW_SENSOR_LEGACY];
+  FrameParser parsers[2];
+  while(reader.Next(&record)){
+    FrameParser *parser = &parsers[record.direction];
+    for(unsigned int i = 0; i < record.size; i++){
+      if(parser->Feed(record.data[i])){
+        DecodeFrame(&decoder, record.direction, parser->Packet(), parser->Size(), record.timeNs);
+      }
+    }
+  }
+  return true;
+}
+
+/*!
+ * \brief Fills the columns with a long run around a target, for timing the analysis
+ * \details The flow wanders around the target with a slow swing and some noise, and the valve makes a small correction every tenth sample.
+ */
+static void GenerateRun(size_t samples, double target, RunColumns *run)
+{
+  uint64_t random = 88172645463325252ULL;
+  double scale = target > 0.0 ? target : 50.0;
+  run->sensor = FLOW_SENSOR_PROFILES[FLOW_SENSOR_LEGACY];
+  run->countedSamples = 0;
+  run->timeS.resize(samples);
+  run->flow.resize(samples);
+  run->countedMl.assign(samples, 0.0);
+  for(size_t i = 0; i < samples; i++){
+    random ^= random << 13;
+    random ^= random >> 7;
+    random ^= random << 17;
+    double noise = (random % 2001 - 1000.0) / 1000.0;
+    run->timeS[i] = i / GENERATED_RATE_HZ;
+    run->flow[i] = scale * (1.0 + 0.03 * sin(run->timeS[i] * 0.5) + 0.01 * noise);
+    if(i % 10 == 0){
+      run->moveTimeS.push_back(run->timeS[i]);
+      run->movePosition.push_back(1000.0 + (random % 21) - 10.0);
+    }
+  }
+}
+
+/*!
+ * \brief Prints the report of one run
+ */
+static void PrintStats(const char *name, const RunColumns &run, const RunStats &stats, double target, double tolerance, int bins)
+{
+  size_t n = run.flow.size();
+  printf("%s: %s flow sensor, %.3f mL per pulse\n", name, run.sensor.name, CalibrationMlPerPulse(run.sensor.nominalUl));
+  if(n == 0){
+    printf("  no flow samples\n");
+    return;
+  }
+  printf("  Duration      %10.1f s, %zu samples (%.1f/s)\n", stats.duration, n,
+         stats.duration > 0.0 ? (n - 1) / stats.duration : 0.0);
+  printf("  Volume        %10.1f mL (%s)\n", stats.volume, stats.countedVolume ? "pulses counted by the Teensy" : "integrated flow");
+  printf("  Flow mean     %10.3f mL/s, %.3f over time, std dev %.3f\n", stats.mean, stats.timeMean, stats.stddev);
+  printf("  Flow range    %10.3f to %.3f mL/s\n", stats.min, stats.max);
+  printf("  Percentiles  ");
+  for(int p = 0; p < 7; p++){
+    printf(" p%g %.3f", PERCENTILES[p], stats.percentiles[p]);
+  }
+  printf("\n");
+  if(target > 0.0){
+    printf("  In tolerance  %10.1f %% of the time within %.3f mL/s of %.3f\n", stats.inTolerance * 100.0, tolerance, target);
+    printf("  Error         %10.3f mL absolute integral, %.3f mL/s rms\n", stats.iae, stats.rmsError);
+  }
+  printf("  Valve         %10zu moves, %.0f steps of travel, %d reversals\n", run.movePosition.size(), stats.travel, stats.reversals);
+  if(stats.crossings >= OSCILLATION_MIN_CROSSINGS){
+    printf("  Oscillation   %10d crossings, period %.2f s\n", stats.crossings, stats.period);
+  }
+  else{
+    printf("  Oscillation   %10s (%d crossings)\n", "none", stats.crossings);
+  }
+  unsigned int most = 1;
+  for(int b = 0; b < bins; b++){
+    most = stats.histogram[b] > most ? stats.histogram[b] : most;
+  }
+  double width = (stats.max - stats.min) / bins;
+  for(int b = 0; b < bins; b++){
+    int bar = (int)((uint64_t)stats.histogram[b] * HISTOGRAM_WIDTH / most);
+    printf("  %9.3f %8u %.*s\n", stats.min + b * width, stats.histogram[b], bar,
+           "##################################################");
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int channel = 0;
+  double target = 0.0;
+  double tolerance = -1.0;
+  int bins = DEFAULT_BINS;
+  long generate = 0;
+  int opt;
+  bool ok = true;
+  while((opt = getopt(argc, argv, "c:f:t:b:g:")) != -1){
+    switch(opt){
+      case 'c': channel = atoi(optarg); break;
+      case 'f': target = atof(optarg); break;
+      case 't': tolerance = atof(optarg); break;
+      case 'b': bins = atoi(optarg); break;
+      case 'g': generate = atol(optarg); break;
+      default: ok = false; break;
+    }
+  }
+  if(!ok || bins < 1 || bins > MAX_BINS || (generate <= 0 && optind >= argc)){
+    fprintf(stderr, "usage: %s [-c channel] [-f target_mL/s] [-t tolerance_mL/s] [-b bins] [-g samples] capture...\n", argv[0]);
+    return 1;
+  }
+  if(tolerance < 0.0){
+    tolerance = target * DEFAULT_TOLERANCE;
+  }
+
+  int status = 0;
+  int last = generate > 0 ? optind + 1 : argc;
+  for(int i = optind; i < last; i++){
+    RunColumns run;
+    RunStats stats;
+    char name[64];
+    const char *runName = name;
+    int64_t loadNs = NowNs();
+    if(generate > 0){
+      GenerateRun(generate, target, &run);
+      snprintf(name, sizeof(name), "%ld generated samples", generate);
+    }
+    else if(!LoadCapture(argv[i], channel, &run)){
+      fprintf(stderr, "%s: %s is not a serial capture\n", argv[0], argv[i]);
+      status = 1;
+      continue;
+    }
+    else{
+      runName = argv[i];
+    }
+    int64_t analyseNs = NowNs();
+    Analyse(run, target, tolerance, bins, &stats);
+    int64_t doneNs = NowNs();
+    PrintStats(runName, run, stats, target, tolerance, bins);
+    printf("  %s in %.1f ms, analysed in %.1f ms\n\n", generate > 0 ? "generated" : "decoded",
+           (analyseNs - loadNs) / 1e6, (doneNs - analyseNs) / 1e6);
+  }
+  return status;
+}
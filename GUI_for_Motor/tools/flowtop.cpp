@@ -0,0 +1,124 @@
+/*!
+ * \file flowtop.cpp
+ * \brief top style viewer for the status the controller publishes in shared memory
+ * \details Usage: flowtop [-s segment_name] [-d refresh_ms] [-l trace.csv]. Valve 0 publishes to /piflow_status and valve n to /piflow_status<n>.
+ * -l appends every new sample as time_s,position,flow, the trace tune_sweep -r fits its plant to.
+ */
+#include "status_shm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_REFRESH_MS 500	//!< Time between screen refreshes
+
+static volatile sig_atomic_t quit = 0;	//!< Set by the signal handler to leave the display loop
+
+static void HandleSignal(int)
+{
+  quit = 1;
+}
+
+/*!
+ * \brief Current CLOCK_MONOTONIC time in nanoseconds
+ */
+static int64_t MonotonicNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+  const char *name = FLOW_STATUS_SHM_NAME;
+  int refreshMs = DEFAULT_REFRESH_MS;
+  FILE *trace = NULL;
+  int opt;
+  while((opt = getopt(argc, argv, "s:d:l:")) != -1){
+    if(opt == 's'){
+      name = optarg;
+    }
+    else if(opt == 'd'){
+      refreshMs = atoi(optarg);
+    }
+    else if(opt == 'l'){
+      trace = fopen(optarg, "a");
+      if(trace == NULL){
+        perror(optarg);
+        return 1;
+      }
+    }
+    else{
+      fprintf(stderr, "usage: %s [-s segment_name] [-d refresh_ms] [-l trace.csv]\n", argv[0]);
+      return 1;
+    }
+  }
+  if(refreshMs <= 0){
+    refreshMs = DEFAULT_REFRESH_MS;
+  }
+  signal(SIGINT, HandleSignal);
+  signal(SIGTERM, HandleSignal);
+
+  FlowStatusReader reader;
+  FlowStatus status, previous;
+  memset(&previous, 0, sizeof(previous));
+  int64_t previousNs = MonotonicNs();
+  int64_t traceStartNs = 0;
+
+  while(!quit){
+    if(!reader.IsOpen() && !reader.Open(name)){
+      printf("\033[H\033[2J%s: waiting for the controller to publish %s\n", argv[0], name);
+      fflush(stdout);
+      usleep(refreshMs * 1000);
+      continue;
+    }
+    if(!reader.Read(&status)){
+      //the writer went away or restarted; map the segment again
+      reader.Close();
+      continue;
+    }
+    int64_t nowNs = MonotonicNs();
+    if(trace != NULL && status.running && status.updateCount != previous.updateCount){
+      if(traceStartNs == 0){
+        traceStartNs = status.timestampNs;
+      }
+      fprintf(trace, "%.3f,%d,%.3f\n", (status.timestampNs - traceStartNs) / 1e9, status.position, status.flow);
+      fflush(trace);
+    }
+    double updatesPerSec = 0.0;
+    if(previous.updateCount != 0 && status.updateCount >= previous.updateCount){
+      updatesPerSec = (status.updateCount - previous.updateCount) * 1e9 / (double)(nowNs - previousNs);
+    }
+    printf("\033[H\033[2J");
+    printf("Pi-Flow status  (%s, writer pid %u)\n\n", name, reader.WriterPid());
+    printf("  Teensy serial   %u\n", status.serialNumber);
+    printf("  Valve           %u\n", status.channel);
+    printf("  State           %s\n", status.running ? "running" : "stopped");
+    printf("  Flow            %8.2f mL/s\n", status.flow);
+    printf("  Target flow     %8.2f mL/s\n", status.targetFlow);
+    printf("  Error           %8.2f mL/s\n", status.flow - status.targetFlow);
+    printf("  Valve position  %8d steps\n", status.position);
+    printf("\n  Updates         %8llu (%.1f/s)\n", (unsigned long long)status.updateCount, updatesPerSec);
+    printf("  Sample age      %8.1f ms\n", (nowNs - status.timestampNs) / 1e6);
+    //older writers and unsynced clocks leave the link times at 0 or -1
+    if(status.uplinkUs > 0 || status.downlinkUs > 0){
+      printf("  Link up/down    %8.3f / %.3f ms\n", status.uplinkUs / 1e3, status.downlinkUs / 1e3);
+      printf("  Clock drift     %8.2f ppm\n", status.clockDriftPpm);
+    }
+    else{
+      printf("  Link up/down         unknown\n");
+    }
+    fflush(stdout);
+    previous = status;
+    previousNs = nowNs;
+    usleep(refreshMs * 1000);
+  }
+  printf("\n");
+  if(trace != NULL){
+    fclose(trace);
+  }
+  return 0;
+}
@@ -0,0 +1,170 @@
+/*!
+ * \file fuzz_frame_parser.cpp
+ * \brief libFuzzer harness of the frame parser shared by the firmware and the host
+ * \details Built as fuzz_frame_parser with clang when CMake is run with -DFUZZ_FRAME_PARSER=ON:
+ *
+ *     fuzz_frame_parser -max_len=2048 ../tools/fuzz_corpus/frame_parser
+ *
+ * The input is fed through a FrameParser a byte at a time and compared with a reference that
+ * splits the whole buffer into packets the way the protocol describes them. The packets, their
+ * order and every counter of the parser must agree, every packet must carry a start byte, a
+ * length that matches its size and a checksum that clears, and a parser that was Reset() must
+ * give the same packets again. Any difference aborts, which libFuzzer reports as a crash.
+ *
+ * Built with FUZZ_STANDALONE, as the fuzz_frame_parser_replay tool, the harness instead runs
+ * the files named on the command line once each, so the corpus can be checked without clang.
+ */
+#include "frame_parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+/*!
+ *  Where one packet sits in the input
+ */
+typedef struct
+{
+  size_t offset;	//!< Index of the start byte
+  unsigned int size;	//!< Size of the packet
+} FrameSpan;
+
+/*!
+ *  What the reference made of an input
+ */
+typedef struct
+{
+  std::vector<FrameSpan> frames;	//!< Valid packets in order
+  uint32_t skippedBytes;		//!< Bytes outside a packet that were not a start byte
+  uint32_t badLengths;			//!< Length bytes out of range
+  uint32_t badChecksums;		//!< Complete packets whose checksum did not clear
+} ReferenceResult;
+
+/*!
+ * \brief Splits a whole buffer into packets
+ * \details A start byte with a length out of range gives up the length byte as well; a bad
+ * checksum gives up the whole packet. A packet cut off by the end of the input is not counted.
+ */
+static void ReferenceParse(const uint8_t *data, size_t size, ReferenceResult *result)
+{
+  result->frames.clear();
+  result->skippedBytes = 0;
+  result->badLengths = 0;
+  result->badChecksums = 0;
+  size_t i = 0;
+  while(i < size){
+    if(data[i] != PACKET_START_BYTE){
+      result->skippedBytes++;
+      i++;
+      continue;
+    }
+    if(i + 1 >= size){
+      return;
+    }
+    unsigned int length = data[i + 1];
+    if(length < PACKET_MIN_BYTES || length > PACKET_MAX_BYTES){
+      result->badLengths++;
+      i += 2;
+      continue;
+    }
+    if(i + length > size){
+      return;
+    }
+    uint8_t checksum = 0;
+    for(unsigned int j = 0; j < length; j++){
+      checksum ^= data[i + j];
+    }
+    if(checksum == 0){
+      FrameSpan span = {i, length};
+      result->frames.push_back(span);
+    }
+    else{
+      result->badChecksums++;
+    }
+    i += length;
+  }
+}
+
+/*!
+ * \brief Feeds the input to a parser and checks every packet against the reference
+ */
+static void CheckParser(FrameParser *parser, const uint8_t *data, size_t size, const ReferenceResult *reference)
+{
+  size_t next = 0;
+  for(size_t i = 0; i < size; i++){
+    if(!parser->Feed(data[i])){
+      continue;
+    }
+    const uint8_t *packet = parser->Packet();
+    unsigned int packetSize = parser->Size();
+    if(next >= reference->frames.size()){
+      abort();
+    }
+    const FrameSpan *span = &reference->frames[next++];
+    //the packet ends on the byte that completed it
+    if(span->size != packetSize || span->offset + packetSize != i + 1 || memcmp(packet, data + span->offset, packetSize) != 0){
+      abort();
+    }
+    if(packet[0] != PACKET_START_BYTE || packet[1] != packetSize || packetSize < PACKET_MIN_BYTES || packetSize > PACKET_MAX_BYTES){
+      abort();
+    }
+    uint8_t checksum = 0;
+    for(unsigned int j = 0; j < packetSize; j++){
+      checksum ^= packet[j];
+    }
+    if(checksum != 0){
+      abort();
+    }
+  }
+  if(next != reference->frames.size()){
+    abort();
+  }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  static ReferenceResult reference;
+  ReferenceParse(data, size, &reference);
+
+  FrameParser parser;
+  CheckParser(&parser, data, size, &reference);
+  if(parser.Frames() != reference.frames.size() || parser.SkippedBytes() != reference.skippedBytes ||
+     parser.BadLengths() != reference.badLengths || parser.BadChecksums() != reference.badChecksums){
+    abort();
+  }
+  //a partial packet must not leak past Reset()
+  parser.Reset();
+  CheckParser(&parser, data, size, &reference);
+  if(parser.Frames() != 2 * reference.frames.size()){
+    abort();
+  }
+  return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int argc, char **argv)
+{
+  if(argc < 2){
+    fprintf(stderr, "usage: %s input...\n", argv[0]);
+    return 1;
+  }
+  std::vector<uint8_t> input;
+  for(int i = 1; i < argc; i++){
+    FILE *file = fopen(argv[i], "rb");
+    if(file == NULL){
+      fprintf(stderr, "%s: cannot open %s\n", argv[0], argv[i]);
+      return 1;
+    }
+    input.clear();
+    uint8_t chunk[4096];
+    size_t n;
+    while((n = fread(chunk, 1, sizeof(chunk), file)) > 0){
+      input.insert(input.end(), chunk, chunk + n);
+    }
+    fclose(file);
+    LLVMFuzzerTestOneInput(input.data(), input.size());
+  }
+  printf("%d inputs passed\n", argc - 1);
+  return 0;
+}
+#endif
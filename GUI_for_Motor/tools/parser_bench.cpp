@@ -0,0 +1,248 @@
+/*!
+ * \file parser_bench.cpp
+ * \brief Throughput benchmark of the frame parser shared by the firmware and the host
+ * \details Usage: parser_bench [-s stream] [-m megabytes] [-r rounds] [-l]
+ *
+ * Every stream is built once from a fixed seed, so each revision parses the same bytes, and is
+ * then fed through a FrameParser a byte at a time the way ReadPacket, the device manager and
+ * the firmware feed it. The best of -r rounds is reported as MB/s and frames/s together with the
+ * counters of the parser. -l lists the streams.
+ *
+ * The clean stream is the mix of replies a running rig sends. The noisy stream is the same mix
+ * with flipped bits and bursts of line noise. The adversarial streams are what a parser handles
+ * worst: nothing but start bytes, start bytes followed by lengths out of range, and packets of
+ * the largest size whose checksum fails, so every byte is collected and then thrown away.
+ * A clean stream that does not give back every packet is an error and exits with status 2.
+ */
+#include "frame_parser.h"
+#include "device_manager.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#define DEFAULT_MEGABYTES 16		//!< Size of each stream
+#define DEFAULT_ROUNDS 5		//!< Rounds per stream, the best one is reported
+#define STREAM_SEED 0x5eed1234u		//!< Seed of every stream
+#define NOISE_FLIP_EVERY 2000		//!< Mean bytes between flipped bits in the noisy stream
+#define NOISE_BURST_EVERY 20000		//!< Mean bytes between bursts of noise in the noisy stream
+#define NOISE_BURST_BYTES 64		//!< Longest burst of noise
+
+/*!
+ * \brief Small xorshift generator so the streams do not depend on the C library
+ */
+static uint32_t NextRandom(uint32_t *state)
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+/*!
+ * \brief Appends a packet with the given payload, with its checksum broken if asked
+ */
+static void AppendPacket(std::vector<uint8_t> &stream, const uint8_t *payload, unsigned int payloadSize, bool badChecksum)
+{
+  unsigned int packetSize = payloadSize + PACKET_OVERHEAD_BYTES;
+  uint8_t checksum = PACKET_START_BYTE ^ (uint8_t)packetSize;
+  stream.push_back(PACKET_START_BYTE);
+  stream.push_back((uint8_t)packetSize);
+  for(unsigned int i = 0; i < payloadSize; i++){
+    stream.push_back(payload[i]);
+    checksum ^= payload[i];
+  }
+  stream.push_back(badChecksum ? (uint8_t)~checksum : checksum);
+}
+
+/*!
+ * \brief Appends one reply of the mix a running rig sends
+ * \details Mostly filtered rates and timed flows, some channel wrapped, with the odd hello and clock sync reply.
+ */
+static void AppendReply(std::vector<uint8_t> &stream, uint32_t *seed)
+{
+  uint8_t payload[PACKET_MAX_BYTES];
+  unsigned int size;
+  uint32_t pick = NextRandom(seed) % 100;
+  if(pick < 45){
+    size = RATE_BYTES;
+    payload[0] = RATE_COMMAND;
+  }
+  else if(pick < 80){
+    size = TIMED_FLOW_BYTES;
+    payload[0] = TIMED_FLOW_COMMAND;
+  }
+  else if(pick < 95){
+    size = SYNC_BYTES;
+    payload[0] = SYNC_COMMAND;
+  }
+  else{
+    size = HELLO_COMMANDS_OFFSET + 16;
+    payload[0] = HELLO_COMMAND;
+  }
+  for(unsigned int i = 1; i < size; i++){
+    payload[i] = (uint8_t)NextRandom(seed);
+  }
+  if(NextRandom(seed) % 4 == 0){
+    uint8_t wrapped[PACKET_MAX_BYTES];
+    wrapped[0] = CHANNEL_COMMAND;
+    wrapped[CHANNEL_INDEX_OFFSET] = 1;
+    memcpy(wrapped + CHANNEL_INNER_OFFSET, payload, size);
+    AppendPacket(stream, wrapped, size + CHANNEL_INNER_OFFSET, false);
+  }
+  else{
+    AppendPacket(stream, payload, size, false);
+  }
+}
+
+/*!
+ * \brief Fills a stream of about the given size
+ * \param packets receives the number of valid packets written, or 0 where that is not known up front
+ * \details Returns false for an unknown stream name.
+ */
+static bool BuildStream(const char *name, size_t bytes, std::vector<uint8_t> &stream, uint32_t *packets)
+{
+  uint32_t seed = STREAM_SEED;
+  stream.clear();
+  stream.reserve(bytes + PACKET_MAX_BYTES);
+  *packets = 0;
+  if(strcmp(name, "clean") == 0){
+    while(stream.size() < bytes){
+      AppendReply(stream, &seed);
+      (*packets)++;
+    }
+  }
+  else if(strcmp(name, "noisy") == 0){
+    while(stream.size() < bytes){
+      AppendReply(stream, &seed);
+    }
+    for(size_t i = 0; i < stream.size(); i++){
+      if(NextRandom(&seed) % NOISE_FLIP_EVERY == 0){
+        stream[i] ^= (uint8_t)(1 << (NextRandom(&seed) % 8));
+      }
+      if(NextRandom(&seed) % NOISE_BURST_EVERY == 0){
+        size_t end = i + NextRandom(&seed) % NOISE_BURST_BYTES;
+        for(; i < end && i < stream.size(); i++){
+          stream[i] = (uint8_t)NextRandom(&seed);
+        }
+      }
+    }
+  }
+  else if(strcmp(name, "start_bytes") == 0){
+    stream.assign(bytes, PACKET_START_BYTE);
+  }
+  else if(strcmp(name, "bad_lengths") == 0){
+    while(stream.size() < bytes){
+      stream.push_back(PACKET_START_BYTE);
+      stream.push_back((uint8_t)(NextRandom(&seed) % PACKET_MIN_BYTES));
+    }
+  }
+  else if(strcmp(name, "bad_checksums") == 0){
+    uint8_t payload[PACKET_MAX_BYTES];
+    while(stream.size() < bytes){
+      for(unsigned int i = 0; i < PACKET_MAX_BYTES - PACKET_OVERHEAD_BYTES; i++){
+        payload[i] = (uint8_t)NextRandom(&seed);
+      }
+      AppendPacket(stream, payload, PACKET_MAX_BYTES - PACKET_OVERHEAD_BYTES, true);
+    }
+  }
+  else{
+    return false;
+  }
+  return true;
+}
+
+static const char *streamNames[] = {"clean", "noisy", "start_bytes", "bad_lengths", "bad_checksums"};	//!< Streams in the order they run
+
+/*!
+ * \brief Parses a stream once and returns the time it took in nanoseconds
+ */
+static int64_t ParseStream(const std::vector<uint8_t> &stream, FrameParser *parser, uint32_t *sizeSum)
+{
+  const uint8_t *data = stream.data();
+  size_t size = stream.size();
+  uint32_t sum = 0;
+  int64_t startNs = MonotonicNs();
+  for(size_t i = 0; i < size; i++){
+    if(parser->Feed(data[i])){
+      sum += parser->Size();
+    }
+  }
+  int64_t elapsedNs = MonotonicNs() - startNs;
+  //the sum keeps the compiler from dropping the work
+  *sizeSum = sum;
+  return elapsedNs;
+}
+
+int main(int argc, char **argv)
+{
+  const char *only = NULL;
+  double megabytes = DEFAULT_MEGABYTES;
+  int rounds = DEFAULT_ROUNDS;
+  int opt;
+  while((opt = getopt(argc, argv, "s:m:r:l")) != -1){
+    if(opt == 's'){
+      only = optarg;
+    }
+    else if(opt == 'm'){
+      megabytes = atof(optarg);
+    }
+    else if(opt == 'r'){
+      rounds = atoi(optarg);
+    }
+    else if(opt == 'l'){
+      for(size_t i = 0; i < sizeof(streamNames) / sizeof(streamNames[0]); i++){
+        printf("%s\n", streamNames[i]);
+      }
+      return 0;
+    }
+    else{
+      fprintf(stderr, "usage: %s [-s stream] [-m megabytes] [-r rounds] [-l]\n", argv[0]);
+      return 1;
+    }
+  }
+  if(megabytes <= 0.0 || rounds < 1){
+    fprintf(stderr, "%s: -m must be above 0 and -r at least 1\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<uint8_t> stream;
+  bool ran = false;
+  int status = 0;
+  printf("%-14s %8s %9s %11s %10s %10s %10s %10s\n", "stream", "MB", "MB/s", "frames/s", "frames", "skipped", "bad_len", "bad_sum");
+  for(size_t s = 0; s < sizeof(streamNames) / sizeof(streamNames[0]); s++){
+    if(only != NULL && strcmp(only, streamNames[s]) != 0){
+      continue;
+    }
+    uint32_t packets;
+    BuildStream(streamNames[s], (size_t)(megabytes * 1e6), stream, &packets);
+    ran = true;
+
+    int64_t bestNs = 0;
+    FrameParser parser;
+    for(int r = 0; r < rounds; r++){
+      uint32_t sizeSum;
+      parser = FrameParser();
+      int64_t elapsedNs = ParseStream(stream, &parser, &sizeSum);
+      if(r == 0 || elapsedNs < bestNs){
+        bestNs = elapsedNs;
+      }
+    }
+    double seconds = bestNs > 0 ? bestNs / 1e9 : 1e-9;
+    printf("%-14s %8.1f %9.1f %11.0f %10u %10u %10u %10u\n", streamNames[s], stream.size() / 1e6,
+           stream.size() / 1e6 / seconds, parser.Frames() / seconds,
+           parser.Frames(), parser.SkippedBytes(), parser.BadLengths(), parser.BadChecksums());
+    if(packets != 0 && parser.Frames() != packets){
+      fprintf(stderr, "%s: %u of %u packets of the %s stream came back\n", argv[0], parser.Frames(), packets, streamNames[s]);
+      status = 2;
+    }
+  }
+  if(!ran){
+    fprintf(stderr, "%s: no stream called %s, -l lists them\n", argv[0], only);
+    return 1;
+  }
+  return status;
+}
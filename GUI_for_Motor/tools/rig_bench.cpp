@@ -0,0 +1,196 @@
+/*!
+ * \file rig_bench.cpp
+ * \brief Scaling benchmark of the device manager against simulated boards behind ptys
+ * \details Usage: rig_bench [-n devices] [-i io_threads] [-c control_threads] [-p period_ms] [-t seconds] [-f target_mL/s]
+ *
+ * A child process plays every board with SimulatedTeensy on the master side of a pty, so the
+ * simulation does not count toward the CPU time of the manager. The manager opens the slave sides
+ * like real serial ports and holds each simulated valve at the target flow. At the end the
+ * lateness of the control steps is printed for every board together with the CPU time the
+ * manager used.
+ */
+#include "device_manager.h"
+#include "device_sim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <vector>
+
+#define DEFAULT_DEVICES 32		//!< Simulated boards
+#define DEFAULT_IO_THREADS 2		//!< I/O threads of the manager
+#define DEFAULT_CONTROL_THREADS 2	//!< Control threads of the manager
+#define DEFAULT_PERIOD_MS 20		//!< Control period
+#define DEFAULT_SECONDS 10		//!< Length of the run
+#define DEFAULT_TARGET_FLOW 30.0	//!< Flow every loop holds in mL/s
+#define BENCH_KP 8.0			//!< Proportional gain for the simulated valve in steps per mL/s
+#define BENCH_KI 15.0			//!< Integral gain for the simulated valve in steps per mL
+#define BENCH_NOISE 0.2			//!< Measurement noise of the simulated sensors in mL/s
+#define SIM_TICK_MS 1			//!< How often the simulator advances the plants while idle
+#define FIRST_SERIAL 90000		//!< Serial number of the first simulated board
+
+/*!
+ * \brief Plays every board on the master sides of the ptys until it is killed
+ */
+static void RunSimulator(const std::vector<int> &masters)
+{
+  SimPlant plant = {SIM_MAX_FLOW, SIM_FLOW_TIME_CONSTANT, 0.0, BENCH_NOISE, NULL};
+  std::vector<SimulatedTeensy *> boards;
+  int epollFd = epoll_create1(0);
+  for(size_t i = 0; i < masters.size(); i++){
+    boards.push_back(new SimulatedTeensy(FIRST_SERIAL + i, plant));
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = i;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, masters[i], &event);
+  }
+  struct epoll_event events[64];
+  uint8_t data[1024];
+  uint8_t reply[4096];
+  while(true){
+    int n = epoll_wait(epollFd, events, 64, SIM_TICK_MS);
+    int64_t nowNs = MonotonicNs();
+    for(int i = 0; i < n; i++){
+      int index = events[i].data.u32;
+      ssize_t got = read(masters[index], data, sizeof(data));
+      if(got > 0){
+        size_t size = boards[index]->Receive(data, got, nowNs, reply, sizeof(reply));
+        if(size > 0 && write(masters[index], reply, size) < 0){
+          perror("simulator write");
+        }
+      }
+    }
+    for(size_t i = 0; i < boards.size(); i++){
+      size_t size = boards[i]->Advance(nowNs, reply, sizeof(reply));
+      if(size > 0 && write(masters[i], reply, size) < 0){
+        perror("simulator write");
+      }
+    }
+  }
+}
+
+/*!
+ * \brief User plus system CPU time of this process in seconds
+ */
+static double CpuSeconds()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+  int numDevices = DEFAULT_DEVICES;
+  int ioThreads = DEFAULT_IO_THREADS;
+  int controlThreads = DEFAULT_CONTROL_THREADS;
+  double periodMs = DEFAULT_PERIOD_MS;
+  double seconds = DEFAULT_SECONDS;
+  double targetFlow = DEFAULT_TARGET_FLOW;
+  int opt;
+  while((opt = getopt(argc, argv, "n:i:c:p:t:f:")) != -1){
+    switch(opt){
+      case 'n': numDevices = atoi(optarg); break;
+      case 'i': ioThreads = atoi(optarg); break;
+      case 'c': controlThreads = atoi(optarg); break;
+      case 'p': periodMs = atof(optarg); break;
+      case 't': seconds = atof(optarg); break;
+      case 'f': targetFlow = atof(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-n devices] [-i io_threads] [-c control_threads] [-p period_ms] [-t seconds] [-f target_mL/s]\n", argv[0]);
+        return 1;
+    }
+  }
+  if(numDevices < 1 || periodMs <= 0.0 || seconds <= 0.0){
+    fprintf(stderr, "%s: the device count, period and run time must be positive\n", argv[0]);
+    return 1;
+  }
+
+  //one pty per simulated board
+  std::vector<int> masters;
+  DeviceManager manager(ioThreads, controlThreads);
+  manager.UseDeviceProfiles(false);
+  PidGains gains = {BENCH_KP, BENCH_KI, 0.0};
+  for(int i = 0; i < numDevices; i++){
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0){
+      perror("posix_openpt");
+      return 1;
+    }
+    masters.push_back(master);
+    if(manager.Add(ptsname(master), targetFlow, gains, periodMs / 1000.0) == NULL){
+      return 1;
+    }
+  }
+
+  pid_t simulator = fork();
+  if(simulator < 0){
+    perror("fork");
+    return 1;
+  }
+  if(simulator == 0){
+    for(int i = 0; i < manager.NumDevices(); i++){
+      close(manager.Device(i)->fd);
+    }
+    RunSimulator(masters);
+    _exit(0);
+  }
+
+  double startCpu = CpuSeconds();
+  int64_t startNs = MonotonicNs();
+  if(!manager.Start()){
+    kill(simulator, SIGTERM);
+    return 1;
+  }
+  usleep((useconds_t)(seconds * 1e6));
+  manager.Stop();
+  double cpu = CpuSeconds() - startCpu;
+  double wall = (MonotonicNs() - startNs) / 1e9;
+  kill(simulator, SIGTERM);
+  waitpid(simulator, NULL, 0);
+
+  printf("%d devices, %d I/O threads, %d control threads, %.1f ms period, %.1f s\n\n",
+         numDevices, ioThreads, controlThreads, periodMs, wall);
+  printf("%-14s %6s %8s %9s %9s %9s %9s %6s %6s %8s\n", "device", "serial", "steps", "mean us",
+         "stddev us", "p99 us", "max us", "missed", "overrun", "flow");
+  LoopJitterStats all;
+  int running = 0;
+  for(int i = 0; i < manager.NumDevices(); i++){
+    TeensyDevice *device = manager.Device(i);
+    const LoopJitterStats &jitter = device->jitter;
+    if(device->state == DEVICE_RUNNING){
+      running++;
+    }
+    printf("%-14s %6u %8llu %9.1f %9.1f %9.1f %9.1f %6llu %6llu %8.2f\n", device->path, device->serialNumber,
+           (unsigned long long)jitter.count, jitter.MeanUs(), jitter.StdDevUs(), jitter.PercentileUs(0.99),
+           jitter.maxUs, (unsigned long long)device->missed, (unsigned long long)device->overruns, device->flow);
+    if(jitter.count == 0){
+      continue;
+    }
+    if(all.count == 0 || jitter.minUs < all.minUs){
+      all.minUs = jitter.minUs;
+    }
+    if(all.count == 0 || jitter.maxUs > all.maxUs){
+      all.maxUs = jitter.maxUs;
+    }
+    all.count += jitter.count;
+    all.sumUs += jitter.sumUs;
+    all.sumSqUs += jitter.sumSqUs;
+    for(int b = 0; b < JITTER_BUCKETS; b++){
+      all.buckets[b] += jitter.buckets[b];
+    }
+  }
+  printf("\n%d of %d devices running, %llu control steps (%.0f/s)\n", running, numDevices,
+         (unsigned long long)all.count, all.count / wall);
+  printf("lateness: mean %.1f us, stddev %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+         all.MeanUs(), all.StdDevUs(), all.PercentileUs(0.50), all.PercentileUs(0.99), all.maxUs);
+  printf("manager CPU: %.3f s in %.1f s (%.1f%% of one core)\n", cpu, wall, 100.0 * cpu / wall);
+  return 0;
+}
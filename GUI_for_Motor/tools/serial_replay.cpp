@@ -0,0 +1,413 @@
+/*!
+ * \file serial_replay.cpp
+ * \brief Replays a capture of the serial traffic through the frame parser and the flow controller
+ * \details Usage: serial_replay [-r] [-v] [-n repeat] [-f target_mL/s [-m pid|table|deadband|smith|mpc] [-P kp] [-I ki] [-D kd] [-p]] capture
+ *
+ * TeensyControl --capture writes the capture, and so does control_bench -w. The bytes are fed
+ * to a FrameParser in each direction in the order they crossed the port. By default this runs as
+ * fast as possible; -r keeps the timing of the capture. -v prints every frame. -n replays the
+ * capture several times, to measure the parser and controller on a real byte stream.
+ *
+ * The summary counts frames per command. It also counts the bytes the parser threw away and the
+ * requests that were sent again before a reply arrived, which is what a lost frame looks like
+ * from the host. With -f the flow controller runs on every flow reply in the capture. Each
+ * decision is compared with the move the host actually sent next, within REPLAY_MATCH_STEPS. The controller is always fed
+ * the position the host commanded, so it stays in step with the recording. -P, -I and -D default
+ * to the gains flowrig uses for boards without tuned ones. -p takes the mode,
+ * gains, plant model and valve table from the device profile of the captured board, as MasterLogic does;
+ * the smith and mpc modes need it for the model.
+ */
+#include "serial_capture.h"
+#include "frame_parser.h"
+#include "flow_controller.h"
+#include "flow_units.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPLAY_CHANNELS 256		//!< Channels a wrapped frame can address
+#define REPLAY_MATCH_STEPS 2		//!< Moves this close to the host's count as the same; the capture times the bytes, not the host's clock reads
+#define DEFAULT_KP 3.0			//!< Proportional gain, as flowrig and control_bench use for boards without tuned gains
+#define DEFAULT_KI 1.5			//!< Integral gain, as flowrig and control_bench use for boards without tuned gains
+
+/*!
+ *  What the replay knows about one valve
+ */
+typedef struct
+{
+  int position;			//!< Position the host last commanded
+  uint8_t pendingRequest;	//!< Flow request waiting for a reply, 0 for none
+  int64_t lastFlowNs;		//!< Time of the previous legacy flow reply
+  int64_t lastSampleNs;		//!< Time of the previous flow sample given to the controller
+  bool started;			//!< The controller has seen a sample
+  bool decided;			//!< The controller made a decision the host has not acted on yet
+  bool expecting;		//!< The decision was a move
+  int expected;			//!< Position the controller wanted
+  FlowControllerState state;
+} ReplayValve;
+
+/*!
+ *  Everything the replay counts
+ */
+typedef struct
+{
+  uint64_t rxBytes;
+  uint64_t txBytes;
+  uint64_t rxFrames[256];	//!< Frames from the Teensy by command byte
+  uint64_t txFrames[256];	//!< Frames to the Teensy by command byte
+  uint64_t resent;		//!< Flow requests sent again before a reply arrived
+  uint64_t samples;		//!< Flow samples decoded
+  double minFlow;
+  double maxFlow;
+  double sumFlow;
+  uint64_t agreed;		//!< Controller decisions the host also made
+  uint64_t differed;		//!< Controller decisions the host did not make
+} ReplayStats;
+
+static bool verbose = false;
+static bool runController = false;
+static double targetFlow = 0.0;
+static FlowControllerConfig control;
+static ValveTable table;
+static FlowSensorProfile sensor = FLOW_SENSOR_PROFILES[FLOW_SENSOR_LEGACY];
+static ReplayValve replayValves[REPLAY_CHANNELS];
+static ReplayStats stats;
+
+/*!
+ * \brief Unwraps a channel frame
+ * \details Returns the channel and points payload at the inner command byte.
+ */
+static int Unwrap(const uint8_t *packet, unsigned int size, const uint8_t **payload, unsigned int *payloadSize)
+{
+  *payload = packet + 2;
+  *payloadSize = size - PACKET_OVERHEAD_BYTES;
+  if((*payload)[0] == CHANNEL_COMMAND && *payloadSize > CHANNEL_INNER_OFFSET){
+    int channel = (*payload)[CHANNEL_INDEX_OFFSET];
+    *payload += CHANNEL_INNER_OFFSET;
+    *payloadSize -= CHANNEL_INNER_OFFSET;
+    return channel;
+  }
+  return 0;
+}
+
+/*!
+ * \brief Compares the move the host made with the one the controller wanted
+ */
+static void CheckDecision(ReplayValve *valve, int channel, int64_t timeNs, bool moved)
+{
+  if(!runController || !valve->decided){
+    return;
+  }
+  bool agree = valve->expecting ? (moved && abs(valve->position - valve->expected) <= REPLAY_MATCH_STEPS) : !moved;
+  if(agree){
+    stats.agreed++;
+  }
+  else{
+    stats.differed++;
+    if(verbose){
+      printf("%12.6f       ch%d controller wanted %s, the host %s %d\n", timeNs / 1e9, channel,
+             valve->expecting ? "a move" : "no move", moved ? "moved to" : "stayed at", valve->position);
+    }
+  }
+  valve->decided = false;
+}
+
+/*!
+ * \brief Handles a frame the host sent
+ */
+static void HostFrame(const uint8_t *packet, unsigned int size, int64_t timeNs)
+{
+  const uint8_t *payload;
+  unsigned int payloadSize;
+  int channel = Unwrap(packet, size, &payload, &payloadSize);
+  ReplayValve *valve = &replayValves[channel];
+  uint8_t command = payload[0];
+  stats.txFrames[command]++;
+  if(command == RATE_COMMAND || command == TIMED_FLOW_COMMAND || command == FLOW_COMMAND){
+    if(valve->pendingRequest == command){
+      stats.resent++;
+    }
+    else{
+      //the next sample is due and the host made no move
+      CheckDecision(valve, channel, timeNs, false);
+    }
+    valve->pendingRequest = command;
+  }
+  else if(command == MOVE_COMMAND && payloadSize == MOVE_BYTES){
+    valve->position = GetU16(payload + MOVE_TARGET_OFFSET);
+    CheckDecision(valve, channel, timeNs, true);
+  }
+  else if(command == MOTOR_COMMAND && payloadSize == 4){
+    int steps = payload[2] * payload[3];
+    valve->position += payload[1] == 'B' ? steps : -steps;
+    CheckDecision(valve, channel, timeNs, true);
+  }
+  if(verbose){
+    printf("%12.6f tx ch%d %c", timeNs / 1e9, channel, command);
+    if(command == MOVE_COMMAND && payloadSize == MOVE_BYTES){
+      printf("  move to %u", GetU16(payload + MOVE_TARGET_OFFSET));
+    }
+    else if(command == MOTOR_COMMAND && payloadSize == 4){
+      printf("  %s %d x %d steps", payload[1] == 'B' ? "open" : "close", payload[2], payload[3]);
+    }
+    printf("\n");
+  }
+}
+
+/*!
+ * \brief Handles a frame from the Teensy
+ */
+static void TeensyFrame(const uint8_t *packet, unsigned int size, int64_t timeNs)
+{
+  const uint8_t *payload;
+  unsigned int payloadSize;
+  int channel = Unwrap(packet, size, &payload, &payloadSize);
+  ReplayValve *valve = &replayValves[channel];
+  uint8_t command = payload[0];
+  stats.rxFrames[command]++;
+  bool sample = false;
+  double flow = 0.0;
+  if(command == HELLO_COMMAND && payloadSize > HELLO_NUM_COMMANDS_OFFSET){
+    sensor = HelloFlowSensor(payload, payloadSize);
+    uint32_t serialNumber = GetU32(payload + HELLO_SERIAL_OFFSET);
+    if(verbose){
+      printf("%12.6f rx ch%d H  serial %u, %s flow sensor at %.3f mL per pulse\n", timeNs / 1e9, channel, serialNumber,
+             sensor.name, CalibrationMlPerPulse(sensor.nominalUl));
+    }
+    return;
+  }
+  if(command == RATE_COMMAND && payloadSize == RATE_BYTES){
+    flow = RateFlow(GetU32(payload + RATE_KALMAN_OFFSET), sensor);
+    sample = true;
+  }
+  else if(command == TIMED_FLOW_COMMAND && payloadSize == TIMED_FLOW_BYTES){
+    flow = TimedFlow(GetU32(payload + TIMED_FLOW_PULSES_OFFSET), GetU32(payload + TIMED_FLOW_WINDOW_OFFSET), sensor);
+    sample = true;
+  }
+  else if(command == FLOW_COMMAND && payloadSize >= 3){
+    //the GUI divides by whole seconds of wall time, which the capture cannot reproduce exactly
+    double seconds = valve->lastFlowNs != 0 ? (timeNs - valve->lastFlowNs) / 1e9 : 0.0;
+    flow = CountFlow(payload[1] + payload[2] * 256, seconds, sensor);
+    valve->lastFlowNs = timeNs;
+    sample = true;
+  }
+  else if(command == MOVE_DONE_FRAME && payloadSize == MOVE_DONE_BYTES){
+    if(payload[MOVE_DONE_ABORTED_OFFSET]){
+      valve->position = GetU16(payload + MOVE_DONE_POSITION_OFFSET);
+    }
+  }
+  if(verbose){
+    printf("%12.6f rx ch%d %c", timeNs / 1e9, channel, command);
+    if(sample){
+      printf("  flow %.3f mL/s", flow);
+    }
+    else if(command == MOVE_DONE_FRAME && payloadSize == MOVE_DONE_BYTES){
+      printf("  stopped at %u%s", GetU16(payload + MOVE_DONE_POSITION_OFFSET), payload[MOVE_DONE_ABORTED_OFFSET] ? " (aborted)" : "");
+    }
+    printf("\n");
+  }
+  if(!sample){
+    return;
+  }
+  if(valve->pendingRequest == command){
+    valve->pendingRequest = 0;
+  }
+  stats.samples++;
+  stats.sumFlow += flow;
+  if(stats.samples == 1 || flow < stats.minFlow){
+    stats.minFlow = flow;
+  }
+  if(stats.samples == 1 || flow > stats.maxFlow){
+    stats.maxFlow = flow;
+  }
+  if(!runController){
+    return;
+  }
+  if(!valve->started){
+    //start from where the host is, without the feedforward jump the host already made
+    FlowControllerStart(&valve->state, &control, NULL, targetFlow, valve->position);
+    valve->started = true;
+    valve->lastSampleNs = timeNs;
+  }
+  FlowControlAction action = FlowControllerStep(&valve->state, &control, &table, targetFlow, flow, valve->position,
+                                                (timeNs - valve->lastSampleNs) / 1e9);
+  valve->lastSampleNs = timeNs;
+  valve->decided = true;
+  valve->expecting = action.move;
+  valve->expected = action.position;
+  if(verbose && action.move){
+    printf("%12.6f       ch%d controller: move to %d, next sample in %.2f s\n", timeNs / 1e9, channel, action.position, action.period);
+  }
+}
+
+/*!
+ * \brief Sleeps until a time on CLOCK_MONOTONIC
+ */
+static void SleepUntil(int64_t wakeNs)
+{
+  struct timespec ts;
+  ts.tv_sec = wakeNs / 1000000000LL;
+  ts.tv_nsec = wakeNs % 1000000000LL;
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0){
+  }
+}
+
+static int64_t NowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+  bool realTime = false;
+  bool useProfile = false;
+  int repeat = 1;
+  FlowControlMode mode = FLOW_CONTROL_PID;
+  PidGains gains = {DEFAULT_KP, DEFAULT_KI, 0.0};
+  PlantModel model = {0.0, 0.0, 0.0};
+  int stepRate = 0;
+  int opt;
+  bool ok = true;
+  while((opt = getopt(argc, argv, "rvn:f:m:P:I:D:p")) != -1){
+    switch(opt){
+      case 'r': realTime = true; break;
+      case 'v': verbose = true; break;
+      case 'n': repeat = atoi(optarg); break;
+      case 'f': targetFlow = atof(optarg); runController = true; break;
+      case 'm':
+        if(strcmp(optarg, "pid") == 0) mode = FLOW_CONTROL_PID;
+        else if(strcmp(optarg, "table") == 0) mode = FLOW_CONTROL_TABLE;
+        else if(strcmp(optarg, "deadband") == 0) mode = FLOW_CONTROL_DEADBAND;
+        else if(strcmp(optarg, "smith") == 0) mode = FLOW_CONTROL_SMITH;
+        else if(strcmp(optarg, "mpc") == 0) mode = FLOW_CONTROL_MPC;
+        else ok = false;
+        break;
+      case 'P': gains.kp = atof(optarg); break;
+      case 'I': gains.ki = atof(optarg); break;
+      case 'D': gains.kd = atof(optarg); break;
+      case 'p': useProfile = true; break;
+      default: ok = false; break;
+    }
+  }
+  if(!ok || optind + 1 != argc || repeat < 1 || ((mode == FLOW_CONTROL_SMITH || mode == FLOW_CONTROL_MPC) && !useProfile)){
+    fprintf(stderr, "usage: %s [-r] [-v] [-n repeat] [-f target_mL/s [-m pid|table|deadband|smith|mpc] [-P kp] [-I ki] [-D kd] [-p]] capture\n", argv[0]);
+    return 1;
+  }
+  const char *fileName = argv[optind];
+
+  SerialCaptureReader reader;
+  SerialCaptureRecord record;
+  if(!reader.Open(fileName)){
+    fprintf(stderr, "%s: %s is not a serial capture\n", argv[0], fileName);
+    return 1;
+  }
+  if(runController && useProfile){
+    //the serial number is in the hello reply at the start of the capture
+    FrameParser parser;
+    unsigned long serialNumber = 0;
+    while(serialNumber == 0 && reader.Next(&record)){
+      for(unsigned int i = 0; i < record.size && record.direction == SERIAL_FROM_TEENSY; i++){
+        if(parser.Feed(record.data[i]) && parser.Packet()[2] == HELLO_COMMAND && parser.Size() > HELLO_SERIAL_OFFSET + 6){
+          serialNumber = GetU32(parser.Packet() + 2 + HELLO_SERIAL_OFFSET);
+          stepRate = parser.Size() > HELLO_STEP_RATE_OFFSET + 4 ? GetU16(parser.Packet() + 2 + HELLO_STEP_RATE_OFFSET) : 0;
+        }
+      }
+    }
+    bool tuned = serialNumber != 0 && LoadPidGains(serialNumber, 0, &gains);
+    bool identified = serialNumber != 0 && LoadPlantModel(serialNumber, 0, &model);
+    bool haveTable = serialNumber != 0 && LoadValveTable(serialNumber, 0, &table);
+    bool planned = mode == FLOW_CONTROL_MPC;
+    if((mode == FLOW_CONTROL_SMITH || planned) && !identified){
+      fprintf(stderr, "%s: Teensy %lu has no plant model, run TeensyControl --step-test first\n", argv[0], serialNumber);
+      return 1;
+    }
+    mode = identified ? (planned ? FLOW_CONTROL_MPC : FLOW_CONTROL_SMITH) : tuned ? FLOW_CONTROL_PID : haveTable ? FLOW_CONTROL_TABLE : FLOW_CONTROL_DEADBAND;
+    printf("profile of Teensy %lu: %s gains, %s plant model, %s valve table\n", serialNumber, tuned ? "tuned" : "no",
+           identified ? "a" : "no", haveTable ? "a" : "no");
+  }
+  FlowControllerDefaults(&control, mode, true);
+  control.gains = gains;
+  control.model = model;
+  control.stepRate = stepRate;
+
+  double wallSeconds = 0.0;
+  int64_t firstNs = 0, lastNs = 0;
+  FrameParser rxParser, txParser;
+  for(int pass = 0; pass < repeat; pass++){
+    if(!reader.Open(fileName)){
+      return 1;
+    }
+    memset(&stats, 0, sizeof(stats));
+    memset(replayValves, 0, sizeof(replayValves));
+    rxParser = FrameParser();
+    txParser = FrameParser();
+    int64_t startNs = NowNs();
+    bool first = true;
+    while(reader.Next(&record)){
+      if(first){
+        firstNs = record.timeNs;
+        first = false;
+      }
+      lastNs = record.timeNs;
+      if(realTime){
+        SleepUntil(startNs + (record.timeNs - firstNs));
+      }
+      int64_t relativeNs = record.timeNs - reader.StartNs();
+      if(record.direction == SERIAL_FROM_TEENSY){
+        stats.rxBytes += record.size;
+        for(unsigned int i = 0; i < record.size; i++){
+          if(rxParser.Feed(record.data[i])){
+            TeensyFrame(rxParser.Packet(), rxParser.Size(), relativeNs);
+          }
+        }
+      }
+      else{
+        stats.txBytes += record.size;
+        for(unsigned int i = 0; i < record.size; i++){
+          if(txParser.Feed(record.data[i])){
+            HostFrame(txParser.Packet(), txParser.Size(), relativeNs);
+          }
+        }
+      }
+    }
+    wallSeconds += (NowNs() - startNs) / 1e9;
+  }
+
+  printf("%s: %.3f s of traffic, %llu bytes from the Teensy, %llu bytes to it\n", fileName, (lastNs - firstNs) / 1e9,
+         (unsigned long long)stats.rxBytes, (unsigned long long)stats.txBytes);
+  printf("frames from the Teensy:");
+  for(int c = 0; c < 256; c++){
+    if(stats.rxFrames[c]){
+      printf(" %c %llu", c, (unsigned long long)stats.rxFrames[c]);
+    }
+  }
+  printf("\nframes to the Teensy:  ");
+  for(int c = 0; c < 256; c++){
+    if(stats.txFrames[c]){
+      printf(" %c %llu", c, (unsigned long long)stats.txFrames[c]);
+    }
+  }
+  printf("\nparser from the Teensy: %u skipped bytes, %u bad lengths, %u bad checksums\n",
+         rxParser.SkippedBytes(), rxParser.BadLengths(), rxParser.BadChecksums());
+  printf("parser to the Teensy:   %u skipped bytes, %u bad lengths, %u bad checksums\n",
+         txParser.SkippedBytes(), txParser.BadLengths(), txParser.BadChecksums());
+  printf("flow requests sent again before a reply: %llu\n", (unsigned long long)stats.resent);
+  if(stats.samples > 0){
+    printf("flow samples: %llu, min %.3f, mean %.3f, max %.3f mL/s\n", (unsigned long long)stats.samples, stats.minFlow,
+           stats.sumFlow / stats.samples, stats.maxFlow);
+  }
+  if(runController){
+    printf("controller decisions: %llu the same as the host, %llu different\n", (unsigned long long)stats.agreed,
+           (unsigned long long)stats.differed);
+  }
+  if(!realTime && wallSeconds > 0.0){
+    double bytes = (double)(stats.rxBytes + stats.txBytes) * repeat;
+    printf("replayed %d time%s in %.3f s: %.1f MB/s, %.0f frames/s\n", repeat, repeat == 1 ? "" : "s", wallSeconds,
+           bytes / wallSeconds / 1e6, (double)(rxParser.Frames() + txParser.Frames()) * repeat / wallSeconds);
+  }
+  return 0;
+}
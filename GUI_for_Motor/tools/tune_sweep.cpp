@@ -0,0 +1,414 @@
+/*!
+ * \file tune_sweep.cpp
+ * \brief Offline sweep of the flow controller tuning against a model of the valve
+ * \details Usage: tune_sweep [-m pid|table|deadband] [-f target_mL/s] [-d seconds] [-j threads]
+ * [-k rank|settle|overshoot|travel|iae] [-n top] [-o results.csv] [-r trace.csv]
+ * [-P kp] [-I ki] [-D kd] [-b band] [-s steps] [-L min_period] [-H max_period]
+ *
+ * Every combination of the parameter ranges runs the same FlowControllerStep that MasterLogic
+ * uses. It steps from a closed valve to the target against a SimulatedTeensy plant, and the
+ * runs are spread over a work-stealing thread pool. A range is given as lo:hi:count or as a
+ * single value. -s is the deadband step size in deadband mode and the largest correction in
+ * table mode. Every run sees the same noise, so the results do not depend on the thread count.
+ *
+ * With -r the plant is fitted to a recorded trace instead of using the built-in valve. A trace
+ * has lines of time_s,position,flow_mL/s, like the ones flowtop -l writes. The valve curve comes
+ * from the flow at the end of each position hold, the time constant from a least squares fit
+ * of the first order response, and the noise from the spread of the flow during the holds.
+ */
+#include "flow_controller.h"
+#include "device_sim.h"
+#include "work_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#define DEFAULT_TARGET_FLOW 30.0	//!< Target of the step in mL/s
+#define DEFAULT_DURATION_S 120.0	//!< Simulated time per run
+#define DEFAULT_TOP 10			//!< Combinations printed
+#define SWEEP_SEED 4242			//!< Noise seed shared by all runs
+#define SWEEP_NOISE 0.2			//!< Sensor noise of the built-in plant in mL/s
+#define METRIC_DT 0.01			//!< Resolution of the metrics in seconds
+#define SETTLE_BAND 0.05		//!< Settled once the flow stays within this fraction of the target
+#define TABLE_STEP 100			//!< Step between the points of the valve table, like the characterization sweep
+#define TRACE_MIN_HOLD_S 1.0		//!< Shortest position hold used to fit the valve curve
+
+/*!
+ *  A parameter range swept as count evenly spaced values from lo to hi
+ */
+struct SweepRange
+{
+  double lo;
+  double hi;
+  int count;
+  double Value(int i) const { return count > 1 ? lo + (hi - lo) * i / (count - 1) : lo; }
+};
+
+/*!
+ *  Outcome of one run
+ */
+struct SweepResult
+{
+  FlowControllerConfig config;
+  double settle;	//!< Seconds until the flow stays within SETTLE_BAND of the target
+  bool settled;		//!< False if the flow was outside the band at the end of the run
+  double overshoot;	//!< Peak above the target as a percentage of the target
+  double travel;	//!< Steps moved by the motor
+  double iae;		//!< Integral of the absolute error in mL
+  int moves;		//!< Moves commanded
+  double rank;		//!< Sum of the ranks of the four metrics
+};
+
+/*!
+ * \brief Parses lo:hi:count or a single value
+ */
+static bool ParseRange(const char *text, SweepRange *range)
+{
+  int n = sscanf(text, "%lf:%lf:%d", &range->lo, &range->hi, &range->count);
+  if(n == 1){
+    range->hi = range->lo;
+    range->count = 1;
+    return true;
+  }
+  return n == 3 && range->count >= 1;
+}
+
+/*!
+ * \brief Fits a plant to a recorded trace
+ * \details Returns false if the trace has too few position holds to build a valve curve.
+ */
+static bool FitTrace(const char *fileName, ValveTable *curve, SimPlant *plant)
+{
+  FILE *f = fopen(fileName, "r");
+  if(f == NULL){
+    perror(fileName);
+    return false;
+  }
+  std::vector<double> t, flow;
+  std::vector<int> position;
+  char line[256];
+  while(fgets(line, sizeof(line), f)){
+    double time, q;
+    int p;
+    if(sscanf(line, "%lf,%d,%lf", &time, &p, &q) == 3){
+      t.push_back(time);
+      position.push_back(p);
+      flow.push_back(q);
+    }
+  }
+  fclose(f);
+
+  //flow at the end of every hold, and the spread of the flow while holding
+  std::vector<std::pair<int, double> > points;
+  double spread = 0.0;
+  int spreadSamples = 0;
+  size_t start = 0;
+  for(size_t i = 1; i <= t.size(); i++){
+    if(i < t.size() && position[i] == position[start]){
+      continue;
+    }
+    if(t[i - 1] - t[start] >= TRACE_MIN_HOLD_S){
+      size_t from = start + (i - start) / 2;
+      double sum = 0.0;
+      for(size_t j = from; j < i; j++){
+        sum += flow[j];
+      }
+      double mean = sum / (i - from);
+      for(size_t j = from; j < i; j++){
+        spread += (flow[j] - mean) * (flow[j] - mean);
+        spreadSamples++;
+      }
+      points.push_back(std::make_pair(position[start], mean));
+    }
+    start = i;
+  }
+  std::sort(points.begin(), points.end());
+  curve->numPoints = 0;
+  for(size_t i = 0; i < points.size(); i++){
+    int n = curve->numPoints;
+    if(n > 0 && curve->position[n - 1] == points[i].first){
+      curve->flow[n - 1] = (curve->flow[n - 1] + points[i].second) / 2.0;
+    }
+    else if(n < VALVE_TABLE_MAX_POINTS){
+      curve->position[n] = points[i].first;
+      curve->flow[n] = points[i].second;
+      curve->numPoints++;
+    }
+  }
+  if(curve->numPoints < 2){
+    fprintf(stderr, "%s: need holds at two or more positions to fit the valve curve\n", fileName);
+    return false;
+  }
+  MakeValveTableMonotone(curve);
+
+  //least squares fit of d(flow)/dt = (curve(position) - flow) / tau
+  double sxy = 0.0, sxx = 0.0;
+  for(size_t i = 0; i + 1 < t.size(); i++){
+    double dt = t[i + 1] - t[i];
+    if(dt <= 0.0){
+      continue;
+    }
+    double x = ValveTableFlow(curve, position[i]) - flow[i];
+    double y = (flow[i + 1] - flow[i]) / dt;
+    sxy += x * y;
+    sxx += x * x;
+  }
+  double tau = sxy > 0.0 ? sxx / sxy : SIM_FLOW_TIME_CONSTANT;
+  plant->maxFlow = curve->flow[curve->numPoints - 1];
+  plant->timeConstant = tau < 0.01 ? 0.01 : tau > 60.0 ? 60.0 : tau;
+  plant->deadTime = 0.0;
+  plant->noise = spreadSamples > 1 ? sqrt(spread / spreadSamples) : 0.0;
+  plant->curve = curve;
+  return true;
+}
+
+/*!
+ * \brief Runs one controller through the step and measures the response
+ * \details Mirrors MasterLogic: the first sample is taken one period after the feedforward move and deadband moves block until the motor stops, as the legacy move command does.
+ */
+static void RunScenario(const SimPlant &model, const ValveTable *table, double target, double duration, SweepResult *result)
+{
+  SimulatedTeensy plant(SWEEP_SEED, model);
+  FlowControllerState state;
+  const FlowControllerConfig *config = &result->config;
+  double t = 0.0, lastSample = 0.0, lastOutside = 0.0, peak = 0.0, iae = 0.0;
+  int moves = 0;
+  plant.Advance(0, NULL, 0);
+  int position = FlowControllerStart(&state, config, table, target, 0);
+  if(position != 0){
+    plant.MoveTo(position);
+    moves++;
+  }
+  double next = state.schedule.period;
+  while(t < duration){
+    //run the plant up to the next sample, or the end of a blocking move
+    while(t < next && t < duration){
+      double h = next - t < METRIC_DT ? next - t : METRIC_DT;
+      t += h;
+      plant.Advance((int64_t)(t * 1e9), NULL, 0);
+      double error = fabs(target - plant.Flow());
+      iae += error * h;
+      if(error > SETTLE_BAND * target){
+        lastOutside = t;
+      }
+      if(plant.Flow() > peak){
+        peak = plant.Flow();
+      }
+    }
+    if(t >= duration){
+      break;
+    }
+    FlowControlAction action = FlowControllerStep(&state, config, table, target, plant.MeasuredFlow(), position, t - lastSample);
+    lastSample = t;
+    next = t + action.period;
+    if(action.move){
+      if(config->mode == FLOW_CONTROL_DEADBAND){
+        next += fabs((double)(action.position - position)) / SIM_STEP_RATE;
+      }
+      plant.MoveTo(action.position);
+      position = action.position;
+      moves++;
+    }
+  }
+  result->settled = lastOutside < duration - METRIC_DT;
+  result->settle = result->settled ? lastOutside : duration;
+  result->overshoot = peak > target ? 100.0 * (peak - target) / target : 0.0;
+  result->travel = plant.Travel();
+  result->iae = iae;
+  result->moves = moves;
+}
+
+/*!
+ * \brief Adds the rank of every result on one metric to its rank sum
+ */
+static void AddRanks(std::vector<SweepResult> &results, double SweepResult::*metric)
+{
+  std::vector<size_t> order(results.size());
+  for(size_t i = 0; i < order.size(); i++){
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b){ return results[a].*metric < results[b].*metric; });
+  for(size_t i = 0; i < order.size(); i++){
+    results[order[i]].rank += i;
+  }
+}
+
+static double Seconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+  FlowControlMode mode = FLOW_CONTROL_PID;
+  double target = DEFAULT_TARGET_FLOW;
+  double duration = DEFAULT_DURATION_S;
+  int threads = 0;
+  int top = DEFAULT_TOP;
+  const char *key = "rank";
+  const char *csvName = NULL;
+  const char *traceName = NULL;
+  SweepRange kp = {1.0, 20.0, 12}, ki = {1.0, 30.0, 12}, kd = {0.0, 2.0, 3};
+  SweepRange band = {0.02, 0.30, 15}, steps = {10.0, 255.0, 15};
+  SweepRange minPeriod = {0.1, 1.0, 4}, maxPeriod = {LOOP_RATE_DEFAULTS.maxPeriod, LOOP_RATE_DEFAULTS.maxPeriod, 1};
+  bool stepsGiven = false;
+  int opt;
+  bool ok = true;
+  while((opt = getopt(argc, argv, "m:f:d:j:k:n:o:r:P:I:D:b:s:L:H:")) != -1){
+    switch(opt){
+      case 'm':
+        if(strcmp(optarg, "pid") == 0) mode = FLOW_CONTROL_PID;
+        else if(strcmp(optarg, "table") == 0) mode = FLOW_CONTROL_TABLE;
+        else if(strcmp(optarg, "deadband") == 0) mode = FLOW_CONTROL_DEADBAND;
+        else ok = false;
+        break;
+      case 'f': target = atof(optarg); break;
+      case 'd': duration = atof(optarg); break;
+      case 'j': threads = atoi(optarg); break;
+      case 'k': key = optarg; break;
+      case 'n': top = atoi(optarg); break;
+      case 'o': csvName = optarg; break;
+      case 'r': traceName = optarg; break;
+      case 'P': ok = ok && ParseRange(optarg, &kp); break;
+      case 'I': ok = ok && ParseRange(optarg, &ki); break;
+      case 'D': ok = ok && ParseRange(optarg, &kd); break;
+      case 'b': ok = ok && ParseRange(optarg, &band); break;
+      case 's': ok = ok && ParseRange(optarg, &steps); stepsGiven = true; break;
+      case 'L': ok = ok && ParseRange(optarg, &minPeriod); break;
+      case 'H': ok = ok && ParseRange(optarg, &maxPeriod); break;
+      default: ok = false; break;
+    }
+  }
+  if(!ok || target <= 0.0 || duration <= 0.0){
+    fprintf(stderr, "usage: %s [-m pid|table|deadband] [-f target_mL/s] [-d seconds] [-j threads] [-k rank|settle|overshoot|travel|iae]\n"
+            "       [-n top] [-o results.csv] [-r trace.csv] [-P kp] [-I ki] [-D kd] [-b band] [-s steps] [-L min_period] [-H max_period]\n"
+            "ranges are lo:hi:count or a single value\n", argv[0]);
+    return 1;
+  }
+  if(mode == FLOW_CONTROL_TABLE && !stepsGiven){
+    steps.lo = 50.0;
+    steps.hi = 800.0;
+    steps.count = 16;
+  }
+  if(mode == FLOW_CONTROL_DEADBAND && steps.hi > FLOW_MAX_STEP_SIZE){
+    fprintf(stderr, "%s: the legacy move command carries at most %d steps\n", argv[0], FLOW_MAX_STEP_SIZE);
+    return 1;
+  }
+
+  //the plant, and the valve table the rig would have measured on it
+  SimPlant model = {SIM_MAX_FLOW, SIM_FLOW_TIME_CONSTANT, 0.0, SWEEP_NOISE, NULL};
+  ValveTable curve;
+  if(traceName != NULL && !FitTrace(traceName, &curve, &model)){
+    return 1;
+  }
+  ValveTable table;
+  SimulatedTeensy(SWEEP_SEED, model).Characterize(TABLE_STEP, &table);
+  printf("plant: %s, %.1f mL/s fully open, time constant %.2f s, noise %.2f mL/s\n",
+         traceName ? traceName : "built-in valve", table.flow[table.numPoints - 1], model.timeConstant, model.noise);
+
+  //every combination of the ranges that matter to the mode
+  std::vector<SweepResult> results;
+  FlowControllerConfig base;
+  FlowControllerDefaults(&base, mode, true);
+  for(int a = 0; a < (mode == FLOW_CONTROL_PID ? kp.count : band.count); a++){
+    for(int b = 0; b < (mode == FLOW_CONTROL_PID ? ki.count : steps.count); b++){
+      for(int c = 0; c < (mode == FLOW_CONTROL_PID ? kd.count : 1); c++){
+        for(int l = 0; l < minPeriod.count; l++){
+          for(int h = 0; h < maxPeriod.count; h++){
+            SweepResult result;
+            memset(&result, 0, sizeof(result));
+            result.config = base;
+            if(mode == FLOW_CONTROL_PID){
+              result.config.gains.kp = kp.Value(a);
+              result.config.gains.ki = ki.Value(b);
+              result.config.gains.kd = kd.Value(c);
+            }
+            else{
+              result.config.errorBand = band.Value(a);
+              result.config.stepSize = (int)(steps.Value(b) + 0.5);
+              result.config.feedbackMaxSteps = result.config.stepSize;
+            }
+            result.config.rate.minPeriod = minPeriod.Value(l);
+            result.config.rate.maxPeriod = std::max(maxPeriod.Value(h), result.config.rate.minPeriod);
+            results.push_back(result);
+          }
+        }
+      }
+    }
+  }
+
+  double start = Seconds();
+  uint64_t steals;
+  {
+    WorkStealingPool pool(threads);
+    threads = pool.NumThreads();
+    for(size_t i = 0; i < results.size(); i++){
+      SweepResult *result = &results[i];
+      pool.Submit([&model, &table, target, duration, result](){ RunScenario(model, &table, target, duration, result); });
+    }
+    pool.Wait();
+    steals = pool.Steals();
+  }
+  double elapsed = Seconds() - start;
+  printf("%zu combinations of %.0f s each on %d threads in %.2f s (%.0f runs/s, %llu stolen)\n\n",
+         results.size(), duration, threads, elapsed, results.size() / elapsed, (unsigned long long)steals);
+
+  AddRanks(results, &SweepResult::settle);
+  AddRanks(results, &SweepResult::overshoot);
+  AddRanks(results, &SweepResult::travel);
+  AddRanks(results, &SweepResult::iae);
+  double SweepResult::*sortBy = &SweepResult::rank;
+  if(strcmp(key, "settle") == 0) sortBy = &SweepResult::settle;
+  else if(strcmp(key, "overshoot") == 0) sortBy = &SweepResult::overshoot;
+  else if(strcmp(key, "travel") == 0) sortBy = &SweepResult::travel;
+  else if(strcmp(key, "iae") == 0) sortBy = &SweepResult::iae;
+  std::stable_sort(results.begin(), results.end(), [&](const SweepResult &a, const SweepResult &b){
+    if(a.settled != b.settled){
+      return a.settled;
+    }
+    return a.*sortBy < b.*sortBy;
+  });
+
+  if(mode == FLOW_CONTROL_PID){
+    printf("%8s %8s %8s", "kp", "ki", "kd");
+  }
+  else{
+    printf("%8s %8s", "band", mode == FLOW_CONTROL_TABLE ? "max step" : "step");
+  }
+  printf(" %7s %7s %9s %10s %8s %8s %6s\n", "min T", "max T", "settle s", "overshoot%", "travel", "IAE mL", "moves");
+  for(int i = 0; i < top && i < (int)results.size(); i++){
+    const SweepResult &r = results[i];
+    if(mode == FLOW_CONTROL_PID){
+      printf("%8.3f %8.3f %8.3f", r.config.gains.kp, r.config.gains.ki, r.config.gains.kd);
+    }
+    else{
+      printf("%8.3f %8d", r.config.errorBand, r.config.stepSize);
+    }
+    printf(" %7.2f %7.2f %8.1f%s %10.1f %8.0f %8.1f %6d\n", r.config.rate.minPeriod, r.config.rate.maxPeriod,
+           r.settle, r.settled ? " " : "+", r.overshoot, r.travel, r.iae, r.moves);
+  }
+
+  if(csvName != NULL){
+    FILE *csv = fopen(csvName, "w");
+    if(csv == NULL){
+      perror(csvName);
+      return 1;
+    }
+    fprintf(csv, "kp,ki,kd,band,step,min_period,max_period,settle_s,settled,overshoot_pct,travel_steps,iae_ml,moves,rank\n");
+    for(size_t i = 0; i < results.size(); i++){
+      const SweepResult &r = results[i];
+      fprintf(csv, "%g,%g,%g,%g,%d,%g,%g,%.3f,%d,%.3f,%.0f,%.3f,%d,%.0f\n", r.config.gains.kp, r.config.gains.ki,
+              r.config.gains.kd, r.config.errorBand, r.config.stepSize, r.config.rate.minPeriod, r.config.rate.maxPeriod,
+              r.settle, r.settled ? 1 : 0, r.overshoot, r.travel, r.iae, r.moves, r.rank);
+    }
+    fclose(csv);
+  }
+  return 0;
+}
@@ -1,3 +1,8 @@
+#include "protocol.h"
+#include "frame_parser.h"
+#include "flow_sensor.h"
+#include "valve_channel.h"
+
 //Declare pin functions for Teensy
 #define EN  5
 #define MS1 6
@@ -7,237 +12,858 @@
 #define FLO 14
 #define led 13
 
+//Pins of the second valve
+#define EN2  2
+#define MS1_2 3
+#define MS2_2 4
+#define stp2 10
+#define dir2 11
+#define FLO2 15
+
 //Declare variables for functions
 char user_input;
 int x;
 int y;
 int i,j;
 int state;
-volatile int flowCount = 0;
-volatile int overflowCount = 0;
- 
-// define packet parameters
-const byte PACKET_START_BYTE = 0xAA;
-const unsigned int PACKET_OVERHEAD_BYTES = 3;
-const unsigned int PACKET_MIN_BYTES = PACKET_OVERHEAD_BYTES + 1;
-const unsigned int PACKET_MAX_BYTES = 255;
+unsigned long identifyStart = 0;	// millis() when the identify blink started
+boolean identifyActive = false;
+
+// flow sensor the board is built for; build with -DFLOW_SENSOR=<id> to pick another profile from flow_sensor.h
+#ifndef FLOW_SENSOR
+#define FLOW_SENSOR FLOW_SENSOR_LEGACY
+#endif
+static_assert(FLOW_SENSOR < NUM_FLOW_SENSORS, "FLOW_SENSOR is not a profile in flow_sensor.h");
+constexpr const FlowSensorProfile &SENSOR = FLOW_SENSOR_PROFILES[FLOW_SENSOR];
+
+// values reported in the hello reply
+const unsigned int FLOW_UL_PER_PULSE = SENSOR.nominalUl;	// flow sensor calibration in microliters per pulse
+const unsigned long IDENTIFY_DURATION_MS = 1000;
+
+// serial receive state
+byte rxChunk[64];			// bytes drained from the USB buffer in one pass
+unsigned long rxChunkAt = 0;		// micros() when the bytes in rxChunk were drained
+FrameParser rxParser;			// reassembles packets from the drained bytes, as the host does
+
+// serial transmit queue; frames are packed together and flushed when idle
+const unsigned int TX_BUFFER_BYTES = 512;
+const unsigned long TX_FLUSH_INTERVAL_US = 1000;
+byte txBuffer[TX_BUFFER_BYTES];
+unsigned int txLength = 0;
+unsigned long txQueuedAt = 0;		// micros() when the oldest queued frame was added
+
+// valve channels; channel 0 is the original valve and answers unaddressed commands
+const ChannelPins CHANNEL_PINS[NUM_CHANNELS] = {{EN, MS1, MS2, stp, dir, FLO}, {EN2, MS1_2, MS2_2, stp2, dir2, FLO2}};
+ValveChannel channels[NUM_CHANNELS];
+
+// background stepping; stepTimer ramps the step rate up and down so a move can be retargeted or aborted at any time
+const unsigned long STEP_TICK_US = 50;
+const unsigned int START_STEP_RATE = 100;	// steps per second at the start and end of a move
+const unsigned long STEP_ACCELERATION = 5000;	// steps per second per second
+IntervalTimer stepTimer;
+
+// pulse timing used by the on-device flow loop
+const unsigned long FLOW_TIMEOUT_US = 2000000;	// no pulse for this long means no flow
+
+// flow filters; filterTimer runs them at 1 kHz in fixed point, all rates in millipulses per second
+const unsigned long FILTER_PERIOD_US = 1000;
+IntervalTimer filterTimer;
+const int64_t KALMAN_P_MAX = 1000000000000LL;	// keeps kalmanP << 16 inside 64 bits during long gaps
+
+// volumetric dosing; the close is started from CountFlow() the moment the trigger count is reached
+const unsigned long DOSE_SETTLE_US = 500000;	// valve shut and no pulse for this long means the dose is over
+const float DOSE_OVERSHOOT_WEIGHT = 0.5;	// weight of the newest dose in the learned overshoot
+const uint32_t DOSE_PULSE_NL = FLOW_UL_PER_PULSE * 1000UL;	// volume of a dose pulse, the unit of the hello calibration
+
+// commands listed in the hello reply
+const byte SUPPORTED_COMMANDS[] = {MOTOR_COMMAND, FLOW_COMMAND, TEST_COMMAND, HELLO_COMMAND, IDENTIFY_COMMAND, TIMED_FLOW_COMMAND,
+                                   LOOP_CONFIG_COMMAND, LOOP_SETPOINT_COMMAND, DOSE_COMMAND, FILTER_CONFIG_COMMAND, RATE_COMMAND,
+                                   MOVE_COMMAND, ABORT_COMMAND, CHANNEL_COMMAND, SYNC_COMMAND};
 
 void setup() {
   // put your setup code here, to run once:
-  pinMode(stp, OUTPUT);
-  pinMode(dir, OUTPUT);               
-  pinMode(MS1, OUTPUT);
-  pinMode(MS2, OUTPUT);
-  pinMode(EN, OUTPUT);
   pinMode(led, OUTPUT);
-  pinMode(FLO, INPUT_PULLUP);
-  attachInterrupt(digitalPinToInterrupt(FLO), CountFlow, RISING);
-  resetEDPins(); //Set step, direction, microstep and enable pins to default states
+  for(unsigned int n = 0; n < NUM_CHANNELS; n++){
+    ValveChannel &c = channels[n];
+    c.index = n;
+    c.pins = &CHANNEL_PINS[n];
+    pinMode(c.pins->stepPin, OUTPUT);
+    pinMode(c.pins->dirPin, OUTPUT);
+    pinMode(c.pins->ms1Pin, OUTPUT);
+    pinMode(c.pins->ms2Pin, OUTPUT);
+    pinMode(c.pins->enablePin, OUTPUT);
+    pinMode(c.pins->flowPin, INPUT_PULLUP);
+    resetEDPins(c); //Set step, direction, microstep and enable pins to default states
+    c.flowWindowStart = micros();
+  }
+  attachInterrupt(digitalPinToInterrupt(FLO), CountFlow0, RISING);
+  attachInterrupt(digitalPinToInterrupt(FLO2), CountFlow1, RISING);
   Serial.begin(9600); //Open Serial connection for debugging
+  stepTimer.begin(StepISR, STEP_TICK_US);
+  filterTimer.begin(FilterISR, FILTER_PERIOD_US);
 }
 
 
 void loop() {
-  // create the serial packet receive buffer
-  static byte buffer[PACKET_MAX_BYTES];
-  int count = 0;
-  int packetSize = PACKET_MIN_BYTES;
-  interrupts();
-  // continuously check for received packets
-  while(true)
-  {
-      // check to see if serial byte is available
-    if(Serial.available())
-    {
-      // get the byte
-      byte b = Serial.read();
-
-      // handle the byte according to the current count
-      if(count == 0 && b == PACKET_START_BYTE){
-        // this byte signals the beginning of a new packet
-        buffer[count] = b;
-        count++;
-        continue;
-      }
-      else if(count == 0){
-        // the first byte is not valid, ignore it and continue
-        continue;
-      }
-      else if(count == 1){
-        // this byte contains the overall packet length
-        buffer[count] = b;
-        // reset the count if the packet length is not in range
-        if(packetSize < PACKET_MIN_BYTES || packetSize > PACKET_MAX_BYTES){
-          count = 0;
-        }
-        else{
-          packetSize = b;
-          count++;
-        }
-        continue;
-      }
-      else if(count < packetSize){
-        // store the byte
-        buffer[count] = b;
-        count++;
-      }
-      // check to see if we have acquired enough bytes for a full packet
-      if(count >= packetSize){
-        // validate the packet
-        if(validatePacket(packetSize, buffer)){
-          if(buffer[2] == 'M' && packetSize == 7){
-            noInterrupts();
-            TurnMotor(buffer[3], buffer[4], buffer[5]);
-            sendPacket(packetSize - PACKET_OVERHEAD_BYTES, buffer + 2);
-            interrupts();
-          }
-          else if(buffer[2] == 'F'){
-            noInterrupts();
-            SendFlow();
-            interrupts();
-          }
-          else if(buffer[2] == 'T'){
-            digitalWrite(led, HIGH);
-            delay(1000);
-            digitalWrite(led, LOW);
-            noInterrupts();
-            sendPacket(packetSize - PACKET_OVERHEAD_BYTES, buffer + 2);
-            interrupts();
-          }
-        }
-        // reset the count
-        count = 0; 
+  // turn the identify LED back off without blocking the packet loop
+  if(identifyActive && millis() - identifyStart >= IDENTIFY_DURATION_MS){
+    digitalWrite(led, LOW);
+    identifyActive = false;
+  }
+  for(unsigned int n = 0; n < NUM_CHANNELS; n++){
+    RunFlowLoop(channels[n]);
+    ServiceDose(channels[n]);
+    ServiceMotion(channels[n]);
+  }
+  // drain everything the USB stack has buffered in one go
+  int available = Serial.available();
+  if(available > 0){
+    if(available > (int)sizeof(rxChunk)){
+      available = sizeof(rxChunk);
+    }
+    rxChunkAt = micros();
+    int received = Serial.readBytes(rxChunk, available);
+    for(int k = 0; k < received; k++){
+      if(rxParser.Feed(rxChunk[k])){
+        HandlePacket(rxParser.Size(), rxParser.Packet());
       }
     }
   }
+  // send the queued replies once the input has gone idle or the flush timer expires
+  if(txLength > 0 && (Serial.available() == 0 || micros() - txQueuedAt >= TX_FLUSH_INTERVAL_US)){
+    FlushTx();
+  }
+}
+
+//Act on a validated packet; a CHANNEL_COMMAND frame carries a command for one of the other valves
+void HandlePacket(unsigned int packetSize, const byte *buffer)
+{
+  const byte *payload = buffer + 2;
+  unsigned int payloadSize = packetSize - PACKET_OVERHEAD_BYTES;
+  if(payload[0] == CHANNEL_COMMAND){
+    if(payloadSize > CHANNEL_INNER_OFFSET && payload[CHANNEL_INDEX_OFFSET] < NUM_CHANNELS){
+      HandleCommand(channels[payload[CHANNEL_INDEX_OFFSET]], payload + CHANNEL_INNER_OFFSET, payloadSize - CHANNEL_INNER_OFFSET);
+    }
+  }
+  else{
+    HandleCommand(channels[0], payload, payloadSize);
+  }
 }
 
-//Default microstep mode function 
-void TurnMotor(char direc, int steps, int multi)
+//Act on a command addressed to one channel
+void HandleCommand(ValveChannel &c, const byte *payload, unsigned int payloadSize)
 {
-  flowCount = 0;
-  overflowCount = 0;
-  digitalWrite(EN, LOW);
+  if(payload[0] == MOTOR_COMMAND && payloadSize == 4){
+    // the reply is held back until the move is over, as the blocking move used to do
+    TurnMotor(c, payload[1], payload[2], payload[3]);
+    memcpy(c.motorReply, payload, sizeof(c.motorReply));
+    c.motorRepliesPending++;
+  }
+  else if(payload[0] == MOVE_COMMAND && payloadSize == MOVE_BYTES){
+    MoveTo(c, GetU16(payload + MOVE_TARGET_OFFSET), GetU16(payload + MOVE_RATE_OFFSET));
+  }
+  else if(payload[0] == ABORT_COMMAND){
+    AbortMove(c);
+  }
+  else if(payload[0] == FLOW_COMMAND){
+    noInterrupts();
+    SendFlow(c);
+    interrupts();
+  }
+  else if(payload[0] == TIMED_FLOW_COMMAND){
+    SendTimedFlow(c);
+  }
+  else if(payload[0] == HELLO_COMMAND){
+    SendHello(c);
+  }
+  else if(payload[0] == LOOP_CONFIG_COMMAND && payloadSize == LOOP_CONFIG_BYTES){
+    ConfigureFlowLoop(c, payload);
+  }
+  else if(payload[0] == LOOP_SETPOINT_COMMAND && payloadSize == LOOP_SETPOINT_BYTES){
+    SetFlowLoop(c, payload[LOOP_SETPOINT_RUN_OFFSET] != 0, GetU32(payload + LOOP_SETPOINT_RATE_OFFSET) / 1000.0);
+  }
+  else if(payload[0] == DOSE_COMMAND && payloadSize == DOSE_BYTES){
+    StartDose(c, GetU32(payload + DOSE_TARGET_OFFSET), GetU32(payload + DOSE_EARLY_CLOSE_OFFSET),
+              GetU16(payload + DOSE_OPEN_POSITION_OFFSET));
+  }
+  else if(payload[0] == FILTER_CONFIG_COMMAND && payloadSize == FILTER_CONFIG_BYTES){
+    ConfigureFilters(c, payload);
+  }
+  else if(payload[0] == RATE_COMMAND){
+    SendRates(c);
+  }
+  else if(payload[0] == SYNC_COMMAND && payloadSize == SYNC_REQUEST_BYTES){
+    SendSync(c, GetU32(payload + SYNC_SEQUENCE_OFFSET));
+  }
+  else if(payload[0] == TEST_COMMAND || payload[0] == IDENTIFY_COMMAND){
+    // reply right away; the LED is switched off later in the loop
+    Identify();
+    sendChannelPacket(c, payloadSize, payload);
+  }
+}
+
+//Write every queued frame to USB in one call
+void FlushTx()
+{
+  if(txLength == 0){
+    return;
+  }
+  Serial.write(txBuffer, txLength);
+  // hand the partial USB packet to the host now instead of waiting for it to fill
+  Serial.send_now();
+  txLength = 0;
+}
+
+//Take the valve away from the flow loop and any dose before a manual move
+void TakeManualControl(ValveChannel &c)
+{
+  noInterrupts();
+  c.loopEnabled = false;
+  c.doseActive = false;
+  c.doseClosing = false;
+  interrupts();
+}
+
+//Legacy relative move; starts in the background and is answered from ServiceMotion()
+void TurnMotor(ValveChannel &c, char direc, int steps, int multi)
+{
+  TakeManualControl(c);
+  c.flowCount = 0;
+  c.overflowCount = 0;
+  noInterrupts();
+  // moves queue up behind the one in flight the way back to back blocking moves did
   if(direc == 'F'){
-    digitalWrite(dir, LOW); //Pull direction pin low to move "forward"
+    c.motorTarget = constrain(c.motorTarget - steps * multi, 0, MAX_NUM_OF_STEPS);
   }
   else if(direc == 'B'){
-    digitalWrite(dir, HIGH);
-  }
-  for(i = 0; i < multi; i++)  //Loop the forward stepping enough times for motion to be visible
-  {
-    for(j = 0; j < steps; j++)
-    {
-      digitalWrite(stp,HIGH); //Trigger one step forward
-      delay(1);
-      digitalWrite(stp,LOW); //Pull step pin low so it can be triggered again
-      delay(1);
+    c.motorTarget = constrain(c.motorTarget + steps * multi, 0, MAX_NUM_OF_STEPS);
+  }
+  c.moveMaxRate = MAX_STEP_RATE;
+  interrupts();
+}
+
+//Move to an absolute position, replacing whatever move is in flight
+void MoveTo(ValveChannel &c, unsigned int target, unsigned int maxRate)
+{
+  TakeManualControl(c);
+  if(maxRate == 0 || maxRate > MAX_STEP_RATE){
+    maxRate = MAX_STEP_RATE;
+  }
+  if(maxRate < START_STEP_RATE){
+    maxRate = START_STEP_RATE;
+  }
+  noInterrupts();
+  c.motorTarget = constrain((int)target, 0, MAX_NUM_OF_STEPS);
+  c.moveMaxRate = maxRate;
+  interrupts();
+  c.moveRequestedTarget = constrain((int)target, 0, MAX_NUM_OF_STEPS);
+  c.moveAborted = false;
+  c.moveReportPending = true;
+}
+
+//Steps needed to slow from rate down to START_STEP_RATE
+unsigned long StoppingSteps(unsigned int rate)
+{
+  if(rate <= START_STEP_RATE){
+    return 0;
+  }
+  return ((unsigned long)rate * rate - (unsigned long)START_STEP_RATE * START_STEP_RATE) / (2 * STEP_ACCELERATION);
+}
+
+//Decelerate to a stop as quickly as the ramp allows; ServiceMotion() reports where the motor ended up
+void StopMotion(ValveChannel &c)
+{
+  noInterrupts();
+  if(c.motorDirection == 0){
+    c.motorTarget = c.motorPosition;
+  }
+  else{
+    c.motorTarget = constrain(c.motorPosition + c.motorDirection * (int)StoppingSteps(c.stepRate), 0, MAX_NUM_OF_STEPS);
+  }
+  interrupts();
+}
+
+//Abort a move; also stops the flow loop and any dose that is driving the valve
+void AbortMove(ValveChannel &c)
+{
+  TakeManualControl(c);
+  StopMotion(c);
+  c.moveAborted = true;
+  c.moveReportPending = true;
+}
+
+//Send the replies owed for moves once the motor has stopped
+void ServiceMotion(ValveChannel &c)
+{
+  if(!c.moveReportPending && c.motorRepliesPending == 0){
+    return;
+  }
+  noInterrupts();
+  boolean stopped = (c.motorDirection == 0 && c.motorPosition == c.motorTarget && !c.stepPinHigh);
+  int position = c.motorPosition;
+  interrupts();
+  if(!stopped){
+    return;
+  }
+  if(c.motorRepliesPending > 0){
+    c.flowCount = 0;
+    c.overflowCount = 0;
+    c.flowWindowStart = micros();
+    for(; c.motorRepliesPending > 0; c.motorRepliesPending--){
+      sendChannelPacket(c, sizeof(c.motorReply), c.motorReply);
     }
   }
-  flowCount = 0;
-  overflowCount = 0;
-  resetEDPins();
+  if(c.moveReportPending){
+    byte payload[MOVE_DONE_BYTES];
+    payload[0] = MOVE_DONE_FRAME;
+    PutU16(payload + MOVE_DONE_POSITION_OFFSET, position);
+    PutU16(payload + MOVE_DONE_TARGET_OFFSET, c.moveRequestedTarget);
+    payload[MOVE_DONE_ABORTED_OFFSET] = c.moveAborted ? 1 : 0;
+    sendChannelPacket(c, sizeof(payload), payload);
+    c.moveReportPending = false;
+  }
+}
+
+//Step every channel; runs every STEP_TICK_US from stepTimer
+void StepISR()
+{
+  for(unsigned int n = 0; n < NUM_CHANNELS; n++){
+    StepChannel(channels[n]);
+  }
 }
 
-boolean SendFlow()
+//Step one motor toward its target on a trapezoidal rate profile
+void StepChannel(ValveChannel &c)
+{
+  if(c.stepPinHigh){
+    // finish the step pulse started on the previous tick
+    digitalWrite(c.pins->stepPin, LOW);
+    c.stepPinHigh = false;
+  }
+  if(c.stepTicksLeft > 1){
+    c.stepTicksLeft--;
+    return;
+  }
+  int remaining = c.motorTarget - c.motorPosition;
+  int wanted = (remaining > 0) ? 1 : ((remaining < 0) ? -1 : 0);
+  boolean atEnd = (c.motorDirection > 0 && c.motorPosition >= MAX_NUM_OF_STEPS) || (c.motorDirection < 0 && c.motorPosition <= 0);
+  if(wanted == 0 || atEnd || (wanted != c.motorDirection && c.stepRate <= START_STEP_RATE)){
+    // arrived, at the end of travel, or slow enough to stop before turning around
+    c.motorDirection = 0;
+    c.stepRate = 0;
+  }
+  if(c.motorDirection == 0){
+    if(wanted == 0){
+      if(c.driverEnabled){
+        resetEDPins(c);
+        c.driverEnabled = false;
+      }
+      c.stepTicksLeft = 0;
+      return;
+    }
+    // set the direction and enable the driver one tick before the first step
+    digitalWrite(c.pins->dirPin, (wanted > 0) ? HIGH : LOW); //HIGH opens like a 'B' move, LOW closes like an 'F' move
+    if(!c.driverEnabled){
+      digitalWrite(c.pins->enablePin, LOW);
+      c.driverEnabled = true;
+    }
+    c.motorDirection = wanted;
+    c.stepRate = START_STEP_RATE;
+    c.stepTicksLeft = 1;
+    return;
+  }
+  digitalWrite(c.pins->stepPin, HIGH);
+  c.stepPinHigh = true;
+  c.motorPosition += c.motorDirection;
+
+  // speed up unless it is time to slow down for the target (or to turn around)
+  unsigned long distance = (wanted == c.motorDirection) ? (c.motorTarget - c.motorPosition) * c.motorDirection : 0;
+  unsigned int change = STEP_ACCELERATION / c.stepRate;
+  if(distance <= StoppingSteps(c.stepRate) || c.stepRate > c.moveMaxRate){
+    c.stepRate = (c.stepRate > START_STEP_RATE + change) ? c.stepRate - change : START_STEP_RATE;
+  }
+  else if(c.stepRate < c.moveMaxRate){
+    c.stepRate = (c.stepRate + change < c.moveMaxRate) ? c.stepRate + change : c.moveMaxRate;
+  }
+  c.stepTicksLeft = 1000000 / ((unsigned long)c.stepRate * STEP_TICK_US);
+}
+
+//Raw pulse rate in millipulses per second from the time between flow sensor pulses
+uint32_t RawPulseRate(unsigned long interval, unsigned long since)
+{
+  if(interval == 0 || since >= FLOW_TIMEOUT_US){
+    return 0;
+  }
+  // a pulse that is overdue means the flow has dropped below the last measured rate
+  if(since > interval){
+    interval = since;
+  }
+  return 1000000000UL / interval;
+}
+
+//Run the flow filters of every channel; called every FILTER_PERIOD_US from filterTimer
+void FilterISR()
+{
+  for(unsigned int n = 0; n < NUM_CHANNELS; n++){
+    FilterChannel(channels[n]);
+  }
+}
+
+//Run the flow filters of one channel
+void FilterChannel(ValveChannel &c)
+{
+  unsigned long now = micros();
+  noInterrupts();
+  unsigned long interval = c.pulseIntervalUs;
+  unsigned long last = c.lastPulseMicros;
+  interrupts();
+  unsigned long since = now - last;
+  uint32_t raw = RawPulseRate(interval, since);
+  c.rawRate = raw;
+
+  // moving average over the last averageLength samples
+  c.averageSum += raw - c.averageBuffer[c.averageIndex];
+  c.averageBuffer[c.averageIndex] = raw;
+  c.averageIndex++;
+  if(c.averageIndex >= c.averageLength){
+    c.averageIndex = 0;
+  }
+  c.averageRate = c.averageSum / c.averageLength;
+
+  // first order low pass: y += alpha * (x - y)
+  c.iirState += ((((int64_t)raw << 16) - c.iirState) * c.iirAlpha) >> 16;
+  c.iirRate = (uint32_t)(c.iirState >> 16);
+
+  // scalar Kalman filter: predict every period, correct once per pulse interval
+  c.kalmanP += c.kalmanQ;
+  if(c.kalmanP > KALMAN_P_MAX){
+    c.kalmanP = KALMAN_P_MAX;
+  }
+  unsigned long measured = (since > interval) ? since : interval;
+  if(last != c.kalmanLastPulse || now - c.kalmanLastUpdate >= measured){
+    c.kalmanLastPulse = last;
+    c.kalmanLastUpdate = now;
+    int64_t gain = (c.kalmanP << 16) / (c.kalmanP + c.kalmanR);
+    c.kalmanState += (((int64_t)raw - c.kalmanState) * gain) >> 16;
+    c.kalmanP = (c.kalmanP * (65536 - gain)) >> 16;
+  }
+  c.kalmanRate = (c.kalmanState > 0) ? (uint32_t)c.kalmanState : 0;
+}
+
+//Rate from the filter selected for the on-device loop, in pulses per second
+float LoopInputRate(ValveChannel &c)
+{
+  uint32_t rate;
+  noInterrupts();
+  if(c.loopFilter == FILTER_AVERAGE){
+    rate = c.averageRate;
+  }
+  else if(c.loopFilter == FILTER_IIR){
+    rate = c.iirRate;
+  }
+  else if(c.loopFilter == FILTER_KALMAN){
+    rate = c.kalmanRate;
+  }
+  else{
+    rate = c.rawRate;
+  }
+  interrupts();
+  return rate / 1000.0;
+}
+
+//Store the filter settings sent by the host
+void ConfigureFilters(ValveChannel &c, const byte *payload)
+{
+  unsigned int length = constrain((unsigned int)payload[FILTER_CONFIG_AVERAGE_OFFSET], 1U, MAX_AVERAGE_LENGTH);
+  noInterrupts();
+  // restart the average so the running sum matches the new length
+  memset(c.averageBuffer, 0, sizeof(c.averageBuffer));
+  c.averageSum = 0;
+  c.averageIndex = 0;
+  c.averageLength = length;
+  c.iirAlpha = GetU16(payload + FILTER_CONFIG_ALPHA_OFFSET);
+  c.kalmanQ = GetU32(payload + FILTER_CONFIG_Q_OFFSET);
+  c.kalmanR = GetU32(payload + FILTER_CONFIG_R_OFFSET);
+  if(c.kalmanR == 0){
+    c.kalmanR = 1;
+  }
+  c.loopFilter = payload[FILTER_CONFIG_LOOP_OFFSET];
+  interrupts();
+}
+
+//Reply with the raw and filtered pulse rates
+boolean SendRates(ValveChannel &c)
+{
+  byte payload[RATE_BYTES];
+  payload[0] = RATE_COMMAND;
+  noInterrupts();
+  PutU32(payload + RATE_TIME_OFFSET, micros());
+  PutU32(payload + RATE_RAW_OFFSET, c.rawRate);
+  PutU32(payload + RATE_AVERAGE_OFFSET, c.averageRate);
+  PutU32(payload + RATE_IIR_OFFSET, c.iirRate);
+  PutU32(payload + RATE_KALMAN_OFFSET, c.kalmanRate);
+  interrupts();
+  return sendChannelPacket(c, sizeof(payload), payload);
+}
+
+//Answer a clock sync request straight away so the host sees the round trip of the link alone
+boolean SendSync(ValveChannel &c, unsigned long sequence)
+{
+  byte payload[SYNC_BYTES];
+  // anything already queued goes first so it does not delay the reply
+  FlushTx();
+  payload[0] = SYNC_COMMAND;
+  PutU32(payload + SYNC_SEQUENCE_OFFSET, sequence);
+  PutU32(payload + SYNC_RECEIVE_OFFSET, rxChunkAt);
+  PutU32(payload + SYNC_TRANSMIT_OFFSET, micros());
+  boolean queued = sendChannelPacket(c, sizeof(payload), payload);
+  FlushTx();
+  return queued;
+}
+
+//Store the gains sent by the host for the on-device flow loop
+void ConfigureFlowLoop(ValveChannel &c, const byte *payload)
+{
+  c.loopKp = (int32_t)GetU32(payload + LOOP_CONFIG_KP_OFFSET) / 1000.0;
+  c.loopKi = (int32_t)GetU32(payload + LOOP_CONFIG_KI_OFFSET) / 1000.0;
+  c.loopKd = (int32_t)GetU32(payload + LOOP_CONFIG_KD_OFFSET) / 1000.0;
+  c.loopPeriodUs = GetU32(payload + LOOP_CONFIG_PERIOD_OFFSET);
+  c.loopStatusEvery = GetU16(payload + LOOP_CONFIG_STATUS_OFFSET);
+  if(c.loopPeriodUs < 1000){
+    c.loopPeriodUs = 1000;
+  }
+}
+
+//Start, retarget or stop the on-device flow loop
+void SetFlowLoop(ValveChannel &c, boolean run, float setpoint)
+{
+  if(run && !c.loopEnabled){
+    // start from the current valve position so the first output does not jump
+    c.loopIntegral = (c.loopKi != 0.0) ? c.motorPosition / c.loopKi : 0.0;
+    c.loopLastError = 0.0;
+    c.loopTicks = 0;
+    c.loopLastTick = micros();
+  }
+  c.loopSetpoint = setpoint;
+  c.loopEnabled = run;
+  if(!run){
+    StopMotion(c);
+    SendLoopStatus(c, 0.0);
+  }
+}
+
+//Run one iteration of the flow loop when its period has elapsed
+void RunFlowLoop(ValveChannel &c)
+{
+  if(!c.loopEnabled){
+    return;
+  }
+  unsigned long now = micros();
+  if(now - c.loopLastTick < c.loopPeriodUs){
+    return;
+  }
+  float dt = (now - c.loopLastTick) / 1000000.0;
+  c.loopLastTick = now;
+
+  float rate = LoopInputRate(c);
+  float error = c.loopSetpoint - rate;
+  float derivative = (error - c.loopLastError) / dt;
+  float integral = c.loopIntegral + error * dt;
+  float output = c.loopKp * error + c.loopKi * integral + c.loopKd * derivative;
+  c.loopLastError = error;
+  // only keep the new integral while the valve is not pinned at an end stop
+  if(output > MAX_NUM_OF_STEPS){
+    output = MAX_NUM_OF_STEPS;
+  }
+  else if(output < 0.0){
+    output = 0.0;
+  }
+  else{
+    c.loopIntegral = integral;
+  }
+  noInterrupts();
+  c.motorTarget = (int)(output + 0.5);
+  interrupts();
+
+  c.loopTicks++;
+  if(c.loopTicks >= c.loopStatusEvery){
+    c.loopTicks = 0;
+    SendLoopStatus(c, rate);
+  }
+}
+
+//Queue a status frame for the host
+boolean SendLoopStatus(ValveChannel &c, float rate)
+{
+  byte payload[LOOP_STATUS_BYTES];
+  payload[0] = LOOP_STATUS_FRAME;
+  payload[LOOP_STATUS_RUN_OFFSET] = c.loopEnabled;
+  PutU32(payload + LOOP_STATUS_TIME_OFFSET, micros());
+  PutU32(payload + LOOP_STATUS_SETPOINT_OFFSET, (uint32_t)(c.loopSetpoint * 1000.0));
+  PutU32(payload + LOOP_STATUS_RATE_OFFSET, (uint32_t)(rate * 1000.0));
+  noInterrupts();
+  PutU16(payload + LOOP_STATUS_POSITION_OFFSET, c.motorPosition);
+  PutU16(payload + LOOP_STATUS_TARGET_OFFSET, c.motorTarget);
+  PutU32(payload + LOOP_STATUS_PULSES_OFFSET, c.totalPulses);
+  interrupts();
+  return sendChannelPacket(c, sizeof(payload), payload);
+}
+
+boolean SendFlow(ValveChannel &c)
 {
   // the payload size will stay constant
-  unsigned int packetSize = 3 + PACKET_OVERHEAD_BYTES;
-  // create the serial packet transmit buffer
-  static byte packet[PACKET_MAX_BYTES];
-  // populate the overhead fields
-  packet[0] = PACKET_START_BYTE;
-  packet[1] = packetSize;
-  byte checkSum = packet[0] ^ packet[1];
-  // populate the packet payload while computing the checksum
-  packet[2] = 'F';
-  checkSum = checkSum ^ packet[2];
-  packet[3] = flowCount;
-  checkSum = checkSum ^ packet[3];
-  packet[4] = overflowCount;
-  packet[5] = checkSum ^ packet[4];
-  // send the packet
-  Serial.write(packet, packetSize);
-  Serial.flush();
-  flowCount = 0;
-  overflowCount = 0;
-  return true;
+  byte payload[3];
+  payload[0] = FLOW_COMMAND;
+  payload[1] = c.flowCount;
+  payload[2] = c.overflowCount;
+  c.flowCount = 0;
+  c.overflowCount = 0;
+  c.flowWindowStart = micros();
+  return sendChannelPacket(c, sizeof(payload), payload);
 }
 
-//Reset Easy Driver pins to default states
-void resetEDPins()
+//Reply with the pulses counted and the microseconds elapsed since the last flow read
+boolean SendTimedFlow(ValveChannel &c)
 {
-  digitalWrite(stp, LOW);
-  digitalWrite(dir, LOW);
-  digitalWrite(MS1, LOW);
-  digitalWrite(MS2, LOW);
-  digitalWrite(EN, HIGH);
+  byte payload[TIMED_FLOW_BYTES];
+  noInterrupts();
+  unsigned long pulses = c.overflowCount * 256UL + c.flowCount;
+  unsigned long now = micros();
+  unsigned long window = now - c.flowWindowStart;
+  c.flowCount = 0;
+  c.overflowCount = 0;
+  c.flowWindowStart = now;
+  interrupts();
+  payload[0] = TIMED_FLOW_COMMAND;
+  PutU32(payload + TIMED_FLOW_PULSES_OFFSET, pulses);
+  PutU32(payload + TIMED_FLOW_WINDOW_OFFSET, window);
+  return sendChannelPacket(c, sizeof(payload), payload);
 }
 
-boolean validatePacket(unsigned int packetSize, byte *packet)
+//Reply to the hello command with the device identity and what it supports
+boolean SendHello(ValveChannel &c)
 {
-  // check the packet size
-  if(packetSize < PACKET_MIN_BYTES || packetSize > PACKET_MAX_BYTES)
-  {
-      return false;
+  byte payload[HELLO_COMMANDS_OFFSET + sizeof(SUPPORTED_COMMANDS) + 2];
+  payload[0] = HELLO_COMMAND;
+  payload[HELLO_PROTOCOL_OFFSET] = PROTOCOL_VERSION;
+  payload[HELLO_FW_MAJOR_OFFSET] = FIRMWARE_VERSION_MAJOR;
+  payload[HELLO_FW_MINOR_OFFSET] = FIRMWARE_VERSION_MINOR;
+  PutU32(payload + HELLO_SERIAL_OFFSET, ReadSerialNumber());
+  PutU16(payload + HELLO_STEP_RATE_OFFSET, MAX_STEP_RATE);
+  PutU16(payload + HELLO_CALIBRATION_OFFSET, FLOW_UL_PER_PULSE);
+  PutU32(payload + HELLO_FEATURES_OFFSET, FEATURE_IDENTIFY | FEATURE_TIMED_FLOW | FEATURE_DEVICE_LOOP | FEATURE_DOSE | FEATURE_FILTERED_RATE |
+                                         FEATURE_PREEMPTIBLE_MOVE | FEATURE_CHANNELS | FEATURE_CLOCK_SYNC | FEATURE_SENSOR_PROFILE);
+  payload[HELLO_NUM_COMMANDS_OFFSET] = sizeof(SUPPORTED_COMMANDS);
+  memcpy(payload + HELLO_COMMANDS_OFFSET, SUPPORTED_COMMANDS, sizeof(SUPPORTED_COMMANDS));
+  payload[HELLO_COMMANDS_OFFSET + sizeof(SUPPORTED_COMMANDS)] = NUM_CHANNELS;
+  payload[HELLO_COMMANDS_OFFSET + sizeof(SUPPORTED_COMMANDS) + 1] = SENSOR.id;
+  return sendChannelPacket(c, sizeof(payload), payload);
+}
+
+//Begin dispensing target pulses; a target of 0 cancels the running dose
+void StartDose(ValveChannel &c, unsigned long target, unsigned long earlyClose, unsigned int openPosition)
+{
+  noInterrupts();
+  c.doseActive = false;
+  c.doseClosing = false;
+  interrupts();
+  if(target == 0){
+    return;
   }
-  // check the start byte
-  if(packet[0] != PACKET_START_BYTE)
-  {
-    return false;
+  if(earlyClose == DOSE_AUTO_EARLY_CLOSE){
+    earlyClose = c.doseOvershootKnown ? (unsigned long)(c.doseOvershoot + 0.5) : 0;
   }
-  // check the length byte
-  if(packet[1] != packetSize)
-  {
-    return false;
+  c.doseTarget = target;
+  c.doseClosedMicros = 0;
+  noInterrupts();
+  c.dosePulses = 0;
+  c.doseNl = 0;
+  c.doseTrigger = (earlyClose < target) ? target - earlyClose : 1;
+  c.doseActive = true;
+  if(openPosition != DOSE_KEEP_POSITION && !c.loopEnabled){
+    c.motorTarget = constrain((int)openPosition, 0, MAX_NUM_OF_STEPS);
   }
-  // compute the checksum
-  byte checksum = 0x00;
-  for(int i = 0; i < packetSize - 1; i++)
-  {
-    checksum = checksum ^ packet[i];
+  interrupts();
+}
+
+//Called from CountFlow() with the volume of the pulse; counts it in dose pulses and shuts the valve as soon as the trigger count is reached
+void CountDosePulse(ValveChannel &c, unsigned long now, uint32_t pulseNl)
+{
+  if(!c.doseActive && !c.doseClosing){
+    return;
   }
-  // check to see if the computed checksum and packet checksum are equal
-  if(packet[packetSize - 1] != checksum)
-  {
-    return false;
+  c.doseNl += pulseNl;
+  while(c.doseNl >= DOSE_PULSE_NL){
+    c.doseNl -= DOSE_PULSE_NL;
+    c.dosePulses++;
+    if(c.doseActive && c.dosePulses >= c.doseTrigger){
+      c.doseActive = false;
+      c.doseClosing = true;
+      c.loopEnabled = false;
+      c.motorTarget = 0;
+      c.doseTriggerMicros = now;
+    }
   }
-  // all validation checks passed, the packet is valid
-  return true;
 }
 
-boolean sendPacket(unsigned int payloadSize, byte *payload)
+//Report the dose once the valve is shut and the flow has stopped
+void ServiceDose(ValveChannel &c)
+{
+  if(!c.doseClosing){
+    return;
+  }
+  unsigned long now = micros();
+  noInterrupts();
+  boolean shut = (c.motorPosition == 0 && c.motorDirection == 0 && !c.stepPinHigh);
+  unsigned long sincePulse = now - c.lastPulseMicros;
+  interrupts();
+  if(!shut){
+    return;
+  }
+  if(c.doseClosedMicros == 0){
+    c.doseClosedMicros = now;
+  }
+  if(now - c.doseClosedMicros < DOSE_SETTLE_US || sincePulse < DOSE_SETTLE_US){
+    return;
+  }
+  noInterrupts();
+  c.doseClosing = false;
+  unsigned long delivered = c.dosePulses;
+  interrupts();
+
+  // learn how far the flow runs on while the valve closes
+  float overshoot = (float)delivered - (float)c.doseTrigger;
+  if(c.doseOvershootKnown){
+    c.doseOvershoot += DOSE_OVERSHOOT_WEIGHT * (overshoot - c.doseOvershoot);
+  }
+  else{
+    c.doseOvershoot = overshoot;
+    c.doseOvershootKnown = true;
+  }
+  if(c.doseOvershoot < 0.0){
+    c.doseOvershoot = 0.0;
+  }
+
+  byte payload[DOSE_REPORT_BYTES];
+  payload[0] = DOSE_REPORT_FRAME;
+  PutU32(payload + DOSE_REPORT_TARGET_OFFSET, c.doseTarget);
+  PutU32(payload + DOSE_REPORT_TRIGGER_OFFSET, c.doseTrigger);
+  PutU32(payload + DOSE_REPORT_DELIVERED_OFFSET, delivered);
+  PutU32(payload + DOSE_REPORT_CLOSE_TIME_OFFSET, c.doseClosedMicros - c.doseTriggerMicros);
+  sendChannelPacket(c, sizeof(payload), payload);
+}
+
+//Start the identify blink; loop() turns the LED off again
+void Identify()
+{
+  digitalWrite(led, HIGH);
+  identifyStart = millis();
+  identifyActive = true;
+}
+
+//Read the factory programmed serial number of the board (0 if unknown)
+unsigned long ReadSerialNumber()
+{
+  uint32_t num = 0;
+#if defined(__MK20DX128__) || defined(__MK20DX256__)
+  __disable_irq();
+  FTFL_FSTAT = FTFL_FSTAT_RDCOLERR | FTFL_FSTAT_ACCERR | FTFL_FSTAT_FPVIOL;
+  FTFL_FCCOB0 = 0x41;
+  FTFL_FCCOB1 = 15;
+  FTFL_FSTAT = FTFL_FSTAT_CCIF;
+  while(!(FTFL_FSTAT & FTFL_FSTAT_CCIF)) ;
+  num = *(uint32_t *)&FTFL_FCCOB7;
+  __enable_irq();
+#elif defined(__IMXRT1062__)
+  num = HW_OCOTP_MAC0 & 0xFFFFFF;
+#endif
+  // match the number printed by the Teensy loader
+  if(num < 10000000) num = num * 10;
+  return num;
+}
+
+//Reset Easy Driver pins to default states
+void resetEDPins(ValveChannel &c)
+{
+  digitalWrite(c.pins->stepPin, LOW);
+  digitalWrite(c.pins->dirPin, LOW);
+  digitalWrite(c.pins->ms1Pin, LOW);
+  digitalWrite(c.pins->ms2Pin, LOW);
+  digitalWrite(c.pins->enablePin, HIGH);
+}
+
+//Queue a frame for transmission; it is written out by FlushTx()
+boolean sendPacket(unsigned int payloadSize, const byte *payload)
 {
   // check for max payload size
   unsigned int packetSize = payloadSize + PACKET_OVERHEAD_BYTES;
   if(packetSize > PACKET_MAX_BYTES){
     return false;
   }
-  // create the serial packet transmit buffer
-  static byte packet[PACKET_MAX_BYTES];
+  // make room in the transmit queue
+  if(txLength + packetSize > TX_BUFFER_BYTES){
+    FlushTx();
+  }
+  if(txLength == 0){
+    txQueuedAt = micros();
+  }
+  byte *packet = txBuffer + txLength;
   // populate the overhead fields
   packet[0] = PACKET_START_BYTE;
   packet[1] = packetSize;
   byte checkSum = packet[0] ^ packet[1];
   // populate the packet payload while computing the checksum
-  for(int i = 0; i < payloadSize; i++){
+  for(unsigned int i = 0; i < payloadSize; i++){
     packet[i + 2] = payload[i];
     checkSum = checkSum ^ packet[i + 2];
   }
   // store the checksum
   packet[packetSize - 1] = checkSum;
-  // send the packet
-  Serial.write(packet, packetSize);
-  Serial.flush();
+  txLength += packetSize;
   return true;
 }
 
-void CountFlow()
+//Queue a frame from one channel; frames from channels other than 0 are wrapped in a CHANNEL_COMMAND frame
+boolean sendChannelPacket(ValveChannel &c, unsigned int payloadSize, const byte *payload)
+{
+  if(c.index == 0){
+    return sendPacket(payloadSize, payload);
+  }
+  byte wrapped[PACKET_MAX_BYTES];
+  if(payloadSize + CHANNEL_INNER_OFFSET + PACKET_OVERHEAD_BYTES > PACKET_MAX_BYTES){
+    return false;
+  }
+  wrapped[0] = CHANNEL_COMMAND;
+  wrapped[CHANNEL_INDEX_OFFSET] = c.index;
+  memcpy(wrapped + CHANNEL_INNER_OFFSET, payload, payloadSize);
+  return sendPacket(payloadSize + CHANNEL_INNER_OFFSET, wrapped);
+}
+
+//Flow sensor interrupts; attachInterrupt() cannot pass the channel along
+void CountFlow0()
+{
+  CountFlow(channels[0]);
+}
+
+void CountFlow1()
+{
+  CountFlow(channels[1]);
+}
+
+void CountFlow(ValveChannel &c)
 {
-  flowCount++;
-  if(flowCount == 256){
-    flowCount = 0;
-    overflowCount++;
+  unsigned long now = micros();
+  unsigned long interval = now - c.lastPulseMicros;
+  c.pulseIntervalUs = interval;
+  c.lastPulseMicros = now;
+  c.totalPulses++;
+  // a linear sensor needs no rate, so this folds away to a constant for one
+  uint32_t pulseNl = SENSOR.numPoints > 1 ? FlowSensorPulseNl(SENSOR, RawPulseRate(interval, 0)) : SENSOR.nlPerPulse[0];
+  CountDosePulse(c, now, pulseNl);
+  c.flowCount++;
+  if(c.flowCount == 256){
+    c.flowCount = 0;
+    c.overflowCount++;
   }
 }
 
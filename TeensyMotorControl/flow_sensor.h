@@ -0,0 +1,168 @@
+/*!
+ * \file flow_sensor.h
+ * \brief Flow sensor calibration profiles shared by the Teensy firmware and the Pi-Flow host.
+ * \details A turbine sensor gives fewer pulses per liter at low flow, where the rotor slips, than
+ * at high flow, so one mL per pulse figure is only right over part of its range. A profile lists
+ * the K-factor (pulses per liter) at a few pulse frequencies, and the volume of a pulse at any
+ * other frequency is interpolated linearly between them and held flat outside them.
+ *
+ * The tables are turned into fixed point when they are compiled: the volume of a pulse at each
+ * point in nanoliters and the slope to the next point in 1/65536 nL per millihertz. A lookup is
+ * then a short scan, a multiply and a shift with no division at all, cheap enough for the firmware
+ * to do once per pulse in the flow sensor interrupt and for the host to do on every sample.
+ *
+ * The firmware is built with the profile FLOW_SENSOR selects and reports its id in the hello reply
+ * with FEATURE_SENSOR_PROFILE; the host looks the id up in the same table, so both sides turn
+ * pulses into volume with the same numbers.
+ */
+#ifndef _TEENSY_FLOW_SENSOR_H
+#define _TEENSY_FLOW_SENSOR_H	//!< Used to ensure the header is only included once during compilation
+
+#include <stdint.h>
+#include <stddef.h>
+
+const unsigned int FLOW_SENSOR_MAX_POINTS = 8;		//!< Points a profile may have
+const unsigned int FLOW_SENSOR_SLOPE_SHIFT = 16;	//!< Fraction bits of the slopes
+
+/*!
+ *  One point of a calibration curve, as read off a datasheet or a bench calibration
+ */
+struct FlowSensorPoint
+{
+  double hz;			//!< Pulse frequency
+  double pulsesPerLiter;	//!< K-factor at that frequency
+};
+
+/*!
+ *  A calibration curve in the fixed point form the lookups use
+ */
+struct FlowSensorProfile
+{
+  const char *name;				//!< Name the host accepts for the profile
+  uint8_t id;					//!< Id reported in the hello reply
+  uint16_t nominalUl;				//!< Calibration reported in the hello reply, and the unit doses are counted in, in microliters per pulse
+  unsigned int numPoints;			//!< Valid points
+  uint32_t milliHz[FLOW_SENSOR_MAX_POINTS];	//!< Frequency of each point in millipulses per second, increasing
+  uint32_t nlPerPulse[FLOW_SENSOR_MAX_POINTS];	//!< Volume of a pulse at each point in nanoliters
+  int32_t slope[FLOW_SENSOR_MAX_POINTS];	//!< Change of nlPerPulse per millihertz up to the next point, in 1/65536 nL
+};
+
+/*!
+ * \brief Builds a profile from a calibration curve
+ * \param nominalPulsesPerLiter is the K-factor the sensor is sold as, which sets nominalUl
+ * \param points are in order of increasing frequency
+ * \details Meant to be evaluated by the compiler; FlowSensorValid checks the result.
+ */
+template<unsigned int N>
+constexpr FlowSensorProfile MakeFlowSensorProfile(const char *name, uint8_t id, double nominalPulsesPerLiter, const FlowSensorPoint (&points)[N])
+{
+  static_assert(N >= 1 && N <= FLOW_SENSOR_MAX_POINTS, "a flow sensor profile needs 1 to FLOW_SENSOR_MAX_POINTS points");
+  FlowSensorProfile profile = {};
+  profile.name = name;
+  profile.id = id;
+  profile.nominalUl = (uint16_t)(1000000.0 / nominalPulsesPerLiter + 0.5);
+  profile.numPoints = N;
+  for(unsigned int i = 0; i < N; i++){
+    profile.milliHz[i] = (uint32_t)(points[i].hz * 1000.0 + 0.5);
+    profile.nlPerPulse[i] = (uint32_t)(1000000000.0 / points[i].pulsesPerLiter + 0.5);
+  }
+  for(unsigned int i = 0; i + 1 < N; i++){
+    int64_t rise = ((int64_t)profile.nlPerPulse[i + 1] - (int64_t)profile.nlPerPulse[i]) * ((int64_t)1 << FLOW_SENSOR_SLOPE_SHIFT);
+    int64_t run = (int64_t)profile.milliHz[i + 1] - (int64_t)profile.milliHz[i];
+    profile.slope[i] = run > 0 ? (int32_t)(rise / run) : 0;
+  }
+  return profile;
+}
+
+/*!
+ * \brief Profile with one calibration at every frequency
+ * \details For firmware that only reports a calibration in the hello reply.
+ */
+constexpr FlowSensorProfile LinearFlowSensor(const char *name, uint8_t id, uint16_t ulPerPulse)
+{
+  FlowSensorProfile profile = {};
+  profile.name = name;
+  profile.id = id;
+  profile.nominalUl = ulPerPulse;
+  profile.numPoints = 1;
+  profile.nlPerPulse[0] = ulPerPulse * 1000UL;
+  return profile;
+}
+
+// ids reported in the hello reply; the id is the index into FLOW_SENSOR_PROFILES
+const uint8_t FLOW_SENSOR_LEGACY = 0;		//!< The 6.50 mL per pulse sensor the rig was built with
+const uint8_t FLOW_SENSOR_YF_S201 = 1;		//!< 1/2 inch hall effect turbine, 450 pulses per liter
+const uint8_t FLOW_SENSOR_FS300A = 2;		//!< 3/4 inch hall effect turbine, 330 pulses per liter
+const uint8_t FLOW_SENSOR_CUSTOM = 0xFF;	//!< Linear profile built from a calibration the host was given
+
+// K-factor curves; the non-linear ones are the typical curves of their models, so a sensor used
+// for dosing should be calibrated against a scale and its points entered here
+constexpr FlowSensorPoint LEGACY_POINTS[] = {{1.0, 1000.0 / 6.50}};
+constexpr FlowSensorPoint YF_S201_POINTS[] = {{1.0, 330.0}, {4.0, 400.0}, {8.0, 430.0}, {16.0, 445.0}, {32.0, 450.0}, {64.0, 452.0}};
+constexpr FlowSensorPoint FS300A_POINTS[] = {{1.0, 250.0}, {4.0, 300.0}, {10.0, 322.0}, {25.0, 330.0}, {50.0, 332.0}};
+
+constexpr FlowSensorProfile FLOW_SENSOR_PROFILES[] = {
+  MakeFlowSensorProfile("legacy", FLOW_SENSOR_LEGACY, 1000.0 / 6.50, LEGACY_POINTS),
+  MakeFlowSensorProfile("yf-s201", FLOW_SENSOR_YF_S201, 450.0, YF_S201_POINTS),
+  MakeFlowSensorProfile("fs300a", FLOW_SENSOR_FS300A, 330.0, FS300A_POINTS),
+};
+const unsigned int NUM_FLOW_SENSORS = sizeof(FLOW_SENSOR_PROFILES) / sizeof(FLOW_SENSOR_PROFILES[0]);	//!< Profiles in FLOW_SENSOR_PROFILES
+
+/*!
+ * \brief True if a profile is usable: its id is its place in the table, its frequencies increase and no pulse is empty
+ */
+constexpr bool FlowSensorValid(const FlowSensorProfile &profile, unsigned int index)
+{
+  if(profile.id != index || profile.numPoints < 1 || profile.numPoints > FLOW_SENSOR_MAX_POINTS || profile.nominalUl == 0){
+    return false;
+  }
+  for(unsigned int i = 0; i < profile.numPoints; i++){
+    if(profile.nlPerPulse[i] == 0 || (i > 0 && profile.milliHz[i] <= profile.milliHz[i - 1])){
+      return false;
+    }
+  }
+  return true;
+}
+
+/*!
+ * \brief True if every profile in FLOW_SENSOR_PROFILES is usable
+ */
+constexpr bool FlowSensorsValid()
+{
+  for(unsigned int i = 0; i < NUM_FLOW_SENSORS; i++){
+    if(!FlowSensorValid(FLOW_SENSOR_PROFILES[i], i)){
+      return false;
+    }
+  }
+  return true;
+}
+
+static_assert(FlowSensorsValid(), "a flow sensor profile is out of order or has an empty pulse");
+
+/*!
+ * \brief Volume of one pulse in nanoliters at a pulse rate
+ * \param milliHz is the pulse rate in millipulses per second
+ * \details Integer only, so it can run in the flow sensor interrupt.
+ */
+inline uint32_t FlowSensorPulseNl(const FlowSensorProfile &profile, uint32_t milliHz)
+{
+  unsigned int i = 0;
+  while(i + 1 < profile.numPoints && milliHz >= profile.milliHz[i + 1]){
+    i++;
+  }
+  if(i + 1 == profile.numPoints || milliHz <= profile.milliHz[i]){
+    return profile.nlPerPulse[i];
+  }
+  int64_t change = ((int64_t)profile.slope[i] * (int64_t)(milliHz - profile.milliHz[i])) >> FLOW_SENSOR_SLOPE_SHIFT;
+  return (uint32_t)((int64_t)profile.nlPerPulse[i] + change);
+}
+
+/*!
+ * \brief Profile with the given id, NULL if there is none
+ */
+inline const FlowSensorProfile *FindFlowSensor(uint8_t id)
+{
+  return id < NUM_FLOW_SENSORS ? &FLOW_SENSOR_PROFILES[id] : NULL;
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*!
+ * \file frame_parser.h
+ * \brief Byte at a time reassembly of packets, shared by the Teensy firmware and the Pi-Flow host.
+ * \details Bytes before a start byte are skipped. A length byte outside PACKET_MIN_BYTES..PACKET_MAX_BYTES
+ * or a bad checksum throws the packet away and the search for the next start byte begins again.
+ * The parser keeps counts of what it threw away so noisy links show up in the statistics.
+ * It is the only packet parser in the firmware, the host and the simulator; tools/parser_bench
+ * measures its throughput and tools/fuzz_frame_parser checks it against a reference.
+ */
+#ifndef _TEENSY_FRAME_PARSER_H
+#define _TEENSY_FRAME_PARSER_H	//!< Used to ensure the header is only included once during compilation
+
+#include "protocol.h"
+
+/*!
+ * \brief Collects packets from a stream of bytes.
+ */
+class FrameParser
+{
+public:
+  FrameParser() : count(0), size(0), skippedBytes(0), badLengths(0), badChecksums(0), frames(0) {}
+
+  /*!
+   * \brief Adds one byte from the link
+   * \details Returns true when the byte completes a valid packet, which Packet() and Size() then describe until the next call.
+   */
+  bool Feed(uint8_t b)
+  {
+    if(count == 0){
+      if(b == PACKET_START_BYTE){
+        packet[count++] = b;
+      }
+      else{
+        skippedBytes++;
+      }
+      return false;
+    }
+    if(count == 1){
+      if(b < PACKET_MIN_BYTES || b > PACKET_MAX_BYTES){
+        badLengths++;
+        count = 0;
+        return false;
+      }
+      packet[count++] = b;
+      return false;
+    }
+    packet[count++] = b;
+    if(count < packet[1]){
+      return false;
+    }
+    size = count;
+    count = 0;
+    uint8_t checksum = 0;
+    for(unsigned int i = 0; i + 1 < size; i++){
+      checksum ^= packet[i];
+    }
+    if(checksum != packet[size - 1]){
+      badChecksums++;
+      return false;
+    }
+    frames++;
+    return true;
+  }
+
+  const uint8_t *Packet() const { return packet; }
+  unsigned int Size() const { return size; }
+  void Reset() { count = 0; }
+
+  uint32_t SkippedBytes() const { return skippedBytes; }
+  uint32_t BadLengths() const { return badLengths; }
+  uint32_t BadChecksums() const { return badChecksums; }
+  uint32_t Frames() const { return frames; }
+
+private:
+  uint8_t packet[PACKET_MAX_BYTES];	//!< Packet being collected, or the last complete one
+  unsigned int count;			//!< Bytes of the packet collected so far
+  unsigned int size;			//!< Size of the last complete packet
+  uint32_t skippedBytes;		//!< Bytes seen while waiting for a start byte
+  uint32_t badLengths;			//!< Packets dropped for a length out of range
+  uint32_t badChecksums;		//!< Packets dropped for a bad checksum
+  uint32_t frames;			//!< Valid packets returned
+};
+
+#endif
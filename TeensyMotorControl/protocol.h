@@ -0,0 +1,198 @@
+/*!
+ * \file protocol.h
+ * \brief Packet layout and command set shared by the Teensy firmware and the Pi-Flow host.
+ * \details Every packet is framed as [start byte][total length][command][payload...][xor checksum].
+ * Multi-byte payload fields are sent least significant byte first.
+ */
+#ifndef _TEENSY_PROTOCOL_H
+#define _TEENSY_PROTOCOL_H	//!< Used to ensure the header is only included once during compilation
+
+#include <stdint.h>
+
+#define FIRMWARE_VERSION_MAJOR 1	//!< Major version of the Teensy firmware
+#define FIRMWARE_VERSION_MINOR 8	//!< Minor version of the Teensy firmware
+#define PROTOCOL_VERSION 2		//!< Version of the packet protocol; the legacy 'T'/'F'/'M' protocol is version 1
+
+// define packet parameters
+const uint8_t PACKET_START_BYTE = 0xAA;
+const unsigned int PACKET_OVERHEAD_BYTES = 3;
+const unsigned int PACKET_MIN_BYTES = PACKET_OVERHEAD_BYTES + 1;
+const unsigned int PACKET_MAX_BYTES = 255;
+
+const int MAX_NUM_OF_STEPS = 2000;	//!< Number of motor steps between fully closed and fully open
+
+// commands understood by the Teensy
+const uint8_t MOTOR_COMMAND = 'M';		//!< Step the motor; payload is direction, steps, multiplier. Replied to once the move is over
+const uint8_t FLOW_COMMAND = 'F';		//!< Legacy flow read; reply holds a 16 bit pulse count
+const uint8_t TEST_COMMAND = 'T';		//!< Legacy connection test; reply echoes the command
+const uint8_t HELLO_COMMAND = 'H';		//!< Capability handshake; reply is described by the HELLO_ offsets below
+const uint8_t IDENTIFY_COMMAND = 'I';		//!< Blink the on board LED so an operator can find the board
+const uint8_t TIMED_FLOW_COMMAND = 'G';	//!< Flow read; reply holds a 32 bit pulse count and the 32 bit window in microseconds
+const uint8_t LOOP_CONFIG_COMMAND = 'C';	//!< Download the on device flow loop gains; see the LOOP_CONFIG_ offsets
+const uint8_t LOOP_SETPOINT_COMMAND = 'S';	//!< Start or stop the on device flow loop; see the LOOP_SETPOINT_ offsets
+const uint8_t LOOP_STATUS_FRAME = 'Z';		//!< Sent by the Teensy while the flow loop runs; see the LOOP_STATUS_ offsets
+const uint8_t DOSE_COMMAND = 'D';		//!< Dispense a number of pulses then close; see the DOSE_ offsets
+const uint8_t DOSE_REPORT_FRAME = 'd';		//!< Sent by the Teensy once a dose has finished; see the DOSE_REPORT_ offsets
+const uint8_t FILTER_CONFIG_COMMAND = 'K';	//!< Configure the flow filters; see the FILTER_CONFIG_ offsets
+const uint8_t RATE_COMMAND = 'R';		//!< Read the raw and filtered pulse rates; see the RATE_ offsets
+const uint8_t MOVE_COMMAND = 'P';		//!< Move to an absolute position, retargeting any move in flight; see the MOVE_ offsets
+const uint8_t ABORT_COMMAND = 'X';		//!< Decelerate to a stop; the Teensy answers with a MOVE_DONE_FRAME
+const uint8_t MOVE_DONE_FRAME = 'p';		//!< Sent by the Teensy once a 'P' or 'X' move has stopped; see the MOVE_DONE_ offsets
+const uint8_t CHANNEL_COMMAND = 'N';		//!< Wraps a command for, or a frame from, one valve channel; see the CHANNEL_ offsets
+const uint8_t SYNC_COMMAND = 'Y';		//!< Clock sync exchange; the reply is sent at once and carries the Teensy's receive and transmit times
+
+// frame option bits reported in the hello reply
+const uint32_t FEATURE_IDENTIFY = 0x00000001;		//!< IDENTIFY_COMMAND is supported
+const uint32_t FEATURE_TIMED_FLOW = 0x00000002;	//!< TIMED_FLOW_COMMAND is supported
+const uint32_t FEATURE_DEVICE_LOOP = 0x00000004;	//!< The flow loop can run on the Teensy
+const uint32_t FEATURE_DOSE = 0x00000008;		//!< DOSE_COMMAND is supported
+const uint32_t FEATURE_FILTERED_RATE = 0x00000010;	//!< FILTER_CONFIG_COMMAND and RATE_COMMAND are supported
+const uint32_t FEATURE_PREEMPTIBLE_MOVE = 0x00000020;	//!< MOVE_COMMAND and ABORT_COMMAND are supported and moves never block the Teensy
+const uint32_t FEATURE_CHANNELS = 0x00000040;		//!< CHANNEL_COMMAND is supported and the hello reply ends with the channel count
+const uint32_t FEATURE_CLOCK_SYNC = 0x00000080;	//!< SYNC_COMMAND is supported
+const uint32_t FEATURE_SENSOR_PROFILE = 0x00000100;	//!< The hello reply ends with the id of the flow sensor profile the firmware was built with; see flow_sensor.h
+
+// layout of the hello reply payload (offsets are from the command byte)
+const unsigned int HELLO_PROTOCOL_OFFSET = 1;		//!< uint8 protocol version
+const unsigned int HELLO_FW_MAJOR_OFFSET = 2;		//!< uint8 firmware major version
+const unsigned int HELLO_FW_MINOR_OFFSET = 3;		//!< uint8 firmware minor version
+const unsigned int HELLO_SERIAL_OFFSET = 4;		//!< uint32 device serial number
+const unsigned int HELLO_STEP_RATE_OFFSET = 8;		//!< uint16 maximum step rate in steps per second
+const unsigned int HELLO_CALIBRATION_OFFSET = 10;	//!< uint16 flow sensor calibration in microliters per pulse
+const unsigned int HELLO_FEATURES_OFFSET = 12;		//!< uint32 FEATURE_ bits
+const unsigned int HELLO_NUM_COMMANDS_OFFSET = 16;	//!< uint8 number of supported command bytes that follow
+const unsigned int HELLO_COMMANDS_OFFSET = 17;		//!< list of supported command bytes, followed by a uint8 channel count with FEATURE_CHANNELS, then a uint8 flow sensor id with FEATURE_SENSOR_PROFILE
+
+// layout of the flow loop config payload; gains are in thousandths of a step per pulse/s
+const unsigned int LOOP_CONFIG_KP_OFFSET = 1;		//!< int32 proportional gain
+const unsigned int LOOP_CONFIG_KI_OFFSET = 5;		//!< int32 integral gain (per second)
+const unsigned int LOOP_CONFIG_KD_OFFSET = 9;		//!< int32 derivative gain (seconds)
+const unsigned int LOOP_CONFIG_PERIOD_OFFSET = 13;	//!< uint32 control period in microseconds
+const unsigned int LOOP_CONFIG_STATUS_OFFSET = 17;	//!< uint16 number of control periods between status frames
+const unsigned int LOOP_CONFIG_BYTES = 19;		//!< payload size including the command byte
+
+// layout of the flow loop setpoint payload
+const unsigned int LOOP_SETPOINT_RUN_OFFSET = 1;	//!< uint8 1 to run the loop, 0 to stop it
+const unsigned int LOOP_SETPOINT_RATE_OFFSET = 2;	//!< uint32 target pulse rate in millipulses per second
+const unsigned int LOOP_SETPOINT_BYTES = 6;		//!< payload size including the command byte
+
+// layout of the flow loop status payload
+const unsigned int LOOP_STATUS_RUN_OFFSET = 1;		//!< uint8 1 while the loop is running
+const unsigned int LOOP_STATUS_TIME_OFFSET = 2;	//!< uint32 micros() on the Teensy when the sample was taken
+const unsigned int LOOP_STATUS_SETPOINT_OFFSET = 6;	//!< uint32 target pulse rate in millipulses per second
+const unsigned int LOOP_STATUS_RATE_OFFSET = 10;	//!< uint32 measured pulse rate in millipulses per second
+const unsigned int LOOP_STATUS_POSITION_OFFSET = 14;	//!< uint16 motor position in steps from fully closed
+const unsigned int LOOP_STATUS_TARGET_OFFSET = 16;	//!< uint16 position the motor is moving to
+const unsigned int LOOP_STATUS_PULSES_OFFSET = 18;	//!< uint32 pulses counted since power up
+const unsigned int LOOP_STATUS_BYTES = 22;		//!< payload size including the command byte
+
+// layout of the dose payload; a target of 0 cancels the running dose. Dose pulses are volume in units of the
+// hello calibration, counted from the flow sensor profile, so they only equal sensor pulses for a linear sensor
+const unsigned int DOSE_TARGET_OFFSET = 1;		//!< uint32 pulses to dispense
+const unsigned int DOSE_EARLY_CLOSE_OFFSET = 5;	//!< uint32 pulses before the target to start closing, or DOSE_AUTO_EARLY_CLOSE
+const unsigned int DOSE_OPEN_POSITION_OFFSET = 9;	//!< uint16 position to open the valve to, or DOSE_KEEP_POSITION
+const unsigned int DOSE_BYTES = 11;			//!< payload size including the command byte
+const uint32_t DOSE_AUTO_EARLY_CLOSE = 0xFFFFFFFF;	//!< Let the Teensy use the overshoot it measured on earlier doses
+const uint16_t DOSE_KEEP_POSITION = 0xFFFF;		//!< Leave the valve (or the running flow loop) as it is
+
+// layout of the dose report payload
+const unsigned int DOSE_REPORT_TARGET_OFFSET = 1;	//!< uint32 pulses that were asked for
+const unsigned int DOSE_REPORT_TRIGGER_OFFSET = 5;	//!< uint32 pulse count at which the close was started
+const unsigned int DOSE_REPORT_DELIVERED_OFFSET = 9;	//!< uint32 pulses counted until the flow stopped
+const unsigned int DOSE_REPORT_CLOSE_TIME_OFFSET = 13;	//!< uint32 microseconds from starting the close until the valve was shut
+const unsigned int DOSE_REPORT_BYTES = 17;		//!< payload size including the command byte
+
+// flow filters that can feed the on-device loop
+const uint8_t FILTER_RAW = 0;		//!< Rate from the last pulse interval
+const uint8_t FILTER_AVERAGE = 1;	//!< Moving average of the raw rate
+const uint8_t FILTER_IIR = 2;		//!< First order low pass of the raw rate
+const uint8_t FILTER_KALMAN = 3;	//!< Scalar Kalman filter over the pulse intervals
+
+// layout of the filter config payload
+const unsigned int FILTER_CONFIG_AVERAGE_OFFSET = 1;	//!< uint8 moving average length in filter periods (1..64)
+const unsigned int FILTER_CONFIG_ALPHA_OFFSET = 2;	//!< uint16 low pass coefficient in 1/65536ths
+const unsigned int FILTER_CONFIG_Q_OFFSET = 4;		//!< uint32 Kalman process noise per filter period, in (millipulses/s)^2
+const unsigned int FILTER_CONFIG_R_OFFSET = 8;		//!< uint32 Kalman measurement noise, in (millipulses/s)^2
+const unsigned int FILTER_CONFIG_LOOP_OFFSET = 12;	//!< uint8 FILTER_ value used by the on-device loop
+const unsigned int FILTER_CONFIG_BYTES = 13;		//!< payload size including the command byte
+
+// layout of the timed flow reply payload
+const unsigned int TIMED_FLOW_PULSES_OFFSET = 1;	//!< uint32 pulses counted since the previous reply
+const unsigned int TIMED_FLOW_WINDOW_OFFSET = 5;	//!< uint32 microseconds the pulses were counted over
+const unsigned int TIMED_FLOW_BYTES = 9;		//!< payload size including the command byte
+
+// layout of the rate reply payload; all rates are in millipulses per second
+const unsigned int RATE_TIME_OFFSET = 1;		//!< uint32 micros() on the Teensy when the rates were read
+const unsigned int RATE_RAW_OFFSET = 5;			//!< uint32 raw rate
+const unsigned int RATE_AVERAGE_OFFSET = 9;		//!< uint32 moving average
+const unsigned int RATE_IIR_OFFSET = 13;		//!< uint32 first order low pass
+const unsigned int RATE_KALMAN_OFFSET = 17;		//!< uint32 Kalman estimate
+const unsigned int RATE_BYTES = 21;			//!< payload size including the command byte
+
+// layout of the move payload
+const unsigned int MOVE_TARGET_OFFSET = 1;		//!< uint16 position to move to in steps from fully closed
+const unsigned int MOVE_RATE_OFFSET = 3;		//!< uint16 maximum step rate in steps per second, 0 for the fastest
+const unsigned int MOVE_BYTES = 5;			//!< payload size including the command byte
+
+// layout of the move done payload
+const unsigned int MOVE_DONE_POSITION_OFFSET = 1;	//!< uint16 position the motor stopped at
+const unsigned int MOVE_DONE_TARGET_OFFSET = 3;	//!< uint16 target of the last 'P' command
+const unsigned int MOVE_DONE_ABORTED_OFFSET = 5;	//!< uint8 1 if the move was cut short by ABORT_COMMAND
+const unsigned int MOVE_DONE_BYTES = 6;			//!< payload size including the command byte
+
+// layout of the sync request and reply; the reply echoes the sequence number of the request
+const unsigned int SYNC_SEQUENCE_OFFSET = 1;		//!< uint32 sequence number chosen by the host
+const unsigned int SYNC_REQUEST_BYTES = 5;		//!< request payload size including the command byte
+const unsigned int SYNC_RECEIVE_OFFSET = 5;		//!< uint32 micros() when the request arrived
+const unsigned int SYNC_TRANSMIT_OFFSET = 9;		//!< uint32 micros() when the reply was written
+const unsigned int SYNC_BYTES = 13;			//!< reply payload size including the command byte
+
+// layout of a channel frame; channel 0 also answers commands that are not wrapped and never wraps its frames
+const unsigned int CHANNEL_INDEX_OFFSET = 1;		//!< uint8 valve channel
+const unsigned int CHANNEL_INNER_OFFSET = 2;		//!< the wrapped command byte and its payload
+
+/*!
+ * \brief True for frames the Teensy sends on its own rather than as a reply to a command.
+ */
+inline bool IsStreamFrame(uint8_t command)
+{
+  return command == LOOP_STATUS_FRAME || command == DOSE_REPORT_FRAME || command == MOVE_DONE_FRAME;
+}
+
+/*!
+ * \brief Stores a 16 bit value least significant byte first.
+ */
+inline void PutU16(uint8_t *p, uint16_t value)
+{
+  p[0] = value & 0xFF;
+  p[1] = (value >> 8) & 0xFF;
+}
+
+/*!
+ * \brief Stores a 32 bit value least significant byte first.
+ */
+inline void PutU32(uint8_t *p, uint32_t value)
+{
+  p[0] = value & 0xFF;
+  p[1] = (value >> 8) & 0xFF;
+  p[2] = (value >> 16) & 0xFF;
+  p[3] = (value >> 24) & 0xFF;
+}
+
+/*!
+ * \brief Reads a 16 bit value stored least significant byte first.
+ */
+inline uint16_t GetU16(const uint8_t *p)
+{
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+/*!
+ * \brief Reads a 32 bit value stored least significant byte first.
+ */
+inline uint32_t GetU32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+#endif
@@ -0,0 +1,112 @@
+/*!
+ * \file valve_channel.h
+ * \brief Pins and state of one stepper and flow sensor pair driven by the Teensy firmware.
+ * \details The firmware keeps one ValveChannel per valve. Everything a channel does (background
+ * motion, pulse counting, filtering, the flow loop and dosing) only touches its own ValveChannel,
+ * so the channels run independently of each other. The struct lives in a header so the prototypes
+ * the Arduino IDE generates for the sketch can use it.
+ */
+#ifndef _VALVE_CHANNEL_H
+#define _VALVE_CHANNEL_H	//!< Used to ensure the header is only included once during compilation
+
+#include <Arduino.h>
+#include "protocol.h"
+
+const unsigned int NUM_CHANNELS = 2;		//!< Number of valve and flow sensor pairs wired to the board
+const unsigned int MAX_AVERAGE_LENGTH = 64;	//!< Longest moving average of the flow filters
+const unsigned int MAX_STEP_RATE = 500;		//!< Fastest step rate the valves are driven at
+
+/*!
+ *  Pins of one Easy Driver and its flow sensor
+ */
+struct ChannelPins
+{
+  byte enablePin;	//!< Driver enable, active low
+  byte ms1Pin;		//!< Microstep select 1
+  byte ms2Pin;		//!< Microstep select 2
+  byte stepPin;		//!< Step input of the driver
+  byte dirPin;		//!< Direction input of the driver
+  byte flowPin;		//!< Flow sensor pulse input
+};
+
+/*!
+ *  State of one valve channel
+ */
+struct ValveChannel
+{
+  byte index = 0;			//!< Channel number used in CHANNEL_COMMAND frames
+  const ChannelPins *pins = NULL;	//!< Pins the channel is wired to
+
+  // legacy flow count
+  volatile int flowCount = 0;
+  volatile int overflowCount = 0;
+  unsigned long flowWindowStart = 0;	//!< micros() when the flow count was last cleared
+
+  // background stepping
+  volatile int motorPosition = 0;		//!< Steps from fully closed
+  volatile int motorTarget = 0;			//!< Position the background stepper is moving to
+  volatile int motorDirection = 0;		//!< +1 opening, -1 closing, 0 stopped
+  volatile unsigned int stepRate = 0;		//!< Current steps per second, 0 when stopped
+  volatile unsigned int moveMaxRate = MAX_STEP_RATE;
+  volatile unsigned long stepTicksLeft = 0;
+  volatile boolean stepPinHigh = false;
+  volatile boolean driverEnabled = false;
+
+  // completion reports for host requested moves
+  boolean moveReportPending = false;	//!< Send a MOVE_DONE_FRAME once the motor stops
+  boolean moveAborted = false;
+  int moveRequestedTarget = 0;
+  unsigned int motorRepliesPending = 0;	//!< Legacy 'M' replies owed once the motor stops
+  byte motorReply[4];
+
+  // pulse timing used by the on-device flow loop
+  volatile unsigned long lastPulseMicros = 0;
+  volatile unsigned long pulseIntervalUs = 0;
+  volatile unsigned long totalPulses = 0;
+
+  // flow filters, all rates in millipulses per second
+  volatile uint32_t rawRate = 0;
+  volatile uint32_t averageRate = 0;
+  volatile uint32_t iirRate = 0;
+  volatile uint32_t kalmanRate = 0;
+  uint32_t averageBuffer[MAX_AVERAGE_LENGTH] = {0};
+  uint32_t averageSum = 0;
+  unsigned int averageIndex = 0;
+  volatile unsigned int averageLength = 16;
+  volatile uint32_t iirAlpha = 3277;		//!< 0.05 in 1/65536ths
+  int64_t iirState = 0;				//!< Rate in 1/65536ths of a millipulse per second
+  volatile int64_t kalmanQ = 10000;		//!< Process noise per filter period
+  volatile int64_t kalmanR = 4000000;		//!< Measurement noise
+  int64_t kalmanP = 4000000;			//!< Estimate variance
+  int64_t kalmanState = 0;
+  unsigned long kalmanLastPulse = 0;
+  unsigned long kalmanLastUpdate = 0;
+  volatile byte loopFilter = FILTER_KALMAN;	//!< Filter that feeds the on-device loop
+
+  // on-device flow loop; gains are in steps per pulse/s
+  volatile boolean loopEnabled = false;
+  float loopKp = 0.0;
+  float loopKi = 0.0;
+  float loopKd = 0.0;
+  float loopSetpoint = 0.0;		//!< Pulses per second
+  float loopIntegral = 0.0;
+  float loopLastError = 0.0;
+  unsigned long loopPeriodUs = 10000;
+  unsigned int loopStatusEvery = 10;
+  unsigned int loopTicks = 0;
+  unsigned long loopLastTick = 0;
+
+  // volumetric dosing
+  volatile boolean doseActive = false;		//!< Counting toward the trigger
+  volatile boolean doseClosing = false;		//!< Trigger reached, waiting for the valve to shut and the flow to stop
+  volatile unsigned long dosePulses = 0;	//!< Dose pulses counted, in units of the hello calibration
+  volatile uint32_t doseNl = 0;			//!< Volume counted toward the next dose pulse in nanoliters
+  volatile unsigned long doseTrigger = 0;
+  volatile unsigned long doseTriggerMicros = 0;
+  unsigned long doseTarget = 0;
+  unsigned long doseClosedMicros = 0;
+  boolean doseOvershootKnown = false;
+  float doseOvershoot = 0.0;			//!< Pulses that pass while the valve closes
+};
+
+#endif